@@ -2,61 +2,52 @@
 
 #include "io.h"
 #include "nostrdb.h"
-#include <sys/mman.h>
 #include <time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
-int map_file(const char *filename, unsigned char **p, size_t *flen)
-{
-	struct stat st;
-	int des;
-	stat(filename, &st);
-	*flen = st.st_size;
-
-	des = open(filename, O_RDONLY);
-
-	*p = mmap(NULL, *flen, PROT_READ, MAP_PRIVATE, des, 0);
-	close(des);
-
-	return *p != MAP_FAILED;
-}
-
-static int bench_parser()
+static int bench_parser(uint32_t flags)
 {
 	long nanos, ms;
-	size_t written;
 	struct ndb *ndb;
 	struct timespec t1, t2;
-	char *json;
 	int times = 1;
 	struct ndb_config config;
+	struct ndb_ingest_meta meta;
+	struct ndb_import_stats stats;
 	ndb_default_config(&config);
 
 	ndb_config_set_mapsize(&config, 1024ULL * 1024ULL * 400ULL * 10ULL);
 	ndb_config_set_ingest_threads(&config, 8);
-	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY | flags);
 
 	assert(ndb_init(&ndb, "testdata/db", &config));
 	const char *filename = "testdata/many-events.json";
-	if (!map_file(filename, (unsigned char**)&json, &written)) {
-		printf("mapping testdata/many-events.json failed\n");
-		return 2;
-	}
-
-	printf("mapped %ld bytes in %s\n", written, filename);
 
 	clock_gettime(CLOCK_MONOTONIC, &t1);
 
-	ndb_process_events(ndb, json, written);
+	ndb_ingest_meta_init(&meta, 0, NULL);
+	if (!ndb_import_file(ndb, filename, &meta, &stats)) {
+		printf("importing %s failed\n", filename);
+		return 2;
+	}
 
 	ndb_destroy(ndb);
 
 	clock_gettime(CLOCK_MONOTONIC, &t2);
 
+	printf("imported %" PRIu64 " lines from %s: %" PRIu64 " new, %" PRIu64
+	       " duplicate, %" PRIu64 " invalid, %" PRIu64 " rejected, %" PRIu64
+	       " dropped\n",
+	       stats.lines, filename, stats.queued, stats.duplicates,
+	       stats.invalid, stats.rejected, stats.dropped);
+	printf("parsed at\t%.0f events/s\n", stats.events_per_sec);
+
 	nanos = (t2.tv_sec - t1.tv_sec) * (long)1e9 + (t2.tv_nsec - t1.tv_nsec);
 	ms = nanos / 1e6;
 	printf("ns/run\t%ld\nms/run\t%f\nns\t%ld\nms\t%ld\n",
@@ -67,9 +58,14 @@ static int bench_parser()
 
 int main(int argc, char *argv[], char **env)
 {
-	if (!bench_parser())
+	uint32_t flags = 0;
+
+	// index everything at the end instead of note by note
+	if (argc > 1 && !strcmp(argv[1], "--defer-indices"))
+		flags |= NDB_FLAG_DEFER_INDICES;
+
+	if (!bench_parser(flags))
 		return 2;
 	
 	return 0;
 }
-
@@ -6,6 +6,7 @@
 #include "hex.h"
 #include <time.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -24,7 +25,7 @@ struct stream_parser_state
 
 static int usage()
 {
-	printf("usage: ndb [--skip-verification] [-d db_dir] <command>\n\n");
+	printf("usage: ndb [--skip-verification] [--defer-indices] [-d db_dir] <command>\n\n");
 
 	printf("commands\n\n");
 
@@ -32,6 +33,7 @@ static int usage()
 	printf("	query [--kind 42] [--id abcdef...] [--notekey key] [--search term] [--limit 42] \n");
 	printf("	      [-e abcdef...] [--author abcdef... -a bcdef...] [--relay wss://relay.damus.io]\n");
 	printf("	      [--tag <char> <value>]        query by any single-char tag (e.g. --tag d myid)\n");
+	printf("	      [--explain]                   print the query plan and the work it took\n");
 	printf("	profile <pubkey>                            print the raw profile data for a pubkey\n");
 	printf("	note-relays <note-id>                       list the relays a given note id has been seen on\n");
 	printf("	print-search-keys\n");
@@ -46,26 +48,12 @@ static int usage()
 	printf("settings\n\n");
 
 	printf("	--skip-verification  skip signature validation\n");
+	printf("	--defer-indices      only index notes by id until exit (for big imports)\n");
 	printf("	-d <db_dir>          set database directory\n");
 	return 1;
 }
 
 
-static int map_file(const char *filename, unsigned char **p, size_t *flen)
-{
-	struct stat st;
-	int des;
-	stat(filename, &st);
-	*flen = st.st_size;
-
-	des = open(filename, O_RDONLY);
-
-	*p = mmap(NULL, *flen, PROT_READ, MAP_PRIVATE, des, 0);
-	close(des);
-
-	return *p != MAP_FAILED;
-}
-
 static inline void print_stat_counts(struct ndb_stat_counts *counts)
 {
 	printf("%zu\t%zu\t%zu\t%zu\n",
@@ -275,8 +263,6 @@ int main(int argc, char *argv[])
 	struct ndb_stat stat;
 	struct ndb_txn txn;
 	const char *dir;
-	unsigned char *data;
-	size_t data_len;
 	struct ndb_config config;
 	struct timespec t1, t2;
 	unsigned char tmp_id[32];
@@ -299,14 +285,18 @@ int main(int argc, char *argv[])
 
 	dir = ".";
 	flags = 0;
-	for (i = 0; i < 2; i++)
+	for (i = 0; i < 3; i++)
 	{
 		if (!strcmp(argv[1], "-d") && argv[2]) {
 			dir = argv[2];
 			argv += 2;
 			argc -= 2;
 		} else if (!strcmp(argv[1], "--skip-verification")) {
-			flags = NDB_FLAG_SKIP_NOTE_VERIFY;
+			flags |= NDB_FLAG_SKIP_NOTE_VERIFY;
+			argv += 1;
+			argc -= 1;
+		} else if (!strcmp(argv[1], "--defer-indices")) {
+			flags |= NDB_FLAG_DEFER_INDICES;
 			argv += 1;
 			argc -= 1;
 		}
@@ -329,6 +319,8 @@ int main(int argc, char *argv[])
 		print_stats(&stat);
 	} else if (argc >= 3 && !strcmp(argv[1], "query")) {
 		struct ndb_filter filter, *f = &filter;
+		struct ndb_query_explain explain;
+		int want_explain = 0;
 		ndb_filter_init(f);
 
 		argv += 2;
@@ -345,6 +337,10 @@ int main(int argc, char *argv[])
 				ndb_filter_add_int_element(f, atoll(argv[1]));
 				argv += 2;
 				argc -= 2;
+			} else if (!strcmp(argv[0], "--explain")) {
+				want_explain = 1;
+				argv++;
+				argc--;
 			} else if (!strcmp(argv[0], "--notekey")) {
 				key = atol(argv[1]);
 				argv += 2;
@@ -595,14 +591,27 @@ int main(int argc, char *argv[])
 				count = 1;
 			else
 				count = 0;
-		} else if (!ndb_query(&txn, f, 1, results, rsize, &count)) {
+		} else if (!ndb_query_explain(&txn, f, 1, results, rsize, &count,
+					      want_explain ? &explain : NULL)) {
 			fprintf(stderr, "query error\n");
+			want_explain = 0;
 		}
 		clock_gettime(CLOCK_MONOTONIC, &t2);
 
 		nanos = (t2.tv_sec - t1.tv_sec) * (long)1e9 + (t2.tv_nsec - t1.tv_nsec);
 
 		fprintf(stderr, "%d results in %f ms\n", count, nanos/1000000.0);
+		if (want_explain && !key) {
+			fprintf(stderr, "plan                 %s\n", explain.plan);
+			fprintf(stderr, "planner entries      %" PRIu64 "\n", explain.planner_entries);
+			fprintf(stderr, "seeks                %" PRIu64 "\n", explain.seeks);
+			fprintf(stderr, "index entries        %" PRIu64 "\n", explain.index_entries);
+			fprintf(stderr, "max scanner entries  %" PRIu64 "\n", explain.max_scanner_entries);
+			fprintf(stderr, "notes loaded         %" PRIu64 "\n", explain.notes_loaded);
+			fprintf(stderr, "filter mismatches    %" PRIu64 "\n", explain.mismatches);
+			fprintf(stderr, "results              %" PRIu64 "\n", explain.results);
+			fprintf(stderr, "filter time          %f ms\n", explain.elapsed_ns/1000000.0);
+		}
 		for (i = 0; i < count; i++) {
 			print_note(results[i].note);
 		}
@@ -633,9 +642,22 @@ int main(int argc, char *argv[])
 		if (!strcmp(argv[0], "-")) {
 			ndb_process_events_stream(ndb, stdin);
 		} else {
-			map_file(argv[0], &data, &data_len);
-			ndb_process_events(ndb, (const char *)data, data_len);
-			//ndb_process_client_events(ndb, (const char *)data, data_len);
+			struct ndb_import_stats stats;
+			struct ndb_ingest_meta meta;
+
+			ndb_ingest_meta_init(&meta, 0, NULL);
+			if (!ndb_import_file(ndb, argv[0], &meta, &stats)) {
+				fprintf(stderr, "import of %s failed\n", argv[0]);
+				res = 1;
+			}
+
+			fprintf(stderr, "%" PRIu64 " lines in %.2fs (%.0f events/s): "
+				"%" PRIu64 " new, %" PRIu64 " duplicate, "
+				"%" PRIu64 " invalid, %" PRIu64 " rejected, "
+				"%" PRIu64 " dropped\n",
+				stats.lines, stats.seconds, stats.events_per_sec,
+				stats.queued, stats.duplicates, stats.invalid,
+				stats.rejected, stats.dropped);
 		}
 	} else if (argc == 2 && !strcmp(argv[1], "print-search-keys")) {
 		ndb_begin_query(ndb, &txn);
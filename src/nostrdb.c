@@ -22,7 +22,18 @@
 #include "secp256k1.h"
 #include <stdlib.h>
 #include <limits.h>
+#include <errno.h>
 #include <assert.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "bindings/c/profile_json_parser.h"
 #include "bindings/c/profile_builder.h"
@@ -39,23 +50,21 @@
 // the maximum number of things threads pop and push in bulk
 #define THREAD_QUEUE_BATCH 4096
 
-// maximum number of active subscriptions
-#define MAX_SUBSCRIPTIONS 256
 #define MAX_SCAN_CURSORS 12
-#define MAX_FILTERS    16
 #define MAX_INGESTER_KEYS 128
 
-/* Cap on the author*kind scanners NDB_PLAN_AUTHOR_KINDS will open for a
- * multi-author filter. The alternative for those filters is NDB_PLAN_KINDS,
- * which opens one cursor per kind and post-filters by author. So the two plans
- * trade a fixed per-group seek cost against an unbounded scan:
+/* Query planner cost model. Costs are counted in index entries read, with a
+ * cursor seek counted as NDB_PLAN_SEEK_COST entries.
+ *
+ * The choice that matters most is a multi-author filter, which can either
+ * merge one pubkey+kind run per author*kind pair or scan the kind index and
+ * post-filter by author:
  *
  *   author_kinds  O(authors*kinds) seeks, then O(limit)
  *   kinds         O(kinds) seeks, then scan until `limit` authors match
  *
  * Which wins depends on how dense the filter's authors are in the recent tail
- * of those kinds, which the planner can't know without probing. Measured on an
- * 863k note db (kind 1, limit 20, warm):
+ * of those kinds. Measured on an 863k note db (kind 1, limit 20, warm):
  *
  *   authors  authors dense+recent    authors sparse+old
  *            kinds   author_kinds    kinds   author_kinds
@@ -65,28 +74,31 @@
  *   32       0.049ms 0.126ms         67ms    0.151ms
  *   500      0.050ms 1.08ms          72ms    6.7ms
  *
- * So author_kinds wins hugely when the authors are sparse and loses by a small
- * absolute margin when they're dense. At the cap the worst measured regression
- * is ~0.15ms (64 dense authors: 0.046ms -> 0.195ms), against ~67ms saved when
- * those same 64 authors are sparse.
- *
- * The cap matters most at the other end of the scale. A contact list is
- * thousands of authors, and its members are dense by construction -- you follow
- * people who post -- so the scan finds `limit` matches almost immediately while
- * author_kinds would pay a seek per author*kind pair. Uncapped, at the 6144
- * author ceiling a single filter can hold (data_buf/32) across kinds
- * 1,6,7,30023, that is 24576 scanners:
- *
  *   6144 authors x 4 kinds   kinds 0.005ms   author_kinds 4.44ms
  *
- * ~900x worse, on the most common query a client makes. Hence a cap rather than
- * an unconditional lift: below it we take the plan that can't blow up, above it
- * we keep the one that can't fan out.
- *
- * The gap this leaves is a *large* author set that has gone quiet -- 1000-2000
- * sparse authors still cost 16-61ms on the kinds plan. Closing that needs a
- * planner that probes the scan before committing to it, not a constant. */
-#define NDB_MAX_AUTHOR_KIND_SCANNERS 64
+ * A seek and a scanned entry (a note load plus a filter match) cost about the
+ * same, within a factor of two, so no constant cap on authors*kinds gets both
+ * ends of this table right. Instead ndb_filter_plan probes: it walks the
+ * plans' index runs for real, reading keys but never loading a note, and
+ * gives up as soon as a probe has read more than the cheapest plan found so
+ * far would cost. The author*kind runs say how far back `limit` matches
+ * reach, and the kind scan costs whatever it has between now and then. A
+ * dense contact list gets there within a few dozen entries, while a quiet
+ * one gives up after ~authors*kinds entries and takes author_kinds. Either
+ * way the probe costs at most about what the plan it loses to does. */
+#define NDB_PLAN_SEEK_COST 2
+
+// the most index entries a single planner probe will read
+#define NDB_PLAN_PROBE_MAX 4096
+
+// don't bother probing when the best plan so far is already this cheap
+#define NDB_PLAN_PROBE_MIN 64
+
+/* The most pubkey runs NDB_PLAN_AUTHORS will merge. Past this, a filter's
+ * authors are a contact list, which is dense enough that a created_at scan
+ * fills its limit long before a seek per author would pay off, and the
+ * scanners alone would cost ~300 bytes each. */
+#define NDB_MAX_AUTHOR_SCANNERS 1024
 
 // the maximum size of inbox queues
 static const int DEFAULT_QUEUE_SIZE = 32768;
@@ -247,6 +259,9 @@ struct ndb_ingest_controller
 	struct ndb_lmdb *lmdb;
 	struct ndb_note *note;
 	uint64_t note_key;
+	struct ndb_seen_ids *seen;
+	const char *relay;
+	int seen_hit; // in flight or in the db, just need the relay
 };
 
 enum ndb_writer_msgtype {
@@ -263,7 +278,8 @@ enum ndb_writer_msgtype {
 
 // keys used for storing data in the NDB metadata database (NDB_DB_NDB_META)
 enum ndb_meta_key {
-	NDB_META_KEY_VERSION = 1
+	NDB_META_KEY_VERSION = 1,
+	NDB_META_KEY_INDICES_DEFERRED = 2, // first note key written without secondary indices
 };
 
 struct ndb_json_parser {
@@ -308,9 +324,100 @@ static int ndb_lmdb_reader_check(MDB_env *env)
 	return 1;
 }
 
+/* Ids of notes the ingesters recently handed to the writer or found in the
+ * db, and which relays they've already vouched for. Relays resend the same
+ * note many times, usually before the first copy is even committed, so this
+ * lets duplicates skip the LMDB lookup and signature check.
+ *
+ * It's a lossy set of 64-bit fingerprints, 4 per bucket, shared by every
+ * ingester without locks. A miss just means doing the work we'd have done
+ * anyway. Notes only go in once they've passed their signature check, so
+ * a forged copy can't hide the real one. */
+#define NDB_SEEN_BUCKETS (1 << 16)
+#define NDB_SEEN_WAYS 4
+
+struct ndb_seen_ids {
+	uint64_t *slots; // 0 is empty
+};
+
+static int ndb_seen_ids_init(struct ndb_seen_ids *seen)
+{
+	seen->slots = calloc(NDB_SEEN_BUCKETS * NDB_SEEN_WAYS,
+			     sizeof(*seen->slots));
+	return seen->slots != NULL;
+}
+
+static void ndb_seen_ids_destroy(struct ndb_seen_ids *seen)
+{
+	free(seen->slots);
+	seen->slots = NULL;
+}
+
+// FNV-1a over the whole id, not just its first bytes, since ids we didn't
+// hash ourselves can be anything
+static uint64_t ndb_seen_ids_key(const unsigned char *id, const char *relay)
+{
+	const unsigned char *p;
+	uint64_t hash;
+	int i;
+
+	hash = 0xcbf29ce484222325ULL;
+	for (i = 0; i < 32; i++)
+		hash = (hash ^ id[i]) * 0x100000001b3ULL;
+
+	if (relay) {
+		for (p = (const unsigned char *)relay; *p; p++)
+			hash = (hash ^ *p) * 0x100000001b3ULL;
+	}
+
+	hash ^= hash >> 29;
+	return hash ? hash : 1;
+}
+
+static inline uint64_t *ndb_seen_ids_bucket(struct ndb_seen_ids *seen,
+					    uint64_t key)
+{
+	return seen->slots + ((key >> 32) % NDB_SEEN_BUCKETS) * NDB_SEEN_WAYS;
+}
+
+static int ndb_seen_ids_has(struct ndb_seen_ids *seen, uint64_t key)
+{
+	uint64_t *bucket = ndb_seen_ids_bucket(seen, key);
+	int i;
+
+	for (i = 0; i < NDB_SEEN_WAYS; i++) {
+		if (__atomic_load_n(&bucket[i], __ATOMIC_RELAXED) == key)
+			return 1;
+	}
+
+	return 0;
+}
+
+// evicts whatever was in the slot the key lands on
+static void ndb_seen_ids_add(struct ndb_seen_ids *seen, uint64_t key)
+{
+	uint64_t *bucket = ndb_seen_ids_bucket(seen, key);
+
+	if (ndb_seen_ids_has(seen, key))
+		return;
+
+	__atomic_store_n(&bucket[key % NDB_SEEN_WAYS], key, __ATOMIC_RELAXED);
+}
+
+// for notes that were queued but never made it into the db
+static void ndb_seen_ids_remove(struct ndb_seen_ids *seen, uint64_t key)
+{
+	uint64_t *bucket = ndb_seen_ids_bucket(seen, key);
+	uint64_t expected = key;
+
+	__atomic_compare_exchange_n(&bucket[key % NDB_SEEN_WAYS], &expected, 0,
+				    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
 struct ndb_writer {
 	struct ndb_lmdb *lmdb;
-	struct ndb_monitor *monitor;
+	struct ndb_notifier *notifier;
+	struct ndb_seen_ids *seen;
 
 	int scratch_size;
 	uint32_t ndb_flags;
@@ -328,12 +435,13 @@ struct ndb_ingester {
 	struct prot_queue *writer_inbox;
 	void *filter_context;
 	ndb_ingest_filter_fn filter;
+	struct ndb_seen_ids *seen;
 
 	int scratch_size;
 };
 
 struct ndb_filter_group {
-	struct ndb_filter filters[MAX_FILTERS];
+	struct ndb_filter *filters;
 	int num_filters;
 };
 
@@ -341,13 +449,64 @@ struct ndb_subscription {
 	uint64_t subid;
 	struct ndb_filter_group group;
 	struct prot_queue inbox;
+
+	// notes at or below this key were already in the subscriber's
+	// backfill query, see ndb_subscribe_with_backfill
+	uint64_t watermark;
+
+	// the first note we dropped since the last resync, and a running
+	// count of drops, see ndb_poll_for_notes_status
+	uint64_t resync_from;
+	uint64_t dropped;
+
+	// see ndb_subscription_fd. -1 until someone asks for one. With
+	// eventfd both ends are the same fd.
+	int fd_read, fd_write;
+	int fd_armed;
+};
+
+// a subscription whose empty filter group matches everything
+#define NDB_SUB_INDEX_ALL UINT32_MAX
+
+struct ndb_sub_index_entry {
+	uint64_t hash;
+	uint32_t sub;
+	uint32_t filter;
+};
+
+struct ndb_sub_mark {
+	uint32_t stamp;
+	int pushed;
+};
+
+/* Which subscriptions could want a note. Each filter is filed under the
+ * values of the one field it requires that narrows things down the most, so
+ * a written note is only matched against the filters filed under its own id,
+ * pubkey, kind and tag values. Filters with none of those fields are always
+ * checked. Rebuilt by the writer when subscriptions change. */
+struct ndb_sub_index {
+	struct ndb_sub_index_entry *entries; // sorted by hash
+	int num_entries, entries_cap;
+
+	struct ndb_sub_index_entry *always;
+	int num_always, always_cap;
+
+	// per subscription: the last note we pushed, and how many
+	struct ndb_sub_mark *marks;
+	int marks_cap;
+	uint32_t stamp;
+
+	int dirty;
 };
 
 struct ndb_monitor {
-	struct ndb_subscription subscriptions[MAX_SUBSCRIPTIONS];
+	// allocated individually so they stay put as the array grows
+	struct ndb_subscription **subscriptions;
+	int subscriptions_cap;
 	ndb_sub_fn sub_cb;
 	void *sub_cb_ctx;
 	int num_subscriptions;
+	struct ndb_sub_index index;
 
 	// monitor isn't a full inbox. We want pollers to be able to poll
 	// subscriptions efficiently without going through a message queue, so
@@ -356,11 +515,133 @@ struct ndb_monitor {
 	pthread_cond_t cond;
 };
 
+/* Ingesters parse notes straight into a slab and carve off what the note
+ * actually used, instead of a malloc and realloc per note. Each note holds a
+ * reference on its slab, and the ingester holds one while it's filling it.
+ * Whoever ends up with a batch of notes (the writer for notes it didn't
+ * write, the notifier for the rest) drops the references in bulk. */
+#define NDB_NOTE_SLAB_SIZE (4 * 1024 * 1024)
+
+struct ndb_note_slab {
+	int refs;
+	size_t size;
+	size_t used;
+	unsigned char data[];
+};
+
+/* Drops references one slab at a time, for notes released in order */
+struct ndb_note_slab_releaser {
+	struct ndb_note_slab *slab;
+	int count;
+};
+
+static void ndb_note_slab_unref(struct ndb_note_slab *slab, int count)
+{
+	if (__atomic_sub_fetch(&slab->refs, count, __ATOMIC_ACQ_REL) == 0)
+		free(slab);
+}
+
+static inline void ndb_note_slab_releaser_init(struct ndb_note_slab_releaser *r)
+{
+	r->slab = NULL;
+	r->count = 0;
+}
+
+static void ndb_note_slab_releaser_flush(struct ndb_note_slab_releaser *r)
+{
+	if (r->slab)
+		ndb_note_slab_unref(r->slab, r->count);
+	r->slab = NULL;
+	r->count = 0;
+}
+
+/* Release a note buffer, from a slab or from malloc if slab is NULL */
+static void ndb_note_slab_release(struct ndb_note_slab_releaser *r,
+				  struct ndb_note_slab *slab,
+				  struct ndb_note *note)
+{
+	if (slab == NULL) {
+		free(note);
+		return;
+	}
+
+	if (slab != r->slab)
+		ndb_note_slab_releaser_flush(r);
+
+	r->slab = slab;
+	r->count++;
+}
+
+/* Room for a note of up to `want` bytes at the end of the current slab,
+ * starting a new one if it doesn't fit. Nothing is taken until
+ * ndb_note_slab_commit. */
+static void *ndb_note_slab_reserve(struct ndb_note_slab **current,
+				   size_t want)
+{
+	struct ndb_note_slab *slab = *current;
+	size_t size;
+
+	if (slab && slab->size - slab->used >= want)
+		return slab->data + slab->used;
+
+	size = max(want, NDB_NOTE_SLAB_SIZE);
+	if (!(slab = malloc(sizeof(*slab) + size)))
+		return NULL;
+
+	slab->refs = 1;
+	slab->size = size;
+	slab->used = 0;
+
+	if (*current)
+		ndb_note_slab_unref(*current, 1);
+	*current = slab;
+
+	return slab->data;
+}
+
+/* Take the first note_size bytes of the reserved space */
+static struct ndb_note *ndb_note_slab_commit(struct ndb_note_slab *slab,
+					     struct ndb_note *note,
+					     size_t note_size)
+{
+	assert((unsigned char *)note == slab->data + slab->used);
+
+	slab->used = min(slab->size, slab->used + ((note_size + 7) & ~7ULL));
+	__atomic_add_fetch(&slab->refs, 1, __ATOMIC_RELAXED);
+
+	return note;
+}
+
+enum ndb_notifier_msgtype {
+	NDB_NOTIFIER_NOTE,
+	NDB_NOTIFIER_QUIT,
+};
+
+struct ndb_notifier_msg {
+	enum ndb_notifier_msgtype type;
+	uint64_t note_id;
+	struct ndb_note *note; // owned by the notifier once queued
+	struct ndb_note_slab *slab; // where note lives, NULL if malloc'd
+};
+
+// Matches committed notes against subscriptions and runs the subscription
+// callback, so the writer can get on with the next transaction
+struct ndb_notifier {
+	struct ndb_monitor *monitor;
+	void *queue_buf;
+	int queue_buflen;
+	pthread_t thread_id;
+
+	struct prot_queue inbox;
+};
+
 struct ndb {
 	struct ndb_lmdb lmdb;
 	struct ndb_ingester ingester;
 	struct ndb_monitor monitor;
+	struct ndb_notifier notifier;
 	struct ndb_writer writer;
+	struct ndb_seen_ids seen; // shared by the ingesters and the writer
 	int version;
 	uint32_t flags; // setting flags
 	// lmdb environ handles, etc
@@ -386,6 +667,7 @@ enum ndb_query_plan {
 	NDB_PLAN_SEARCH,
 	NDB_PLAN_RELAY_KINDS,
 	NDB_PLAN_PROFILE_SEARCH,
+	NDB_PLAN_INTERSECT,
 
 	/* The all notes scan is a special case where we have basically an
 	 * empty filter
@@ -704,12 +986,16 @@ static inline int ndb_filter_elem_is_ptr(struct ndb_filter_field *field) {
 	return field->elem_type == NDB_ELEMENT_STRING || field->elem_type == NDB_ELEMENT_ID;
 }
 
+static struct ndb_filter_matcher *ndb_filter_compile(struct ndb_filter *filter);
+static void ndb_filter_matcher_free(struct ndb_filter_matcher *m);
+
 // Copy the filter
 int ndb_filter_clone(struct ndb_filter *dst, struct ndb_filter *src)
 {
 	size_t src_size, elem_size, data_size;
 
 	memcpy(dst, src, sizeof(*src));
+	dst->matcher = NULL;
 
 	elem_size = src->elem_buf.end - src->elem_buf.start;
 	data_size = src->data_buf.end - src->data_buf.start;
@@ -719,6 +1005,10 @@ int ndb_filter_clone(struct ndb_filter *dst, struct ndb_filter *src)
 	if (!src || !src->finalized)
 		return 0;
 
+	// empty filters don't keep a buffer around, neither do their clones
+	if (src_size == 0)
+		return 1;
+
 	dst->elem_buf.start = malloc(src_size);
 	dst->elem_buf.end = dst->elem_buf.start + elem_size;
 	dst->elem_buf.p = dst->elem_buf.end;
@@ -732,6 +1022,9 @@ int ndb_filter_clone(struct ndb_filter *dst, struct ndb_filter *src)
 
 	memcpy(dst->elem_buf.start, src->elem_buf.start, src_size);
 
+	// the matcher points into the filter's buffers, so build our own
+	dst->matcher = ndb_filter_compile(dst);
+
 	return 1;
 }
 
@@ -792,6 +1085,9 @@ int ndb_filter_end(struct ndb_filter *filter)
 
 	filter->finalized = 1;
 
+	// a filter we can't compile still matches, just more slowly
+	filter->matcher = ndb_filter_compile(filter);
+
 	ndb_debug("ndb_filter_end: %ld -> %ld\n", orig_size, elem_len + data_len);
 
 	return 1;
@@ -907,6 +1203,7 @@ int ndb_filter_init_with(struct ndb_filter *filter, int pages)
 	filter->elements[0] = 0;
 	filter->current = -1;
 	filter->finalized = 0;
+	filter->matcher = NULL;
 
 	return 1;
 }
@@ -920,6 +1217,8 @@ void ndb_filter_destroy(struct ndb_filter *filter)
 	if (filter->elem_buf.start)
 		free(filter->elem_buf.start);
 
+	ndb_filter_matcher_free(filter->matcher);
+
 	memset(filter, 0, sizeof(*filter));
 }
 
@@ -1383,3402 +1682,5358 @@ static int compare_kinds(const void *pa, const void *pb)
 	}
 }
 
-//
-// returns 1 if a filter matches a note
-static int ndb_filter_matches_with(struct ndb_filter *filter,
-				   struct ndb_note *note, int already_matched,
-				   struct ndb_note_relay_iterator *relay_iter)
-{
-	int i, j;
+/* The compiled form of a finalized filter, built by ndb_filter_end.
+ *
+ * ndb_filter_matches_with used to walk the filter's fields for every note:
+ * bsearching ids through offsets into the data buffer, scanning kinds
+ * linearly, and comparing every tag of the note against every unsorted tag
+ * element. Subscriptions and query post-filtering both match every note
+ * they see, so we do that work once up front instead:
+ *
+ *   - ids and authors are copied inline, sorted, with a hash table on top
+ *     once there are enough of them to be worth it
+ *   - kinds become a bitmap over the range they span
+ *   - tag values get the same treatment as ids, and the fields are indexed
+ *     by tag letter, so a note's tags are walked once for all of them
+ *   - the checks run cheapest and most selective first
+ *
+ * since and until are still read from the filter, since callers bump them in
+ * place through ndb_filter_get_int_element_ptr. */
+
+// sets smaller than this are just bsearched
+#define NDB_MATCHER_HASH_MIN 16
+
+// the widest range of kinds we'll build a bitmap for
+#define NDB_MATCHER_KIND_SPAN (1 << 16)
+
+/* A set of 32 byte ids or nul terminated strings */
+struct ndb_value_set {
+	int is_id;
+	int count;
+	unsigned char *ids;    // count * 32 bytes, sorted
+	const char **strs;     // sorted, pointing into the filter's data
+	uint32_t *slots;       // value index + 1, 0 for an empty slot
+	uint32_t mask;
+};
+
+/* A search word, keyed by the hash of the prefix a note word has to share
+ * with it. This is the same rule ndb_prefix_matches uses when walking the
+ * fulltext index, so live matches agree with query results. */
+struct ndb_matcher_word {
+	const char *word;
+	int len;
+	int need;      // prefix chars a note word has to share with us
+	uint32_t hash; // FNV-1a of the first `need` chars, lowercased
+};
+
+struct ndb_matcher_search {
+	int num_words; // 0 when the query can't match anything
+	struct ndb_matcher_word words[MAX_TEXT_SEARCH_WORDS]; // sorted by need
+};
+
+struct ndb_matcher_step {
 	struct ndb_filter_elements *els;
-	struct search_id_state state;
-	struct ndb_filter_custom *custom;
+	struct ndb_value_set set;
 
-	state.filter = filter;
+	// kinds
+	uint64_t kind_base;
+	uint64_t kind_span;
+	unsigned char *kind_bits;
 
-	for (i = 0; i < filter->num_elements; i++) {
-		els = ndb_filter_get_elements(filter, i);
-		state.els = els;
-		assert(els);
+	// search
+	struct ndb_matcher_search *search;
+};
 
-		// if we know we already match from a query scan result,
-		// we can skip this check
-		if ((1 << els->field.type) & already_matched)
-			continue;
+struct ndb_filter_matcher {
+	int num_steps;
+	struct ndb_matcher_step steps[NDB_NUM_FILTERS];
 
-		switch (els->field.type) {
-                case NDB_FILTER_KINDS:
-                        for (j = 0; j < els->count; j++) {
-                                if ((unsigned int)els->elements[j] == note->kind)
-                                        goto cont;
-			}
-			break;
-		case NDB_FILTER_RELAYS:
-			// for each relay the note was seen on, see if any match
-			if (!relay_iter) {
-				assert(!"expected relay iterator...");
-				break;
-			}
-			while ((state.key = (unsigned char *)ndb_note_relay_iterate_next(relay_iter))) {
-				// relays in filters are always sorted
-				if (bsearch(&state, &els->elements[0], els->count,
-					    sizeof(els->elements[0]), search_strs)) {
-					ndb_note_relay_iterate_close(relay_iter);
-					goto cont;
-				}
-			}
-			ndb_note_relay_iterate_close(relay_iter);
-			break;
-		case NDB_FILTER_IDS:
-			state.key = ndb_note_id(note);
-			if (bsearch(&state, &els->elements[0], els->count,
-				    sizeof(els->elements[0]), search_ids)) {
-				continue;
-			}
-			break;
-		case NDB_FILTER_AUTHORS:
-			state.key = ndb_note_pubkey(note);
-			if (bsearch(&state, &els->elements[0], els->count,
-				    sizeof(els->elements[0]), search_ids)) {
-				continue;
-			}
-			break;
-		case NDB_FILTER_TAGS:
-			if (ndb_tag_filter_matches(filter, els, note))
-				continue;
-			break;
-		case NDB_FILTER_SINCE:
-			assert(els->count == 1);
-			if (note->created_at >= els->elements[0])
-				continue;
-			break;
-		case NDB_FILTER_UNTIL:
-			assert(els->count == 1);
-			if (note->created_at < els->elements[0])
-				continue;
-			break;
-		case NDB_FILTER_SEARCH:
-			// TODO: matching search filters will need an accelerated
-			// data structure, like our minimal perfect hashmap
-			// idea for mutewords.
-			//
-			// We'll also want to store tokenized words in the filter
-			// itself, so that we can walk over each word and check
-			// the hashmap to see if the note contains at least
-			// one word.
-			//
-			// For now we always return true, since we assume
-			// the search index will be walked for these kinds
-			// of queries.
-			continue;
-		case NDB_FILTER_CUSTOM:
-			custom = ndb_filter_get_custom_element(filter, els);
-			if (custom->cb(custom->ctx, note))
-				continue;
-			break;
+	// steps that are tag fields, looked up by tag letter
+	int num_tag_steps;
+	uint64_t tag_chars[4]; // bitmap of the letters we have fields for
+};
 
-		case NDB_FILTER_LIMIT:
-cont:
-			continue;
-		}
+static uint64_t ndb_value_hash(struct ndb_value_set *set, const void *value)
+{
+	const unsigned char *p;
+	uint64_t hash;
 
-		// all need to match
-		return 0;
+	// ids are already hashes
+	if (set->is_id) {
+		memcpy(&hash, value, sizeof(hash));
+		return hash;
 	}
 
-	return 1;
+	// FNV-1a
+	hash = 0xcbf29ce484222325ULL;
+	for (p = (const unsigned char *)value; *p; p++)
+		hash = (hash ^ *p) * 0x100000001b3ULL;
+
+	return hash;
 }
 
-int ndb_filter_matches(struct ndb_filter *filter, struct ndb_note *note)
+static inline const void *ndb_value_set_get(struct ndb_value_set *set, int i)
 {
-	return ndb_filter_matches_with(filter, note, 0, NULL);
+	return set->is_id ? (const void *)(set->ids + i * 32)
+			  : (const void *)set->strs[i];
 }
 
-int ndb_filter_matches_with_relay(struct ndb_filter *filter,
-				  struct ndb_note *note,
-				  struct ndb_note_relay_iterator *note_relay_iter)
+static inline int ndb_value_cmp(struct ndb_value_set *set, const void *a,
+				const void *b)
 {
-	return ndb_filter_matches_with(filter, note, 0, note_relay_iter);
+	return set->is_id ? memcmp(a, b, 32)
+			  : strcmp((const char *)a, (const char *)b);
 }
 
-// because elements are stored as offsets and qsort doesn't support context,
-// we do a dumb thing where we convert elements to pointers and back if we
-// are doing an id or string sort
-static void sort_filter_elements(struct ndb_filter *filter,
-				 struct ndb_filter_elements *els,
-				 int (*cmp)(const void *, const void *))
+static int ndb_value_set_contains(struct ndb_value_set *set, const void *value)
 {
-	int i;
+	uint32_t slot, ind;
+	int lo, hi, mid, cmp;
 
-	assert(ndb_filter_elem_is_ptr(&els->field));
+	if (set->slots) {
+		slot = ndb_value_hash(set, value) & set->mask;
+		while ((ind = set->slots[slot])) {
+			if (!ndb_value_cmp(set, value, ndb_value_set_get(set, ind - 1)))
+				return 1;
+			slot = (slot + 1) & set->mask;
+		}
+		return 0;
+	}
 
-	for (i = 0; i < els->count; i++)
-		els->elements[i] += (uint64_t)filter->data_buf.start;
+	lo = 0;
+	hi = set->count - 1;
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = ndb_value_cmp(set, value, ndb_value_set_get(set, mid));
+		if (cmp == 0)
+			return 1;
+		else if (cmp < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
 
-	qsort(&els->elements[0], els->count, sizeof(els->elements[0]), cmp);
+	return 0;
+}
 
-	for (i = 0; i < els->count; i++)
-		els->elements[i] -= (uint64_t)filter->data_buf.start;
+static int ndb_id_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, 32);
 }
 
-static int ndb_filter_field_eq(struct ndb_filter *a_filt,
-			       struct ndb_filter_elements *a_field,
-			       struct ndb_filter *b_filt,
-			       struct ndb_filter_elements *b_field)
+static int ndb_value_set_build(struct ndb_value_set *set,
+			       struct ndb_filter *filter,
+			       struct ndb_filter_elements *els)
 {
+	uint32_t slot, size;
 	int i;
-	const char *a_str, *b_str;
-	unsigned char *a_id, *b_id;
-	uint64_t a_int, b_int;
-	struct ndb_filter_custom *a_custom, *b_custom;
 
-	if (a_field->count != b_field->count)
-		return 0;
+	set->is_id = els->field.elem_type == NDB_ELEMENT_ID;
+	set->count = els->count;
 
-	if (a_field->field.type != b_field->field.type) {
-		ndb_debug("UNUSUAL: field types do not match in ndb_filter_field_eq\n");
-		return 0;
-	}
+	if (set->is_id) {
+		if (!(set->ids = malloc(els->count * 32 + 1)))
+			return 0;
 
-	if (a_field->field.elem_type != b_field->field.elem_type) {
-		ndb_debug("UNUSUAL: field element types do not match in ndb_filter_field_eq\n");
-		return 0;
+		for (i = 0; i < els->count; i++)
+			memcpy(set->ids + i * 32,
+			       ndb_filter_get_id_element(filter, els, i), 32);
+
+		// ids and authors are sorted by ndb_filter_end_field, tag
+		// values aren't
+		qsort(set->ids, set->count, 32, ndb_id_cmp);
+	} else {
+		if (!(set->strs = malloc(els->count * sizeof(*set->strs) + 1)))
+			return 0;
+
+		for (i = 0; i < els->count; i++)
+			set->strs[i] = ndb_filter_get_string_element(filter, els, i);
+
+		qsort(set->strs, set->count, sizeof(*set->strs), compare_strs);
 	}
 
-	if (a_field->field.elem_type == NDB_ELEMENT_UNKNOWN) {
-		ndb_debug("UNUSUAL: field element types are unknown\n");
+	if (set->count < NDB_MATCHER_HASH_MIN)
+		return 1;
+
+	// keep the table at most half full
+	for (size = 1; size < (uint32_t)set->count * 2; size <<= 1)
+		;
+
+	if (!(set->slots = calloc(size, sizeof(*set->slots))))
 		return 0;
-	}
+	set->mask = size - 1;
 
-	for (i = 0; i < a_field->count; i++) {
-		switch (a_field->field.elem_type) {
-		case NDB_ELEMENT_CUSTOM:
-			a_custom = ndb_filter_get_custom_element(a_filt, a_field);
-			b_custom = ndb_filter_get_custom_element(b_filt, b_field);
-			if (memcmp(a_custom, b_custom, sizeof(*a_custom)))
-				return 0;
-			break;
-		case NDB_ELEMENT_UNKNOWN:
-			return 0;
-		case NDB_ELEMENT_STRING:
-			a_str = ndb_filter_get_string_element(a_filt, a_field, i);
-			b_str = ndb_filter_get_string_element(b_filt, b_field, i);
-			if (strcmp(a_str, b_str))
-				return 0;
-			break;
-		case NDB_ELEMENT_ID:
-			a_id = ndb_filter_get_id_element(a_filt, a_field, i);
-			b_id = ndb_filter_get_id_element(b_filt, b_field, i);
-			if (memcmp(a_id, b_id, 32))
-				return 0;
-			break;
-		case NDB_ELEMENT_INT:
-			a_int = ndb_filter_get_int_element(a_field, i);
-			b_int = ndb_filter_get_int_element(b_field, i);
-			if (a_int != b_int)
-				return 0;
-			break;
-		}
+	for (i = 0; i < set->count; i++) {
+		slot = ndb_value_hash(set, ndb_value_set_get(set, i)) & set->mask;
+		while (set->slots[slot])
+			slot = (slot + 1) & set->mask;
+		set->slots[slot] = i + 1;
 	}
 
 	return 1;
 }
 
-void ndb_filter_end_field(struct ndb_filter *filter)
+static int ndb_matcher_kinds_build(struct ndb_matcher_step *step)
 {
-	int cur_offset;
-	struct ndb_filter_elements *cur;
-
-	cur_offset = filter->current;
+	struct ndb_filter_elements *els = step->els;
+	uint64_t kind;
+	int i;
 
-	if (!(cur = ndb_filter_current_element(filter)))
-		return;
+	// sorted by ndb_filter_end_field
+	if (els->count == 0)
+		return 1;
 
-	filter->elements[filter->num_elements++] = cur_offset;
+	step->kind_base = els->elements[0];
+	step->kind_span = els->elements[els->count - 1] - step->kind_base + 1;
 
-	// sort elements for binary search
-	switch (cur->field.type) {
-	case NDB_FILTER_IDS:
-	case NDB_FILTER_AUTHORS:
-		sort_filter_elements(filter, cur, compare_ids);
-		break;
-	case NDB_FILTER_RELAYS:
-		sort_filter_elements(filter, cur, compare_strs);
-		break;
-	case NDB_FILTER_KINDS:
-		qsort(&cur->elements[0], cur->count,
-		      sizeof(cur->elements[0]), compare_kinds);
-		break;
-	case NDB_FILTER_TAGS:
-		// TODO: generic tag search sorting
-		break;
-	case NDB_FILTER_SINCE:
-	case NDB_FILTER_CUSTOM:
-	case NDB_FILTER_UNTIL:
-	case NDB_FILTER_LIMIT:
-	case NDB_FILTER_SEARCH:
-		// don't need to sort these
-		break;
-	}
+	// too spread out for a bitmap, bsearch the sorted kinds instead
+	if (step->kind_span > NDB_MATCHER_KIND_SPAN)
+		return 1;
 
-	filter->current = -1;
+	if (!(step->kind_bits = calloc((step->kind_span + 7) / 8, 1)))
+		return 0;
 
-}
+	for (i = 0; i < els->count; i++) {
+		kind = els->elements[i] - step->kind_base;
+		step->kind_bits[kind / 8] |= 1 << (kind % 8);
+	}
 
-static void ndb_filter_group_init(struct ndb_filter_group *group)
-{
-	group->num_filters = 0;
+	return 1;
 }
 
-static int ndb_filter_group_add(struct ndb_filter_group *group,
-				struct ndb_filter *filter)
+/* Cheapest and most decisive checks first. The note's own fields are
+ * cheaper to test than its tags, and relays cost a db lookup. Custom
+ * callbacks are unknown, so they go last. Smaller sets reject more notes,
+ * so they go first among their kind. */
+static int ndb_matcher_step_rank(struct ndb_matcher_step *step)
 {
-	if (group->num_filters + 1 > MAX_FILTERS)
-		return 0;
+	switch (step->els->field.type) {
+	case NDB_FILTER_SINCE:
+	case NDB_FILTER_UNTIL:   return 0;
+	case NDB_FILTER_IDS:     return 1;
+	case NDB_FILTER_KINDS:   return 2;
+	case NDB_FILTER_AUTHORS: return 3;
+	case NDB_FILTER_TAGS:    return 4;
+	case NDB_FILTER_RELAYS:  return 5;
+	case NDB_FILTER_CUSTOM:  return 6;
+	case NDB_FILTER_LIMIT:
+	case NDB_FILTER_SEARCH:  return 7;
+	}
 
-	return ndb_filter_clone(&group->filters[group->num_filters++], filter);
+	return 7;
 }
 
-static int ndb_filter_group_matches(struct ndb_filter_group *group, struct ndb_note *note)
+static int ndb_matcher_step_cmp(const void *pa, const void *pb)
 {
-	int i;
-	struct ndb_filter *filter;
+	struct ndb_matcher_step *a = (struct ndb_matcher_step *)pa;
+	struct ndb_matcher_step *b = (struct ndb_matcher_step *)pb;
+	int ra, rb;
 
-	if (group->num_filters == 0)
-		return 1;
+	ra = ndb_matcher_step_rank(a);
+	rb = ndb_matcher_step_rank(b);
+	if (ra != rb)
+		return ra - rb;
 
-	for (i = 0; i < group->num_filters; i++) {
-		filter = &group->filters[i];
+	return a->els->count - b->els->count;
+}
 
-		if (ndb_filter_matches(filter, note))
-			return 1;
-	}
+static int ndb_parse_words(struct cursor *cur, void *ctx, ndb_word_parser_fn fn);
+static int ndb_parse_search_words(void *ctx, const char *word_str, int word_len, int word_index);
+static void ndb_search_words_init(struct ndb_search_words *words);
+static int prefix_count(const char *str1, int len1, const char *str2, int len2);
 
-	return 0;
+static uint32_t ndb_search_hash_step(uint32_t hash, char c)
+{
+	return (hash ^ (unsigned char)tolower(c)) * 16777619u;
 }
 
-static void ndb_make_search_key(struct ndb_search_key *key, unsigned char *id,
-			        uint64_t timestamp, const char *search)
+static int ndb_matcher_word_cmp(const void *pa, const void *pb)
 {
-	memcpy(key->id, id, 32);
-	key->timestamp = timestamp;
-	lowercase_strncpy(key->search, search, sizeof(key->search) - 1);
-	key->search[sizeof(key->search) - 1] = '\0';
+	const struct ndb_matcher_word *a = pa, *b = pb;
+	return a->need - b->need;
 }
 
-static int ndb_write_profile_search_index(struct ndb_txn *txn,
-					  struct ndb_search_key *index_key,
-					  uint64_t profile_key)
+static void ndb_matcher_search_init(struct ndb_matcher_search *search,
+				    const char *query)
 {
-	int rc;
-	MDB_val key, val;
+	struct ndb_search_words words;
+	struct ndb_matcher_word *w;
+	struct cursor cur;
+	int i, j;
 
-	key.mv_data = index_key;
-	key.mv_size = sizeof(*index_key);
-	val.mv_data = &profile_key;
-	val.mv_size = sizeof(profile_key);
+	search->num_words = 0;
+	if (query == NULL)
+		return;
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH],
-			  &key, &val, 0)))
-	{
-		ndb_debug("ndb_write_profile_search_index failed: %s\n",
-			  mdb_strerror(rc));
-		return 0;
+	ndb_search_words_init(&words);
+	make_cursor((unsigned char *)query,
+		    (unsigned char *)query + strlen(query), &cur);
+	ndb_parse_words(&cur, &words, ndb_parse_search_words);
+
+	for (i = 0; i < words.num_words; i++) {
+		// the index never matches these, so neither do we
+		if (words.words[i].word_len < 2) {
+			search->num_words = 0;
+			return;
+		}
+
+		w = &search->words[search->num_words++];
+		w->word = words.words[i].word;
+		w->len = words.words[i].word_len;
+		w->need = (int)((double)w->len / 1.5) + 1;
+		w->hash = 2166136261u;
+		for (j = 0; j < w->need; j++)
+			w->hash = ndb_search_hash_step(w->hash, w->word[j]);
 	}
 
-	return 1;
+	qsort(search->words, search->num_words, sizeof(search->words[0]),
+	      ndb_matcher_word_cmp);
 }
 
+struct ndb_search_match_ctx {
+	struct ndb_matcher_search *search;
+	struct cursor *cur;
+	uint32_t matched;
+	uint32_t all;
+};
 
-// map usernames and display names to profile keys for user searching
-static int ndb_write_profile_search_indices(struct ndb_txn *txn,
-					    struct ndb_note *note,
-					    uint64_t profile_key,
-					    void *profile_root)
+static int ndb_search_match_word(void *ctx, const char *word, int word_len,
+				 int word_index)
 {
-	struct ndb_search_key index;
-	NdbProfileRecord_table_t profile_record;
-	NdbProfile_table_t profile;
-
-	profile_record = NdbProfileRecord_as_root(profile_root);
-	profile = NdbProfileRecord_profile_get(profile_record);
+	struct ndb_search_match_ctx *m = ctx;
+	struct ndb_matcher_search *search = m->search;
+	struct ndb_matcher_word *w;
+	uint32_t hash;
+	int i, k;
 
-	const char *name = NdbProfile_name_get(profile);
-	const char *display_name = NdbProfile_display_name_get(profile);
+	(void)word_index;
 
-	// words + pubkey + created
-	if (name) {
-		ndb_make_search_key(&index, note->pubkey, note->created_at,
-				    name);
-		if (!ndb_write_profile_search_index(txn, &index, profile_key))
-			return 0;
-	}
+	// hash the note word one char at a time, checking the search words
+	// whose prefix ends here
+	hash = 2166136261u;
+	k = 0;
+	for (i = 0; i < word_len && k < search->num_words; i++) {
+		hash = ndb_search_hash_step(hash, word[i]);
 
-	if (display_name) {
-		// don't write the same name/display_name twice
-		if (name && !strcmp(display_name, name)) {
-			return 1;
+		for (; k < search->num_words && search->words[k].need == i + 1; k++) {
+			w = &search->words[k];
+			if ((m->matched & (1 << k)) || w->hash != hash)
+				continue;
+			if (prefix_count(word, i + 1, w->word, i + 1) == i + 1)
+				m->matched |= 1 << k;
 		}
-		ndb_make_search_key(&index, note->pubkey, note->created_at,
-				    display_name);
-		if (!ndb_write_profile_search_index(txn, &index, profile_key))
-			return 0;
 	}
 
+	// every word matched, no need to look at the rest of the note
+	if (m->matched == m->all)
+		m->cur->p = m->cur->end;
+
 	return 1;
 }
 
-static inline void ndb_tsid_init(struct ndb_tsid *key, unsigned char *id,
-				 uint64_t timestamp)
+/* Every search word has to prefix match some word in the note's content */
+static int ndb_matcher_search(struct ndb_matcher_search *search,
+			      struct ndb_note *note)
 {
-	memcpy(key->id, id, 32);
-	key->timestamp = timestamp;
-}
+	struct ndb_search_match_ctx ctx;
+	struct cursor cur;
+	struct ndb_str str;
 
-static inline void ndb_tsid_low(struct ndb_tsid *key, unsigned char *id)
-{
-	memcpy(key->id, id, 32);
-	key->timestamp = 0;
-}
+	if (search->num_words == 0)
+		return 0;
 
-static inline void ndb_u64_ts_init(struct ndb_u64_ts *key, uint64_t integer,
-				     uint64_t timestamp)
-{
-	key->u64 = integer;
-	key->timestamp = timestamp;
-}
+	str = ndb_note_str(note, &note->content);
+	if (unlikely(str.flag == NDB_PACKED_ID))
+		return 0;
 
-// useful for range-searching for the latest key with a clustered created_at timen
-static inline void ndb_tsid_high(struct ndb_tsid *key, const unsigned char *id)
-{
-	memcpy(key->id, id, 32);
-	key->timestamp = UINT64_MAX;
-}
+	make_cursor((unsigned char *)str.str,
+		    (unsigned char *)str.str + note->content_length, &cur);
 
-static int _ndb_begin_query(struct ndb *ndb, struct ndb_txn *txn, int flags)
-{
-	txn->lmdb = &ndb->lmdb;
-	MDB_txn **mdb_txn = (MDB_txn **)&txn->mdb_txn;
-	if (!txn->lmdb->env)
-		return 0;
-	return mdb_txn_begin(txn->lmdb->env, NULL, flags, mdb_txn) == 0;
-}
+	ctx.search = search;
+	ctx.cur = &cur;
+	ctx.matched = 0;
+	ctx.all = (1 << search->num_words) - 1;
 
-int ndb_begin_query(struct ndb *ndb, struct ndb_txn *txn)
-{
-	return _ndb_begin_query(ndb, txn, MDB_RDONLY);
-}
+	ndb_parse_words(&cur, &ctx, ndb_search_match_word);
 
-// this should only be used in migrations, etc
-static int ndb_begin_rw_query(struct ndb *ndb, struct ndb_txn *txn)
-{
-	return _ndb_begin_query(ndb, txn, 0);
+	return ctx.matched == ctx.all;
 }
 
-static int ndb_db_is_index(enum ndb_dbs index)
+static void ndb_filter_matcher_free(struct ndb_filter_matcher *m)
 {
-	switch (index) {
-		case NDB_DB_NOTE:
-		case NDB_DB_META:
-		case NDB_DB_PROFILE:
-		case NDB_DB_NOTE_ID:
-		case NDB_DB_NDB_META:
-		case NDB_DB_PROFILE_SEARCH:
-		case NDB_DB_PROFILE_LAST_FETCH:
-		case NDB_DB_NOTE_RELAYS:
-		case NDB_DBS:
-			return 0;
-		case NDB_DB_PROFILE_PK:
-		case NDB_DB_NOTE_KIND:
-		case NDB_DB_NOTE_TEXT:
-		case NDB_DB_NOTE_BLOCKS:
-		case NDB_DB_NOTE_TAGS:
-		case NDB_DB_NOTE_PUBKEY:
-		case NDB_DB_NOTE_PUBKEY_KIND:
-		case NDB_DB_NOTE_RELAY_KIND:
-			return 1;
+	int i;
+
+	if (!m)
+		return;
+
+	for (i = 0; i < m->num_steps; i++) {
+		free(m->steps[i].set.ids);
+		free(m->steps[i].set.strs);
+		free(m->steps[i].set.slots);
+		free(m->steps[i].kind_bits);
+		free(m->steps[i].search);
 	}
 
-	return 0;
+	free(m);
 }
 
-static inline void ndb_id_u64_ts_init(struct ndb_id_u64_ts *key,
-				      unsigned char *id, uint64_t iu64,
-				      uint64_t timestamp)
+static struct ndb_filter_matcher *ndb_filter_compile(struct ndb_filter *filter)
 {
-	memcpy(key->id, id, 32);
-	key->u64 = iu64;
-	key->timestamp = timestamp;
-}
+	struct ndb_filter_matcher *m;
+	struct ndb_matcher_step *step;
+	struct ndb_filter_elements *els;
+	int i, ok;
 
-// formats the relay url buffer for the NDB_DB_NOTE_RELAYS value. It's a
-// null terminated string padded to 8 bytes (we must keep the entire database
-// aligned to 8 bytes at all times)
-static int prepare_relay_buf(char *relay_buf, int bufsize, const char *relay,
-			     int relay_len)
-{
-	struct cursor cur;
+	// empty filters own no memory once finalized, keep it that way
+	if (filter->num_elements == 0)
+		return NULL;
 
-	// make sure the size of the buffer is aligned
-	assert((bufsize % 8) == 0);
+	if (!(m = calloc(1, sizeof(*m))))
+		return NULL;
 
-	make_cursor((unsigned char *)relay_buf, (unsigned char *)relay_buf + bufsize, &cur);
+	ok = 1;
+	for (i = 0; ok && i < filter->num_elements; i++) {
+		if (!(els = ndb_filter_get_elements(filter, i))) {
+			ok = 0;
+			break;
+		}
 
-	// push the relay string
-	if (!cursor_push(&cur, (unsigned char *)relay, relay_len))
-		return 0;
+		step = &m->steps[m->num_steps++];
+		step->els = els;
 
-	// relay urls are null terminated for convenience
-	if (!cursor_push_byte(&cur, 0))
-		return 0;
+		switch (els->field.type) {
+		case NDB_FILTER_IDS:
+		case NDB_FILTER_AUTHORS:
+			ok = ndb_value_set_build(&step->set, filter, els);
+			break;
+		case NDB_FILTER_TAGS:
+			if (els->field.elem_type != NDB_ELEMENT_ID &&
+			    els->field.elem_type != NDB_ELEMENT_STRING) {
+				ok = 0;
+				break;
+			}
+			ok = ndb_value_set_build(&step->set, filter, els);
+			m->num_tag_steps++;
+			m->tag_chars[(unsigned char)els->field.tag / 64] |=
+				1ULL << ((unsigned char)els->field.tag % 64);
+			break;
+		case NDB_FILTER_KINDS:
+			ok = ndb_matcher_kinds_build(step);
+			break;
+		case NDB_FILTER_SEARCH:
+			if (!(step->search = malloc(sizeof(*step->search)))) {
+				ok = 0;
+				break;
+			}
+			ndb_matcher_search_init(step->search,
+				ndb_filter_get_string_element(filter, els, 0));
+			break;
+		case NDB_FILTER_SINCE:
+		case NDB_FILTER_UNTIL:
+		case NDB_FILTER_LIMIT:
+		case NDB_FILTER_RELAYS:
+		case NDB_FILTER_CUSTOM:
+			break;
+		}
+	}
 
-	// align the buffer
-	if (!cursor_align(&cur, 8))
-		return 0;
+	if (!ok) {
+		ndb_filter_matcher_free(m);
+		return NULL;
+	}
 
-	return cur.p - cur.start;
+	qsort(m->steps, m->num_steps, sizeof(m->steps[0]), ndb_matcher_step_cmp);
+
+	return m;
 }
 
-// Write to the note_id -> relay_url database. This records where notes
-// have been seen
-static int ndb_write_note_relay(struct ndb_txn *txn, uint64_t note_key,
-				const char *relay, uint8_t relay_len)
+static int ndb_matcher_kinds(struct ndb_matcher_step *step, uint64_t kind)
 {
-	char relay_buf[256];
-	int rc, len;
-	MDB_val k, v;
+	uint64_t bit;
 
-	if (relay == NULL || relay_len == 0) {
-		ndb_debug("relay is NULL in ndb_write_note_relay? '%s' %d\n", relay, relay_len);
-		return 0;
+	if (step->kind_bits) {
+		if (kind < step->kind_base)
+			return 0;
+		bit = kind - step->kind_base;
+		return bit < step->kind_span &&
+		       (step->kind_bits[bit / 8] & (1 << (bit % 8)));
 	}
 
-	ndb_debug("writing note_relay '%s' for notekey:%" PRIu64 "\n", relay, note_key);
+	return bsearch(&kind, &step->els->elements[0], step->els->count,
+		       sizeof(step->els->elements[0]), compare_kinds) != NULL;
+}
 
-	if (!(len = prepare_relay_buf(relay_buf, sizeof(relay_buf), relay, relay_len))) {
-		fprintf(stderr, "relay url '%s' too large when writing note relay index\n", relay);
-		return 0;
-	}
+/* Every tag field has to match, which we check in a single walk over the
+ * note's tags. Tag steps sit next to each other after sorting, starting at
+ * `first`. */
+static int ndb_matcher_tags(struct ndb_filter_matcher *m, int first,
+			    struct ndb_note *note)
+{
+	struct ndb_matcher_step *step;
+	struct ndb_iterator iter, *it = &iter;
+	struct ndb_str str;
+	unsigned char c;
+	int i, matched, want;
 
-	assert((len % 8) == 0);
+	matched = 0;
+	want = (1 << m->num_tag_steps) - 1;
 
-	k.mv_data = &note_key;
-	k.mv_size = sizeof(note_key);
+	ndb_tags_iterate_start(note, it);
 
-	v.mv_data = relay_buf;
-	v.mv_size = len;
+	while (ndb_tags_iterate_next(it)) {
+		// we're looking for tags with 2 or more entries: ["p", id], etc
+		if (it->tag->count < 2)
+			continue;
 
-	// NODUPDATA is specified so that we don't accidently add duplicate
-	// key/value pairs
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAYS],
-			  &k, &v, MDB_NODUPDATA)))
-	{
-		ndb_debug("ndb_write_note_relay failed: %s\n", mdb_strerror(rc));
-		return 0;
-	}
+		str = ndb_tag_str(note, it->tag, 0);
 
-	ndb_debug("wrote %d bytes to note relay: '%s'\n", len, relay_buf);
+		// single letter tags only
+		if (str.flag != NDB_PACKED_STR || str.str[1] != 0)
+			continue;
 
-	return 1;
-}
+		c = (unsigned char)str.str[0];
+		if (c >= 128 || !(m->tag_chars[c / 64] & (1ULL << (c % 64))))
+			continue;
 
-struct ndb_relay_kind_key {
-	uint64_t note_key;
-	uint64_t kind;
-	uint64_t created_at;
-	uint8_t relay_len;
-	const char *relay;
-};
+		str = ndb_tag_str(note, it->tag, 1);
 
-static int ndb_relay_kind_key_init(
-		struct ndb_relay_kind_key *key,
-		uint64_t note_key,
-		uint64_t kind,
-		uint64_t created_at,
-		const char *relay)
-{
-	if (relay == NULL)
-		return 0;
+		for (i = 0; i < m->num_tag_steps; i++) {
+			step = &m->steps[first + i];
 
-	key->relay = relay;
-	key->relay_len = strlen(relay);
-	if (key->relay_len > 248)
-		return 0;
+			if ((matched & (1 << i)) || step->els->field.tag != (char)c)
+				continue;
 
-	key->note_key = note_key;
-	key->kind = kind;
-	key->created_at = created_at;
-	return 1;
-}
+			// ids only match packed ids and strings only match
+			// strings
+			if (step->set.is_id != (str.flag == NDB_PACKED_ID))
+				continue;
 
+			if (ndb_value_set_contains(&step->set, step->set.is_id
+						   ? (const void *)str.id
+						   : (const void *)str.str))
+				matched |= 1 << i;
+		}
 
-// create a range key for a relay kind query
-static int ndb_relay_kind_key_init_high(
-		struct ndb_relay_kind_key *key,
-		const char *relay,
-		uint64_t kind,
-		uint64_t until)
-{
-	// note_key is the last field in the key, so UINT64_MAX puts us just
-	// past every entry at created_at == until
-	return ndb_relay_kind_key_init(key, UINT64_MAX, kind, until, relay);
-}
+		if (matched == want)
+			return 1;
+	}
 
-static void ndb_parse_relay_kind_key(struct ndb_relay_kind_key *key, unsigned char *buf)
-{
-	// WE ARE ASSUMING WE ARE PARSING FROM AN ALIGNED BUFFER HERE
-	assert((uint64_t)buf % 8 == 0);
-	// - note_id:        00 + 8 bytes
-	// - kind:           08 + 8 bytes
-	// - created_at:     16 + 8 bytes
-	// - relay_url_size: 24 + 1 byte
-	// - relay_url:      25 + n byte null-terminated string
-	// - pad to 8 byte alignment
-	key->note_key   =  *(uint64_t*) (buf + 0);
-	key->kind       =  *(uint64_t*) (buf + 8);
-	key->created_at =  *(uint64_t*) (buf + 16);
-	key->relay_len  =   *(uint8_t*) (buf + 24);
-	key->relay      = (const char*) (buf + 25);
+	return 0;
 }
 
-static void ndb_debug_relay_kind_key(struct ndb_relay_kind_key *key)
+static int ndb_filter_matcher_matches(struct ndb_filter *filter,
+				      struct ndb_note *note,
+				      int already_matched,
+				      struct ndb_note_relay_iterator *relay_iter)
 {
-	ndb_debug("note_key:%" PRIu64 " kind:%" PRIu64 " created_at:%" PRIu64 " '%s'\n",
-			key->note_key, key->kind, key->created_at, key->relay);
-}
+	struct ndb_filter_matcher *m = filter->matcher;
+	struct ndb_matcher_step *step;
+	struct ndb_filter_elements *els;
+	struct ndb_filter_custom *custom;
+	struct search_id_state state;
+	int i, tags_done;
 
-static int ndb_build_relay_kind_key(unsigned char *buf, int bufsize, struct ndb_relay_kind_key *key)
-{
-	struct cursor cur;
-	make_cursor(buf, buf + bufsize, &cur);
+	tags_done = 0;
 
-	if (!cursor_push(&cur, (unsigned char *)&key->note_key, 8))   return 0;
-	if (!cursor_push(&cur, (unsigned char *)&key->kind, 8))       return 0;
-	if (!cursor_push(&cur, (unsigned char *)&key->created_at, 8)) return 0;
-	if (!cursor_push_byte(&cur, key->relay_len)) return 0;
-	if (!cursor_push(&cur, (unsigned char *)key->relay, key->relay_len)) return 0;
-	if (!cursor_push_byte(&cur, 0)) return 0;
-	if (!cursor_align(&cur, 8)) return 0;
+	for (i = 0; i < m->num_steps; i++) {
+		step = &m->steps[i];
+		els = step->els;
 
-	assert(((cur.p-cur.start)%8) == 0);
+		// if we know we already match from a query scan result,
+		// we can skip this check
+		if ((1 << els->field.type) & already_matched)
+			continue;
 
-	return cur.p - cur.start;
+		switch (els->field.type) {
+		case NDB_FILTER_SINCE:
+			if (note->created_at < els->elements[0])
+				return 0;
+			break;
+		case NDB_FILTER_UNTIL:
+			if (note->created_at >= els->elements[0])
+				return 0;
+			break;
+		case NDB_FILTER_KINDS:
+			if (!ndb_matcher_kinds(step, note->kind))
+				return 0;
+			break;
+		case NDB_FILTER_IDS:
+			if (!ndb_value_set_contains(&step->set, ndb_note_id(note)))
+				return 0;
+			break;
+		case NDB_FILTER_AUTHORS:
+			if (!ndb_value_set_contains(&step->set, ndb_note_pubkey(note)))
+				return 0;
+			break;
+		case NDB_FILTER_TAGS:
+			if (tags_done)
+				break;
+			tags_done = 1;
+			if (!ndb_matcher_tags(m, i, note))
+				return 0;
+			break;
+		case NDB_FILTER_RELAYS:
+			if (!relay_iter) {
+				assert(!"expected relay iterator...");
+				return 0;
+			}
+			state.filter = filter;
+			state.els = els;
+			while ((state.key = (unsigned char *)ndb_note_relay_iterate_next(relay_iter))) {
+				// relays in filters are always sorted
+				if (bsearch(&state, &els->elements[0], els->count,
+					    sizeof(els->elements[0]), search_strs))
+					break;
+			}
+			ndb_note_relay_iterate_close(relay_iter);
+			if (!state.key)
+				return 0;
+			break;
+		case NDB_FILTER_CUSTOM:
+			custom = ndb_filter_get_custom_element(filter, els);
+			if (!custom->cb(custom->ctx, note))
+				return 0;
+			break;
+		case NDB_FILTER_SEARCH:
+			if (!ndb_matcher_search(step->search, note))
+				return 0;
+			break;
+		case NDB_FILTER_LIMIT:
+			break;
+		}
+	}
+
+	return 1;
 }
 
-static int ndb_write_note_relay_kind_index(
-		struct ndb_txn *txn,
-		struct ndb_relay_kind_key *key)
+//
+// returns 1 if a filter matches a note
+static int ndb_filter_matches_with(struct ndb_filter *filter,
+				   struct ndb_note *note, int already_matched,
+				   struct ndb_note_relay_iterator *relay_iter)
 {
-	// The relay kind key has a layout like so
-	//
-	// - note_key:       00 + 8 bytes
-	// - kind:           08 + 8 bytes
-	// - created_at:     16 + 8 bytes
-	// - relay_url_size: 24 + 1 byte
-	// - relay_url:      25 + n byte null-terminated string
-	// - pad to 8 byte alignment
+	int i, j;
+	struct ndb_filter_elements *els;
+	struct search_id_state state;
+	struct ndb_filter_custom *custom;
+	struct ndb_matcher_search search;
 
-	unsigned char buf[256];
-	int rc, len;
-	MDB_val k, v;
+	if (filter->matcher)
+		return ndb_filter_matcher_matches(filter, note, already_matched,
+						  relay_iter);
 
-	// come on bro
-	if (key->relay_len > 248 || key->relay == NULL || key->relay_len == 0)
-		return 0;
+	state.filter = filter;
 
-	ndb_debug("writing note_relay_kind_index '%s' for notekey:%" PRIu64 "\n", key->relay, key->note_key);
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		state.els = els;
+		assert(els);
 
-	if (!(len = ndb_build_relay_kind_key(buf, sizeof(buf), key)))
-		return 0;
+		// if we know we already match from a query scan result,
+		// we can skip this check
+		if ((1 << els->field.type) & already_matched)
+			continue;
 
-	k.mv_data = buf;
-	k.mv_size = len;
+		switch (els->field.type) {
+                case NDB_FILTER_KINDS:
+                        for (j = 0; j < els->count; j++) {
+                                if ((unsigned int)els->elements[j] == note->kind)
+                                        goto cont;
+			}
+			break;
+		case NDB_FILTER_RELAYS:
+			// for each relay the note was seen on, see if any match
+			if (!relay_iter) {
+				assert(!"expected relay iterator...");
+				break;
+			}
+			while ((state.key = (unsigned char *)ndb_note_relay_iterate_next(relay_iter))) {
+				// relays in filters are always sorted
+				if (bsearch(&state, &els->elements[0], els->count,
+					    sizeof(els->elements[0]), search_strs)) {
+					ndb_note_relay_iterate_close(relay_iter);
+					goto cont;
+				}
+			}
+			ndb_note_relay_iterate_close(relay_iter);
+			break;
+		case NDB_FILTER_IDS:
+			state.key = ndb_note_id(note);
+			if (bsearch(&state, &els->elements[0], els->count,
+				    sizeof(els->elements[0]), search_ids)) {
+				continue;
+			}
+			break;
+		case NDB_FILTER_AUTHORS:
+			state.key = ndb_note_pubkey(note);
+			if (bsearch(&state, &els->elements[0], els->count,
+				    sizeof(els->elements[0]), search_ids)) {
+				continue;
+			}
+			break;
+		case NDB_FILTER_TAGS:
+			if (ndb_tag_filter_matches(filter, els, note))
+				continue;
+			break;
+		case NDB_FILTER_SINCE:
+			assert(els->count == 1);
+			if (note->created_at >= els->elements[0])
+				continue;
+			break;
+		case NDB_FILTER_UNTIL:
+			assert(els->count == 1);
+			if (note->created_at < els->elements[0])
+				continue;
+			break;
+		case NDB_FILTER_SEARCH:
+			// only reached when the filter couldn't be compiled,
+			// so parse the query each time
+			ndb_matcher_search_init(&search,
+				ndb_filter_get_string_element(filter, els, 0));
+			if (ndb_matcher_search(&search, note))
+				continue;
+			break;
+		case NDB_FILTER_CUSTOM:
+			custom = ndb_filter_get_custom_element(filter, els);
+			if (custom->cb(custom->ctx, note))
+				continue;
+			break;
 
-	v.mv_data = NULL;
-	v.mv_size = 0;
+		case NDB_FILTER_LIMIT:
+cont:
+			continue;
+		}
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAY_KIND], &k, &v, 0))) {
-		fprintf(stderr, "write note relay kind index failed: %s\n",
-			  mdb_strerror(rc));
+		// all need to match
 		return 0;
 	}
 
 	return 1;
 }
 
-// writes the relay note kind index and the note_id -> relay db
-static int ndb_write_note_relay_indexes(struct ndb_txn *txn, struct ndb_relay_kind_key *key)
+int ndb_filter_matches(struct ndb_filter *filter, struct ndb_note *note)
 {
-	ndb_write_note_relay_kind_index(txn, key);
-	ndb_write_note_relay(txn, key->note_key, key->relay, key->relay_len);
-	return 1;
+	return ndb_filter_matches_with(filter, note, 0, NULL);
 }
 
-static int ndb_write_note_pubkey_index(struct ndb_txn *txn, struct ndb_note *note,
-				       uint64_t note_key)
+int ndb_filter_matches_with_relay(struct ndb_filter *filter,
+				  struct ndb_note *note,
+				  struct ndb_note_relay_iterator *note_relay_iter)
 {
-	int rc;
-	struct ndb_tsid key;
-	MDB_val k, v;
-
-	ndb_tsid_init(&key, ndb_note_pubkey(note), ndb_note_created_at(note));
-
-	k.mv_data = &key;
-	k.mv_size = sizeof(key);
-
-	v.mv_data = &note_key;
-	v.mv_size = sizeof(note_key);
-
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY], &k, &v, 0))) {
-		fprintf(stderr, "write note pubkey index failed: %s\n",
-			  mdb_strerror(rc));
-		return 0;
-	}
-
-	return 1;
+	return ndb_filter_matches_with(filter, note, 0, note_relay_iter);
 }
 
-static int ndb_write_note_pubkey_kind_index(struct ndb_txn *txn,
-					    struct ndb_note *note,
-					    uint64_t note_key)
+// because elements are stored as offsets and qsort doesn't support context,
+// we do a dumb thing where we convert elements to pointers and back if we
+// are doing an id or string sort
+static void sort_filter_elements(struct ndb_filter *filter,
+				 struct ndb_filter_elements *els,
+				 int (*cmp)(const void *, const void *))
 {
-	int rc;
-	struct ndb_id_u64_ts key;
-	MDB_val k, v;
-
-	ndb_id_u64_ts_init(&key, ndb_note_pubkey(note), ndb_note_kind(note),
-			   ndb_note_created_at(note));
+	int i;
 
-	k.mv_data = &key;
-	k.mv_size = sizeof(key);
+	assert(ndb_filter_elem_is_ptr(&els->field));
 
-	v.mv_data = &note_key;
-	v.mv_size = sizeof(note_key);
+	for (i = 0; i < els->count; i++)
+		els->elements[i] += (uint64_t)filter->data_buf.start;
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND], &k, &v, 0))) {
-		fprintf(stderr, "write note pubkey_kind index failed: %s\n",
-			  mdb_strerror(rc));
-		return 0;
-	}
+	qsort(&els->elements[0], els->count, sizeof(els->elements[0]), cmp);
 
-	return 1;
+	for (i = 0; i < els->count; i++)
+		els->elements[i] -= (uint64_t)filter->data_buf.start;
 }
 
-
-static int ndb_rebuild_note_indices(struct ndb_txn *txn, enum ndb_dbs *indices, int num_indices)
+static int ndb_filter_field_eq(struct ndb_filter *a_filt,
+			       struct ndb_filter_elements *a_field,
+			       struct ndb_filter *b_filt,
+			       struct ndb_filter_elements *b_field)
 {
-	MDB_val k, v;
-	MDB_cursor *cur;
-	int i, drop_dbi, count, rc;
-	uint64_t note_key;
-	struct ndb_note *note;
-	enum ndb_dbs index;
+	int i;
+	const char *a_str, *b_str;
+	unsigned char *a_id, *b_id;
+	uint64_t a_int, b_int;
+	struct ndb_filter_custom *a_custom, *b_custom;
 
-	// 0 means empty, not delete the dbi
-	drop_dbi = 0;
+	if (a_field->count != b_field->count)
+		return 0;
 
-	// ensure they are all index dbs
-	for (i = 0; i < num_indices; i++) {
-		if (!ndb_db_is_index(indices[i])) {
-			fprintf(stderr, "ndb_rebuild_note_indices: %s is not an index db\n", ndb_db_name(indices[i]));
-			return -1;
-		}
+	if (a_field->field.type != b_field->field.type) {
+		ndb_debug("UNUSUAL: field types do not match in ndb_filter_field_eq\n");
+		return 0;
 	}
 
-	// empty the index dbs before we rebuild
-	for (i = 0; i < num_indices; i++) {
-		index = indices[i];
-		if (mdb_drop(txn->mdb_txn, index, drop_dbi)) {
-			fprintf(stderr, "ndb_rebuild_note_indices: mdb_drop failed for %s\n", ndb_db_name(index));
-			return -1;
-		}
+	if (a_field->field.elem_type != b_field->field.elem_type) {
+		ndb_debug("UNUSUAL: field element types do not match in ndb_filter_field_eq\n");
+		return 0;
 	}
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE], &cur))) {
-		fprintf(stderr, "ndb_rebuild_note_indices: mdb_cursor_open failed, error %d\n", rc);
-		return -1;
+	if (a_field->field.elem_type == NDB_ELEMENT_UNKNOWN) {
+		ndb_debug("UNUSUAL: field element types are unknown\n");
+		return 0;
 	}
 
-	count = 0;
-
-	// loop through all notes and write search indices
-	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
-		note = v.mv_data;
-		note_key = *((uint64_t*)k.mv_data);
-
-		for (i = 0; i < num_indices; i++) {
-			index = indices[i];
-			switch (index) {
-			case NDB_DB_NOTE:
-			case NDB_DB_META:
-			case NDB_DB_PROFILE:
-			case NDB_DB_NOTE_ID:
-			case NDB_DB_NDB_META:
-			case NDB_DB_PROFILE_SEARCH:
-			case NDB_DB_PROFILE_LAST_FETCH:
-			case NDB_DB_NOTE_RELAYS:
-			case NDB_DBS:
-				// this should never happen since we check at
-				// the start
-				count = -1;
-				goto cleanup;
-			case NDB_DB_PROFILE_PK:
-			case NDB_DB_NOTE_KIND:
-			case NDB_DB_NOTE_TEXT:
-			case NDB_DB_NOTE_BLOCKS:
-			case NDB_DB_NOTE_TAGS:
-				fprintf(stderr, "%s index rebuild not supported yet. sorry.\n", ndb_db_name(index));
-				count = -1;
-				goto cleanup;
-			case NDB_DB_NOTE_PUBKEY:
-				if (!ndb_write_note_pubkey_index(txn, note, note_key)) {
-					count = -1;
-					goto cleanup;
-				}
-				break;
-			case NDB_DB_NOTE_RELAY_KIND:
-				fprintf(stderr, "it doesn't make sense to rebuild note relay kind index\n");
+	for (i = 0; i < a_field->count; i++) {
+		switch (a_field->field.elem_type) {
+		case NDB_ELEMENT_CUSTOM:
+			a_custom = ndb_filter_get_custom_element(a_filt, a_field);
+			b_custom = ndb_filter_get_custom_element(b_filt, b_field);
+			if (memcmp(a_custom, b_custom, sizeof(*a_custom)))
 				return 0;
-			case NDB_DB_NOTE_PUBKEY_KIND:
-				if (!ndb_write_note_pubkey_kind_index(txn, note, note_key)) {
-					count = -1;
-					goto cleanup;
-				}
-				break;
-			}
+			break;
+		case NDB_ELEMENT_UNKNOWN:
+			return 0;
+		case NDB_ELEMENT_STRING:
+			a_str = ndb_filter_get_string_element(a_filt, a_field, i);
+			b_str = ndb_filter_get_string_element(b_filt, b_field, i);
+			if (strcmp(a_str, b_str))
+				return 0;
+			break;
+		case NDB_ELEMENT_ID:
+			a_id = ndb_filter_get_id_element(a_filt, a_field, i);
+			b_id = ndb_filter_get_id_element(b_filt, b_field, i);
+			if (memcmp(a_id, b_id, 32))
+				return 0;
+			break;
+		case NDB_ELEMENT_INT:
+			a_int = ndb_filter_get_int_element(a_field, i);
+			b_int = ndb_filter_get_int_element(b_field, i);
+			if (a_int != b_int)
+				return 0;
+			break;
 		}
-
-		count++;
 	}
 
-cleanup:
-	mdb_cursor_close(cur);
-
-	return count;
+	return 1;
 }
 
-int ndb_cursor_start(MDB_cursor *cur, MDB_val *k, MDB_val *v);
-
-// find the last id tag in a note (e, p, etc)
-static unsigned char *ndb_note_last_id_tag(struct ndb_note *note, char type)
+void ndb_filter_end_field(struct ndb_filter *filter)
 {
-	unsigned char *last = NULL;
-	struct ndb_iterator iter;
-	struct ndb_str str;
+	int cur_offset;
+	struct ndb_filter_elements *cur;
 
-	// get the liked event id (last id)
-	ndb_tags_iterate_start(note, &iter);
+	cur_offset = filter->current;
 
-	while (ndb_tags_iterate_next(&iter)) {
-		if (iter.tag->count < 2)
-			continue;
+	if (!(cur = ndb_filter_current_element(filter)))
+		return;
 
-		str = ndb_tag_str(note, iter.tag, 0);
+	filter->elements[filter->num_elements++] = cur_offset;
 
-		// assign liked to the last e tag
-		if (str.flag == NDB_PACKED_STR && str.str[0] == type) {
-			str = ndb_tag_str(note, iter.tag, 1);
-			if (str.flag == NDB_PACKED_ID)
-				last = str.id;
-		}
-	}
+	// sort elements for binary search
+	switch (cur->field.type) {
+	case NDB_FILTER_IDS:
+	case NDB_FILTER_AUTHORS:
+		sort_filter_elements(filter, cur, compare_ids);
+		break;
+	case NDB_FILTER_RELAYS:
+		sort_filter_elements(filter, cur, compare_strs);
+		break;
+	case NDB_FILTER_KINDS:
+		qsort(&cur->elements[0], cur->count,
+		      sizeof(cur->elements[0]), compare_kinds);
+		break;
+	case NDB_FILTER_TAGS:
+		// TODO: generic tag search sorting
+		break;
+	case NDB_FILTER_SINCE:
+	case NDB_FILTER_CUSTOM:
+	case NDB_FILTER_UNTIL:
+	case NDB_FILTER_LIMIT:
+	case NDB_FILTER_SEARCH:
+		// don't need to sort these
+		break;
+	}
+
+	filter->current = -1;
 
-	return last;
 }
 
-/* get reply information from a note */
-static void ndb_parse_reply(struct ndb_note *note, struct ndb_note_reply *note_reply)
+static void ndb_filter_group_init(struct ndb_filter_group *group)
 {
-	unsigned char *root, *reply, *mention, *id;
-	const char *marker;
-	struct ndb_iterator iter;
-	struct ndb_str str;
-	uint16_t count;
-	int any_marker, first;
+	group->filters = NULL;
+	group->num_filters = 0;
+}
 
-	any_marker = 0;
-	first = 1;
-	root = NULL;
-	reply = NULL;
-	mention = NULL;
+static int ndb_filter_group_add(struct ndb_filter_group *group,
+				struct ndb_filter *filter)
+{
+	struct ndb_filter *filters;
 
-	// get the liked event id (last id)
-	ndb_tags_iterate_start(note, &iter);
-	while (ndb_tags_iterate_next(&iter)) {
-		if (root && reply && mention)
-			break;
+	filters = realloc(group->filters,
+			  (group->num_filters + 1) * sizeof(*filters));
+	if (filters == NULL)
+		return 0;
+	group->filters = filters;
 
-		marker = NULL;
-		count = ndb_tag_count(iter.tag);
+	if (!ndb_filter_clone(&group->filters[group->num_filters], filter))
+		return 0;
 
-		if (count < 2)
-			continue;
+	group->num_filters++;
+	return 1;
+}
 
-		str = ndb_tag_str(note, iter.tag, 0);
-		if (!(str.flag == NDB_PACKED_STR && str.str[0] == 'e'))
-			continue;
+static int ndb_filter_group_matches(struct ndb_filter_group *group, struct ndb_note *note)
+{
+	int i;
+	struct ndb_filter *filter;
 
-		str = ndb_tag_str(note, iter.tag, 1);
-		if (str.flag != NDB_PACKED_ID)
-			continue;
-		id = str.id;
+	if (group->num_filters == 0)
+		return 1;
 
-		/* if we have the marker, assign it */
-		if (count >= 4) {
-			str = ndb_tag_str(note, iter.tag, 3);
-			if (str.flag == NDB_PACKED_STR)
-				marker = str.str;
-		}
+	for (i = 0; i < group->num_filters; i++) {
+		filter = &group->filters[i];
 
-		if (marker) {
-			any_marker = true;
-			if (!strcmp(marker, "root"))
-				root = id;
-			else if (!strcmp(marker, "reply"))
-				reply = id;
-			else if (!strcmp(marker, "mention"))
-				mention = id;
-		} else if (!any_marker && first) {
-			root = id;
-			first = 0;
-		} else if (!any_marker && !reply) {
-			reply = id;
-		}
+		if (ndb_filter_matches(filter, note))
+			return 1;
 	}
 
-	note_reply->reply = reply;
-	note_reply->root = root;
-	note_reply->mention = mention;
+	return 0;
 }
 
-static int ndb_is_reply_to_root(struct ndb_note_reply *reply)
+static void ndb_make_search_key(struct ndb_search_key *key, unsigned char *id,
+			        uint64_t timestamp, const char *search)
 {
-	if (reply->root && !reply->reply)
-		return 1;
-	else if (reply->root && reply->reply)
-		return !memcmp(reply->root, reply->reply, 32);
-	else
-		return 0;
+	memcpy(key->id, id, 32);
+	key->timestamp = timestamp;
+	lowercase_strncpy(key->search, search, sizeof(key->search) - 1);
+	key->search[sizeof(key->search) - 1] = '\0';
 }
 
-
-int ndb_count_replies(struct ndb_txn *txn, const unsigned char *note_id, uint16_t *direct_replies, uint32_t *thread_replies)
+static int ndb_write_profile_search_index(struct ndb_txn *txn,
+					  struct ndb_search_key *index_key,
+					  uint64_t profile_key)
 {
-	MDB_val k, v;
-	MDB_cursor *cur;
-	MDB_dbi db;
-
 	int rc;
-	uint64_t note_key;
-	size_t size;
-	struct ndb_note *note;
-	unsigned char *keybuf, *reply_id;
-	struct ndb_note_reply reply;
-	char buffer[41]; /* 1 + 32 + 8 */
+	MDB_val key, val;
 
-	*direct_replies = 0;
-	*thread_replies = 0;
+	key.mv_data = index_key;
+	key.mv_size = sizeof(*index_key);
+	val.mv_data = &profile_key;
+	val.mv_size = sizeof(profile_key);
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur))) {
-		fprintf(stderr, "ndb_count_reactions: mdb_cursor_open failed, error %d\n", rc);
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH],
+			  &key, &val, 0)))
+	{
+		ndb_debug("ndb_write_profile_search_index failed: %s\n",
+			  mdb_strerror(rc));
 		return 0;
 	}
 
-	buffer[0] = 'e';
-	memcpy(&buffer[1], note_id, 32);
-	memset(&buffer[33], 0x00, 8);
-
-	k.mv_data = buffer;
-	k.mv_size = sizeof(buffer);
-	v.mv_data = NULL;
-	v.mv_size = 0;
+	return 1;
+}
 
-	if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE))
-		goto cleanup;
 
-	do {
-		keybuf = (unsigned char *)k.mv_data;
-		note_key = *((uint64_t*)v.mv_data);
-		if (k.mv_size < sizeof(buffer))
-			break;
-		if (keybuf[0] != 'e')
-			break;
-		if (memcmp(&keybuf[1], note_id, 32))
-			break;
-		if (!(note = ndb_get_note_by_key(txn, note_key, &size)))
-			continue;
-		if (ndb_note_kind(note) != 1)
-			continue;
+// map usernames and display names to profile keys for user searching
+static int ndb_write_profile_search_indices(struct ndb_txn *txn,
+					    struct ndb_note *note,
+					    uint64_t profile_key,
+					    void *profile_root)
+{
+	struct ndb_search_key index;
+	NdbProfileRecord_table_t profile_record;
+	NdbProfile_table_t profile;
 
-		ndb_parse_reply(note, &reply);
+	profile_record = NdbProfileRecord_as_root(profile_root);
+	profile = NdbProfileRecord_profile_get(profile_record);
 
-		if (ndb_is_reply_to_root(&reply)) {
-			reply_id = reply.root;
-		} else {
-			reply_id = reply.reply;
-		}
+	const char *name = NdbProfile_name_get(profile);
+	const char *display_name = NdbProfile_display_name_get(profile);
 
-		if (reply_id && !memcmp(reply_id, note_id, 32)) {
-			(*direct_replies)++;
-		}
+	// words + pubkey + created
+	if (name) {
+		ndb_make_search_key(&index, note->pubkey, note->created_at,
+				    name);
+		if (!ndb_write_profile_search_index(txn, &index, profile_key))
+			return 0;
+	}
 
-		if (reply.root && !memcmp(reply.root, note_id, 32)) {
-			(*thread_replies)++;
+	if (display_name) {
+		// don't write the same name/display_name twice
+		if (name && !strcmp(display_name, name)) {
+			return 1;
 		}
+		ndb_make_search_key(&index, note->pubkey, note->created_at,
+				    display_name);
+		if (!ndb_write_profile_search_index(txn, &index, profile_key))
+			return 0;
+	}
 
-	} while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0);
-
-cleanup:
-	mdb_cursor_close(cur);
 	return 1;
 }
 
-/* count all of the reactions for a note */
-int ndb_rebuild_reaction_metadata(struct ndb_txn *txn, const unsigned char *note_id, struct ndb_note_meta_builder *builder, uint32_t *count)
+static inline void ndb_tsid_init(struct ndb_tsid *key, unsigned char *id,
+				 uint64_t timestamp)
 {
-	MDB_val k, v;
-	MDB_cursor *cur;
-	MDB_dbi db;
+	memcpy(key->id, id, 32);
+	key->timestamp = timestamp;
+}
 
-	int rc;
-	uint64_t note_key;
-	size_t size;
-	struct ndb_note *note;
-	unsigned char *keybuf, *last_id;
-	struct ndb_note_meta_entry *entry;
-	union ndb_reaction_str reaction_str;
-	char buffer[41]; /* 1 + 32 + 8 */
-	*count = 0;
+static inline void ndb_tsid_low(struct ndb_tsid *key, unsigned char *id)
+{
+	memcpy(key->id, id, 32);
+	key->timestamp = 0;
+}
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur))) {
-		fprintf(stderr, "ndb_count_reactions: mdb_cursor_open failed, error %d\n", rc);
-		return 0;
-	}
+static inline void ndb_u64_ts_init(struct ndb_u64_ts *key, uint64_t integer,
+				     uint64_t timestamp)
+{
+	key->u64 = integer;
+	key->timestamp = timestamp;
+}
 
-	buffer[0] = 'e';
-	memcpy(&buffer[1], note_id, 32);
-	memset(&buffer[33], 0x00, 8);
+// useful for range-searching for the latest key with a clustered created_at timen
+static inline void ndb_tsid_high(struct ndb_tsid *key, const unsigned char *id)
+{
+	memcpy(key->id, id, 32);
+	key->timestamp = UINT64_MAX;
+}
 
-	k.mv_data = buffer;
-	k.mv_size = sizeof(buffer);
-	v.mv_data = NULL;
-	v.mv_size = 0;
-
-	if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE))
-		goto cleanup;
-
-	do {
-		keybuf = (unsigned char *)k.mv_data;
-		note_key = *((uint64_t*)v.mv_data);
-		if (k.mv_size < sizeof(buffer))
-			break;
-		if (keybuf[0] != 'e')
-			break;
-		if (memcmp(&keybuf[1], note_id, 32))
-			break;
-		if (!(note = ndb_get_note_by_key(txn, note_key, &size)))
-			continue;
-		if (ndb_note_kind(note) != 7)
-			continue;
-		if (!(last_id = ndb_note_last_id_tag(note, 'e')))
-			continue;
-		if (memcmp(last_id, note_id, 32))
-			continue;
+static int _ndb_begin_query(struct ndb *ndb, struct ndb_txn *txn, int flags)
+{
+	txn->lmdb = &ndb->lmdb;
+	MDB_txn **mdb_txn = (MDB_txn **)&txn->mdb_txn;
+	if (!txn->lmdb->env)
+		return 0;
+	return mdb_txn_begin(txn->lmdb->env, NULL, flags, mdb_txn) == 0;
+}
 
-		if (builder) {
-			if (!ndb_reaction_set(&reaction_str, ndb_note_content(note)))
-				ndb_reaction_set(&reaction_str, "+");
+int ndb_begin_query(struct ndb *ndb, struct ndb_txn *txn)
+{
+	return _ndb_begin_query(ndb, txn, MDB_RDONLY);
+}
 
-			if ((entry = ndb_note_meta_builder_find_entry(builder, NDB_NOTE_META_REACTION, &reaction_str.binmoji))) {
-				(*ndb_note_meta_reaction_count(entry))++;
-			} else if ((entry = ndb_note_meta_add_entry(builder))) {
-				ndb_note_meta_reaction_set(entry, 1, reaction_str);
-			} else {
-				/* couldn't add reaction entry ? */
-				ndb_debug("ndb_rebuild_note_indices: couldn't add reaction count entry to metadata builder\n");
-			}
-		}
+// this should only be used in migrations, etc
+static int ndb_begin_rw_query(struct ndb *ndb, struct ndb_txn *txn)
+{
+	return _ndb_begin_query(ndb, txn, 0);
+}
 
-		(*count)++;
-	} while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0);
+static int ndb_db_is_index(enum ndb_dbs index)
+{
+	switch (index) {
+		case NDB_DB_NOTE:
+		case NDB_DB_META:
+		case NDB_DB_PROFILE:
+		case NDB_DB_NOTE_ID:
+		case NDB_DB_NDB_META:
+		case NDB_DB_PROFILE_SEARCH:
+		case NDB_DB_PROFILE_LAST_FETCH:
+		case NDB_DB_NOTE_RELAYS:
+		case NDB_DBS:
+			return 0;
+		case NDB_DB_PROFILE_PK:
+		case NDB_DB_NOTE_KIND:
+		case NDB_DB_NOTE_TEXT:
+		case NDB_DB_NOTE_BLOCKS:
+		case NDB_DB_NOTE_TAGS:
+		case NDB_DB_NOTE_PUBKEY:
+		case NDB_DB_NOTE_PUBKEY_KIND:
+		case NDB_DB_NOTE_RELAY_KIND:
+		case NDB_DB_NOTE_CREATED:
+			return 1;
+	}
 
-cleanup:
-	mdb_cursor_close(cur);
-	return 1;
+	return 0;
 }
 
-static int ndb_count_reposts(struct ndb_txn *txn, const unsigned char *note_id, uint16_t *count)
+static inline void ndb_id_u64_ts_init(struct ndb_id_u64_ts *key,
+				      unsigned char *id, uint64_t iu64,
+				      uint64_t timestamp)
 {
-	MDB_val k, v;
-	MDB_cursor *cur;
-	MDB_dbi db;
-	int rc;
-	unsigned char *keybuf;
-	struct ndb_note *note;
-	uint64_t note_key, kind;
-	char buffer[41]; /* 1 + 32 + 8 */
-
-	*count = 0;
-	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
+	memcpy(key->id, id, 32);
+	key->u64 = iu64;
+	key->timestamp = timestamp;
+}
 
-	/* we will iterate q tags for this particular id */
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur))) {
-		fprintf(stderr, "ndb_count_quotes: mdb_cursor_open failed, error %d\n", rc);
-		return 0;
-	}
+// formats the relay url buffer for the NDB_DB_NOTE_RELAYS value. It's a
+// null terminated string padded to 8 bytes (we must keep the entire database
+// aligned to 8 bytes at all times)
+static int prepare_relay_buf(char *relay_buf, int bufsize, const char *relay,
+			     int relay_len)
+{
+	struct cursor cur;
 
-	buffer[0] = 'e';
-	memcpy(&buffer[1], note_id, 32);
-	memset(&buffer[33], 0x00, 8);
+	// make sure the size of the buffer is aligned
+	assert((bufsize % 8) == 0);
 
-	k.mv_data = buffer;
-	k.mv_size = sizeof(buffer);
-	v.mv_data = NULL;
-	v.mv_size = 0;
+	make_cursor((unsigned char *)relay_buf, (unsigned char *)relay_buf + bufsize, &cur);
 
-	if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE))
-		goto cleanup;
+	// push the relay string
+	if (!cursor_push(&cur, (unsigned char *)relay, relay_len))
+		return 0;
 
-	do {
-		keybuf = (unsigned char *)k.mv_data;
-		note_key = *((uint64_t*)v.mv_data);
+	// relay urls are null terminated for convenience
+	if (!cursor_push_byte(&cur, 0))
+		return 0;
 
-		if (k.mv_size < sizeof(buffer))
-			break;
-		if (keybuf[0] != 'e')
-			break;
-		if (memcmp(&keybuf[1], note_id, 32) != 0)
-			break;
-		if (!(note = ndb_get_note_by_key(txn, note_key, NULL)))
-			continue;
-		kind = ndb_note_kind(note);
-		if (!(kind == 6 || kind == 16))
-			continue;
-		(*count)++;
-	} while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0);
+	// align the buffer
+	if (!cursor_align(&cur, 8))
+		return 0;
 
-cleanup:
-	mdb_cursor_close(cur);
-	return 1;
+	return cur.p - cur.start;
 }
 
-/* count all of the quote reposts for a note id */
-static int ndb_count_quotes(struct ndb_txn *txn, const unsigned char *note_id, uint16_t *count)
+// Write to the note_id -> relay_url database. This records where notes
+// have been seen
+static int ndb_write_note_relay(struct ndb_txn *txn, uint64_t note_key,
+				const char *relay, uint8_t relay_len)
 {
+	char relay_buf[256];
+	int rc, len;
 	MDB_val k, v;
-	MDB_cursor *cur;
-	MDB_dbi db;
-	int rc;
-	unsigned char *keybuf;
-	char buffer[41]; /* 1 + 32 + 8 */
 
-	*count = 0;
-	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
-
-	/* we will iterate q tags for this particular id */
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur))) {
-		fprintf(stderr, "ndb_count_quotes: mdb_cursor_open failed, error %d\n", rc);
+	if (relay == NULL || relay_len == 0) {
+		ndb_debug("relay is NULL in ndb_write_note_relay? '%s' %d\n", relay, relay_len);
 		return 0;
 	}
 
-	buffer[0] = 'q';
-	memcpy(&buffer[1], note_id, 32);
-	memset(&buffer[33], 0x00, 8);
-
-	k.mv_data = buffer;
-	k.mv_size = sizeof(buffer);
-	v.mv_data = NULL;
-	v.mv_size = 0;
-
-	if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE))
-		goto cleanup;
-
-	for (;;) {
-		keybuf = (unsigned char *)k.mv_data;
-		if (k.mv_size < sizeof(buffer))
-			break;
-		if (keybuf[0] != 'q')
-			break;
-		if (memcmp(&keybuf[1], note_id, 32) != 0)
-			break;
-		/* TODO(jb55): technically we should check to see if this is a kind 1.
-		 * there could be other kinds with q tags that reference this note
-		 *
-		 * Starting to think we should have tag-kind index
-		 */
-		(*count)++;
+	ndb_debug("writing note_relay '%s' for notekey:%" PRIu64 "\n", relay, note_key);
 
-		if (mdb_cursor_get(cur, &k, &v, MDB_NEXT))
-			break;
+	if (!(len = prepare_relay_buf(relay_buf, sizeof(relay_buf), relay, relay_len))) {
+		fprintf(stderr, "relay url '%s' too large when writing note relay index\n", relay);
+		return 0;
 	}
 
-cleanup:
-	mdb_cursor_close(cur);
-	return 1;
-}
-
-/* count quotes and add them to a metadata builder.
- * we assume there is no existing quotes entry */
-static int ndb_note_meta_builder_counts(struct ndb_txn *txn,
-					unsigned char *note_id,
-					struct ndb_note_meta_builder *builder)
-{
-	uint32_t thread_replies, total_reactions;
-	uint16_t direct_replies, quotes, reposts;
-	struct ndb_note_meta_entry *entry;
-	int rcs[4];
-
-	quotes = 0;
-	direct_replies = 0;
-	thread_replies = 0;
-	total_reactions = 0;
-
-	rcs[0] = ndb_rebuild_reaction_metadata(txn, note_id, builder, &total_reactions);
-	rcs[1] = ndb_count_quotes(txn, note_id, &quotes);
-	rcs[2] = ndb_count_replies(txn, note_id, &direct_replies, &thread_replies);
-	rcs[3] = ndb_count_reposts(txn, note_id, &reposts);
+	assert((len % 8) == 0);
 
-	if (!rcs[0] && !rcs[1] && !rcs[2] && !rcs[3]) {
-		return 0;
-	}
+	k.mv_data = &note_key;
+	k.mv_size = sizeof(note_key);
 
-	/* no entry needed */
-	if (quotes == 0 && direct_replies == 0 && thread_replies == 0 && quotes == 0 && reposts == 0) {
-		return 0;
-	}
+	v.mv_data = relay_buf;
+	v.mv_size = len;
 
-	if (!(entry = ndb_note_meta_add_entry(builder))) {
+	// NODUPDATA is specified so that we don't accidently add duplicate
+	// key/value pairs
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAYS],
+			  &k, &v, MDB_NODUPDATA)))
+	{
+		ndb_debug("ndb_write_note_relay failed: %s\n", mdb_strerror(rc));
 		return 0;
 	}
 
-	ndb_note_meta_counts_set(entry, total_reactions, quotes, direct_replies, thread_replies, reposts);
+	ndb_debug("wrote %d bytes to note relay: '%s'\n", len, relay_buf);
 
 	return 1;
 }
 
-// Migrations
-//
+struct ndb_relay_kind_key {
+	uint64_t note_key;
+	uint64_t kind;
+	uint64_t created_at;
+	uint8_t relay_len;
+	const char *relay;
+};
 
-/* switch from flatbuffer stats to custom v2 */
-static int ndb_migrate_metadata(struct ndb_txn *txn)
+static int ndb_relay_kind_key_init(
+		struct ndb_relay_kind_key *key,
+		uint64_t note_key,
+		uint64_t kind,
+		uint64_t created_at,
+		const char *relay)
 {
-	MDB_val k, k2, v, v2;
-	MDB_cursor *cur;
-	MDB_dbi note_db, meta_db;
-	unsigned char *id;
-	size_t scratch_size = 1024 * 1024;
-	unsigned char *buffer = malloc(scratch_size);
-	int rc, count;
-	struct ndb_note_meta_builder builder;
-	struct ndb_note *note;
-	struct ndb_note_meta *meta;
-
-	meta_db = txn->lmdb->dbs[NDB_DB_META];
-	note_db = txn->lmdb->dbs[NDB_DB_NOTE];
-
-	/* drop metadata table to avoid issues */
-	if (mdb_drop(txn->mdb_txn, meta_db, 0)) {
-		fprintf(stderr, "ndb_migrate_metadata: mdb_drop failed\n");
-		return -1;
-	}
-
-	if ((rc = mdb_cursor_open(txn->mdb_txn, note_db, &cur))) {
-		fprintf(stderr, "ndb_migrate_metadata: mdb_cursor_open failed, error %d\n", rc);
-		return -1;
-	}
+	if (relay == NULL)
+		return 0;
 
-	count = 0;
+	key->relay = relay;
+	key->relay_len = strlen(relay);
+	if (key->relay_len > 248)
+		return 0;
 
-	/* loop through every metadata entry */
-	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
-		ndb_note_meta_builder_init(&builder, buffer, scratch_size);
+	key->note_key = note_key;
+	key->kind = kind;
+	key->created_at = created_at;
+	return 1;
+}
 
-		note = (struct ndb_note *)v.mv_data;
-		id = ndb_note_id(note);
-		k2.mv_data = (unsigned char *)id;
-		k2.mv_size = 32;
 
-		rc = ndb_note_meta_builder_counts(txn, id, &builder);
-		if (!rc) {
-			mdb_del(txn->mdb_txn, meta_db, &k2, NULL);
-			continue;
-		}
+// create a range key for a relay kind query
+static int ndb_relay_kind_key_init_high(
+		struct ndb_relay_kind_key *key,
+		const char *relay,
+		uint64_t kind,
+		uint64_t until)
+{
+	// note_key is the last field in the key, so UINT64_MAX puts us just
+	// past every entry at created_at == until
+	return ndb_relay_kind_key_init(key, UINT64_MAX, kind, until, relay);
+}
 
-		ndb_note_meta_build(&builder, &meta);
-		assert(ndb_note_meta_entries(meta)->type != 0);
+static void ndb_parse_relay_kind_key(struct ndb_relay_kind_key *key, unsigned char *buf)
+{
+	// WE ARE ASSUMING WE ARE PARSING FROM AN ALIGNED BUFFER HERE
+	assert((uint64_t)buf % 8 == 0);
+	// - note_id:        00 + 8 bytes
+	// - kind:           08 + 8 bytes
+	// - created_at:     16 + 8 bytes
+	// - relay_url_size: 24 + 1 byte
+	// - relay_url:      25 + n byte null-terminated string
+	// - pad to 8 byte alignment
+	key->note_key   =  *(uint64_t*) (buf + 0);
+	key->kind       =  *(uint64_t*) (buf + 8);
+	key->created_at =  *(uint64_t*) (buf + 16);
+	key->relay_len  =   *(uint8_t*) (buf + 24);
+	key->relay      = (const char*) (buf + 25);
+}
 
-		v2.mv_data = meta;
-		v2.mv_size = ndb_note_meta_total_size(meta);
+static void ndb_debug_relay_kind_key(struct ndb_relay_kind_key *key)
+{
+	ndb_debug("note_key:%" PRIu64 " kind:%" PRIu64 " created_at:%" PRIu64 " '%s'\n",
+			key->note_key, key->kind, key->created_at, key->relay);
+}
 
-		/* set entry */
-		if ((rc = mdb_put(txn->mdb_txn, meta_db, &k2, &v2, 0))) {
-			ndb_debug("migrate metadata entry failed on write: %s\n", mdb_strerror(rc));
-		}
+static int ndb_build_relay_kind_key(unsigned char *buf, int bufsize, struct ndb_relay_kind_key *key)
+{
+	struct cursor cur;
+	make_cursor(buf, buf + bufsize, &cur);
 
-		count++;
-	}
+	if (!cursor_push(&cur, (unsigned char *)&key->note_key, 8))   return 0;
+	if (!cursor_push(&cur, (unsigned char *)&key->kind, 8))       return 0;
+	if (!cursor_push(&cur, (unsigned char *)&key->created_at, 8)) return 0;
+	if (!cursor_push_byte(&cur, key->relay_len)) return 0;
+	if (!cursor_push(&cur, (unsigned char *)key->relay, key->relay_len)) return 0;
+	if (!cursor_push_byte(&cur, 0)) return 0;
+	if (!cursor_align(&cur, 8)) return 0;
 
-	fprintf(stderr, "nostrdb: migrated %d metadata entries\n", count);
+	assert(((cur.p-cur.start)%8) == 0);
 
-	free(buffer);
-	mdb_cursor_close(cur);
-	return 1;
+	return cur.p - cur.start;
 }
 
-// This was before we had note_profile_pubkey{,_kind} indices. Let's create them.
-static int ndb_migrate_profile_indices(struct ndb_txn *txn)
+static int ndb_write_note_relay_kind_index(
+		struct ndb_txn *txn,
+		struct ndb_relay_kind_key *key)
 {
-	int count;
-
-	enum ndb_dbs indices[] = {NDB_DB_NOTE_PUBKEY, NDB_DB_NOTE_PUBKEY_KIND};
-	if ((count = ndb_rebuild_note_indices(txn, indices, 2)) != -1) {
-		fprintf(stderr, "migrated %d notes to have pubkey and pubkey_kind indices\n", count);
-		return 1;
-	} else {
-		fprintf(stderr, "error migrating notes to have pubkey and pubkey_kind indices, aborting.\n");
-		return 0;
-	}
-}
+	// The relay kind key has a layout like so
+	//
+	// - note_key:       00 + 8 bytes
+	// - kind:           08 + 8 bytes
+	// - created_at:     16 + 8 bytes
+	// - relay_url_size: 24 + 1 byte
+	// - relay_url:      25 + n byte null-terminated string
+	// - pad to 8 byte alignment
 
-static int ndb_migrate_user_search_indices(struct ndb_txn *txn)
-{
-	int rc;
-	MDB_cursor *cur;
+	unsigned char buf[256];
+	int rc, len;
 	MDB_val k, v;
-	void *profile_root;
-	NdbProfileRecord_table_t record;
-	struct ndb_note *note;
-	uint64_t note_key, profile_key;
-	size_t len;
-	int count;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE], &cur))) {
-		fprintf(stderr, "ndb_migrate_user_search_indices: mdb_cursor_open failed, error %d\n", rc);
+	// come on bro
+	if (key->relay_len > 248 || key->relay == NULL || key->relay_len == 0)
 		return 0;
-	}
 
-	count = 0;
+	ndb_debug("writing note_relay_kind_index '%s' for notekey:%" PRIu64 "\n", key->relay, key->note_key);
 
-	// loop through all profiles and write search indices
-	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
-		profile_root = v.mv_data;
-		profile_key = *((uint64_t*)k.mv_data);
-		record = NdbProfileRecord_as_root(profile_root);
-		note_key = NdbProfileRecord_note_key(record);
-		note = ndb_get_note_by_key(txn, note_key, &len);
+	if (!(len = ndb_build_relay_kind_key(buf, sizeof(buf), key)))
+		return 0;
 
-		if (note == NULL) {
-			continue;
-		}
+	k.mv_data = buf;
+	k.mv_size = len;
 
-		if (!ndb_write_profile_search_indices(txn, note, profile_key,
-						      profile_root)) {
-			fprintf(stderr, "ndb_migrate_user_search_indices: ndb_write_profile_search_indices failed\n");
-			continue;
-		}
+	v.mv_data = NULL;
+	v.mv_size = 0;
 
-		count++;
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAY_KIND], &k, &v, 0))) {
+		fprintf(stderr, "write note relay kind index failed: %s\n",
+			  mdb_strerror(rc));
+		return 0;
 	}
 
-	fprintf(stderr, "migrated %d profiles to include search indices\n", count);
-
-	mdb_cursor_close(cur);
-
 	return 1;
 }
 
-static int ndb_migrate_lower_user_search_indices(struct ndb_txn *txn)
+// writes the relay note kind index and the note_id -> relay db
+static int ndb_write_note_relay_indexes(struct ndb_txn *txn, struct ndb_relay_kind_key *key)
 {
-	// just drop the search db so we can rebuild it
-	if (mdb_drop(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH], 0)) {
-		fprintf(stderr, "ndb_migrate_lower_user_search_indices: mdb_drop failed\n");
-		return 0;
-	}
-
-	return ndb_migrate_user_search_indices(txn);
+	ndb_write_note_relay_kind_index(txn, key);
+	ndb_write_note_relay(txn, key->note_key, key->relay, key->relay_len);
+	return 1;
 }
 
-int ndb_process_profile_note(struct ndb_note *note, struct ndb_profile_record_builder *profile);
+/* Entries for one index db, collected while it's being rebuilt so they can
+ * be sorted and appended in order instead of put in note order. Each record
+ * is a key and value size, the key padded to 8 bytes, then the value. Runs
+ * are written out every NDB_INDEX_RUN_MAX bytes to bound memory. */
+#define NDB_INDEX_RUN_MAX (64 * 1024 * 1024)
 
+struct ndb_index_run {
+	enum ndb_dbs db;
+	unsigned char *buf;
+	size_t len, cap;
+	size_t count;
+	int failed; // ran out of memory, some entries are missing
+};
 
-int ndb_db_version(struct ndb_txn *txn)
+static int ndb_index_run_add(struct ndb_index_run *run, MDB_val *k, MDB_val *v)
 {
-	uint64_t version, version_key;
-	MDB_val k, v;
+	uint32_t *hdr;
+	unsigned char *buf;
+	size_t size, cap;
 
-	version_key = NDB_META_KEY_VERSION;
-	k.mv_data = &version_key;
-	k.mv_size = sizeof(version_key);
+	size = 8 + ((k->mv_size + 7) & ~7ULL) + ((v->mv_size + 7) & ~7ULL);
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META], &k, &v)) {
-		version = -1;
-	} else {
-		if (v.mv_size != 8) {
-			fprintf(stderr, "run_migrations: invalid version size?");
+	if (run->len + size > run->cap) {
+		cap = max(max(run->cap * 2, 1024 * 1024), run->len + size);
+		if (!(buf = realloc(run->buf, cap))) {
+			run->failed = 1;
 			return 0;
 		}
-		version = *((uint64_t*)v.mv_data);
+		run->buf = buf;
+		run->cap = cap;
 	}
 
-	return version;
+	hdr = (uint32_t *)(run->buf + run->len);
+	hdr[0] = k->mv_size;
+	hdr[1] = v->mv_size;
+	memcpy(hdr + 2, k->mv_data, k->mv_size);
+	memcpy((unsigned char *)(hdr + 2) + ((k->mv_size + 7) & ~7ULL),
+	       v->mv_data, v->mv_size);
+
+	run->len += size;
+	run->count++;
+
+	return 1;
 }
 
-// custom pubkey+kind+timestamp comparison function. This is used by lmdb to
-// perform b+ tree searches over the pubkey+kind+timestamp index
-static int ndb_id_u64_ts_compare(const MDB_val *a, const MDB_val *b)
+static inline size_t ndb_index_rec_vals(const unsigned char *rec,
+					MDB_val *k, MDB_val *v)
 {
-	struct ndb_id_u64_ts *tsa, *tsb;
-	MDB_val a2 = *a, b2 = *b;
+	const uint32_t *hdr = (const uint32_t *)rec;
 
-	a2.mv_size = sizeof(tsa->id);
-	b2.mv_size = sizeof(tsb->id);
+	k->mv_size = hdr[0];
+	k->mv_data = (void *)(hdr + 2);
+	v->mv_size = hdr[1];
+	v->mv_data = (unsigned char *)k->mv_data + ((hdr[0] + 7) & ~7ULL);
 
-	int cmp = mdb_cmp_memn(&a2, &b2);
-	if (cmp) return cmp;
+	return 8 + ((hdr[0] + 7) & ~7ULL) + ((hdr[1] + 7) & ~7ULL);
+}
 
-	tsa = a->mv_data;
-	tsb = b->mv_data;
+// orders records the way the db does, key then duplicate
+static int ndb_index_rec_cmp(MDB_txn *txn, MDB_dbi dbi,
+			     const unsigned char *a, const unsigned char *b)
+{
+	MDB_val ka, va, kb, vb;
+	int cmp;
 
-	if (tsa->u64 < tsb->u64)
-		return -1;
-	else if (tsa->u64 > tsb->u64)
-		return 1;
+	ndb_index_rec_vals(a, &ka, &va);
+	ndb_index_rec_vals(b, &kb, &vb);
 
-	if (tsa->timestamp < tsb->timestamp)
-		return -1;
-	else if (tsa->timestamp > tsb->timestamp)
-		return 1;
+	if ((cmp = mdb_cmp(txn, dbi, &ka, &kb)))
+		return cmp;
 
-	return 0;
+	return mdb_dcmp(txn, dbi, &va, &vb);
 }
 
-// custom kind+timestamp comparison function. This is used by lmdb to perform
-// b+ tree searches over the kind+timestamp index
-static int ndb_u64_ts_compare(const MDB_val *a, const MDB_val *b)
+/* Sort the run and write it to its index db. The db's comparators need the
+ * txn, which qsort can't pass along, so this is a merge sort. Entries sorting
+ * after everything in the db are appended, the rest are put normally, which
+ * only happens from the second run on or for notes added to existing
+ * indices. */
+static int ndb_index_run_append(struct ndb_txn *txn, struct ndb_index_run *run)
 {
-	struct ndb_u64_ts *tsa, *tsb;
-	tsa = a->mv_data;
-	tsb = b->mv_data;
+	unsigned char **recs, **tmp, **swap, *rec;
+	size_t i, j, k, lo, mid, hi, width, off;
+	MDB_dbi dbi = txn->lmdb->dbs[run->db];
+	MDB_cursor *cur;
+	MDB_val key, val;
+	int rc, ok;
 
-	if (tsa->u64 < tsb->u64)
-		return -1;
-	else if (tsa->u64 > tsb->u64)
+	if (run->count == 0)
 		return 1;
 
-	if (tsa->timestamp < tsb->timestamp)
-		return -1;
-	else if (tsa->timestamp > tsb->timestamp)
-		return 1;
+	recs = malloc(sizeof(*recs) * run->count);
+	tmp = malloc(sizeof(*tmp) * run->count);
+	if (recs == NULL || tmp == NULL) {
+		free(recs);
+		free(tmp);
+		return 0;
+	}
 
-	return 0;
-}
+	for (i = 0, off = 0; i < run->count; i++) {
+		recs[i] = run->buf + off;
+		off += ndb_index_rec_vals(recs[i], &key, &val);
+	}
 
-static int ndb_tsid_compare(const MDB_val *a, const MDB_val *b)
-{
-	struct ndb_tsid *tsa, *tsb;
-	MDB_val a2 = *a, b2 = *b;
+	for (width = 1; width < run->count; width *= 2) {
+		for (lo = 0; lo < run->count; lo += 2 * width) {
+			mid = min(lo + width, run->count);
+			hi = min(lo + 2 * width, run->count);
+			for (i = lo, j = mid, k = lo; k < hi; k++) {
+				if (j >= hi || (i < mid &&
+				    ndb_index_rec_cmp(txn->mdb_txn, dbi, recs[i], recs[j]) <= 0))
+					tmp[k] = recs[i++];
+				else
+					tmp[k] = recs[j++];
+			}
+		}
+		swap = recs;
+		recs = tmp;
+		tmp = swap;
+	}
 
-	a2.mv_size = sizeof(tsa->id);
-	b2.mv_size = sizeof(tsb->id);
+	ok = 0;
+	if ((rc = mdb_cursor_open(txn->mdb_txn, dbi, &cur))) {
+		fprintf(stderr, "ndb_index_run_append: mdb_cursor_open failed: %s\n",
+			mdb_strerror(rc));
+		goto cleanup;
+	}
 
-	int cmp = mdb_cmp_memn(&a2, &b2);
-	if (cmp) return cmp;
+	for (i = 0, rec = NULL; i < run->count; i++) {
+		// notes can repeat an entry, like a tag listed twice
+		if (rec && !ndb_index_rec_cmp(txn->mdb_txn, dbi, rec, recs[i]))
+			continue;
 
-	tsa = a->mv_data;
-	tsb = b->mv_data;
+		rec = recs[i];
+		ndb_index_rec_vals(rec, &key, &val);
+		rc = mdb_cursor_put(cur, &key, &val, MDB_APPENDDUP);
+		if (rc == MDB_KEYEXIST)
+			rc = mdb_cursor_put(cur, &key, &val, 0);
+		if (rc) {
+			fprintf(stderr, "ndb_index_run_append: %s append failed: %s\n",
+				ndb_db_name(run->db), mdb_strerror(rc));
+			mdb_cursor_close(cur);
+			goto cleanup;
+		}
+	}
 
-	if (tsa->timestamp < tsb->timestamp)
-		return -1;
-	else if (tsa->timestamp > tsb->timestamp)
-		return 1;
-	return 0;
+	mdb_cursor_close(cur);
+	ok = 1;
+
+cleanup:
+	free(recs);
+	free(tmp);
+	return ok;
 }
 
-enum ndb_ingester_msgtype {
-	NDB_INGEST_EVENT, // write json to the ingester queue for processing
-	NDB_INGEST_QUIT,  // kill ingester thread immediately
-	NDB_INGEST_ADD_KEY, // add a key for monitoring encrypted data
-	NDB_INGEST_PROCESS_GIFTWRAP, // reprocess unwrapped giftwraps
-	NDB_INGEST_PROCESS_PNS, // reprocess kind-1080 events
-	NDB_INGEST_ADD_TEAM_ROOT, // add a shared SNS team_root for monitoring
-	NDB_INGEST_PROCESS_SNS, // reprocess kind-1081 events
-};
+// write out what's been collected so far and start a new run
+static int ndb_index_run_flush(struct ndb_txn *txn, struct ndb_index_run *run)
+{
+	if (run->failed || !ndb_index_run_append(txn, run))
+		return 0;
 
-struct ndb_ingester_event {
-	const char *relay;
-	char *json;
-	unsigned client : 1; // ["EVENT", {...}] messages
-	unsigned len : 31;
-};
+	run->len = 0;
+	run->count = 0;
+	return 1;
+}
 
-struct ndb_ingester_add_key {
-	unsigned char key[32];
-};
+// put an index entry, or collect it into `run` if that index is being rebuilt
+static int ndb_index_put(struct ndb_txn *txn, struct ndb_index_run *run,
+			 enum ndb_dbs db, MDB_val *k, MDB_val *v)
+{
+	if (run && run->db == db)
+		return ndb_index_run_add(run, k, v) ? 0 : ENOMEM;
 
-struct ndb_ingester_add_team_root {
-	unsigned char root[32];
-};
+	return mdb_put(txn->mdb_txn, txn->lmdb->dbs[db], k, v, 0);
+}
 
-struct ndb_ingester_process_giftwrap {
-	uint64_t giftwrap_key;
-};
+static int ndb_write_note_pubkey_index(struct ndb_txn *txn, struct ndb_note *note,
+				       uint64_t note_key,
+				       struct ndb_index_run *run)
+{
+	int rc;
+	struct ndb_tsid key;
+	MDB_val k, v;
 
-struct ndb_ingester_process_pns {
-	uint64_t note_key;
-};
+	ndb_tsid_init(&key, ndb_note_pubkey(note), ndb_note_created_at(note));
 
-struct ndb_ingester_process_sns {
-	uint64_t note_key;
-};
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
 
-struct ndb_writer_note_relay {
-	const char *relay;
-	uint64_t note_key;
-	uint64_t kind;
-	uint64_t created_at;
-};
+	v.mv_data = &note_key;
+	v.mv_size = sizeof(note_key);
 
-struct ndb_writer_note {
-	struct ndb_note *note;
-	size_t note_len;
-	const char *relay;
-	uint64_t overwrite_note_id;
-};
+	if ((rc = ndb_index_put(txn, run, NDB_DB_NOTE_PUBKEY, &k, &v))) {
+		fprintf(stderr, "write note pubkey index failed: %s\n",
+			  mdb_strerror(rc));
+		return 0;
+	}
 
-static void ndb_writer_note_init(struct ndb_writer_note *writer_note,
-				 struct ndb_note *note, size_t note_len,
-				 const char *relay, uint64_t overwrite_note_id)
-{
-	writer_note->note = note;
-	writer_note->note_len = note_len;
-	writer_note->relay = relay;
-	writer_note->overwrite_note_id = overwrite_note_id;
+	return 1;
 }
 
-struct ndb_writer_profile {
-	struct ndb_writer_note note;
-	struct ndb_profile_record_builder record;
-};
-
-struct ndb_ingester_msg {
-	enum ndb_ingester_msgtype type;
-	union {
-		struct ndb_ingester_event event;
-		struct ndb_ingester_add_key add_key;
-		struct ndb_ingester_add_team_root add_team_root;
-		struct ndb_ingester_process_giftwrap process_giftwrap;
-		struct ndb_ingester_process_pns process_pns;
-		struct ndb_ingester_process_sns process_sns;
-	};
-};
-
-struct ndb_writer_ndb_meta {
-	// these are 64 bit because I'm paranoid of db-wide alignment issues
-	uint64_t version;
-};
+static int ndb_write_note_pubkey_kind_index(struct ndb_txn *txn,
+					    struct ndb_note *note,
+					    uint64_t note_key,
+					    struct ndb_index_run *run)
+{
+	int rc;
+	struct ndb_id_u64_ts key;
+	MDB_val k, v;
 
-struct ndb_writer_note_meta {
-	unsigned char note_id[32];
-	struct ndb_note_meta *metadata;
-};
+	ndb_id_u64_ts_init(&key, ndb_note_pubkey(note), ndb_note_kind(note),
+			   ndb_note_created_at(note));
 
-// Used in the writer thread when writing ndb_profile_fetch_record's
-//   kv = pubkey: recor
-struct ndb_writer_last_fetch {
-	unsigned char pubkey[32];
-	uint64_t fetched_at;
-};
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
 
-// write note blocks
-struct ndb_writer_blocks {
-	struct ndb_blocks *blocks;
-	uint64_t note_key;
-};
+	v.mv_data = &note_key;
+	v.mv_size = sizeof(note_key);
 
-// The different types of messages that the writer thread can write to the
-// database
-struct ndb_writer_msg {
-	enum ndb_writer_msgtype type;
-	union {
-		struct ndb_writer_note_relay note_relay;
-		struct ndb_writer_note note;
-		struct ndb_writer_profile profile;
-		struct ndb_writer_ndb_meta ndb_meta;
-		struct ndb_writer_last_fetch last_fetch;
-		struct ndb_writer_blocks blocks;
-		struct ndb_writer_note_meta note_meta;
-	};
-};
+	if ((rc = ndb_index_put(txn, run, NDB_DB_NOTE_PUBKEY_KIND, &k, &v))) {
+		fprintf(stderr, "write note pubkey_kind index failed: %s\n",
+			  mdb_strerror(rc));
+		return 0;
+	}
 
-static inline int ndb_writer_queue_msg(struct prot_queue *writer_inbox,
-				       struct ndb_writer_msg *msg)
-{
-	return prot_queue_push(writer_inbox, msg);
+	return 1;
 }
 
-static uint64_t ndb_write_note_and_profile(
-	secp256k1_context *secp, struct ndb_txn *txn,
-	struct ndb_writer_profile *profile,
-	unsigned char *scratch, size_t scratch_size, uint32_t ndb_flags,
-	struct prot_queue *writer_inbox);
-
-static int ndb_migrate_utf8_profile_names(struct ndb_txn *txn)
+static int ndb_write_note_created_index(struct ndb_txn *txn,
+					struct ndb_note *note,
+					uint64_t note_key,
+					struct ndb_index_run *run)
 {
 	int rc;
-	MDB_cursor *cur;
+	uint64_t created_at;
 	MDB_val k, v;
-	void *profile_root;
-	NdbProfileRecord_table_t record;
-	struct ndb_note *note, *copied_note;
-	uint64_t note_key;
-	size_t len;
-	int count, failed, ret;
-	struct ndb_writer_profile profile;
-	secp256k1_context *secp;
 
-	secp = secp256k1_context_create(SECP256K1_CONTEXT_NONE);
+	created_at = ndb_note_created_at(note);
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE], &cur))) {
-		fprintf(stderr, "ndb_migrate_utf8_profile_names: mdb_cursor_open failed, error %d\n", rc);
+	k.mv_data = &created_at;
+	k.mv_size = sizeof(created_at);
+
+	v.mv_data = &note_key;
+	v.mv_size = sizeof(note_key);
+
+	if ((rc = ndb_index_put(txn, run, NDB_DB_NOTE_CREATED, &k, &v))) {
+		fprintf(stderr, "write note created index failed: %s\n",
+			  mdb_strerror(rc));
 		return 0;
 	}
 
-	size_t scratch_size = 8 * 1024 * 1024;
-	unsigned char *scratch = malloc(scratch_size);
-
-	ret = 1;
-	count = 0;
-	failed = 0;
+	return 1;
+}
 
-	// loop through all profiles and write search indices
-	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
-		profile_root = v.mv_data;
-		record = NdbProfileRecord_as_root(profile_root);
-		note_key = NdbProfileRecord_note_key(record);
-		note = ndb_get_note_by_key(txn, note_key, &len);
 
-		if (note == NULL) {
-			failed++;
-			continue;
-		}
+static int ndb_write_note_kind_index(struct ndb_txn *txn, struct ndb_note *note,
+				     uint64_t note_key,
+				     struct ndb_index_run *run);
+static int ndb_write_note_tag_index(struct ndb_txn *txn, struct ndb_note *note,
+				    uint64_t note_key,
+				    struct ndb_index_run *run);
+static int ndb_write_note_fulltext_index(struct ndb_txn *txn,
+					 struct ndb_note *note,
+					 uint64_t note_id,
+					 struct ndb_index_run *run);
 
-		struct ndb_profile_record_builder *b = &profile.record;
+// write one index's entries for every note from note key `from` on
+static int ndb_collect_note_index(struct ndb_txn *txn, struct ndb_index_run *run,
+				  uint64_t from)
+{
+	MDB_val k, v;
+	MDB_cursor *cur;
+	MDB_cursor_op op;
+	int count, rc, ok;
+	uint64_t note_key;
+	struct ndb_note *note;
 
-		// reprocess profile
-		if (!ndb_process_profile_note(note, b)) {
-			failed++;
-			continue;
-		}
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE], &cur))) {
+		fprintf(stderr, "ndb_rebuild_note_indices: mdb_cursor_open failed, error %d\n", rc);
+		return -1;
+	}
 
-		// the writer needs to own this note, and its expected to free it
-		copied_note = malloc(len);
-		memcpy(copied_note, note, len);
+	count = 0;
+	k.mv_data = &from;
+	k.mv_size = sizeof(from);
 
-		ndb_writer_note_init(&profile.note, copied_note, len, NULL, 0);
+	// loop through the notes and write search indices
+	for (op = MDB_SET_RANGE; mdb_cursor_get(cur, &k, &v, op) == 0; op = MDB_NEXT) {
+		note = v.mv_data;
+		note_key = *((uint64_t*)k.mv_data);
 
-		// we don't pass in flags when migrating... a bit sketchy but
-		// whatever. noone is using this to customize nostrdb atm
-		if (ndb_write_note_and_profile(secp, txn, &profile,
-					       scratch, scratch_size,
-					       0, NULL)) {
-			count++;
+		switch (run->db) {
+		case NDB_DB_NOTE_KIND:
+			ok = ndb_write_note_kind_index(txn, note, note_key, run);
+			break;
+		case NDB_DB_NOTE_TAGS:
+			ok = ndb_write_note_tag_index(txn, note, note_key, run);
+			break;
+		case NDB_DB_NOTE_PUBKEY:
+			ok = ndb_write_note_pubkey_index(txn, note, note_key, run);
+			break;
+		case NDB_DB_NOTE_PUBKEY_KIND:
+			ok = ndb_write_note_pubkey_kind_index(txn, note, note_key, run);
+			break;
+		case NDB_DB_NOTE_CREATED:
+			ok = ndb_write_note_created_index(txn, note, note_key, run);
+			break;
+		case NDB_DB_NOTE_TEXT:
+			// same notes ndb_write_note indexes. words too big for
+			// a key are skipped there too
+			if (note->kind == 1 || note->kind == 30023)
+				ndb_write_note_fulltext_index(txn, note, note_key, run);
+			ok = 1;
+			break;
+		default:
+			ok = 0;
+			break;
 		}
-	}
 
-	fprintf(stderr, "migrated %d profiles to fix utf8 profile names\n", count);
+		if (!ok || (run->len >= NDB_INDEX_RUN_MAX &&
+			    !ndb_index_run_flush(txn, run))) {
+			count = -1;
+			break;
+		}
 
-	if (failed != 0) {
-		fprintf(stderr, "failed to migrate %d profiles to fix utf8 profile names\n", failed);
+		count++;
 	}
 
-	secp256k1_context_destroy(secp);
-	free(scratch);
 	mdb_cursor_close(cur);
 
-	return ret;
-}
-
-static struct ndb_migration MIGRATIONS[] = {
-	{ .fn = ndb_migrate_user_search_indices },
-	{ .fn = ndb_migrate_lower_user_search_indices },
-	{ .fn = ndb_migrate_utf8_profile_names },
-	{ .fn = ndb_migrate_profile_indices },
-	{ .fn = ndb_migrate_metadata },
-};
-
+	if (count != -1 && !ndb_index_run_flush(txn, run))
+		count = -1;
 
-int ndb_end_query(struct ndb_txn *txn)
-{
-	// this works on read or write queries.
-	return mdb_txn_commit(txn->mdb_txn) == 0;
+	return count;
 }
 
-int ndb_note_verify(void *ctx, unsigned char *scratch, size_t scratch_size,
-		    struct ndb_note *note)
+/* Rebuild index dbs from the notes. Entries are collected an index at a time,
+ * sorted, and appended to the db, which is much faster than putting them in
+ * note order and leaves the b-tree pages full. With `from` past the first
+ * note key, only notes from there on are indexed, on top of the existing
+ * entries; otherwise the dbs are emptied and rebuilt from every note. */
+static int ndb_rebuild_note_indices(struct ndb_txn *txn, enum ndb_dbs *indices,
+				    int num_indices, uint64_t from)
 {
-	unsigned char id[32];
-	secp256k1_xonly_pubkey xonly_pubkey;
-	int ok;
+	struct ndb_index_run run;
+	int i, drop_dbi, count;
+	enum ndb_dbs index;
 
-	// first, we ensure the id is valid by calculating the id independently
-	// from what is given to us
-	if (!ndb_calculate_id(note, scratch, scratch_size, id)) {
-		ndb_debug("ndb_note_verify: scratch buffer size too small\n");
-		return 0;
-	}
+	// 0 means empty, not delete the dbi
+	drop_dbi = 0;
 
-	if (memcmp(id, note->id, 32)) {
-		ndb_debug("ndb_note_verify: note id does not match!\n");
-		return 0;
+	// ensure they are all index dbs we know how to rebuild
+	for (i = 0; i < num_indices; i++) {
+		index = indices[i];
+		if (!ndb_db_is_index(index)) {
+			fprintf(stderr, "ndb_rebuild_note_indices: %s is not an index db\n", ndb_db_name(index));
+			return -1;
+		}
+
+		switch (index) {
+		case NDB_DB_NOTE_KIND:
+		case NDB_DB_NOTE_TAGS:
+		case NDB_DB_NOTE_PUBKEY:
+		case NDB_DB_NOTE_PUBKEY_KIND:
+		case NDB_DB_NOTE_CREATED:
+		case NDB_DB_NOTE_TEXT:
+			break;
+		case NDB_DB_NOTE_RELAY_KIND:
+			fprintf(stderr, "it doesn't make sense to rebuild note relay kind index\n");
+			return 0;
+		default:
+			fprintf(stderr, "%s index rebuild not supported yet. sorry.\n", ndb_db_name(index));
+			return -1;
+		}
 	}
 
-        // id is ok, let's check signature
-	ok = secp256k1_xonly_pubkey_parse((secp256k1_context*)ctx,
-					  &xonly_pubkey,
-					  ndb_note_pubkey(note)) != 0;
-	if (!ok) return 0;
+	count = 0;
 
-	ok = secp256k1_schnorrsig_verify((secp256k1_context*)ctx,
-					 ndb_note_sig(note), id, 32,
-					 &xonly_pubkey) > 0;
-	if (!ok) return 0;
+	for (i = 0; i < num_indices; i++) {
+		index = indices[i];
 
-	return 1;
-}
+		// empty the index db before we rebuild
+		if (from <= 1 && mdb_drop(txn->mdb_txn, txn->lmdb->dbs[index], drop_dbi)) {
+			fprintf(stderr, "ndb_rebuild_note_indices: mdb_drop failed for %s\n", ndb_db_name(index));
+			return -1;
+		}
 
-static void ndb_writer_last_profile_fetch(struct ndb_txn *txn,
-					  const unsigned char *pubkey,
-					  uint64_t fetched_at)
-{
-	int rc;
-	MDB_val key, val;
+		memset(&run, 0, sizeof(run));
+		run.db = index;
 
-	key.mv_data = (unsigned char*)pubkey;
-	key.mv_size = 32;
-	val.mv_data = &fetched_at;
-	val.mv_size = sizeof(fetched_at);
+		count = ndb_collect_note_index(txn, &run, from);
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_LAST_FETCH],
-			  &key, &val, 0)))
-	{
-		ndb_debug("write version to ndb_meta failed: %s\n",
-				mdb_strerror(rc));
-		return;
+		if (count == -1) {
+			fprintf(stderr, "ndb_rebuild_note_indices: rebuilding %s failed\n", ndb_db_name(index));
+			free(run.buf);
+			return -1;
+		}
+
+		free(run.buf);
 	}
 
-	//fprintf(stderr, "writing version %" PRIu64 "\n", version);
+	return count;
 }
 
+int ndb_cursor_start(MDB_cursor *cur, MDB_val *k, MDB_val *v);
 
-// We just received a profile that we haven't processed yet, but it could
-// be an older one! Make sure we only write last fetched profile if it's a new
-// one
-//
-// To do this, we first check the latest profile in the database. If the
-// created_date for this profile note is newer, then we write a
-// last_profile_fetch record, otherwise we do not.
-//
-// WARNING: This function is only valid when called from the writer thread
-static int ndb_maybe_write_last_profile_fetch(struct ndb_txn *txn,
-					       struct ndb_note *note)
+// find the last id tag in a note (e, p, etc)
+static unsigned char *ndb_note_last_id_tag(struct ndb_note *note, char type)
 {
-	size_t len;
-	uint64_t profile_key, note_key;
-	void *root;
-	struct ndb_note *last_profile;
-	NdbProfileRecord_table_t record;
+	unsigned char *last = NULL;
+	struct ndb_iterator iter;
+	struct ndb_str str;
 
-	if ((root = ndb_get_profile_by_pubkey(txn, note->pubkey, &len, &profile_key))) {
-		record = NdbProfileRecord_as_root(root);
-		note_key = NdbProfileRecord_note_key(record);
-		last_profile = ndb_get_note_by_key(txn, note_key, &len);
-		if (last_profile == NULL) {
-			return 0;
-		}
+	// get the liked event id (last id)
+	ndb_tags_iterate_start(note, &iter);
 
-		// found profile, let's see if it's newer than ours
-		if (note->created_at > last_profile->created_at) {
-			// this is a new profile note, record last fetched time
-			ndb_writer_last_profile_fetch(txn, note->pubkey, time(NULL));
+	while (ndb_tags_iterate_next(&iter)) {
+		if (iter.tag->count < 2)
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 0);
+
+		// assign liked to the last e tag
+		if (str.flag == NDB_PACKED_STR && str.str[0] == type) {
+			str = ndb_tag_str(note, iter.tag, 1);
+			if (str.flag == NDB_PACKED_ID)
+				last = str.id;
 		}
-	} else {
-		// couldn't fetch profile. record last fetched time
-		ndb_writer_last_profile_fetch(txn, note->pubkey, time(NULL));
 	}
 
-	return 1;
+	return last;
 }
 
-int ndb_write_last_profile_fetch(struct ndb *ndb, const unsigned char *pubkey,
-				 uint64_t fetched_at)
+/* get reply information from a note */
+static void ndb_parse_reply(struct ndb_note *note, struct ndb_note_reply *note_reply)
 {
-	struct ndb_writer_msg msg;
-	msg.type = NDB_WRITER_PROFILE_LAST_FETCH;
-	memcpy(&msg.last_fetch.pubkey[0], pubkey, 32);
-	msg.last_fetch.fetched_at = fetched_at;
+	unsigned char *root, *reply, *mention, *id;
+	const char *marker;
+	struct ndb_iterator iter;
+	struct ndb_str str;
+	uint16_t count;
+	int any_marker, first;
 
-	return ndb_writer_queue_msg(&ndb->writer.inbox, &msg);
-}
+	any_marker = 0;
+	first = 1;
+	root = NULL;
+	reply = NULL;
+	mention = NULL;
 
+	// get the liked event id (last id)
+	ndb_tags_iterate_start(note, &iter);
+	while (ndb_tags_iterate_next(&iter)) {
+		if (root && reply && mention)
+			break;
 
-// When doing cursor scans from greatest to lowest, this function positions the
-// cursor at the first element before descending. MDB_SET_RANGE puts us right
-// after the first element, so we have to go back one.
-int ndb_cursor_start(MDB_cursor *cur, MDB_val *k, MDB_val *v)
-{
-	int rc;
-	// Position cursor at the next key greater than or equal to the
-	// specified key
+		marker = NULL;
+		count = ndb_tag_count(iter.tag);
 
-	if ((rc = mdb_cursor_get(cur, k, v, MDB_SET_RANGE))) {
-		ndb_debug("MDB_SET_RANGE failed: '%s'\n", mdb_strerror(rc));
-		// Failed :(. It could be the last element?
-		if ((rc = mdb_cursor_get(cur, k, v, MDB_LAST))) {
-			ndb_debug("MDB_LAST failed: '%s'\n", mdb_strerror(rc));
-			return 0;
+		if (count < 2)
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 0);
+		if (!(str.flag == NDB_PACKED_STR && str.str[0] == 'e'))
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 1);
+		if (str.flag != NDB_PACKED_ID)
+			continue;
+		id = str.id;
+
+		/* if we have the marker, assign it */
+		if (count >= 4) {
+			str = ndb_tag_str(note, iter.tag, 3);
+			if (str.flag == NDB_PACKED_STR)
+				marker = str.str;
 		}
-	} else {
-		// if set range worked and our key exists, it should be
-		// the one right before this one
-		if ((rc = mdb_cursor_get(cur, k, v, MDB_PREV))) {
-			ndb_debug("moving back failed: '%s'\n", mdb_strerror(rc));
-			return 0;
+
+		if (marker) {
+			any_marker = true;
+			if (!strcmp(marker, "root"))
+				root = id;
+			else if (!strcmp(marker, "reply"))
+				reply = id;
+			else if (!strcmp(marker, "mention"))
+				mention = id;
+		} else if (!any_marker && first) {
+			root = id;
+			first = 0;
+		} else if (!any_marker && !reply) {
+			reply = id;
 		}
 	}
 
-	return 1;
+	note_reply->reply = reply;
+	note_reply->root = root;
+	note_reply->mention = mention;
 }
 
-
-// get some value based on a clustered id key
-int ndb_get_tsid(struct ndb_txn *txn, enum ndb_dbs db, const unsigned char *id,
-		 MDB_val *val)
+static int ndb_is_reply_to_root(struct ndb_note_reply *reply)
 {
-	MDB_val k, v;
-	MDB_cursor *cur;
-	int success = 0, rc;
-	struct ndb_tsid tsid;
+	if (reply->root && !reply->reply)
+		return 1;
+	else if (reply->root && reply->reply)
+		return !memcmp(reply->root, reply->reply, 32);
+	else
+		return 0;
+}
 
-	// position at the most recent
-	ndb_tsid_high(&tsid, id);
 
-	k.mv_data = &tsid;
-	k.mv_size = sizeof(tsid);
+int ndb_count_replies(struct ndb_txn *txn, const unsigned char *note_id, uint16_t *direct_replies, uint32_t *thread_replies)
+{
+	MDB_val k, v;
+	MDB_cursor *cur;
+	MDB_dbi db;
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[db], &cur))) {
-		ndb_debug("ndb_get_tsid: failed to open cursor: '%s'\n", mdb_strerror(rc));
+	int rc;
+	uint64_t note_key;
+	size_t size;
+	struct ndb_note *note;
+	unsigned char *keybuf, *reply_id;
+	struct ndb_note_reply reply;
+	char buffer[41]; /* 1 + 32 + 8 */
+
+	*direct_replies = 0;
+	*thread_replies = 0;
+
+	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur))) {
+		fprintf(stderr, "ndb_count_reactions: mdb_cursor_open failed, error %d\n", rc);
 		return 0;
 	}
 
-	if (!ndb_cursor_start(cur, &k, &v))
+	buffer[0] = 'e';
+	memcpy(&buffer[1], note_id, 32);
+	memset(&buffer[33], 0x00, 8);
+
+	k.mv_data = buffer;
+	k.mv_size = sizeof(buffer);
+	v.mv_data = NULL;
+	v.mv_size = 0;
+
+	if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE))
 		goto cleanup;
 
-	if (memcmp(k.mv_data, id, 32) == 0) {
-		*val = v;
-		success = 1;
-	}
+	do {
+		keybuf = (unsigned char *)k.mv_data;
+		note_key = *((uint64_t*)v.mv_data);
+		if (k.mv_size < sizeof(buffer))
+			break;
+		if (keybuf[0] != 'e')
+			break;
+		if (memcmp(&keybuf[1], note_id, 32))
+			break;
+		if (!(note = ndb_get_note_by_key(txn, note_key, &size)))
+			continue;
+		if (ndb_note_kind(note) != 1)
+			continue;
 
-cleanup:
-	mdb_cursor_close(cur);
-	return success;
-}
+		ndb_parse_reply(note, &reply);
 
-static void *ndb_lookup_by_key(struct ndb_txn *txn, uint64_t key,
-			       enum ndb_dbs store, size_t *len)
-{
-	MDB_val k, v;
+		if (ndb_is_reply_to_root(&reply)) {
+			reply_id = reply.root;
+		} else {
+			reply_id = reply.reply;
+		}
 
-	k.mv_data = &key;
-	k.mv_size = sizeof(key);
+		if (reply_id && !memcmp(reply_id, note_id, 32)) {
+			(*direct_replies)++;
+		}
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[store], &k, &v)) {
-		ndb_debug("ndb_lookup_by_key: mdb_get note failed\n");
-		return NULL;
-	}
+		if (reply.root && !memcmp(reply.root, note_id, 32)) {
+			(*thread_replies)++;
+		}
 
-	if (len)
-		*len = v.mv_size;
+	} while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0);
 
-	return v.mv_data;
+cleanup:
+	mdb_cursor_close(cur);
+	return 1;
 }
 
-static void *ndb_lookup_tsid(struct ndb_txn *txn, enum ndb_dbs ind,
-			     enum ndb_dbs store, const unsigned char *pk,
-			     size_t *len, uint64_t *primkey)
+/* count all of the reactions for a note */
+int ndb_rebuild_reaction_metadata(struct ndb_txn *txn, const unsigned char *note_id, struct ndb_note_meta_builder *builder, uint32_t *count)
 {
 	MDB_val k, v;
-	void *res = NULL;
-	if (len)
-		*len = 0;
-
-	if (!ndb_get_tsid(txn, ind, pk, &k)) {
-		//ndb_debug("ndb_get_profile_by_pubkey: ndb_get_tsid failed\n");
-		return 0;
-	}
+	MDB_cursor *cur;
+	MDB_dbi db;
 
-	if (primkey)
-		*primkey = *(uint64_t*)k.mv_data;
+	int rc;
+	uint64_t note_key;
+	size_t size;
+	struct ndb_note *note;
+	unsigned char *keybuf, *last_id;
+	struct ndb_note_meta_entry *entry;
+	union ndb_reaction_str reaction_str;
+	char buffer[41]; /* 1 + 32 + 8 */
+	*count = 0;
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[store], &k, &v)) {
-		ndb_debug("ndb_get_profile_by_pubkey: mdb_get note failed\n");
+	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur))) {
+		fprintf(stderr, "ndb_count_reactions: mdb_cursor_open failed, error %d\n", rc);
 		return 0;
 	}
 
-	res = v.mv_data;
-	assert(((uint64_t)res % 4) == 0);
-	if (len)
-		*len = v.mv_size;
-	return res;
-}
-
-void *ndb_get_profile_by_pubkey(struct ndb_txn *txn, const unsigned char *pk, size_t *len, uint64_t *key)
-{
-	return ndb_lookup_tsid(txn, NDB_DB_PROFILE_PK, NDB_DB_PROFILE, pk, len, key);
-}
-
-struct ndb_note *ndb_get_note_by_id(struct ndb_txn *txn, const unsigned char *id, size_t *len, uint64_t *key)
-{
-	return ndb_lookup_tsid(txn, NDB_DB_NOTE_ID, NDB_DB_NOTE, id, len, key);
-}
+	buffer[0] = 'e';
+	memcpy(&buffer[1], note_id, 32);
+	memset(&buffer[33], 0x00, 8);
 
-static inline uint64_t ndb_get_indexkey_by_id(struct ndb_txn *txn,
-					      enum ndb_dbs db,
-					      const unsigned char *id)
-{
-	MDB_val k;
+	k.mv_data = buffer;
+	k.mv_size = sizeof(buffer);
+	v.mv_data = NULL;
+	v.mv_size = 0;
 
-	if (!ndb_get_tsid(txn, db, id, &k))
-		return 0;
+	if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE))
+		goto cleanup;
 
-	return *(uint32_t*)k.mv_data;
-}
+	do {
+		keybuf = (unsigned char *)k.mv_data;
+		note_key = *((uint64_t*)v.mv_data);
+		if (k.mv_size < sizeof(buffer))
+			break;
+		if (keybuf[0] != 'e')
+			break;
+		if (memcmp(&keybuf[1], note_id, 32))
+			break;
+		if (!(note = ndb_get_note_by_key(txn, note_key, &size)))
+			continue;
+		if (ndb_note_kind(note) != 7)
+			continue;
+		if (!(last_id = ndb_note_last_id_tag(note, 'e')))
+			continue;
+		if (memcmp(last_id, note_id, 32))
+			continue;
 
-uint64_t ndb_get_notekey_by_id(struct ndb_txn *txn, const unsigned char *id)
-{
-	return ndb_get_indexkey_by_id(txn, NDB_DB_NOTE_ID, id);
-}
+		if (builder) {
+			if (!ndb_reaction_set(&reaction_str, ndb_note_content(note)))
+				ndb_reaction_set(&reaction_str, "+");
 
-uint64_t ndb_get_profilekey_by_pubkey(struct ndb_txn *txn, const unsigned char *id)
-{
-	return ndb_get_indexkey_by_id(txn, NDB_DB_PROFILE_PK, id);
-}
+			if ((entry = ndb_note_meta_builder_find_entry(builder, NDB_NOTE_META_REACTION, &reaction_str.binmoji))) {
+				(*ndb_note_meta_reaction_count(entry))++;
+			} else if ((entry = ndb_note_meta_add_entry(builder))) {
+				ndb_note_meta_reaction_set(entry, 1, reaction_str);
+			} else {
+				/* couldn't add reaction entry ? */
+				ndb_debug("ndb_rebuild_note_indices: couldn't add reaction count entry to metadata builder\n");
+			}
+		}
 
-struct ndb_note *ndb_get_note_by_key(struct ndb_txn *txn, uint64_t key, size_t *len)
-{
-	return ndb_lookup_by_key(txn, key, NDB_DB_NOTE, len);
-}
+		(*count)++;
+	} while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0);
 
-void *ndb_get_profile_by_key(struct ndb_txn *txn, uint64_t key, size_t *len)
-{
-	return ndb_lookup_by_key(txn, key, NDB_DB_PROFILE, len);
+cleanup:
+	mdb_cursor_close(cur);
+	return 1;
 }
 
-uint64_t
-ndb_read_last_profile_fetch(struct ndb_txn *txn, const unsigned char *pubkey)
+static int ndb_count_reposts(struct ndb_txn *txn, const unsigned char *note_id, uint16_t *count)
 {
 	MDB_val k, v;
+	MDB_cursor *cur;
+	MDB_dbi db;
+	int rc;
+	unsigned char *keybuf;
+	struct ndb_note *note;
+	uint64_t note_key, kind;
+	char buffer[41]; /* 1 + 32 + 8 */
 
-	k.mv_data = (unsigned char*)pubkey;
-	k.mv_size = 32;
+	*count = 0;
+	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_LAST_FETCH], &k, &v)) {
-		//ndb_debug("ndb_read_last_profile_fetch: mdb_get note failed\n");
+	/* we will iterate q tags for this particular id */
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur))) {
+		fprintf(stderr, "ndb_count_quotes: mdb_cursor_open failed, error %d\n", rc);
 		return 0;
 	}
 
-	return *((uint64_t*)v.mv_data);
-}
-
-
-static int ndb_has_note(struct ndb_txn *txn, const unsigned char *id)
-{
-	MDB_val val;
+	buffer[0] = 'e';
+	memcpy(&buffer[1], note_id, 32);
+	memset(&buffer[33], 0x00, 8);
 
-	if (!ndb_get_tsid(txn, NDB_DB_NOTE_ID, id, &val))
-		return 0;
+	k.mv_data = buffer;
+	k.mv_size = sizeof(buffer);
+	v.mv_data = NULL;
+	v.mv_size = 0;
 
-	return 1;
-}
+	if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE))
+		goto cleanup;
 
-static void ndb_txn_from_mdb(struct ndb_txn *txn, struct ndb_lmdb *lmdb,
-			     MDB_txn *mdb_txn)
-{
-	txn->lmdb = lmdb;
-	txn->mdb_txn = mdb_txn;
-}
+	do {
+		keybuf = (unsigned char *)k.mv_data;
+		note_key = *((uint64_t*)v.mv_data);
 
-static enum ndb_idres ndb_ingester_json_controller(void *data, const char *hexid)
+		if (k.mv_size < sizeof(buffer))
+			break;
+		if (keybuf[0] != 'e')
+			break;
+		if (memcmp(&keybuf[1], note_id, 32) != 0)
+			break;
+		if (!(note = ndb_get_note_by_key(txn, note_key, NULL)))
+			continue;
+		kind = ndb_note_kind(note);
+		if (!(kind == 6 || kind == 16))
+			continue;
+		(*count)++;
+	} while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0);
+
+cleanup:
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+/* count all of the quote reposts for a note id */
+static int ndb_count_quotes(struct ndb_txn *txn, const unsigned char *note_id, uint16_t *count)
 {
-	unsigned char id[32];
-	struct ndb_ingest_controller *c = data;
-	struct ndb_txn txn;
+	MDB_val k, v;
+	MDB_cursor *cur;
+	MDB_dbi db;
+	int rc;
+	unsigned char *keybuf;
+	char buffer[41]; /* 1 + 32 + 8 */
 
-	hex_decode(hexid, 64, id, sizeof(id));
+	*count = 0;
+	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
 
-	// let's see if we already have it
-	ndb_txn_from_mdb(&txn, c->lmdb, c->read_txn);
-	c->note = ndb_get_note_by_id(&txn, id, NULL, &c->note_key);
+	/* we will iterate q tags for this particular id */
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur))) {
+		fprintf(stderr, "ndb_count_quotes: mdb_cursor_open failed, error %d\n", rc);
+		return 0;
+	}
 
-	if (c->note == NULL)
-		return NDB_IDRES_CONT;
+	buffer[0] = 'q';
+	memcpy(&buffer[1], note_id, 32);
+	memset(&buffer[33], 0x00, 8);
 
-	return NDB_IDRES_STOP;
+	k.mv_data = buffer;
+	k.mv_size = sizeof(buffer);
+	v.mv_data = NULL;
+	v.mv_size = 0;
+
+	if (mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE))
+		goto cleanup;
+
+	for (;;) {
+		keybuf = (unsigned char *)k.mv_data;
+		if (k.mv_size < sizeof(buffer))
+			break;
+		if (keybuf[0] != 'q')
+			break;
+		if (memcmp(&keybuf[1], note_id, 32) != 0)
+			break;
+		/* TODO(jb55): technically we should check to see if this is a kind 1.
+		 * there could be other kinds with q tags that reference this note
+		 *
+		 * Starting to think we should have tag-kind index
+		 */
+		(*count)++;
+
+		if (mdb_cursor_get(cur, &k, &v, MDB_NEXT))
+			break;
+	}
+
+cleanup:
+	mdb_cursor_close(cur);
+	return 1;
 }
 
-static int ndbprofile_parse_json(flatcc_builder_t *B,
-        const char *buf, size_t bufsiz, int flags, NdbProfile_ref_t *profile)
+/* count quotes and add them to a metadata builder.
+ * we assume there is no existing quotes entry */
+static int ndb_note_meta_builder_counts(struct ndb_txn *txn,
+					unsigned char *note_id,
+					struct ndb_note_meta_builder *builder)
 {
-	flatcc_json_parser_t parser, *ctx = &parser;
-	flatcc_json_parser_init(ctx, B, buf, buf + bufsiz, flags);
+	uint32_t thread_replies, total_reactions;
+	uint16_t direct_replies, quotes, reposts;
+	struct ndb_note_meta_entry *entry;
+	int rcs[4];
 
-	if (flatcc_builder_start_buffer(B, 0, 0, 0))
-		return 0;
+	quotes = 0;
+	direct_replies = 0;
+	thread_replies = 0;
+	total_reactions = 0;
 
-	NdbProfile_parse_json_table(ctx, buf, buf + bufsiz, profile);
-	if (ctx->error)
+	rcs[0] = ndb_rebuild_reaction_metadata(txn, note_id, builder, &total_reactions);
+	rcs[1] = ndb_count_quotes(txn, note_id, &quotes);
+	rcs[2] = ndb_count_replies(txn, note_id, &direct_replies, &thread_replies);
+	rcs[3] = ndb_count_reposts(txn, note_id, &reposts);
+
+	if (!rcs[0] && !rcs[1] && !rcs[2] && !rcs[3]) {
 		return 0;
+	}
 
-	if (!flatcc_builder_end_buffer(B, *profile))
+	/* no entry needed */
+	if (quotes == 0 && direct_replies == 0 && thread_replies == 0 && quotes == 0 && reposts == 0) {
 		return 0;
+	}
 
-	ctx->end_loc = buf;
+	if (!(entry = ndb_note_meta_add_entry(builder))) {
+		return 0;
+	}
 
+	ndb_note_meta_counts_set(entry, total_reactions, quotes, direct_replies, thread_replies, reposts);
 
 	return 1;
 }
 
-void ndb_profile_record_builder_init(struct ndb_profile_record_builder *b)
-{
-	b->builder = malloc(sizeof(*b->builder));
-	b->flatbuf = NULL;
-}
+// Migrations
+//
 
-void ndb_profile_record_builder_free(struct ndb_profile_record_builder *b)
+/* switch from flatbuffer stats to custom v2 */
+static int ndb_migrate_metadata(struct ndb_txn *txn)
 {
-	if (b->flatbuf)
-		flatcc_builder_aligned_free(b->flatbuf);
-	if (b->builder) {
-		flatcc_builder_clear(b->builder);
-		free(b->builder);
-	}
+	MDB_val k, k2, v, v2;
+	MDB_cursor *cur;
+	MDB_dbi note_db, meta_db;
+	unsigned char *id;
+	size_t scratch_size = 1024 * 1024;
+	unsigned char *buffer = malloc(scratch_size);
+	int rc, count;
+	struct ndb_note_meta_builder builder;
+	struct ndb_note *note;
+	struct ndb_note_meta *meta;
 
-	b->builder = NULL;
-	b->flatbuf = NULL;
+	meta_db = txn->lmdb->dbs[NDB_DB_META];
+	note_db = txn->lmdb->dbs[NDB_DB_NOTE];
 
-}
+	/* drop metadata table to avoid issues */
+	if (mdb_drop(txn->mdb_txn, meta_db, 0)) {
+		fprintf(stderr, "ndb_migrate_metadata: mdb_drop failed\n");
+		return -1;
+	}
 
-int ndb_process_profile_note(struct ndb_note *note,
-			     struct ndb_profile_record_builder *profile)
-{
-	int res;
+	if ((rc = mdb_cursor_open(txn->mdb_txn, note_db, &cur))) {
+		fprintf(stderr, "ndb_migrate_metadata: mdb_cursor_open failed, error %d\n", rc);
+		return -1;
+	}
 
-	NdbProfile_ref_t profile_table;
-	flatcc_builder_t *builder;
+	count = 0;
 
-	ndb_profile_record_builder_init(profile);
-	builder = profile->builder;
-	flatcc_builder_init(builder);
+	/* loop through every metadata entry */
+	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
+		ndb_note_meta_builder_init(&builder, buffer, scratch_size);
 
-	NdbProfileRecord_start_as_root(builder);
+		note = (struct ndb_note *)v.mv_data;
+		id = ndb_note_id(note);
+		k2.mv_data = (unsigned char *)id;
+		k2.mv_size = 32;
 
-	//printf("parsing profile '%.*s'\n", note->content_length, ndb_note_content(note));
-	if (!(res = ndbprofile_parse_json(builder, ndb_note_content(note),
-					  note->content_length,
-					  flatcc_json_parser_f_skip_unknown,
-					  &profile_table)))
-	{
-		ndb_debug("profile_parse_json failed %d '%.*s'\n", res,
-			  note->content_length, ndb_note_content(note));
-		ndb_profile_record_builder_free(profile);
-		return 0;
-	}
+		rc = ndb_note_meta_builder_counts(txn, id, &builder);
+		if (!rc) {
+			mdb_del(txn->mdb_txn, meta_db, &k2, NULL);
+			continue;
+		}
 
-	uint64_t received_at = time(NULL);
-	const char *lnurl = "fixme";
+		ndb_note_meta_build(&builder, &meta);
+		assert(ndb_note_meta_entries(meta)->type != 0);
 
-	NdbProfileRecord_profile_add(builder, profile_table);
-	NdbProfileRecord_received_at_add(builder, received_at);
+		v2.mv_data = meta;
+		v2.mv_size = ndb_note_meta_total_size(meta);
 
-	flatcc_builder_ref_t lnurl_off;
-	lnurl_off = flatcc_builder_create_string_str(builder, lnurl);
+		/* set entry */
+		if ((rc = mdb_put(txn->mdb_txn, meta_db, &k2, &v2, 0))) {
+			ndb_debug("migrate metadata entry failed on write: %s\n", mdb_strerror(rc));
+		}
 
-	NdbProfileRecord_lnurl_add(builder, lnurl_off);
+		count++;
+	}
 
-	//*profile = flatcc_builder_finalize_aligned_buffer(builder, profile_len);
+	fprintf(stderr, "nostrdb: migrated %d metadata entries\n", count);
+
+	free(buffer);
+	mdb_cursor_close(cur);
 	return 1;
 }
 
-static int ndb_ingester_queue_event(struct ndb_ingester *ingester,
-				    char *json, unsigned len,
-				    unsigned client, const char *relay)
+// This was before we had note_profile_pubkey{,_kind} indices. Let's create them.
+static int ndb_migrate_profile_indices(struct ndb_txn *txn)
 {
-	struct ndb_ingester_msg msg;
-	msg.type = NDB_INGEST_EVENT;
-
-	msg.event.json = json;
-	msg.event.len = len;
-	msg.event.client = client;
-	msg.event.relay = relay;
+	int count;
 
-	return threadpool_dispatch(&ingester->tp, &msg);
+	enum ndb_dbs indices[] = {NDB_DB_NOTE_PUBKEY, NDB_DB_NOTE_PUBKEY_KIND};
+	if ((count = ndb_rebuild_note_indices(txn, indices, 2, 0)) != -1) {
+		fprintf(stderr, "migrated %d notes to have pubkey and pubkey_kind indices\n", count);
+		return 1;
+	} else {
+		fprintf(stderr, "error migrating notes to have pubkey and pubkey_kind indices, aborting.\n");
+		return 0;
+	}
 }
 
-int ndb_add_key(struct ndb *ndb, unsigned char *key)
+// Build the created_at index for notes written before we had one.
+static int ndb_migrate_created_index(struct ndb_txn *txn)
 {
-	struct ndb_ingester_msg msg;
-	msg.type = NDB_INGEST_ADD_KEY;
-
-	memcpy(msg.add_key.key, key, 32);
+	int count;
 
-	/* add the key to all ingester threads */
-	return threadpool_dispatch_all_threads(&ndb->ingester.tp, &msg);
+	enum ndb_dbs indices[] = {NDB_DB_NOTE_CREATED};
+	if ((count = ndb_rebuild_note_indices(txn, indices, 1, 0)) != -1) {
+		fprintf(stderr, "migrated %d notes to have a created_at index\n", count);
+		return 1;
+	} else {
+		fprintf(stderr, "error migrating notes to have a created_at index, aborting.\n");
+		return 0;
+	}
 }
 
-int ndb_add_team_root(struct ndb *ndb, unsigned char *team_root)
+static int ndb_migrate_user_search_indices(struct ndb_txn *txn)
 {
-	struct ndb_ingester_msg msg;
-	msg.type = NDB_INGEST_ADD_TEAM_ROOT;
+	int rc;
+	MDB_cursor *cur;
+	MDB_val k, v;
+	void *profile_root;
+	NdbProfileRecord_table_t record;
+	struct ndb_note *note;
+	uint64_t note_key, profile_key;
+	size_t len;
+	int count;
 
-	memcpy(msg.add_team_root.root, team_root, 32);
-
-	/* register the team_root on all ingester threads */
-	return threadpool_dispatch_all_threads(&ndb->ingester.tp, &msg);
-}
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE], &cur))) {
+		fprintf(stderr, "ndb_migrate_user_search_indices: mdb_cursor_open failed, error %d\n", rc);
+		return 0;
+	}
 
-void ndb_ingest_meta_init(struct ndb_ingest_meta *meta, unsigned client, const char *relay)
-{
-	meta->client = client;
-	meta->relay = relay;
-}
+	count = 0;
 
-static int ndb_ingest_event(struct ndb_ingester *ingester, const char *json,
-			    int len, struct ndb_ingest_meta *meta)
-{
-	const char *relay = meta->relay;
+	// loop through all profiles and write search indices
+	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
+		profile_root = v.mv_data;
+		profile_key = *((uint64_t*)k.mv_data);
+		record = NdbProfileRecord_as_root(profile_root);
+		note_key = NdbProfileRecord_note_key(record);
+		note = ndb_get_note_by_key(txn, note_key, &len);
 
-	// Without this, we get bus errors in the json parser inside when
-	// trying to ingest empty kind 6 reposts... we should probably do fuzz
-	// testing on inputs to the json parser
-	if (len == 0)
-		return 0;
+		if (note == NULL) {
+			continue;
+		}
 
-	// Since we need to return as soon as possible, and we're not
-	// making any assumptions about the lifetime of the string, we
-	// definitely need to copy the json here. In the future once we
-	// have our thread that manages a websocket connection, we can
-	// avoid the copy and just use the buffer we get from that
-	// thread.
-	char *json_copy = strdupn(json, len);
-	if (json_copy == NULL)
-		return 0;
+		if (!ndb_write_profile_search_indices(txn, note, profile_key,
+						      profile_root)) {
+			fprintf(stderr, "ndb_migrate_user_search_indices: ndb_write_profile_search_indices failed\n");
+			continue;
+		}
 
-	if (relay != NULL) {
-		relay = strdup(meta->relay);
-		if (relay == NULL)
-			return 0;
+		count++;
 	}
 
-	return ndb_ingester_queue_event(ingester, json_copy, len, meta->client, relay);
-}
+	fprintf(stderr, "migrated %d profiles to include search indices\n", count);
+
+	mdb_cursor_close(cur);
 
+	return 1;
+}
 
-static int ndb_ingester_process_note(secp256k1_context *secp,
-				     struct ndb_note *note,
-				     size_t note_size,
-				     struct ndb_ingester *ingester,
-				     unsigned char *scratch,
-				     size_t scratch_size,
-				     const char *relay,
-				     struct keypair *keys, int nkeys,
-				     struct pns_key *pns_keys, int npns_keys,
-				     struct sns_key *sns_keys, int nsns_keys)
+static int ndb_migrate_lower_user_search_indices(struct ndb_txn *txn)
 {
-	enum ndb_ingest_filter_action action;
-	struct ndb_ingest_meta meta;
-	struct ndb_writer_msg msg;
-	int is_rumor;
+	// just drop the search db so we can rebuild it
+	if (mdb_drop(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH], 0)) {
+		fprintf(stderr, "ndb_migrate_lower_user_search_indices: mdb_drop failed\n");
+		return 0;
+	}
 
-	action = NDB_INGEST_ACCEPT;
+	return ndb_migrate_user_search_indices(txn);
+}
 
-	if (ingester->filter)
-		action = ingester->filter(ingester->filter_context, note);
+int ndb_process_profile_note(struct ndb_note *note, struct ndb_profile_record_builder *profile);
 
-	if (action == NDB_INGEST_REJECT)
-		return 0;
 
-	is_rumor = (*ndb_note_flags(note)) & NDB_NOTE_FLAG_RUMOR;
+int ndb_db_version(struct ndb_txn *txn)
+{
+	uint64_t version, version_key;
+	MDB_val k, v;
 
-	// some special situations we might want to skip sig validation,
-	// like during large imports
-	if (is_rumor || action == NDB_INGEST_SKIP_VALIDATION ||
-	    (ingester->flags & NDB_FLAG_SKIP_NOTE_VERIFY)) {
-		// if we're skipping validation we don't need to verify
+	version_key = NDB_META_KEY_VERSION;
+	k.mv_data = &version_key;
+	k.mv_size = sizeof(version_key);
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META], &k, &v)) {
+		version = -1;
 	} else {
-		// verify! If it's an invalid note we don't need to
-		// bother writing it to the database
-		if (!ndb_note_verify(secp, scratch, scratch_size, note)) {
-			ndb_debug("note verification failed\n");
+		if (v.mv_size != 8) {
+			fprintf(stderr, "run_migrations: invalid version size?");
 			return 0;
 		}
+		version = *((uint64_t*)v.mv_data);
 	}
 
-	// we didn't find anything. let's send it
-	// to the writer thread
-	note = realloc(note, note_size);
-	assert(((uint64_t)note % 4) == 0);
+	return version;
+}
 
-	if (note->kind == 0) {
-		struct ndb_profile_record_builder *b = &msg.profile.record;
+// custom pubkey+kind+timestamp comparison function. This is used by lmdb to
+// perform b+ tree searches over the pubkey+kind+timestamp index
+static int ndb_id_u64_ts_compare(const MDB_val *a, const MDB_val *b)
+{
+	struct ndb_id_u64_ts *tsa, *tsb;
+	MDB_val a2 = *a, b2 = *b;
 
-		ndb_process_profile_note(note, b);
+	a2.mv_size = sizeof(tsa->id);
+	b2.mv_size = sizeof(tsb->id);
 
-		msg.type = NDB_WRITER_PROFILE;
-		ndb_writer_note_init(&msg.profile.note, note, note_size, relay, 0);
+	int cmp = mdb_cmp_memn(&a2, &b2);
+	if (cmp) return cmp;
 
-		prot_queue_push(ingester->writer_inbox, &msg);
+	tsa = a->mv_data;
+	tsb = b->mv_data;
 
+	if (tsa->u64 < tsb->u64)
+		return -1;
+	else if (tsa->u64 > tsb->u64)
 		return 1;
-	} else if (note->kind == 6) {
-		// process the repost if we have a repost event
-		//ndb_debug("processing kind 6 repost\n");
-		// dup the relay string
-		ndb_ingest_meta_init(&meta, 0, relay);
-		ndb_ingest_event(ingester, ndb_note_content(note),
-					   ndb_note_content_length(note),
-					   &meta);
-	} else if (note->kind == 1059) {
-		ndb_debug("processing giftwrap\n");
-		ndb_process_giftwrap(secp, ingester, note, keys, nkeys, relay,
-				     scratch, scratch_size);
-	} else if (note->kind == 1080) {
-		ndb_debug("processing pns\n");
-		ndb_process_pns_event(ingester, note, pns_keys, npns_keys,
-				      relay, scratch, scratch_size,
-				      keys, nkeys, secp);
-	} else if (note->kind == 1081) {
-		ndb_debug("processing sns\n");
-		ndb_process_sns_event(secp, ingester, note, sns_keys, nsns_keys,
-				      relay, scratch, scratch_size, keys, nkeys);
-	}
 
-	msg.type = NDB_WRITER_NOTE;
-	ndb_writer_note_init(&msg.note, note, note_size, relay, 0);
+	if (tsa->timestamp < tsb->timestamp)
+		return -1;
+	else if (tsa->timestamp > tsb->timestamp)
+		return 1;
 
-	prot_queue_push(ingester->writer_inbox, &msg);
+	return 0;
+}
 
-	return 1;
+// custom kind+timestamp comparison function. This is used by lmdb to perform
+// b+ tree searches over the kind+timestamp index
+static int ndb_u64_ts_compare(const MDB_val *a, const MDB_val *b)
+{
+	struct ndb_u64_ts *tsa, *tsb;
+	tsa = a->mv_data;
+	tsb = b->mv_data;
+
+	if (tsa->u64 < tsb->u64)
+		return -1;
+	else if (tsa->u64 > tsb->u64)
+		return 1;
+
+	if (tsa->timestamp < tsb->timestamp)
+		return -1;
+	else if (tsa->timestamp > tsb->timestamp)
+		return 1;
+
+	return 0;
 }
 
-int ndb_note_seen_on_relay(struct ndb_txn *txn, uint64_t note_key, const char *relay)
+static int ndb_tsid_compare(const MDB_val *a, const MDB_val *b)
 {
-	MDB_val k, v;
-	MDB_cursor *cur;
-	int rc, len;
-	char relay_buf[256];
+	struct ndb_tsid *tsa, *tsb;
+	MDB_val a2 = *a, b2 = *b;
 
-	if (relay == NULL)
-		return 0;
+	a2.mv_size = sizeof(tsa->id);
+	b2.mv_size = sizeof(tsb->id);
 
-	len = strlen(relay);
+	int cmp = mdb_cmp_memn(&a2, &b2);
+	if (cmp) return cmp;
 
-	if (!(len = prepare_relay_buf(relay_buf, sizeof(relay_buf), relay, len)))
-		return 0;
+	tsa = a->mv_data;
+	tsb = b->mv_data;
 
-	assert((len % 8) == 0);
+	if (tsa->timestamp < tsb->timestamp)
+		return -1;
+	else if (tsa->timestamp > tsb->timestamp)
+		return 1;
+	return 0;
+}
 
-	k.mv_data = &note_key;
-	k.mv_size = sizeof(note_key);
+enum ndb_ingester_msgtype {
+	NDB_INGEST_EVENT, // write json to the ingester queue for processing
+	NDB_INGEST_QUIT,  // kill ingester thread immediately
+	NDB_INGEST_ADD_KEY, // add a key for monitoring encrypted data
+	NDB_INGEST_PROCESS_GIFTWRAP, // reprocess unwrapped giftwraps
+	NDB_INGEST_PROCESS_PNS, // reprocess kind-1080 events
+	NDB_INGEST_ADD_TEAM_ROOT, // add a shared SNS team_root for monitoring
+	NDB_INGEST_PROCESS_SNS, // reprocess kind-1081 events
+	NDB_INGEST_IMPORT, // parse a range of an imported file in place
+};
 
-	v.mv_data = relay_buf;
-	v.mv_size = len;
+// what became of an event, for bulk imports to tally
+enum ndb_ingest_status {
+	NDB_INGEST_STATUS_QUEUED,    // sent to the writer
+	NDB_INGEST_STATUS_DUPLICATE, // we have it, at most it had a new relay
+	NDB_INGEST_STATUS_IGNORED,   // not a note, like EOSE or NOTICE
+	NDB_INGEST_STATUS_INVALID,   // couldn't be parsed
+	NDB_INGEST_STATUS_REJECTED,  // failed verification or the ingest filter
+	NDB_INGEST_STATUS_DROPPED,   // the writer queue was full
+};
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAYS], &cur)) != MDB_SUCCESS)
-		return 0;
+struct ndb_ingester_event {
+	const char *relay;
+	char *json;
+	unsigned client : 1; // ["EVENT", {...}] messages
+	unsigned len : 31;
+	unsigned wait : 1; // wait for room in the writer queue, for imports
 
-	rc = mdb_cursor_get(cur, &k, &v, MDB_GET_BOTH);
-	ndb_debug("seen_on_relay result: %s\n", mdb_strerror(rc));
-	mdb_cursor_close(cur);
+	// a caller-owned json buffer, NULL when we made our own copy
+	ndb_release_fn release;
+	void *release_ctx;
+};
 
-	return rc == MDB_SUCCESS;
-}
+struct ndb_ingester_add_key {
+	unsigned char key[32];
+};
 
-// process the relay for the note. this is called when we already have the
-// note in the database but still need to check if the relay needs to be
-// written to the relay indexes for corresponding note
-static int ndb_process_note_relay(struct ndb_txn *txn,
-				  struct prot_queue *writer,
-				  uint64_t note_key, struct ndb_note *note,
-				  const char *relay)
-{
-	struct ndb_writer_msg msg;
-	// query to see if we already have the relay on this note
-	if (ndb_note_seen_on_relay(txn, note_key, relay)) {
-		return 0;
-	}
+struct ndb_ingester_add_team_root {
+	unsigned char root[32];
+};
 
-	// if not, tell the writer thread to emit a NOTE_RELAY event
-	msg.type = NDB_WRITER_NOTE_RELAY;
+struct ndb_ingester_process_giftwrap {
+	uint64_t giftwrap_key;
+};
 
-	ndb_debug("pushing NDB_WRITER_NOTE_RELAY with note_key %" PRIu64 "\n", note_key);
-	msg.note_relay.relay = relay;
-	msg.note_relay.note_key = note_key;
-	msg.note_relay.kind = ndb_note_kind(note);
-	msg.note_relay.created_at = ndb_note_created_at(note);
+struct ndb_ingester_process_pns {
+	uint64_t note_key;
+};
 
-	prot_queue_push(writer, &msg);
+struct ndb_ingester_process_sns {
+	uint64_t note_key;
+};
 
-	return 1;
-}
+// ranges per ingester thread, so idle threads have something to steal
+#define NDB_IMPORT_RANGES_PER_THREAD 4
 
-static int ndb_ingester_process_event(secp256k1_context *ctx,
-				      struct ndb_ingester *ingester,
-				      struct ndb_ingester_event *ev,
-				      unsigned char *scratch,
-				      struct keypair *keys, int nkeys,
-				      struct pns_key *pns_keys, int npns_keys,
-				      struct sns_key *sns_keys, int nsns_keys,
-				      MDB_txn *read_txn)
-{
-	struct ndb_tce tce;
-	struct ndb_fce fce;
-	struct ndb_note *note;
-	struct ndb_ingest_controller controller;
-	struct ndb_id_cb cb;
-	void *buf;
-	int ok;
-	size_t bufsize, note_size;
-
-	ok = 0;
-
-	// we will use this to check if we already have it in the DB during
-	// ID parsing
-	controller.read_txn = read_txn;
-	controller.lmdb = ingester->lmdb;
-	cb.fn = ndb_ingester_json_controller;
-	cb.data = &controller;
+// lines parsed against one read txn, so a long range doesn't keep the
+// writer from reusing pages
+#define NDB_IMPORT_TXN_LINES 1024
 
-	// since we're going to be passing this allocated note to a different
-	// thread, we can't use thread-local buffers. just allocate a block
-        bufsize = max(ev->len * 8.0, 4096);
-	buf = malloc(bufsize);
-	if (!buf) {
-		ndb_debug("couldn't malloc buf\n");
-		return 0;
-	}
+// a file import, shared by the ingesters parsing its ranges
+struct ndb_import {
+	const char *relay;
+	unsigned client;
+	struct ndb_import_stats stats; // added to atomically
+	int failed;  // lines were skipped without a read txn
+	int pending; // ranges not parsed yet
+	int refs;    // one per range, plus the importer
+	struct prot_event done;
+};
 
-	note_size =
-		ev->client ?
-		ndb_client_event_from_json(ev->json, ev->len, &fce, buf, bufsize, &cb) :
-		ndb_ws_event_from_json(ev->json, ev->len, &tce, buf, bufsize, &cb);
+struct ndb_ingester_import {
+	struct ndb_import *import;
+	const char *start;
+	size_t len;
+};
 
-	// This is a result from our special json parser. It parsed the id
-	// and found that we already have it in the database
-	if ((int)note_size == -42) {
-		assert(controller.note != NULL);
-		assert(controller.note_key != 0);
-		struct ndb_txn txn;
-		ndb_txn_from_mdb(&txn, ingester->lmdb, read_txn);
+struct ndb_writer_note_relay {
+	const char *relay;
+	uint64_t note_key;
+	uint64_t kind;
+	uint64_t created_at;
+};
 
-		// we still need to process the relays on the note even
-		// if we already have it
-	 	if (ev->relay && ndb_process_note_relay(&txn,
-							ingester->writer_inbox,
-							controller.note_key,
-							controller.note,
-							ev->relay))
-		{
-			// free note buf here since we don't pass the note to the writer thread
-			free(buf);
-			goto success;
-		} else {
-			// we already have the note and there are no new
-			// relays to process. nothing to write.
-			goto cleanup;
-		}
-	} else if (note_size == 0) {
-		ndb_debug("failed to parse '%.*s'\n", ev->len, ev->json);
-		goto cleanup;
-	}
+/* Relays ride along with their notes from the ingesters to the writer,
+ * which frees them once they're written. An import hands the same one to
+ * every note it reads, so they're refcounted instead of copied per note. */
+struct ndb_relay_str {
+	int refs;
+	char str[];
+};
 
-	//ndb_debug("parsed evtype:%d '%.*s'\n", tce.evtype, ev->len, ev->json);
+static const char *ndb_relay_dup(const char *relay)
+{
+	struct ndb_relay_str *r;
+	size_t len;
 
-	if (ev->client) {
-		switch (fce.evtype) {
-		case NDB_FCE_EVENT:
-			note = fce.event.note;
-			if (note != buf) {
-				ndb_debug("note buffer not equal to malloc'd buffer\n");
-				goto cleanup;
-			}
+	len = strlen(relay) + 1;
+	if (!(r = malloc(sizeof(*r) + len)))
+		return NULL;
 
-			if (!ndb_ingester_process_note(ctx, note, note_size,
-						       ingester,
-						       scratch,
-						       ingester->scratch_size,
-						       ev->relay, keys, nkeys,
-						       pns_keys, npns_keys,
-						       sns_keys, nsns_keys)) {
-				ndb_debug("failed to process note\n");
-				goto cleanup;
-			} else {
-				goto success;
-			}
-		}
-	} else {
-		switch (tce.evtype) {
-		case NDB_TCE_AUTH:   goto cleanup;
-		case NDB_TCE_NOTICE: goto cleanup;
-		case NDB_TCE_EOSE:   goto cleanup;
-		case NDB_TCE_OK:     goto cleanup;
-		case NDB_TCE_EVENT:
-			note = tce.event.note;
-			if (note != buf) {
-				ndb_debug("note buffer not equal to malloc'd buffer\n");
-				goto cleanup;
-			}
+	r->refs = 1;
+	memcpy(r->str, relay, len);
 
-			if (!ndb_ingester_process_note(ctx, note, note_size,
-						       ingester, scratch,
-						       ingester->scratch_size,
-						       ev->relay,
-						       keys, nkeys,
-						       pns_keys, npns_keys,
-						       sns_keys, nsns_keys)) {
-				ndb_debug("failed to process note\n");
-				goto cleanup;
-			} else {
-				goto success;
-			}
-		}
-	}
+	return r->str;
+}
 
+static const char *ndb_relay_ref(const char *relay)
+{
+	struct ndb_relay_str *r;
 
-success:
-	free(ev->json);
-	// we don't free relay or buf since those are passed to the writer thread
-	return 1;
+	if (relay == NULL)
+		return NULL;
 
-cleanup:
-	free(ev->json);
-	if (ev->relay)
-		free((void*)ev->relay);
-	free(buf);
+	r = (struct ndb_relay_str *)(relay - offsetof(struct ndb_relay_str, str));
+	__atomic_add_fetch(&r->refs, 1, __ATOMIC_RELAXED);
 
-	return ok;
+	return relay;
 }
 
-static uint64_t ndb_get_last_key(MDB_txn *txn, MDB_dbi db)
+static void ndb_relay_free(const char *relay)
 {
-	MDB_cursor *mc;
-	MDB_val key, val;
-
-	if (mdb_cursor_open(txn, db, &mc))
-		return 0;
-
-	if (mdb_cursor_get(mc, &key, &val, MDB_LAST)) {
-		mdb_cursor_close(mc);
-		return 0;
-	}
+	struct ndb_relay_str *r;
 
-	mdb_cursor_close(mc);
+	if (relay == NULL)
+		return;
 
-	assert(key.mv_size == 8);
-        return *((uint64_t*)key.mv_data);
+	r = (struct ndb_relay_str *)(relay - offsetof(struct ndb_relay_str, str));
+	if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(r);
 }
 
-//
-// make a search key meant for user queries without any other note info
-static void ndb_make_search_key_low(struct ndb_search_key *key, const char *search)
+struct ndb_writer_note {
+	struct ndb_note *note;
+	struct ndb_note_slab *slab; // where note lives, NULL if malloc'd
+	size_t note_len;
+	const char *relay;
+	uint64_t overwrite_note_id;
+	int relay_only; // unverified copy, only its relay is recorded
+};
+
+static void ndb_writer_note_init(struct ndb_writer_note *writer_note,
+				 struct ndb_note *note, size_t note_len,
+				 const char *relay, uint64_t overwrite_note_id)
 {
-	memset(key->id, 0, sizeof(key->id));
-	key->timestamp = 0;
-	lowercase_strncpy(key->search, search, sizeof(key->search) - 1);
-	key->search[sizeof(key->search) - 1] = '\0';
+	writer_note->note = note;
+	writer_note->slab = NULL;
+	writer_note->note_len = note_len;
+	writer_note->relay = relay;
+	writer_note->overwrite_note_id = overwrite_note_id;
+	writer_note->relay_only = 0;
 }
 
-int ndb_search_profile(struct ndb_txn *txn, struct ndb_search *search, const char *query)
-{
-	int rc;
-	struct ndb_search_key s;
-	MDB_val k, v;
-	search->cursor = NULL;
+struct ndb_writer_profile {
+	struct ndb_writer_note note;
+	struct ndb_profile_record_builder record;
+};
 
-	MDB_cursor **cursor = (MDB_cursor **)&search->cursor;
+struct ndb_ingester_msg {
+	enum ndb_ingester_msgtype type;
+	union {
+		struct ndb_ingester_event event;
+		struct ndb_ingester_add_key add_key;
+		struct ndb_ingester_add_team_root add_team_root;
+		struct ndb_ingester_process_giftwrap process_giftwrap;
+		struct ndb_ingester_process_pns process_pns;
+		struct ndb_ingester_process_sns process_sns;
+		struct ndb_ingester_import import;
+	};
+};
 
-	ndb_make_search_key_low(&s, query);
+struct ndb_writer_ndb_meta {
+	// these are 64 bit because I'm paranoid of db-wide alignment issues
+	uint64_t version;
+};
 
-	k.mv_data = &s;
-	k.mv_size = sizeof(s);
+struct ndb_writer_note_meta {
+	unsigned char note_id[32];
+	struct ndb_note_meta *metadata;
+};
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn,
-				  txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH],
-				  cursor))) {
-		printf("search_profile: cursor opened failed: %s\n",
-				mdb_strerror(rc));
-		return 0;
-	}
+// Used in the writer thread when writing ndb_profile_fetch_record's
+//   kv = pubkey: recor
+struct ndb_writer_last_fetch {
+	unsigned char pubkey[32];
+	uint64_t fetched_at;
+};
 
-	// Position cursor at the next key greater than or equal to the specified key
-	if (mdb_cursor_get(search->cursor, &k, &v, MDB_SET_RANGE)) {
-		printf("search_profile: cursor get failed\n");
-		goto cleanup;
-	} else {
-		search->key = k.mv_data;
-		assert(v.mv_size == 8);
-		search->profile_key = *((uint64_t*)v.mv_data);
-		return 1;
-	}
+// write note blocks
+struct ndb_writer_blocks {
+	struct ndb_blocks *blocks;
+	uint64_t note_key;
+};
 
-cleanup:
-	mdb_cursor_close(search->cursor);
-	search->cursor = NULL;
-	return 0;
-}
+// The different types of messages that the writer thread can write to the
+// database
+struct ndb_writer_msg {
+	enum ndb_writer_msgtype type;
+	union {
+		struct ndb_writer_note_relay note_relay;
+		struct ndb_writer_note note;
+		struct ndb_writer_profile profile;
+		struct ndb_writer_ndb_meta ndb_meta;
+		struct ndb_writer_last_fetch last_fetch;
+		struct ndb_writer_blocks blocks;
+		struct ndb_writer_note_meta note_meta;
+	};
+};
 
-void ndb_search_profile_end(struct ndb_search *search)
+static inline int ndb_writer_queue_msg(struct prot_queue *writer_inbox,
+				       struct ndb_writer_msg *msg)
 {
-	if (search->cursor)
-		mdb_cursor_close(search->cursor);
+	return prot_queue_push(writer_inbox, msg);
 }
 
-int ndb_search_profile_next(struct ndb_search *search)
+static uint64_t ndb_write_note_and_profile(
+	secp256k1_context *secp, struct ndb_txn *txn,
+	struct ndb_writer_profile *profile,
+	unsigned char *scratch, size_t scratch_size, uint32_t ndb_flags,
+	struct prot_queue *writer_inbox);
+
+static int ndb_migrate_utf8_profile_names(struct ndb_txn *txn)
 {
 	int rc;
+	MDB_cursor *cur;
 	MDB_val k, v;
-	unsigned char *init_id;
+	void *profile_root;
+	NdbProfileRecord_table_t record;
+	struct ndb_note *note, *copied_note;
+	uint64_t note_key;
+	size_t len;
+	int count, failed, ret;
+	struct ndb_writer_profile profile;
+	secp256k1_context *secp;
 
-	init_id = search->key->id;
-	k.mv_data = search->key;
-	k.mv_size = sizeof(*search->key);
+	secp = secp256k1_context_create(SECP256K1_CONTEXT_NONE);
 
-retry:
-	if ((rc = mdb_cursor_get(search->cursor, &k, &v, MDB_NEXT))) {
-		ndb_debug("ndb_search_profile_next: %s\n",
-				mdb_strerror(rc));
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE], &cur))) {
+		fprintf(stderr, "ndb_migrate_utf8_profile_names: mdb_cursor_open failed, error %d\n", rc);
 		return 0;
-	} else {
-		search->key = k.mv_data;
-		assert(v.mv_size == 8);
-		search->profile_key = *((uint64_t*)v.mv_data);
-
-		// skip duplicate pubkeys
-		if (!memcmp(init_id, search->key->id, 32))
-			goto retry;
 	}
 
-	return 1;
-}
-
-//
-// The relay kind index has a layout like so (so we don't need dupsort)
-//
-// - note_id:        00 + 8 bytes
-// - kind:           08 + 8 bytes
-// - created_at:     16 + 8 bytes
-// - relay_url_size: 24 + 1 byte
-// - relay_url:      25 + n byte null-terminated string
-// - pad to 8 byte alignment
-//
-// The key sort order is:
-//
-// relay_url, kind, created_at
-//
-static int ndb_relay_kind_cmp(const MDB_val *a, const MDB_val *b)
-{
-	int cmp;
-	MDB_val va, vb;
-	uint64_t iva, ivb;
-	unsigned char *ad = (unsigned char *)a->mv_data;
-	unsigned char *bd = (unsigned char *)b->mv_data;
-	assert(((uint64_t)a->mv_data % 8) == 0);
-
-	va.mv_size = *(ad + 24);
-	va.mv_data =   ad + 25;
+	size_t scratch_size = 8 * 1024 * 1024;
+	unsigned char *scratch = malloc(scratch_size);
 
-	vb.mv_size = *(bd + 24);
-	vb.mv_data =   bd + 25;
+	ret = 1;
+	count = 0;
+	failed = 0;
 
-	cmp = mdb_cmp_memn(&va, &vb);
-	if (cmp) return cmp;
+	// loop through all profiles and write search indices
+	while (mdb_cursor_get(cur, &k, &v, MDB_NEXT) == 0) {
+		profile_root = v.mv_data;
+		record = NdbProfileRecord_as_root(profile_root);
+		note_key = NdbProfileRecord_note_key(record);
+		note = ndb_get_note_by_key(txn, note_key, &len);
 
-	// kind
-	iva = *(uint64_t*)(ad + 8);
-	ivb = *(uint64_t*)(bd + 8);
+		if (note == NULL) {
+			failed++;
+			continue;
+		}
 
-	if (iva < ivb)
-		return -1;
-	else if (iva > ivb)
-		return 1;
+		struct ndb_profile_record_builder *b = &profile.record;
 
-	// created_at
-	iva = *(uint64_t*)(ad + 16);
-	ivb = *(uint64_t*)(bd + 16);
+		// reprocess profile
+		if (!ndb_process_profile_note(note, b)) {
+			failed++;
+			continue;
+		}
 
-	if (iva < ivb)
-		return -1;
-	else if (iva > ivb)
-		return 1;
+		// the writer needs to own this note, and its expected to free it
+		copied_note = malloc(len);
+		memcpy(copied_note, note, len);
 
-	// note_id (so we don't need dupsort logic)
-	iva = *(uint64_t*)ad;
-	ivb = *(uint64_t*)bd;
+		ndb_writer_note_init(&profile.note, copied_note, len, NULL, 0);
 
-	if (iva < ivb)
-		return -1;
-	else if (iva > ivb)
-		return 1;
+		// we don't pass in flags when migrating... a bit sketchy but
+		// whatever. noone is using this to customize nostrdb atm
+		if (ndb_write_note_and_profile(secp, txn, &profile,
+					       scratch, scratch_size,
+					       0, NULL)) {
+			count++;
+		}
+	}
 
-	return 0;
-}
+	fprintf(stderr, "migrated %d profiles to fix utf8 profile names\n", count);
 
-static int ndb_search_key_cmp(const MDB_val *a, const MDB_val *b)
-{
-	int cmp;
-	struct ndb_search_key *ska, *skb;
+	if (failed != 0) {
+		fprintf(stderr, "failed to migrate %d profiles to fix utf8 profile names\n", failed);
+	}
 
-	ska = a->mv_data;
-	skb = b->mv_data;
+	secp256k1_context_destroy(secp);
+	free(scratch);
+	mdb_cursor_close(cur);
 
-	MDB_val a2 = *a;
-	MDB_val b2 = *b;
+	return ret;
+}
 
-	a2.mv_data = ska->search;
-	a2.mv_size = sizeof(ska->search) + sizeof(ska->id);
+// migrations run in this order, a db's version is how many have run
+enum ndb_migration_id {
+	NDB_MIGRATION_USER_SEARCH,
+	NDB_MIGRATION_LOWER_USER_SEARCH,
+	NDB_MIGRATION_UTF8_PROFILE_NAMES,
+	NDB_MIGRATION_PROFILE_INDICES,
+	NDB_MIGRATION_METADATA,
+	NDB_MIGRATION_CREATED_INDEX,
+};
 
-	cmp = mdb_cmp_memn(&a2, &b2);
-	if (cmp) return cmp;
+static struct ndb_migration MIGRATIONS[] = {
+	[NDB_MIGRATION_USER_SEARCH] = { .fn = ndb_migrate_user_search_indices },
+	[NDB_MIGRATION_LOWER_USER_SEARCH] = { .fn = ndb_migrate_lower_user_search_indices },
+	[NDB_MIGRATION_UTF8_PROFILE_NAMES] = { .fn = ndb_migrate_utf8_profile_names },
+	[NDB_MIGRATION_PROFILE_INDICES] = { .fn = ndb_migrate_profile_indices },
+	[NDB_MIGRATION_METADATA] = { .fn = ndb_migrate_metadata },
+	[NDB_MIGRATION_CREATED_INDEX] = { .fn = ndb_migrate_created_index },
+};
 
-	if (ska->timestamp < skb->timestamp)
-		return -1;
-	else if (ska->timestamp > skb->timestamp)
-		return 1;
+// the db version at which every note is in the created_at index, which
+// later migrations don't move
+#define NDB_CREATED_INDEX_VERSION (NDB_MIGRATION_CREATED_INDEX + 1)
 
-	return 0;
+int ndb_end_query(struct ndb_txn *txn)
+{
+	// this works on read or write queries.
+	return mdb_txn_commit(txn->mdb_txn) == 0;
 }
 
-static int ndb_write_profile_pk_index(struct ndb_txn *txn, struct ndb_note *note, uint64_t profile_key)
-
+int ndb_note_verify(void *ctx, unsigned char *scratch, size_t scratch_size,
+		    struct ndb_note *note)
 {
-	MDB_val key, val;
-	int rc;
-	struct ndb_tsid tsid;
-	MDB_dbi pk_db;
-
-	pk_db = txn->lmdb->dbs[NDB_DB_PROFILE_PK];
-
-	// write profile_pk + created_at index
-	ndb_tsid_init(&tsid, note->pubkey, note->created_at);
+	unsigned char id[32];
+	secp256k1_xonly_pubkey xonly_pubkey;
+	int ok;
 
-	key.mv_data = &tsid;
-	key.mv_size = sizeof(tsid);
-	val.mv_data = &profile_key;
-	val.mv_size = sizeof(profile_key);
+	// first, we ensure the id is valid by calculating the id independently
+	// from what is given to us
+	if (!ndb_calculate_id(note, scratch, scratch_size, id)) {
+		ndb_debug("ndb_note_verify: scratch buffer size too small\n");
+		return 0;
+	}
 
-	if ((rc = mdb_put(txn->mdb_txn, pk_db, &key, &val, 0))) {
-		ndb_debug("write profile_pk(%" PRIu64 ") to db failed: %s\n",
-				profile_key, mdb_strerror(rc));
+	if (memcmp(id, note->id, 32)) {
+		ndb_debug("ndb_note_verify: note id does not match!\n");
 		return 0;
 	}
 
+        // id is ok, let's check signature
+	ok = secp256k1_xonly_pubkey_parse((secp256k1_context*)ctx,
+					  &xonly_pubkey,
+					  ndb_note_pubkey(note)) != 0;
+	if (!ok) return 0;
+
+	ok = secp256k1_schnorrsig_verify((secp256k1_context*)ctx,
+					 ndb_note_sig(note), id, 32,
+					 &xonly_pubkey) > 0;
+	if (!ok) return 0;
+
 	return 1;
 }
 
-static int ndb_write_profile(struct ndb_txn *txn,
-			     struct ndb_writer_profile *profile,
-			     uint64_t note_key)
+static void ndb_writer_last_profile_fetch(struct ndb_txn *txn,
+					  const unsigned char *pubkey,
+					  uint64_t fetched_at)
 {
-	uint64_t profile_key;
-	struct ndb_note *note;
-	void *flatbuf;
-	size_t flatbuf_len;
 	int rc;
-
 	MDB_val key, val;
-	MDB_dbi profile_db;
 
-	note = profile->note.note;
+	key.mv_data = (unsigned char*)pubkey;
+	key.mv_size = 32;
+	val.mv_data = &fetched_at;
+	val.mv_size = sizeof(fetched_at);
 
-	// add note_key to profile record
-	NdbProfileRecord_note_key_add(profile->record.builder, note_key);
-	NdbProfileRecord_end_as_root(profile->record.builder);
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_LAST_FETCH],
+			  &key, &val, 0)))
+	{
+		ndb_debug("write version to ndb_meta failed: %s\n",
+				mdb_strerror(rc));
+		return;
+	}
 
-	flatbuf = profile->record.flatbuf =
-		flatcc_builder_finalize_aligned_buffer(profile->record.builder, &flatbuf_len);
+	//fprintf(stderr, "writing version %" PRIu64 "\n", version);
+}
 
-	assert(((uint64_t)flatbuf % 8) == 0);
 
-	// TODO: this may not be safe!?
-	flatbuf_len = (flatbuf_len + 7) & ~7;
+// We just received a profile that we haven't processed yet, but it could
+// be an older one! Make sure we only write last fetched profile if it's a new
+// one
+//
+// To do this, we first check the latest profile in the database. If the
+// created_date for this profile note is newer, then we write a
+// last_profile_fetch record, otherwise we do not.
+//
+// WARNING: This function is only valid when called from the writer thread
+static int ndb_maybe_write_last_profile_fetch(struct ndb_txn *txn,
+					       struct ndb_note *note)
+{
+	size_t len;
+	uint64_t profile_key, note_key;
+	void *root;
+	struct ndb_note *last_profile;
+	NdbProfileRecord_table_t record;
 
-	//assert(NdbProfileRecord_verify_as_root(flatbuf, flatbuf_len) == 0);
+	if ((root = ndb_get_profile_by_pubkey(txn, note->pubkey, &len, &profile_key))) {
+		record = NdbProfileRecord_as_root(root);
+		note_key = NdbProfileRecord_note_key(record);
+		last_profile = ndb_get_note_by_key(txn, note_key, &len);
+		if (last_profile == NULL) {
+			return 0;
+		}
 
-	// get dbs
-	profile_db = txn->lmdb->dbs[NDB_DB_PROFILE];
+		// found profile, let's see if it's newer than ours
+		if (note->created_at > last_profile->created_at) {
+			// this is a new profile note, record last fetched time
+			ndb_writer_last_profile_fetch(txn, note->pubkey, time(NULL));
+		}
+	} else {
+		// couldn't fetch profile. record last fetched time
+		ndb_writer_last_profile_fetch(txn, note->pubkey, time(NULL));
+	}
 
-	// get new key
-	profile_key = ndb_get_last_key(txn->mdb_txn, profile_db) + 1;
+	return 1;
+}
 
-	// write profile to profile store
-	key.mv_data = &profile_key;
-	key.mv_size = sizeof(profile_key);
-	val.mv_data = flatbuf;
-	val.mv_size = flatbuf_len;
+int ndb_write_last_profile_fetch(struct ndb *ndb, const unsigned char *pubkey,
+				 uint64_t fetched_at)
+{
+	struct ndb_writer_msg msg;
+	msg.type = NDB_WRITER_PROFILE_LAST_FETCH;
+	memcpy(&msg.last_fetch.pubkey[0], pubkey, 32);
+	msg.last_fetch.fetched_at = fetched_at;
 
-	if ((rc = mdb_put(txn->mdb_txn, profile_db, &key, &val, 0))) {
-		ndb_debug("write profile to db failed: %s\n", mdb_strerror(rc));
-		return 0;
-	}
+	return ndb_writer_queue_msg(&ndb->writer.inbox, &msg);
+}
 
-	// write last fetched record
-	if (!ndb_maybe_write_last_profile_fetch(txn, note)) {
-		ndb_debug("failed to write last profile fetched record\n");
-	}
 
-	// write profile pubkey index
-	if (!ndb_write_profile_pk_index(txn, note, profile_key)) {
-		ndb_debug("failed to write profile pubkey index\n");
-		return 0;
-	}
+// When doing cursor scans from greatest to lowest, this function positions the
+// cursor at the first element before descending. MDB_SET_RANGE puts us right
+// after the first element, so we have to go back one.
+int ndb_cursor_start(MDB_cursor *cur, MDB_val *k, MDB_val *v)
+{
+	int rc;
+	// Position cursor at the next key greater than or equal to the
+	// specified key
 
-	// write name, display_name profile search indices
-	if (!ndb_write_profile_search_indices(txn, note, profile_key,
-					      flatbuf)) {
-		ndb_debug("failed to write profile search indices\n");
-		return 0;
+	if ((rc = mdb_cursor_get(cur, k, v, MDB_SET_RANGE))) {
+		ndb_debug("MDB_SET_RANGE failed: '%s'\n", mdb_strerror(rc));
+		// Failed :(. It could be the last element?
+		if ((rc = mdb_cursor_get(cur, k, v, MDB_LAST))) {
+			ndb_debug("MDB_LAST failed: '%s'\n", mdb_strerror(rc));
+			return 0;
+		}
+	} else {
+		// if set range worked and our key exists, it should be
+		// the one right before this one
+		if ((rc = mdb_cursor_get(cur, k, v, MDB_PREV))) {
+			ndb_debug("moving back failed: '%s'\n", mdb_strerror(rc));
+			return 0;
+		}
 	}
 
 	return 1;
 }
 
-int ndb_set_note_meta(struct ndb *ndb, const unsigned char *id, struct ndb_note_meta *meta)
-{
-	struct ndb_writer_msg msg;
-	struct ndb_writer_note_meta *meta_msg = &msg.note_meta;
-
-	msg.type = NDB_WRITER_NOTE_META;
-
-	memcpy(meta_msg->note_id, id, 32);
-	meta_msg->metadata = meta;
-
-	return ndb_writer_queue_msg(&ndb->writer.inbox, &msg);
-}
 
-int ndb_writer_set_note_meta(struct ndb_txn *txn, const unsigned char *id, struct ndb_note_meta *meta)
+// get some value based on a clustered id key
+int ndb_get_tsid(struct ndb_txn *txn, enum ndb_dbs db, const unsigned char *id,
+		 MDB_val *val)
 {
-	int rc;
 	MDB_val k, v;
-	MDB_dbi note_meta_db;
-
-	// get dbs
-	note_meta_db = txn->lmdb->dbs[NDB_DB_META];
+	MDB_cursor *cur;
+	int success = 0, rc;
+	struct ndb_tsid tsid;
 
-	k.mv_data = (unsigned char *)id;
-	k.mv_size = 32;
+	// position at the most recent
+	ndb_tsid_high(&tsid, id);
 
-	v.mv_data = (unsigned char *)meta;
-	v.mv_size = ndb_note_meta_total_size(meta);
+	k.mv_data = &tsid;
+	k.mv_size = sizeof(tsid);
 
-	if ((rc = mdb_put(txn->mdb_txn, note_meta_db, &k, &v, 0))) {
-		ndb_debug("ndb_set_note_meta: write note metadata to db failed: %s\n", mdb_strerror(rc));
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[db], &cur))) {
+		ndb_debug("ndb_get_tsid: failed to open cursor: '%s'\n", mdb_strerror(rc));
 		return 0;
 	}
 
-	return 1;
+	if (!ndb_cursor_start(cur, &k, &v))
+		goto cleanup;
+
+	if (memcmp(k.mv_data, id, 32) == 0) {
+		*val = v;
+		success = 1;
+	}
+
+cleanup:
+	mdb_cursor_close(cur);
+	return success;
 }
 
-struct ndb_note_meta *ndb_get_note_meta(struct ndb_txn *txn, const unsigned char *id)
+static void *ndb_lookup_by_key(struct ndb_txn *txn, uint64_t key,
+			       enum ndb_dbs store, size_t *len)
 {
 	MDB_val k, v;
 
-	k.mv_data = (unsigned char*)id;
-	k.mv_size = 32;
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
 
-	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &k, &v)) {
-		//ndb_debug("ndb_get_note_meta: mdb_get note failed\n");
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[store], &k, &v)) {
+		ndb_debug("ndb_lookup_by_key: mdb_get note failed\n");
 		return NULL;
 	}
 
+	if (len)
+		*len = v.mv_size;
+
 	return v.mv_data;
 }
 
-/* write reaction stats if its a valid reaction */
-static int ndb_process_reaction(
-		struct ndb_txn *txn,
-		struct ndb_note *note,
-		unsigned char **liked,
-		unsigned char *scratch,
-		size_t scratch_size)
+static void *ndb_lookup_tsid(struct ndb_txn *txn, enum ndb_dbs ind,
+			     enum ndb_dbs store, const unsigned char *pk,
+			     size_t *len, uint64_t *primkey)
 {
-	const char *content;
-	int rc;
-	uint32_t *count;
-	MDB_val key, val;
-	union ndb_reaction_str reaction_str;
-	struct ndb_note_meta *meta;
-	struct ndb_note_meta_entry *entry;
-	enum ndb_meta_clone_result cres;
-	char strbuf[128];
-
-	*liked = ndb_note_last_id_tag(note, 'e');
+	MDB_val k, v;
+	void *res = NULL;
+	if (len)
+		*len = 0;
 
-	if (*liked == NULL)
+	if (!ndb_get_tsid(txn, ind, pk, &k)) {
+		//ndb_debug("ndb_get_profile_by_pubkey: ndb_get_tsid failed\n");
 		return 0;
-
-	meta = ndb_get_note_meta(txn, *liked);
-
-	/* initial builder setup, build reaction string from reaction contents */
-	content = ndb_note_content(note);
-	if (!ndb_reaction_set(&reaction_str, content)) {
-		ndb_debug("reaction string '%s' was too big\n", content);
-		/* string was too big, let's just record a `+` for now */
-		rc = ndb_reaction_set(&reaction_str, "+");
-		assert(rc);
 	}
 
-	cres = ndb_note_meta_clone_with_entry(&meta,
-			&entry,
-			NDB_NOTE_META_REACTION,
-			&reaction_str.binmoji,
-			scratch,
-			scratch_size);
+	if (primkey)
+		*primkey = *(uint64_t*)k.mv_data;
 
-	switch (cres) {
-	case NDB_META_CLONE_FAILED:
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[store], &k, &v)) {
+		ndb_debug("ndb_get_profile_by_pubkey: mdb_get note failed\n");
 		return 0;
-	case NDB_META_CLONE_NEW_ENTRY:
-		ndb_reaction_to_str(&reaction_str, strbuf);
-		/* printf("initializing reaction stats for %s\n", strbuf); */
-		ndb_note_meta_reaction_set(entry, 1, reaction_str);
-		break;
-	case NDB_META_CLONE_EXISTING_ENTRY:
-		count = ndb_note_meta_reaction_count(entry);
-		/* printf("increasing count from %d to %d\n", (int)*count, (int)*count+1); */
-		(*count)++;
-		break;
 	}
 
-	key.mv_data = *liked;
-	key.mv_size = 32;
-
-	val.mv_data = meta;
-	val.mv_size = ndb_note_meta_total_size(meta);
-	assert((val.mv_size % 8) == 0);
-
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &key, &val, 0))) {
-		ndb_debug("write reaction stats to db failed: %s\n", mdb_strerror(rc));
-		return 0;
-	}
+	res = v.mv_data;
+	assert(((uint64_t)res % 4) == 0);
+	if (len)
+		*len = v.mv_size;
+	return res;
+}
 
-	return 1;
+void *ndb_get_profile_by_pubkey(struct ndb_txn *txn, const unsigned char *pk, size_t *len, uint64_t *key)
+{
+	return ndb_lookup_tsid(txn, NDB_DB_PROFILE_PK, NDB_DB_PROFILE, pk, len, key);
 }
 
-static int ndb_increment_total_reactions(
-		struct ndb_txn *txn,
-		unsigned char *liked,
-		unsigned char *scratch,
-		size_t scratch_size)
+struct ndb_note *ndb_get_note_by_id(struct ndb_txn *txn, const unsigned char *id, size_t *len, uint64_t *key)
 {
-	MDB_val key, val;
-	uint32_t *total_reactions;
-	struct ndb_note_meta *meta;
-	struct ndb_note_meta_entry *entry;
-	int rc;
+	return ndb_lookup_tsid(txn, NDB_DB_NOTE_ID, NDB_DB_NOTE, id, len, key);
+}
 
-	meta = ndb_get_note_meta(txn, liked);
-	rc = ndb_note_meta_clone_with_entry(&meta, &entry,
-		NDB_NOTE_META_COUNTS,
-		NULL, /* payload to match. only relevant for reactions */
-		scratch,
-		scratch_size);
+static inline uint64_t ndb_get_indexkey_by_id(struct ndb_txn *txn,
+					      enum ndb_dbs db,
+					      const unsigned char *id)
+{
+	MDB_val k;
 
-	switch (rc) {
-	case NDB_META_CLONE_FAILED:
+	if (!ndb_get_tsid(txn, db, id, &k))
 		return 0;
-	case NDB_META_CLONE_NEW_ENTRY:
-		ndb_note_meta_counts_set(entry, 1, 0, 0, 0, 0);
-		break;
-	case NDB_META_CLONE_EXISTING_ENTRY:
-		total_reactions = ndb_note_meta_counts_total_reactions(entry);
-		(*total_reactions)++;
-		break;
-	}
 
-	key.mv_data = liked;
-	key.mv_size = 32;
+	return *(uint32_t*)k.mv_data;
+}
 
-	val.mv_data = meta;
-	val.mv_size = ndb_note_meta_total_size(meta);
-	assert((val.mv_size % 8) == 0);
+uint64_t ndb_get_notekey_by_id(struct ndb_txn *txn, const unsigned char *id)
+{
+	return ndb_get_indexkey_by_id(txn, NDB_DB_NOTE_ID, id);
+}
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &key, &val, 0))) {
-		ndb_debug("write reaction stats to db failed: %s\n", mdb_strerror(rc));
-		return 0;
-	}
+uint64_t ndb_get_profilekey_by_pubkey(struct ndb_txn *txn, const unsigned char *id)
+{
+	return ndb_get_indexkey_by_id(txn, NDB_DB_PROFILE_PK, id);
+}
 
-	return 1;
+struct ndb_note *ndb_get_note_by_key(struct ndb_txn *txn, uint64_t key, size_t *len)
+{
+	return ndb_lookup_by_key(txn, key, NDB_DB_NOTE, len);
 }
 
+void *ndb_get_profile_by_key(struct ndb_txn *txn, uint64_t key, size_t *len)
+{
+	return ndb_lookup_by_key(txn, key, NDB_DB_PROFILE, len);
+}
 
-// When receiving a reaction note, look for the liked id and increase the
-// reaction counter in the note metadata database
-static int ndb_write_reaction_stats(struct ndb_txn *txn, struct ndb_note *note,
-				    unsigned char *scratch,
-				    size_t scratch_size)
+uint64_t
+ndb_read_last_profile_fetch(struct ndb_txn *txn, const unsigned char *pubkey)
 {
-	unsigned char *liked;
-	/* we short circuit here since we only want to increment total reaction count
-	 * if its a valid reaction */
-	return ndb_process_reaction(txn, note, &liked, scratch, scratch_size) &&
-	       ndb_increment_total_reactions(txn, liked, scratch, scratch_size);
+	MDB_val k, v;
+
+	k.mv_data = (unsigned char*)pubkey;
+	k.mv_size = 32;
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_PROFILE_LAST_FETCH], &k, &v)) {
+		//ndb_debug("ndb_read_last_profile_fetch: mdb_get note failed\n");
+		return 0;
+	}
+
+	return *((uint64_t*)v.mv_data);
 }
 
-static struct ndb_str ndb_note_find_tag_str(struct ndb_note *note,
-					    const char *tag_name);
 
-// Parse bolt11 tag from a kind-9735 zap receipt and extract msats.
-// Returns 1 on success, 0 on failure. Sets *msats to 0 if amount unspecified.
-static int ndb_parse_zap_bolt11(struct ndb_note *note, uint64_t *msats)
+static int ndb_has_note(struct ndb_txn *txn, const unsigned char *id)
 {
-	struct ndb_str bolt11_str;
-	struct bolt11 *inv;
-	char *fail;
+	MDB_val val;
 
-	bolt11_str = ndb_note_find_tag_str(note, "bolt11");
-	if (bolt11_str.str == NULL || bolt11_str.flag == NDB_PACKED_ID)
+	if (!ndb_get_tsid(txn, NDB_DB_NOTE_ID, id, &val))
 		return 0;
 
-	inv = bolt11_decode_minimal(NULL, bolt11_str.str, &fail);
-	if (inv == NULL)
+	return 1;
+}
+
+static void ndb_txn_from_mdb(struct ndb_txn *txn, struct ndb_lmdb *lmdb,
+			     MDB_txn *mdb_txn)
+{
+	txn->lmdb = lmdb;
+	txn->mdb_txn = mdb_txn;
+}
+
+static enum ndb_idres ndb_ingester_json_controller(void *data, const char *hexid)
+{
+	unsigned char id[32];
+	struct ndb_ingest_controller *c = data;
+	struct ndb_txn txn;
+
+	hex_decode(hexid, 64, id, sizeof(id));
+
+	// a copy of a note we've already taken. unless it's from a relay we
+	// haven't recorded for it yet, there's nothing left to do
+	if (ndb_seen_ids_has(c->seen, ndb_seen_ids_key(id, NULL))) {
+		c->seen_hit = 1;
+		if (c->relay == NULL ||
+		    ndb_seen_ids_has(c->seen, ndb_seen_ids_key(id, c->relay)))
+			return NDB_IDRES_STOP;
+		return NDB_IDRES_CONT;
+	}
+
+	// let's see if we already have it
+	ndb_txn_from_mdb(&txn, c->lmdb, c->read_txn);
+	c->note = ndb_get_note_by_id(&txn, id, NULL, &c->note_key);
+
+	if (c->note == NULL)
+		return NDB_IDRES_CONT;
+
+	return NDB_IDRES_STOP;
+}
+
+static int ndbprofile_parse_json(flatcc_builder_t *B,
+        const char *buf, size_t bufsiz, int flags, NdbProfile_ref_t *profile)
+{
+	flatcc_json_parser_t parser, *ctx = &parser;
+	flatcc_json_parser_init(ctx, B, buf, buf + bufsiz, flags);
+
+	if (flatcc_builder_start_buffer(B, 0, 0, 0))
 		return 0;
 
-	*msats = (inv->msat != NULL) ? inv->msat->millisatoshis : 0;
-	tal_free(inv);
+	NdbProfile_parse_json_table(ctx, buf, buf + bufsiz, profile);
+	if (ctx->error)
+		return 0;
+
+	if (!flatcc_builder_end_buffer(B, *profile))
+		return 0;
+
+	ctx->end_loc = buf;
+
+
 	return 1;
 }
 
-// When receiving a kind-9735 zap receipt, parse the bolt11 tag and update
-// unverified zap counters on the zapped note's metadata
-static int ndb_write_unverified_zap_stats(struct ndb_txn *txn,
-					  struct ndb_note *note,
-					  unsigned char *scratch,
-					  size_t scratch_size)
+void ndb_profile_record_builder_init(struct ndb_profile_record_builder *b)
 {
-	int rc;
-	uint32_t *count;
-	uint64_t *total;
-	uint64_t msats;
-	MDB_val key, val;
-	unsigned char *zapped_id;
-	struct ndb_note_meta *meta;
-	struct ndb_note_meta_entry *entry;
-	enum ndb_meta_clone_result cres;
+	b->builder = malloc(sizeof(*b->builder));
+	b->flatbuf = NULL;
+}
 
-	zapped_id = ndb_note_last_id_tag(note, 'e');
-	if (zapped_id == NULL)
-		return 0;
+void ndb_profile_record_builder_free(struct ndb_profile_record_builder *b)
+{
+	if (b->flatbuf)
+		flatcc_builder_aligned_free(b->flatbuf);
+	if (b->builder) {
+		flatcc_builder_clear(b->builder);
+		free(b->builder);
+	}
 
-	if (!ndb_parse_zap_bolt11(note, &msats))
+	b->builder = NULL;
+	b->flatbuf = NULL;
+
+}
+
+int ndb_process_profile_note(struct ndb_note *note,
+			     struct ndb_profile_record_builder *profile)
+{
+	int res;
+
+	NdbProfile_ref_t profile_table;
+	flatcc_builder_t *builder;
+
+	ndb_profile_record_builder_init(profile);
+	builder = profile->builder;
+	flatcc_builder_init(builder);
+
+	NdbProfileRecord_start_as_root(builder);
+
+	//printf("parsing profile '%.*s'\n", note->content_length, ndb_note_content(note));
+	if (!(res = ndbprofile_parse_json(builder, ndb_note_content(note),
+					  note->content_length,
+					  flatcc_json_parser_f_skip_unknown,
+					  &profile_table)))
+	{
+		ndb_debug("profile_parse_json failed %d '%.*s'\n", res,
+			  note->content_length, ndb_note_content(note));
+		ndb_profile_record_builder_free(profile);
 		return 0;
+	}
 
-	meta = ndb_get_note_meta(txn, zapped_id);
+	uint64_t received_at = time(NULL);
+	const char *lnurl = "fixme";
 
-	cres = ndb_note_meta_clone_with_entry(&meta, &entry,
-		NDB_NOTE_META_ZAP_UNVERIFIED, NULL, scratch, scratch_size);
+	NdbProfileRecord_profile_add(builder, profile_table);
+	NdbProfileRecord_received_at_add(builder, received_at);
 
-	switch (cres) {
-	case NDB_META_CLONE_FAILED:
+	flatcc_builder_ref_t lnurl_off;
+	lnurl_off = flatcc_builder_create_string_str(builder, lnurl);
+
+	NdbProfileRecord_lnurl_add(builder, lnurl_off);
+
+	//*profile = flatcc_builder_finalize_aligned_buffer(builder, profile_len);
+	return 1;
+}
+
+static int ndb_ingester_queue_event(struct ndb_ingester *ingester,
+				    char *json, unsigned len,
+				    unsigned client, const char *relay,
+				    ndb_release_fn release, void *release_ctx)
+{
+	struct ndb_ingester_msg msg;
+	msg.type = NDB_INGEST_EVENT;
+
+	msg.event.json = json;
+	msg.event.len = len;
+	msg.event.client = client;
+	msg.event.wait = 0;
+	msg.event.relay = relay;
+	msg.event.release = release;
+	msg.event.release_ctx = release_ctx;
+
+	return threadpool_dispatch(&ingester->tp, &msg);
+}
+
+int ndb_add_key(struct ndb *ndb, unsigned char *key)
+{
+	struct ndb_ingester_msg msg;
+	msg.type = NDB_INGEST_ADD_KEY;
+
+	memcpy(msg.add_key.key, key, 32);
+
+	/* add the key to all ingester threads */
+	return threadpool_dispatch_all_threads(&ndb->ingester.tp, &msg);
+}
+
+int ndb_add_team_root(struct ndb *ndb, unsigned char *team_root)
+{
+	struct ndb_ingester_msg msg;
+	msg.type = NDB_INGEST_ADD_TEAM_ROOT;
+
+	memcpy(msg.add_team_root.root, team_root, 32);
+
+	/* register the team_root on all ingester threads */
+	return threadpool_dispatch_all_threads(&ndb->ingester.tp, &msg);
+}
+
+void ndb_ingest_meta_init(struct ndb_ingest_meta *meta, unsigned client, const char *relay)
+{
+	meta->client = client;
+	meta->relay = relay;
+}
+
+static int ndb_ingest_event(struct ndb_ingester *ingester, const char *json,
+			    int len, struct ndb_ingest_meta *meta)
+{
+	const char *relay = meta->relay;
+
+	// Without this, we get bus errors in the json parser inside when
+	// trying to ingest empty kind 6 reposts... we should probably do fuzz
+	// testing on inputs to the json parser
+	if (len == 0)
 		return 0;
-	case NDB_META_CLONE_NEW_ENTRY:
-		ndb_note_meta_zap_unverified_set(entry, 1, msats);
-		break;
-	case NDB_META_CLONE_EXISTING_ENTRY:
-		count = ndb_note_meta_zap_unverified_count(entry);
-		total = ndb_note_meta_zap_unverified_msats(entry);
-		(*count)++;
-		*total += msats;
-		break;
+
+	// Since we need to return as soon as possible, and we're not
+	// making any assumptions about the lifetime of the string, we
+	// definitely need to copy the json here. Callers that own their
+	// buffers (websocket frames) can skip this with
+	// ndb_process_event_owned.
+	char *json_copy = strdupn(json, len);
+	if (json_copy == NULL)
+		return 0;
+
+	if (relay != NULL) {
+		relay = ndb_relay_dup(meta->relay);
+		if (relay == NULL)
+			return 0;
 	}
 
-	key.mv_data = zapped_id;
-	key.mv_size = 32;
+	return ndb_ingester_queue_event(ingester, json_copy, len, meta->client,
+					relay, NULL, NULL);
+}
 
-	val.mv_data = meta;
-	val.mv_size = ndb_note_meta_total_size(meta);
-	assert((val.mv_size % 8) == 0);
+// Like ndb_ingest_event, but the json stays in the caller's buffer until an
+// ingester is done parsing it. The relay is still copied since it lives on
+// in the writer.
+static int ndb_ingest_event_owned(struct ndb_ingester *ingester,
+				  const char *json, int len,
+				  struct ndb_ingest_meta *meta,
+				  ndb_release_fn release, void *release_ctx)
+{
+	const char *relay = meta->relay;
 
-	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &key, &val, 0))) {
-		ndb_debug("write unverified zap stats to db failed: %s\n", mdb_strerror(rc));
+	// a NULL release means the ingester owns (and frees) the json, which
+	// would free the caller's buffer
+	if (len == 0 || release == NULL)
+		return 0;
+
+	if (relay != NULL) {
+		relay = ndb_relay_dup(meta->relay);
+		if (relay == NULL)
+			return 0;
+	}
+
+	if (!ndb_ingester_queue_event(ingester, (char *)json, len,
+				      meta->client, relay, release,
+				      release_ctx)) {
+		ndb_relay_free(relay);
 		return 0;
 	}
 
 	return 1;
 }
 
-// Find the first tag matching a multi-char name (e.g. "bolt11") and return
-// its value (element at index 1) as an ndb_str
-static struct ndb_str ndb_note_find_tag_str(struct ndb_note *note,
-					    const char *tag_name)
+static void ndb_ingester_event_release(struct ndb_ingester_event *ev)
+{
+	if (ev->release)
+		ev->release(ev->release_ctx, ev->json, ev->len);
+	else
+		free(ev->json);
+}
+
+
+/* Remember a note once it's queued for the writer, so that a copy that sees
+ * it in the set is always queued behind it */
+static void ndb_ingester_seen(struct ndb_ingester *ingester, uint64_t id_key,
+			      uint64_t relay_key)
+{
+	if (id_key)
+		ndb_seen_ids_add(ingester->seen, id_key);
+	if (relay_key)
+		ndb_seen_ids_add(ingester->seen, relay_key);
+}
+
+/* Imports would rather wait for the writer than lose notes. Everyone else
+ * gets told the queue is full right away */
+static int ndb_ingester_push_writer(struct ndb_ingester *ingester,
+				    struct ndb_writer_msg *msg, int wait)
+{
+	if (wait)
+		return prot_queue_push_all_wait(ingester->writer_inbox, msg, 1);
+
+	return prot_queue_push(ingester->writer_inbox, msg);
+}
+
+static enum ndb_ingest_status
+ndb_ingester_process_note(secp256k1_context *secp,
+			  struct ndb_note *note,
+			  size_t note_size,
+			  struct ndb_note_slab *slab,
+			  struct ndb_ingester *ingester,
+			  unsigned char *scratch,
+			  size_t scratch_size,
+			  const char *relay,
+			  struct keypair *keys, int nkeys,
+			  struct pns_key *pns_keys, int npns_keys,
+			  struct sns_key *sns_keys, int nsns_keys,
+			  int wait)
+{
+	enum ndb_ingest_filter_action action;
+	struct ndb_ingest_meta meta;
+	struct ndb_writer_msg msg;
+	uint64_t id_key, relay_key;
+	int is_rumor;
+
+	action = NDB_INGEST_ACCEPT;
+
+	if (ingester->filter)
+		action = ingester->filter(ingester->filter_context, note);
+
+	if (action == NDB_INGEST_REJECT)
+		return NDB_INGEST_STATUS_REJECTED;
+
+	is_rumor = (*ndb_note_flags(note)) & NDB_NOTE_FLAG_RUMOR;
+
+	// some special situations we might want to skip sig validation,
+	// like during large imports
+	if (is_rumor || action == NDB_INGEST_SKIP_VALIDATION ||
+	    (ingester->flags & NDB_FLAG_SKIP_NOTE_VERIFY)) {
+		// if we're skipping validation we don't need to verify
+	} else {
+		// verify! If it's an invalid note we don't need to
+		// bother writing it to the database
+		if (!ndb_note_verify(secp, scratch, scratch_size, note)) {
+			ndb_debug("note verification failed\n");
+			return NDB_INGEST_STATUS_REJECTED;
+		}
+	}
+
+	// we didn't find anything. let's send it
+	// to the writer thread
+	if (slab)
+		note = ndb_note_slab_commit(slab, note, note_size);
+	else
+		note = realloc(note, note_size);
+	assert(((uint64_t)note % 4) == 0);
+
+	// the writer owns the note and relay once they're queued
+	id_key = ndb_seen_ids_key(note->id, NULL);
+	relay_key = relay ? ndb_seen_ids_key(note->id, relay) : 0;
+
+	if (note->kind == 0) {
+		struct ndb_profile_record_builder *b = &msg.profile.record;
+
+		ndb_process_profile_note(note, b);
+
+		msg.type = NDB_WRITER_PROFILE;
+		ndb_writer_note_init(&msg.profile.note, note, note_size, relay, 0);
+		msg.profile.note.slab = slab;
+
+		if (!ndb_ingester_push_writer(ingester, &msg, wait)) {
+			ndb_profile_record_builder_free(b);
+			goto queue_full;
+		}
+		ndb_ingester_seen(ingester, id_key, relay_key);
+
+		return NDB_INGEST_STATUS_QUEUED;
+	} else if (note->kind == 6) {
+		// process the repost if we have a repost event
+		//ndb_debug("processing kind 6 repost\n");
+		// dup the relay string
+		ndb_ingest_meta_init(&meta, 0, relay);
+		ndb_ingest_event(ingester, ndb_note_content(note),
+					   ndb_note_content_length(note),
+					   &meta);
+	} else if (note->kind == 1059) {
+		ndb_debug("processing giftwrap\n");
+		ndb_process_giftwrap(secp, ingester, note, keys, nkeys, relay,
+				     scratch, scratch_size);
+	} else if (note->kind == 1080) {
+		ndb_debug("processing pns\n");
+		ndb_process_pns_event(ingester, note, pns_keys, npns_keys,
+				      relay, scratch, scratch_size,
+				      keys, nkeys, secp);
+	} else if (note->kind == 1081) {
+		ndb_debug("processing sns\n");
+		ndb_process_sns_event(secp, ingester, note, sns_keys, nsns_keys,
+				      relay, scratch, scratch_size, keys, nkeys);
+	}
+
+	msg.type = NDB_WRITER_NOTE;
+	ndb_writer_note_init(&msg.note, note, note_size, relay, 0);
+	msg.note.slab = slab;
+
+	if (!ndb_ingester_push_writer(ingester, &msg, wait))
+		goto queue_full;
+	ndb_ingester_seen(ingester, id_key, relay_key);
+
+	return NDB_INGEST_STATUS_QUEUED;
+
+queue_full:
+	// the relay is still the caller's
+	ndb_debug("writer queue full, dropping note\n");
+	if (slab)
+		ndb_note_slab_unref(slab, 1);
+	else
+		free(note);
+	return NDB_INGEST_STATUS_DROPPED;
+}
+
+/* A copy of a note that's in flight or in the db, from a relay we haven't
+ * recorded for it yet. It isn't verified, so the writer only takes the relay,
+ * and only if it finds a note with this id. */
+static int ndb_ingester_process_relay_copy(struct ndb_ingester *ingester,
+					    struct ndb_note *note,
+					    size_t note_size,
+					    struct ndb_note_slab *slab,
+					    const char *relay, int wait)
+{
+	struct ndb_writer_msg msg;
+	uint64_t relay_key;
+
+	relay_key = ndb_seen_ids_key(note->id, relay);
+	note = ndb_note_slab_commit(slab, note, note_size);
+
+	msg.type = NDB_WRITER_NOTE;
+	ndb_writer_note_init(&msg.note, note, note_size, relay, 0);
+	msg.note.slab = slab;
+	msg.note.relay_only = 1;
+
+	if (!ndb_ingester_push_writer(ingester, &msg, wait)) {
+		ndb_note_slab_unref(slab, 1);
+		return 0;
+	}
+	ndb_ingester_seen(ingester, 0, relay_key);
+
+	return 1;
+}
+
+int ndb_note_seen_on_relay(struct ndb_txn *txn, uint64_t note_key, const char *relay)
+{
+	MDB_val k, v;
+	MDB_cursor *cur;
+	int rc, len;
+	char relay_buf[256];
+
+	if (relay == NULL)
+		return 0;
+
+	len = strlen(relay);
+
+	if (!(len = prepare_relay_buf(relay_buf, sizeof(relay_buf), relay, len)))
+		return 0;
+
+	assert((len % 8) == 0);
+
+	k.mv_data = &note_key;
+	k.mv_size = sizeof(note_key);
+
+	v.mv_data = relay_buf;
+	v.mv_size = len;
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_RELAYS], &cur)) != MDB_SUCCESS)
+		return 0;
+
+	rc = mdb_cursor_get(cur, &k, &v, MDB_GET_BOTH);
+	ndb_debug("seen_on_relay result: %s\n", mdb_strerror(rc));
+	mdb_cursor_close(cur);
+
+	return rc == MDB_SUCCESS;
+}
+
+// process the relay for the note. this is called when we already have the
+// note in the database, but not yet on this relay, so the relay needs to be
+// written to the relay indexes for corresponding note
+static int ndb_process_note_relay(struct ndb_ingester *ingester,
+				  uint64_t note_key, struct ndb_note *note,
+				  const char *relay, int wait)
+{
+	struct ndb_writer_msg msg;
+
+	// tell the writer thread to emit a NOTE_RELAY event
+	msg.type = NDB_WRITER_NOTE_RELAY;
+
+	ndb_debug("pushing NDB_WRITER_NOTE_RELAY with note_key %" PRIu64 "\n", note_key);
+	msg.note_relay.relay = relay;
+	msg.note_relay.note_key = note_key;
+	msg.note_relay.kind = ndb_note_kind(note);
+	msg.note_relay.created_at = ndb_note_created_at(note);
+
+	// the relay stays with the caller if the writer can't take it
+	return ndb_ingester_push_writer(ingester, &msg, wait);
+}
+
+static enum ndb_ingest_status
+ndb_ingester_process_event(secp256k1_context *ctx,
+				      struct ndb_ingester *ingester,
+				      struct ndb_ingester_event *ev,
+				      unsigned char *scratch,
+				      struct keypair *keys, int nkeys,
+				      struct pns_key *pns_keys, int npns_keys,
+				      struct sns_key *sns_keys, int nsns_keys,
+				      struct ndb_note_slab **slab,
+				      MDB_txn *read_txn)
+{
+	struct ndb_tce tce;
+	struct ndb_fce fce;
+	struct ndb_note *note;
+	struct ndb_ingest_controller controller;
+	struct ndb_id_cb cb;
+	void *buf;
+	enum ndb_ingest_status status;
+	size_t bufsize, note_size;
+	uint64_t relay_key;
+	int relay_queued;
+
+	status = NDB_INGEST_STATUS_INVALID;
+
+	// we will use this to check if we already have it in the DB during
+	// ID parsing
+	controller.read_txn = read_txn;
+	controller.lmdb = ingester->lmdb;
+	controller.seen = ingester->seen;
+	controller.relay = ev->relay;
+	controller.seen_hit = 0;
+	cb.fn = ndb_ingester_json_controller;
+	cb.data = &controller;
+
+	// since we're going to be passing this allocated note to a different
+	// thread, we can't use thread-local buffers. parse into the end of our
+	// slab, only the part the note uses is kept
+        bufsize = max(ev->len * 8.0, 4096);
+	buf = ndb_note_slab_reserve(slab, bufsize);
+	if (!buf) {
+		ndb_debug("couldn't malloc buf\n");
+		goto cleanup;
+	}
+
+	note_size =
+		ev->client ?
+		ndb_client_event_from_json(ev->json, ev->len, &fce, buf, bufsize, &cb) :
+		ndb_ws_event_from_json(ev->json, ev->len, &tce, buf, bufsize, &cb);
+
+	// This is a result from our special json parser. It parsed the id
+	// and found that we already have it in the database
+	if ((int)note_size == -42) {
+		status = NDB_INGEST_STATUS_DUPLICATE;
+
+		// a copy of a note we've already taken, with nothing new
+		if (controller.seen_hit)
+			goto cleanup;
+
+		assert(controller.note != NULL);
+		assert(controller.note_key != 0);
+		struct ndb_txn txn;
+		ndb_txn_from_mdb(&txn, ingester->lmdb, read_txn);
+
+		// we still need to process the relays on the note even
+		// if we already have it. the relay only goes in the seen set
+		// once it's recorded or queued
+		relay_key = 0;
+		relay_queued = 0;
+		if (ev->relay) {
+			if (ndb_note_seen_on_relay(&txn, controller.note_key,
+						   ev->relay)) {
+				relay_key = ndb_seen_ids_key(controller.note->id,
+							     ev->relay);
+			} else if (ndb_process_note_relay(ingester,
+							  controller.note_key,
+							  controller.note,
+							  ev->relay, ev->wait)) {
+				relay_key = ndb_seen_ids_key(controller.note->id,
+							     ev->relay);
+				relay_queued = 1;
+			} else {
+				status = NDB_INGEST_STATUS_DROPPED;
+			}
+		}
+
+		// so the next copy doesn't have to look it up
+		ndb_ingester_seen(ingester,
+				  ndb_seen_ids_key(controller.note->id, NULL),
+				  relay_key);
+
+		// the note buf was never taken from the slab, since we
+		// don't pass the note to the writer thread
+		if (relay_queued)
+			goto success;
+
+		// we already have the note and there are no new relays to
+		// process. nothing to write.
+		goto cleanup;
+	} else if (note_size == 0) {
+		ndb_debug("failed to parse '%.*s'\n", ev->len, ev->json);
+		goto cleanup;
+	}
+
+	//ndb_debug("parsed evtype:%d '%.*s'\n", tce.evtype, ev->len, ev->json);
+
+	if (ev->client) {
+		switch (fce.evtype) {
+		case NDB_FCE_EVENT:
+			note = fce.event.note;
+			if (note != buf) {
+				ndb_debug("note buffer not equal to malloc'd buffer\n");
+				goto cleanup;
+			}
+
+			if (controller.seen_hit) {
+				status = NDB_INGEST_STATUS_DUPLICATE;
+				if (!ndb_ingester_process_relay_copy(ingester,
+								     note,
+								     note_size,
+								     *slab,
+								     ev->relay,
+								     ev->wait)) {
+					status = NDB_INGEST_STATUS_DROPPED;
+					goto cleanup;
+				}
+				goto success;
+			}
+
+			status = ndb_ingester_process_note(ctx, note,
+						       note_size, *slab,
+						       ingester, scratch,
+						       ingester->scratch_size,
+						       ev->relay, keys, nkeys,
+						       pns_keys, npns_keys,
+						       sns_keys, nsns_keys,
+						       ev->wait);
+			if (status != NDB_INGEST_STATUS_QUEUED) {
+				ndb_debug("failed to process note\n");
+				goto cleanup;
+			}
+			goto success;
+		}
+	} else {
+		switch (tce.evtype) {
+		case NDB_TCE_AUTH:
+		case NDB_TCE_NOTICE:
+		case NDB_TCE_EOSE:
+		case NDB_TCE_OK:
+			status = NDB_INGEST_STATUS_IGNORED;
+			goto cleanup;
+		case NDB_TCE_EVENT:
+			note = tce.event.note;
+			if (note != buf) {
+				ndb_debug("note buffer not equal to malloc'd buffer\n");
+				goto cleanup;
+			}
+
+			if (controller.seen_hit) {
+				status = NDB_INGEST_STATUS_DUPLICATE;
+				if (!ndb_ingester_process_relay_copy(ingester,
+								     note,
+								     note_size,
+								     *slab,
+								     ev->relay,
+								     ev->wait)) {
+					status = NDB_INGEST_STATUS_DROPPED;
+					goto cleanup;
+				}
+				goto success;
+			}
+
+			status = ndb_ingester_process_note(ctx, note,
+						       note_size, *slab,
+						       ingester, scratch,
+						       ingester->scratch_size,
+						       ev->relay,
+						       keys, nkeys,
+						       pns_keys, npns_keys,
+						       sns_keys, nsns_keys,
+						       ev->wait);
+			if (status != NDB_INGEST_STATUS_QUEUED) {
+				ndb_debug("failed to process note\n");
+				goto cleanup;
+			}
+			goto success;
+		}
+	}
+
+	status = NDB_INGEST_STATUS_IGNORED;
+
+success:
+	ndb_ingester_event_release(ev);
+	// we don't free relay or buf since those are passed to the writer thread
+	return status;
+
+cleanup:
+	ndb_ingester_event_release(ev);
+	ndb_relay_free(ev->relay);
+
+	return status;
+}
+
+static void ndb_import_unref(struct ndb_import *import)
+{
+	if (__atomic_sub_fetch(&import->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		ndb_relay_free(import->relay);
+		prot_event_destroy(&import->done);
+		free(import);
+	}
+}
+
+// the file stays mapped until every range is done
+static void ndb_import_release_line(void *ctx, const char *json, int len)
+{
+}
+
+static void ndb_import_stats_add(struct ndb_import_stats *to,
+				 struct ndb_import_stats *from)
+{
+	__atomic_add_fetch(&to->lines, from->lines, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->queued, from->queued, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->duplicates, from->duplicates, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->ignored, from->ignored, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->invalid, from->invalid, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->rejected, from->rejected, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&to->dropped, from->dropped, __ATOMIC_RELAXED);
+}
+
+/* Parse every line of an import range straight out of the mapped file. If
+ * there's no read txn, or renewing it fails, the rest of the range is counted
+ * as invalid and *read_txn is left NULL for the rest of the batch */
+static void ndb_ingester_import_range(secp256k1_context *ctx,
+				      struct ndb_ingester *ingester,
+				      struct ndb_ingester_import *range,
+				      unsigned char *scratch,
+				      struct keypair *keys, int nkeys,
+				      struct pns_key *pns_keys, int npns_keys,
+				      struct sns_key *sns_keys, int nsns_keys,
+				      struct ndb_note_slab **slab,
+				      MDB_txn **read_txn)
+{
+	struct ndb_import *import = range->import;
+	struct ndb_import_stats stats = {0};
+	struct ndb_ingester_event ev;
+	const char *p, *end, *eol;
+	size_t len;
+	int rc;
+
+	end = range->start + range->len;
+
+	for (p = range->start; p < end; p = eol + 1) {
+		if (!(eol = fast_strchr(p, '\n', end - p)))
+			eol = end;
+
+		len = eol - p;
+		if (len > 0 && p[len - 1] == '\r')
+			len--;
+		if (len == 0)
+			continue;
+
+		if (*read_txn && stats.lines > 0 &&
+		    stats.lines % NDB_IMPORT_TXN_LINES == 0) {
+			mdb_txn_reset(*read_txn);
+			if ((rc = mdb_txn_renew(*read_txn))) {
+				fprintf(stderr, "ndb_import: mdb_txn_renew failed: '%s'\n",
+					mdb_strerror(rc));
+				mdb_txn_abort(*read_txn);
+				*read_txn = NULL;
+			}
+		}
+
+		stats.lines++;
+
+		if (*read_txn == NULL) {
+			__atomic_store_n(&import->failed, 1, __ATOMIC_RELAXED);
+			stats.invalid++;
+			continue;
+		}
+
+		if (len > INT_MAX) {
+			stats.invalid++;
+			continue;
+		}
+
+		ev.json = (char *)p;
+		ev.len = len;
+		ev.client = import->client;
+		ev.wait = 1;
+		ev.relay = ndb_relay_ref(import->relay);
+		ev.release = ndb_import_release_line;
+		ev.release_ctx = NULL;
+
+		switch (ndb_ingester_process_event(ctx, ingester, &ev, scratch,
+						   keys, nkeys,
+						   pns_keys, npns_keys,
+						   sns_keys, nsns_keys,
+						   slab, *read_txn)) {
+		case NDB_INGEST_STATUS_QUEUED:    stats.queued++;     break;
+		case NDB_INGEST_STATUS_DUPLICATE: stats.duplicates++; break;
+		case NDB_INGEST_STATUS_IGNORED:   stats.ignored++;    break;
+		case NDB_INGEST_STATUS_INVALID:   stats.invalid++;    break;
+		case NDB_INGEST_STATUS_REJECTED:  stats.rejected++;   break;
+		case NDB_INGEST_STATUS_DROPPED:   stats.dropped++;    break;
+		}
+	}
+
+	ndb_import_stats_add(&import->stats, &stats);
+
+	if (__atomic_sub_fetch(&import->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		prot_event_wake(&import->done, 1);
+
+	ndb_import_unref(import);
+}
+
+static uint64_t ndb_get_last_key(MDB_txn *txn, MDB_dbi db)
+{
+	MDB_cursor *mc;
+	MDB_val key, val;
+
+	if (mdb_cursor_open(txn, db, &mc))
+		return 0;
+
+	if (mdb_cursor_get(mc, &key, &val, MDB_LAST)) {
+		mdb_cursor_close(mc);
+		return 0;
+	}
+
+	mdb_cursor_close(mc);
+
+	assert(key.mv_size == 8);
+        return *((uint64_t*)key.mv_data);
+}
+
+//
+// make a search key meant for user queries without any other note info
+static void ndb_make_search_key_low(struct ndb_search_key *key, const char *search)
+{
+	memset(key->id, 0, sizeof(key->id));
+	key->timestamp = 0;
+	lowercase_strncpy(key->search, search, sizeof(key->search) - 1);
+	key->search[sizeof(key->search) - 1] = '\0';
+}
+
+int ndb_search_profile(struct ndb_txn *txn, struct ndb_search *search, const char *query)
+{
+	int rc;
+	struct ndb_search_key s;
+	MDB_val k, v;
+	search->cursor = NULL;
+
+	MDB_cursor **cursor = (MDB_cursor **)&search->cursor;
+
+	ndb_make_search_key_low(&s, query);
+
+	k.mv_data = &s;
+	k.mv_size = sizeof(s);
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn,
+				  txn->lmdb->dbs[NDB_DB_PROFILE_SEARCH],
+				  cursor))) {
+		printf("search_profile: cursor opened failed: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	}
+
+	// Position cursor at the next key greater than or equal to the specified key
+	if (mdb_cursor_get(search->cursor, &k, &v, MDB_SET_RANGE)) {
+		printf("search_profile: cursor get failed\n");
+		goto cleanup;
+	} else {
+		search->key = k.mv_data;
+		assert(v.mv_size == 8);
+		search->profile_key = *((uint64_t*)v.mv_data);
+		return 1;
+	}
+
+cleanup:
+	mdb_cursor_close(search->cursor);
+	search->cursor = NULL;
+	return 0;
+}
+
+void ndb_search_profile_end(struct ndb_search *search)
+{
+	if (search->cursor)
+		mdb_cursor_close(search->cursor);
+}
+
+int ndb_search_profile_next(struct ndb_search *search)
+{
+	int rc;
+	MDB_val k, v;
+	unsigned char *init_id;
+
+	init_id = search->key->id;
+	k.mv_data = search->key;
+	k.mv_size = sizeof(*search->key);
+
+retry:
+	if ((rc = mdb_cursor_get(search->cursor, &k, &v, MDB_NEXT))) {
+		ndb_debug("ndb_search_profile_next: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	} else {
+		search->key = k.mv_data;
+		assert(v.mv_size == 8);
+		search->profile_key = *((uint64_t*)v.mv_data);
+
+		// skip duplicate pubkeys
+		if (!memcmp(init_id, search->key->id, 32))
+			goto retry;
+	}
+
+	return 1;
+}
+
+//
+// The relay kind index has a layout like so (so we don't need dupsort)
+//
+// - note_id:        00 + 8 bytes
+// - kind:           08 + 8 bytes
+// - created_at:     16 + 8 bytes
+// - relay_url_size: 24 + 1 byte
+// - relay_url:      25 + n byte null-terminated string
+// - pad to 8 byte alignment
+//
+// The key sort order is:
+//
+// relay_url, kind, created_at
+//
+static int ndb_relay_kind_cmp(const MDB_val *a, const MDB_val *b)
+{
+	int cmp;
+	MDB_val va, vb;
+	uint64_t iva, ivb;
+	unsigned char *ad = (unsigned char *)a->mv_data;
+	unsigned char *bd = (unsigned char *)b->mv_data;
+	assert(((uint64_t)a->mv_data % 8) == 0);
+
+	va.mv_size = *(ad + 24);
+	va.mv_data =   ad + 25;
+
+	vb.mv_size = *(bd + 24);
+	vb.mv_data =   bd + 25;
+
+	cmp = mdb_cmp_memn(&va, &vb);
+	if (cmp) return cmp;
+
+	// kind
+	iva = *(uint64_t*)(ad + 8);
+	ivb = *(uint64_t*)(bd + 8);
+
+	if (iva < ivb)
+		return -1;
+	else if (iva > ivb)
+		return 1;
+
+	// created_at
+	iva = *(uint64_t*)(ad + 16);
+	ivb = *(uint64_t*)(bd + 16);
+
+	if (iva < ivb)
+		return -1;
+	else if (iva > ivb)
+		return 1;
+
+	// note_id (so we don't need dupsort logic)
+	iva = *(uint64_t*)ad;
+	ivb = *(uint64_t*)bd;
+
+	if (iva < ivb)
+		return -1;
+	else if (iva > ivb)
+		return 1;
+
+	return 0;
+}
+
+static int ndb_search_key_cmp(const MDB_val *a, const MDB_val *b)
+{
+	int cmp;
+	struct ndb_search_key *ska, *skb;
+
+	ska = a->mv_data;
+	skb = b->mv_data;
+
+	MDB_val a2 = *a;
+	MDB_val b2 = *b;
+
+	a2.mv_data = ska->search;
+	a2.mv_size = sizeof(ska->search) + sizeof(ska->id);
+
+	cmp = mdb_cmp_memn(&a2, &b2);
+	if (cmp) return cmp;
+
+	if (ska->timestamp < skb->timestamp)
+		return -1;
+	else if (ska->timestamp > skb->timestamp)
+		return 1;
+
+	return 0;
+}
+
+static int ndb_write_profile_pk_index(struct ndb_txn *txn, struct ndb_note *note, uint64_t profile_key)
+
+{
+	MDB_val key, val;
+	int rc;
+	struct ndb_tsid tsid;
+	MDB_dbi pk_db;
+
+	pk_db = txn->lmdb->dbs[NDB_DB_PROFILE_PK];
+
+	// write profile_pk + created_at index
+	ndb_tsid_init(&tsid, note->pubkey, note->created_at);
+
+	key.mv_data = &tsid;
+	key.mv_size = sizeof(tsid);
+	val.mv_data = &profile_key;
+	val.mv_size = sizeof(profile_key);
+
+	if ((rc = mdb_put(txn->mdb_txn, pk_db, &key, &val, 0))) {
+		ndb_debug("write profile_pk(%" PRIu64 ") to db failed: %s\n",
+				profile_key, mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int ndb_write_profile(struct ndb_txn *txn,
+			     struct ndb_writer_profile *profile,
+			     uint64_t note_key)
+{
+	uint64_t profile_key;
+	struct ndb_note *note;
+	void *flatbuf;
+	size_t flatbuf_len;
+	int rc;
+
+	MDB_val key, val;
+	MDB_dbi profile_db;
+
+	note = profile->note.note;
+
+	// add note_key to profile record
+	NdbProfileRecord_note_key_add(profile->record.builder, note_key);
+	NdbProfileRecord_end_as_root(profile->record.builder);
+
+	flatbuf = profile->record.flatbuf =
+		flatcc_builder_finalize_aligned_buffer(profile->record.builder, &flatbuf_len);
+
+	assert(((uint64_t)flatbuf % 8) == 0);
+
+	// TODO: this may not be safe!?
+	flatbuf_len = (flatbuf_len + 7) & ~7;
+
+	//assert(NdbProfileRecord_verify_as_root(flatbuf, flatbuf_len) == 0);
+
+	// get dbs
+	profile_db = txn->lmdb->dbs[NDB_DB_PROFILE];
+
+	// get new key
+	profile_key = ndb_get_last_key(txn->mdb_txn, profile_db) + 1;
+
+	// write profile to profile store
+	key.mv_data = &profile_key;
+	key.mv_size = sizeof(profile_key);
+	val.mv_data = flatbuf;
+	val.mv_size = flatbuf_len;
+
+	if ((rc = mdb_put(txn->mdb_txn, profile_db, &key, &val, 0))) {
+		ndb_debug("write profile to db failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	// write last fetched record
+	if (!ndb_maybe_write_last_profile_fetch(txn, note)) {
+		ndb_debug("failed to write last profile fetched record\n");
+	}
+
+	// write profile pubkey index
+	if (!ndb_write_profile_pk_index(txn, note, profile_key)) {
+		ndb_debug("failed to write profile pubkey index\n");
+		return 0;
+	}
+
+	// write name, display_name profile search indices
+	if (!ndb_write_profile_search_indices(txn, note, profile_key,
+					      flatbuf)) {
+		ndb_debug("failed to write profile search indices\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+int ndb_set_note_meta(struct ndb *ndb, const unsigned char *id, struct ndb_note_meta *meta)
+{
+	struct ndb_writer_msg msg;
+	struct ndb_writer_note_meta *meta_msg = &msg.note_meta;
+
+	msg.type = NDB_WRITER_NOTE_META;
+
+	memcpy(meta_msg->note_id, id, 32);
+	meta_msg->metadata = meta;
+
+	return ndb_writer_queue_msg(&ndb->writer.inbox, &msg);
+}
+
+int ndb_writer_set_note_meta(struct ndb_txn *txn, const unsigned char *id, struct ndb_note_meta *meta)
+{
+	int rc;
+	MDB_val k, v;
+	MDB_dbi note_meta_db;
+
+	// get dbs
+	note_meta_db = txn->lmdb->dbs[NDB_DB_META];
+
+	k.mv_data = (unsigned char *)id;
+	k.mv_size = 32;
+
+	v.mv_data = (unsigned char *)meta;
+	v.mv_size = ndb_note_meta_total_size(meta);
+
+	if ((rc = mdb_put(txn->mdb_txn, note_meta_db, &k, &v, 0))) {
+		ndb_debug("ndb_set_note_meta: write note metadata to db failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+struct ndb_note_meta *ndb_get_note_meta(struct ndb_txn *txn, const unsigned char *id)
+{
+	MDB_val k, v;
+
+	k.mv_data = (unsigned char*)id;
+	k.mv_size = 32;
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &k, &v)) {
+		//ndb_debug("ndb_get_note_meta: mdb_get note failed\n");
+		return NULL;
+	}
+
+	return v.mv_data;
+}
+
+/* write reaction stats if its a valid reaction */
+static int ndb_process_reaction(
+		struct ndb_txn *txn,
+		struct ndb_note *note,
+		unsigned char **liked,
+		unsigned char *scratch,
+		size_t scratch_size)
+{
+	const char *content;
+	int rc;
+	uint32_t *count;
+	MDB_val key, val;
+	union ndb_reaction_str reaction_str;
+	struct ndb_note_meta *meta;
+	struct ndb_note_meta_entry *entry;
+	enum ndb_meta_clone_result cres;
+	char strbuf[128];
+
+	*liked = ndb_note_last_id_tag(note, 'e');
+
+	if (*liked == NULL)
+		return 0;
+
+	meta = ndb_get_note_meta(txn, *liked);
+
+	/* initial builder setup, build reaction string from reaction contents */
+	content = ndb_note_content(note);
+	if (!ndb_reaction_set(&reaction_str, content)) {
+		ndb_debug("reaction string '%s' was too big\n", content);
+		/* string was too big, let's just record a `+` for now */
+		rc = ndb_reaction_set(&reaction_str, "+");
+		assert(rc);
+	}
+
+	cres = ndb_note_meta_clone_with_entry(&meta,
+			&entry,
+			NDB_NOTE_META_REACTION,
+			&reaction_str.binmoji,
+			scratch,
+			scratch_size);
+
+	switch (cres) {
+	case NDB_META_CLONE_FAILED:
+		return 0;
+	case NDB_META_CLONE_NEW_ENTRY:
+		ndb_reaction_to_str(&reaction_str, strbuf);
+		/* printf("initializing reaction stats for %s\n", strbuf); */
+		ndb_note_meta_reaction_set(entry, 1, reaction_str);
+		break;
+	case NDB_META_CLONE_EXISTING_ENTRY:
+		count = ndb_note_meta_reaction_count(entry);
+		/* printf("increasing count from %d to %d\n", (int)*count, (int)*count+1); */
+		(*count)++;
+		break;
+	}
+
+	key.mv_data = *liked;
+	key.mv_size = 32;
+
+	val.mv_data = meta;
+	val.mv_size = ndb_note_meta_total_size(meta);
+	assert((val.mv_size % 8) == 0);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &key, &val, 0))) {
+		ndb_debug("write reaction stats to db failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int ndb_increment_total_reactions(
+		struct ndb_txn *txn,
+		unsigned char *liked,
+		unsigned char *scratch,
+		size_t scratch_size)
+{
+	MDB_val key, val;
+	uint32_t *total_reactions;
+	struct ndb_note_meta *meta;
+	struct ndb_note_meta_entry *entry;
+	int rc;
+
+	meta = ndb_get_note_meta(txn, liked);
+	rc = ndb_note_meta_clone_with_entry(&meta, &entry,
+		NDB_NOTE_META_COUNTS,
+		NULL, /* payload to match. only relevant for reactions */
+		scratch,
+		scratch_size);
+
+	switch (rc) {
+	case NDB_META_CLONE_FAILED:
+		return 0;
+	case NDB_META_CLONE_NEW_ENTRY:
+		ndb_note_meta_counts_set(entry, 1, 0, 0, 0, 0);
+		break;
+	case NDB_META_CLONE_EXISTING_ENTRY:
+		total_reactions = ndb_note_meta_counts_total_reactions(entry);
+		(*total_reactions)++;
+		break;
+	}
+
+	key.mv_data = liked;
+	key.mv_size = 32;
+
+	val.mv_data = meta;
+	val.mv_size = ndb_note_meta_total_size(meta);
+	assert((val.mv_size % 8) == 0);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &key, &val, 0))) {
+		ndb_debug("write reaction stats to db failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+
+// When receiving a reaction note, look for the liked id and increase the
+// reaction counter in the note metadata database
+static int ndb_write_reaction_stats(struct ndb_txn *txn, struct ndb_note *note,
+				    unsigned char *scratch,
+				    size_t scratch_size)
+{
+	unsigned char *liked;
+	/* we short circuit here since we only want to increment total reaction count
+	 * if its a valid reaction */
+	return ndb_process_reaction(txn, note, &liked, scratch, scratch_size) &&
+	       ndb_increment_total_reactions(txn, liked, scratch, scratch_size);
+}
+
+static struct ndb_str ndb_note_find_tag_str(struct ndb_note *note,
+					    const char *tag_name);
+
+// Parse bolt11 tag from a kind-9735 zap receipt and extract msats.
+// Returns 1 on success, 0 on failure. Sets *msats to 0 if amount unspecified.
+static int ndb_parse_zap_bolt11(struct ndb_note *note, uint64_t *msats)
+{
+	struct ndb_str bolt11_str;
+	struct bolt11 *inv;
+	char *fail;
+
+	bolt11_str = ndb_note_find_tag_str(note, "bolt11");
+	if (bolt11_str.str == NULL || bolt11_str.flag == NDB_PACKED_ID)
+		return 0;
+
+	inv = bolt11_decode_minimal(NULL, bolt11_str.str, &fail);
+	if (inv == NULL)
+		return 0;
+
+	*msats = (inv->msat != NULL) ? inv->msat->millisatoshis : 0;
+	tal_free(inv);
+	return 1;
+}
+
+// When receiving a kind-9735 zap receipt, parse the bolt11 tag and update
+// unverified zap counters on the zapped note's metadata
+static int ndb_write_unverified_zap_stats(struct ndb_txn *txn,
+					  struct ndb_note *note,
+					  unsigned char *scratch,
+					  size_t scratch_size)
+{
+	int rc;
+	uint32_t *count;
+	uint64_t *total;
+	uint64_t msats;
+	MDB_val key, val;
+	unsigned char *zapped_id;
+	struct ndb_note_meta *meta;
+	struct ndb_note_meta_entry *entry;
+	enum ndb_meta_clone_result cres;
+
+	zapped_id = ndb_note_last_id_tag(note, 'e');
+	if (zapped_id == NULL)
+		return 0;
+
+	if (!ndb_parse_zap_bolt11(note, &msats))
+		return 0;
+
+	meta = ndb_get_note_meta(txn, zapped_id);
+
+	cres = ndb_note_meta_clone_with_entry(&meta, &entry,
+		NDB_NOTE_META_ZAP_UNVERIFIED, NULL, scratch, scratch_size);
+
+	switch (cres) {
+	case NDB_META_CLONE_FAILED:
+		return 0;
+	case NDB_META_CLONE_NEW_ENTRY:
+		ndb_note_meta_zap_unverified_set(entry, 1, msats);
+		break;
+	case NDB_META_CLONE_EXISTING_ENTRY:
+		count = ndb_note_meta_zap_unverified_count(entry);
+		total = ndb_note_meta_zap_unverified_msats(entry);
+		(*count)++;
+		*total += msats;
+		break;
+	}
+
+	key.mv_data = zapped_id;
+	key.mv_size = 32;
+
+	val.mv_data = meta;
+	val.mv_size = ndb_note_meta_total_size(meta);
+	assert((val.mv_size % 8) == 0);
+
+	if ((rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_META], &key, &val, 0))) {
+		ndb_debug("write unverified zap stats to db failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+// Find the first tag matching a multi-char name (e.g. "bolt11") and return
+// its value (element at index 1) as an ndb_str
+static struct ndb_str ndb_note_find_tag_str(struct ndb_note *note,
+					    const char *tag_name)
+{
+	struct ndb_iterator iter;
+	struct ndb_str str;
+	struct ndb_str empty = {0};
+
+	ndb_tags_iterate_start(note, &iter);
+
+	while (ndb_tags_iterate_next(&iter)) {
+		if (iter.tag->count < 2)
+			continue;
+
+		str = ndb_tag_str(note, iter.tag, 0);
+		if (str.flag != NDB_PACKED_ID && !strcmp(str.str, tag_name))
+			return ndb_tag_str(note, iter.tag, 1);
+	}
+
+	return empty;
+}
+
+static int ndb_write_note_id_index(struct ndb_txn *txn, struct ndb_note *note,
+				   uint64_t note_key)
+
+{
+	struct ndb_tsid tsid;
+	int rc;
+	MDB_val key, val;
+	MDB_dbi id_db;
+
+	ndb_tsid_init(&tsid, note->id, note->created_at);
+
+	key.mv_data = &tsid;
+	key.mv_size = sizeof(tsid);
+	val.mv_data = &note_key;
+	val.mv_size = sizeof(note_key);
+
+	id_db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
+
+	if ((rc = mdb_put(txn->mdb_txn, id_db, &key, &val, 0))) {
+		ndb_debug("write note id index to db failed: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+static int ndb_filter_group_add_filters(struct ndb_filter_group *group,
+					struct ndb_filter *filters,
+					int num_filters)
+{
+	int i;
+
+	for (i = 0; i < num_filters; i++) {
+		if (!ndb_filter_group_add(group, &filters[i]))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static struct ndb_filter_elements *
+ndb_filter_find_elements(struct ndb_filter *filter, enum ndb_filter_fieldtype typ)
+{
+	int i;
+	struct ndb_filter_elements *els;
+
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		assert(els);
+		if (els->field.type == typ) {
+			return els;
+		}
+	}
+
+	return NULL;
+}
+
+static const char *ndb_filter_find_search(struct ndb_filter *filter)
+{
+	struct ndb_filter_elements *els;
+
+	if (!(els = ndb_filter_find_elements(filter, NDB_FILTER_SEARCH)))
+		return NULL;
+
+	return ndb_filter_get_string_element(filter, els, 0);
+}
+
+int ndb_filter_is_subset_of(const struct ndb_filter *a, const struct ndb_filter *b)
+{
+	int i;
+	struct ndb_filter_elements *b_field, *a_field;
+
+        // Everything is always a subset of {}
+	if (b->num_elements == 0)
+		return 1;
+
+        // We can't be a subset if the number of elements in the other
+        // filter is larger then the number of elements we have.
+	if (b->num_elements > a->num_elements)
+		return 0;
+
+        // If our filter count matches, we can only be a subset if we are
+        // equal
+	if (b->num_elements == a->num_elements)
+		return ndb_filter_eq(a, b);
+
+        // If our element count is larger than the other filter, then we
+        // must see if every element in the other filter exists in ours. If
+        // so, then we are a subset of the other.
+        //
+        // eg: B={k:1, a:b} <- A={t:x, k:1, a:b}
+        //
+        // A is a subset of B because `k:1` and `a:b` both exist in A
+
+	for (i = 0; i < b->num_elements; i++) {
+		b_field = ndb_filter_get_elements((struct ndb_filter*)b, i);
+		a_field = ndb_filter_find_elements((struct ndb_filter*)a,
+						   b_field->field.type);
+
+		if (a_field == NULL)
+			return 0;
+
+		if (!ndb_filter_field_eq((struct ndb_filter*)a, a_field,
+					 (struct ndb_filter*)b, b_field))
+			return 0;
+	}
+
+	return 1;
+}
+
+int ndb_filter_eq(const struct ndb_filter *a, const struct ndb_filter *b)
+{
+	int i;
+	struct ndb_filter_elements *a_els, *b_els;
+
+	if (a->num_elements != b->num_elements)
+		return 0;
+
+	for (i = 0; i < a->num_elements; i++) {
+		a_els = ndb_filter_get_elements((struct ndb_filter*)a, i);
+		b_els = ndb_filter_find_elements((struct ndb_filter *)b,
+						 a_els->field.type);
+
+		if (b_els == NULL)
+			return 0;
+
+		if (!ndb_filter_field_eq((struct ndb_filter*)a, a_els,
+					 (struct ndb_filter*)b, b_els))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static uint64_t *
+ndb_filter_get_elem(struct ndb_filter *filter, enum ndb_filter_fieldtype typ)
+{
+	struct ndb_filter_elements *els;
+	if ((els = ndb_filter_find_elements(filter, typ)))
+		return &els->elements[0];
+	return NULL;
+}
+
+static uint64_t *ndb_filter_get_int(struct ndb_filter *filter,
+				    enum ndb_filter_fieldtype typ)
+{
+	uint64_t *el;
+	if (NULL == (el = ndb_filter_get_elem(filter, typ)))
+		return NULL;
+	return el;
+}
+
+static inline int push_query_result(struct ndb_query_state *state,
+				    struct ndb_query_result *result)
+{
+	enum ndb_visitor_action action;
+
+	switch (state->type) {
+	case NDB_QUERY_TYPE_STANDARD:
+		return cursor_push(&state->query.results.cur,
+				   (unsigned char*)result, sizeof(*result));
+	case NDB_QUERY_TYPE_VISITOR:
+		action = state->visitor.visitor(state->visitor.ctx, result);
+		state->visitor.visited++;
+		if (action == NDB_VISITOR_STOP) {
+			state->visitor.done = 1;
+			return 0;
+		}
+		return 1;
+	}
+
+	assert(!"corrupt query state");
+	return 0;
+}
+
+static int compare_query_results(const void *pa, const void *pb)
+{
+	struct ndb_query_result *a, *b;
+
+	a = (struct ndb_query_result *)pa;
+	b = (struct ndb_query_result *)pb;
+
+	if (a->note->created_at == b->note->created_at) {
+		return 0;
+	} else if (a->note->created_at > b->note->created_at) {
+		return -1;
+	} else {
+		return 1;
+	}
+}
+
+static void ndb_query_result_init(struct ndb_query_result *res,
+				  struct ndb_note *note,
+				  uint64_t note_size,
+				  uint64_t note_id)
+{
+	*res = (struct ndb_query_result){
+		.note_id = note_id,
+		.note_size = note_size,
+		.note = note,
+	};
+}
+
+static int query_is_full(struct ndb_query_state *state)
+{
+	size_t count;
+
+	switch (state->type) {
+	case NDB_QUERY_TYPE_STANDARD:
+		if (state->query.results.cur.p >= state->query.results.cur.end)
+			return 1;
+		/* limit 0 means no limit */
+		if (state->limit == 0)
+			return 0;
+		count = cursor_count(&state->query.results.cur,
+				     sizeof(struct ndb_query_result));
+		return count >= state->limit;
+	case NDB_QUERY_TYPE_VISITOR:
+		if (state->visitor.done)
+			return 1;
+		if (state->limit == 0)
+			return 0;
+		return state->visitor.visited >= state->limit;
+	}
+
+	assert(!"corrupt query state");
+	return 0;
+}
+
+/* Query profiling. Plans report the work they do through these, which do
+ * nothing unless the query came in through ndb_query_explain. */
+static inline void ndb_explain_seeks(struct ndb_query_state *state, uint64_t n)
+{
+	if (state->explain)
+		state->explain->seeks += n;
+}
+
+static inline void ndb_explain_entry(struct ndb_query_state *state)
+{
+	if (state->explain)
+		state->explain->index_entries++;
+}
+
+static inline void ndb_explain_note(struct ndb_query_state *state, int matched)
+{
+	if (!state->explain)
+		return;
+
+	state->explain->notes_loaded++;
+	if (!matched)
+		state->explain->mismatches++;
+}
+
+static int ndb_query_plan_execute_search(struct ndb_txn *txn,
+					 struct ndb_filter *filter,
+					 struct ndb_query_state *results)
+{
+	const char *search;
+	int i;
+	struct ndb_text_search_results text_results;
+	struct ndb_text_search_result *text_result;
+	struct ndb_text_search_config config;
+	struct ndb_query_result result;
+
+	ndb_default_text_search_config(&config);
+
+	if (!(search = ndb_filter_find_search(filter)))
+		return 0;
+
+	if (!ndb_text_search_with(txn, search, &text_results, &config, filter))
+		return 0;
+
+	for (i = 0; i < text_results.num_results; i++) {
+		if (query_is_full(results))
+			break;
+
+		text_result = &text_results.results[i];
+		ndb_explain_entry(results);
+		ndb_explain_note(results, 1);
+
+		result.note = text_result->note;
+		result.note_size = text_result->note_size;
+		result.note_id = text_result->key.note_id;
+
+		if (!push_query_result(results, &result))
+			break;
+	}
+
+	return 1;
+}
+
+static int ndb_query_plan_all_notes(struct ndb_txn *txn, struct ndb_query_state *results)
+{
+	MDB_cursor *cur;
+	MDB_dbi db;
+	MDB_val k, v;
+	int rc;
+	struct ndb_query_result res;
+	uint64_t note_id;
+	struct ndb_note *note;
+	size_t note_size;
+
+	db = txn->lmdb->dbs[NDB_DB_NOTE];
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+		return 0;
+
+	rc = mdb_cursor_get(cur, &k, &v, MDB_FIRST);
+	while (rc == MDB_SUCCESS) {
+		memcpy(&note_id, k.mv_data, sizeof(note_id));
+		note = (struct ndb_note *)v.mv_data;
+		note_size = v.mv_size;
+		ndb_explain_entry(results);
+		ndb_explain_note(results, 1);
+
+		ndb_query_result_init(&res, note, note_size, note_id);
+		if (!push_query_result(results, &res))
+			break;
+
+		rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT);
+	}
+
+	mdb_cursor_close(cur);
+
+	return 1;
+}
+
+static int ndb_query_plan_execute_ids(struct ndb_txn *txn,
+				      struct ndb_filter *filter,
+				      struct ndb_query_state *results)
+{
+	MDB_cursor *cur;
+	MDB_dbi db;
+	MDB_val k, v;
+	int rc, i, need_relays = 0;
+	struct ndb_filter_elements *ids;
+	struct ndb_note *note;
+	struct ndb_query_result res;
+	struct ndb_tsid tsid, *ptsid;
+	uint64_t note_id, until, *pint;
+	size_t note_size;
+	unsigned char *id;
+	struct ndb_note_relay_iterator note_relay_iter = {0};
+	struct ndb_note_relay_iterator *relay_iter = NULL;
+
+	until = UINT64_MAX;
+
+	if (!(ids = ndb_filter_find_elements(filter, NDB_FILTER_IDS)))
+		return 0;
+
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
+
+	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
+		need_relays = 1;
+
+	db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
+	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+		return 0;
+
+	// for each id in our ids filter, find in the db
+	for (i = 0; i < ids->count; i++) {
+		if (query_is_full(results))
+			break;
+
+		id = ndb_filter_get_id_element(filter, ids, i);
+		ndb_tsid_init(&tsid, (unsigned char *)id, until);
+
+		k.mv_data = &tsid;
+		k.mv_size = sizeof(tsid);
+
+		ndb_explain_seeks(results, 1);
+		if (!ndb_cursor_start(cur, &k, &v))
+			continue;
+
+		ptsid = (struct ndb_tsid *)k.mv_data;
+		note_id = *(uint64_t*)v.mv_data;
+
+		if (memcmp(id, ptsid->id, 32))
+			continue;
+
+		ndb_explain_entry(results);
+
+		// get the note because we need it to match against the filter
+		if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
+			continue;
+
+		relay_iter = need_relays ? &note_relay_iter : NULL;
+		if (relay_iter)
+			ndb_note_relay_iterate_start(txn, relay_iter, note_id);
+
+		// Sure this particular lookup matched the index query, but
+		// does it match the entire filter? Check! We also pass in
+		// things we've already matched via the filter so we don't have
+		// to check again. This can be pretty important for filters
+		// with a large number of entries.
+		if (!ndb_filter_matches_with(filter, note, 1 << NDB_FILTER_IDS, relay_iter)) {
+			ndb_explain_note(results, 0);
+			ndb_note_relay_iterate_close(relay_iter);
+			continue;
+		}
+		ndb_explain_note(results, 1);
+		ndb_note_relay_iterate_close(relay_iter);
+
+		ndb_query_result_init(&res, note, note_size, note_id);
+		if (!push_query_result(results, &res))
+			break;
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+//
+// encode a tag index key
+//
+// consists of:
+//
+//   u8   tag
+//   u8   tag_val_len
+//   [u8] tag_val_bytes
+//   u64  created_at
+//
+static int ndb_encode_tag_key(unsigned char *buf, int buf_size,
+			      char tag, const unsigned char *val,
+			      unsigned char val_len,
+			      uint64_t timestamp)
+{
+	struct cursor writer;
+	int ok;
+
+	// quick exit for obvious case where it will be too big. There can be
+	// values of val_len that still fail, but we just let the writer handle
+	// those failure cases
+	if (val_len >= buf_size)
+		return 0;
+
+	make_cursor(buf, buf + buf_size, &writer);
+
+	ok =
+		cursor_push_byte(&writer, tag) &&
+		cursor_push(&writer, (unsigned char*)val, val_len) &&
+		cursor_push(&writer, (unsigned char*)&timestamp, sizeof(timestamp));
+
+	if (!ok)
+		return 0;
+
+	return writer.p - writer.start;
+}
+
+/* The largest index key we know how to scan over. relay+kind keys are the
+ * biggest: 24 bytes of ints, a length byte, up to 248 bytes of relay url, a
+ * nul terminator and 8-byte alignment padding. */
+#define NDB_SCAN_KEY_MAX 288
+
+/* The index key layouts we know how to walk backwards over.
+ *
+ * Each of these indexes clusters its entries by some group (a kind, a
+ * pubkey+kind, a relay+kind) and orders them by created_at within that group,
+ * so a reverse cursor walk inside a single group is descending by created_at.
+ * Across groups it is not ordered at all. */
+enum ndb_scan_key_type {
+	NDB_SCAN_KEY_U64_TS,     // note_kind:        {kind, created_at}
+	NDB_SCAN_KEY_ID_U64_TS,  // note_pubkey_kind: {pubkey, kind, created_at}
+	NDB_SCAN_KEY_RELAY_KIND, // relay_kind:       {note_key, kind, created_at, relay}
+	NDB_SCAN_KEY_ID_TS,      // note_pubkey:      {pubkey, created_at}
+	NDB_SCAN_KEY_TAG,        // note_tags:        {tag, value..., created_at}
+	NDB_SCAN_KEY_TS,         // note_created:     {created_at}
+};
+
+/* A reverse cursor over a single group of an index. */
+struct ndb_index_scanner {
+	/* the key we seeked with, kept so we can tell when we've walked out
+	 * of our group. first member so that it inherits the struct's 8 byte
+	 * alignment, which the relay+kind key parser requires */
+	unsigned char group[NDB_SCAN_KEY_MAX];
+	size_t group_size;
+	MDB_cursor *cur;
+	uint64_t created_at;
+	uint64_t note_key;
+	uint64_t entries; // how many entries we've handed out
+};
+
+/* Merges any number of reverse index scans into one created_at-descending
+ * stream.
+ *
+ * Anything that spans more than one group (every kind, several kinds, several
+ * authors) has to merge rather than concatenate. Draining group by group
+ * lets the first group eat the whole limit and starve the rest, which looks
+ * like results arriving out of order. */
+struct ndb_index_merger {
+	struct ndb_index_scanner *scanners;
+	int *heap; // indices into scanners, max-heap on created_at
+	int num_scanners;
+	int capacity;
+	int heap_len;
+	uint64_t since;
+	uint64_t entries; // entries read across every scanner, seeks included
+	enum ndb_scan_key_type key_type;
+	MDB_dbi db;
+};
+
+/* is the entry the cursor is sitting on still in this scanner's group? */
+static int ndb_scanner_in_group(struct ndb_index_scanner *s,
+				enum ndb_scan_key_type type, MDB_val *k)
+{
+	struct ndb_u64_ts *kts, *gts;
+	struct ndb_id_u64_ts *kits, *gits;
+	struct ndb_tsid *ktsid, *gtsid;
+	struct ndb_relay_kind_key krk, grk;
+
+	switch (type) {
+	case NDB_SCAN_KEY_U64_TS:
+		if (k->mv_size != sizeof(*kts))
+			return 0;
+		kts = (struct ndb_u64_ts *)k->mv_data;
+		gts = (struct ndb_u64_ts *)s->group;
+		return kts->u64 == gts->u64;
+	case NDB_SCAN_KEY_ID_U64_TS:
+		if (k->mv_size != sizeof(*kits))
+			return 0;
+		kits = (struct ndb_id_u64_ts *)k->mv_data;
+		gits = (struct ndb_id_u64_ts *)s->group;
+		return kits->u64 == gits->u64 && !memcmp(kits->id, gits->id, 32);
+	case NDB_SCAN_KEY_RELAY_KIND:
+		ndb_parse_relay_kind_key(&krk, (unsigned char *)k->mv_data);
+		ndb_parse_relay_kind_key(&grk, s->group);
+		return krk.kind == grk.kind && !strcmp(krk.relay, grk.relay);
+	case NDB_SCAN_KEY_ID_TS:
+		if (k->mv_size != sizeof(*ktsid))
+			return 0;
+		ktsid = (struct ndb_tsid *)k->mv_data;
+		gtsid = (struct ndb_tsid *)s->group;
+		return !memcmp(ktsid->id, gtsid->id, 32);
+	case NDB_SCAN_KEY_TAG:
+		// tag byte and value, everything but the trailing created_at
+		if (k->mv_size != s->group_size)
+			return 0;
+		return !memcmp(k->mv_data, s->group, s->group_size - 8);
+	case NDB_SCAN_KEY_TS:
+		// one group spanning the whole index
+		return k->mv_size == sizeof(uint64_t);
+	}
+
+	return 0;
+}
+
+static void ndb_scanner_read(struct ndb_index_scanner *s,
+			     enum ndb_scan_key_type type,
+			     MDB_val *k, MDB_val *v)
+{
+	struct ndb_relay_kind_key rk;
+
+	switch (type) {
+	case NDB_SCAN_KEY_U64_TS:
+		s->created_at = ((struct ndb_u64_ts *)k->mv_data)->timestamp;
+		s->note_key = *(uint64_t *)v->mv_data;
+		return;
+	case NDB_SCAN_KEY_ID_U64_TS:
+		s->created_at = ((struct ndb_id_u64_ts *)k->mv_data)->timestamp;
+		s->note_key = *(uint64_t *)v->mv_data;
+		return;
+	case NDB_SCAN_KEY_RELAY_KIND:
+		// the relay+kind index stores everything in the key
+		ndb_parse_relay_kind_key(&rk, (unsigned char *)k->mv_data);
+		s->created_at = rk.created_at;
+		s->note_key = rk.note_key;
+		return;
+	case NDB_SCAN_KEY_ID_TS:
+		s->created_at = ((struct ndb_tsid *)k->mv_data)->timestamp;
+		s->note_key = *(uint64_t *)v->mv_data;
+		return;
+	case NDB_SCAN_KEY_TAG:
+		s->created_at = *(uint64_t *)((unsigned char *)k->mv_data +
+					      k->mv_size - 8);
+		s->note_key = *(uint64_t *)v->mv_data;
+		return;
+	case NDB_SCAN_KEY_TS:
+		s->created_at = *(uint64_t *)k->mv_data;
+		s->note_key = *(uint64_t *)v->mv_data;
+		return;
+	}
+}
+
+/* Load the entry under the cursor. Returns 0 when this scanner is finished:
+ * off the end of the db, out of its group, or below `since`. Stopping at
+ * `since` is sound here because created_at descends within a group. */
+static int ndb_scanner_load(struct ndb_index_merger *m,
+			    struct ndb_index_scanner *s)
+{
+	MDB_val k, v;
+
+	if (mdb_cursor_get(s->cur, &k, &v, MDB_GET_CURRENT))
+		return 0;
+
+	if (!ndb_scanner_in_group(s, m->key_type, &k))
+		return 0;
+
+	ndb_scanner_read(s, m->key_type, &k, &v);
+
+	return s->created_at >= m->since;
+}
+
+static int ndb_merger_gt(struct ndb_index_merger *m, int a, int b)
+{
+	struct ndb_index_scanner *sa, *sb;
+
+	sa = &m->scanners[a];
+	sb = &m->scanners[b];
+
+	if (sa->created_at != sb->created_at)
+		return sa->created_at > sb->created_at;
+
+	// deterministic tiebreak for notes sharing a created_at
+	return sa->note_key > sb->note_key;
+}
+
+static void ndb_merger_swap(struct ndb_index_merger *m, int a, int b)
+{
+	int tmp;
+
+	tmp = m->heap[a];
+	m->heap[a] = m->heap[b];
+	m->heap[b] = tmp;
+}
+
+static void ndb_merger_push(struct ndb_index_merger *m, int scanner)
 {
-	struct ndb_iterator iter;
-	struct ndb_str str;
-	struct ndb_str empty = {0};
-
-	ndb_tags_iterate_start(note, &iter);
+	int i, parent;
 
-	while (ndb_tags_iterate_next(&iter)) {
-		if (iter.tag->count < 2)
-			continue;
+	i = m->heap_len++;
+	m->heap[i] = scanner;
 
-		str = ndb_tag_str(note, iter.tag, 0);
-		if (str.flag != NDB_PACKED_ID && !strcmp(str.str, tag_name))
-			return ndb_tag_str(note, iter.tag, 1);
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!ndb_merger_gt(m, m->heap[i], m->heap[parent]))
+			break;
+		ndb_merger_swap(m, i, parent);
+		i = parent;
 	}
-
-	return empty;
 }
 
-static int ndb_write_note_id_index(struct ndb_txn *txn, struct ndb_note *note,
-				   uint64_t note_key)
-
+static void ndb_merger_sift(struct ndb_index_merger *m)
 {
-	struct ndb_tsid tsid;
-	int rc;
-	MDB_val key, val;
-	MDB_dbi id_db;
-
-	ndb_tsid_init(&tsid, note->id, note->created_at);
+	int i, l, r, big;
 
-	key.mv_data = &tsid;
-	key.mv_size = sizeof(tsid);
-	val.mv_data = &note_key;
-	val.mv_size = sizeof(note_key);
+	for (i = 0;;) {
+		l = i * 2 + 1;
+		r = l + 1;
+		big = i;
 
-	id_db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
+		if (l < m->heap_len && ndb_merger_gt(m, m->heap[l], m->heap[big]))
+			big = l;
+		if (r < m->heap_len && ndb_merger_gt(m, m->heap[r], m->heap[big]))
+			big = r;
+		if (big == i)
+			break;
 
-	if ((rc = mdb_put(txn->mdb_txn, id_db, &key, &val, 0))) {
-		ndb_debug("write note id index to db failed: %s\n",
-				mdb_strerror(rc));
-		return 0;
+		ndb_merger_swap(m, i, big);
+		i = big;
 	}
-
-	return 1;
 }
 
-static int ndb_filter_group_add_filters(struct ndb_filter_group *group,
-					struct ndb_filter *filters,
-					int num_filters)
+static int ndb_index_merger_init(struct ndb_index_merger *m, MDB_dbi db,
+				 enum ndb_scan_key_type key_type,
+				 uint64_t since, int capacity)
 {
-	int i;
+	if (capacity <= 0)
+		capacity = 1;
 
-	for (i = 0; i < num_filters; i++) {
-		if (!ndb_filter_group_add(group, &filters[i]))
-			return 0;
+	m->scanners = calloc(capacity, sizeof(*m->scanners));
+	m->heap = malloc(capacity * sizeof(*m->heap));
+
+	if (!m->scanners || !m->heap) {
+		free(m->scanners);
+		free(m->heap);
+		return 0;
 	}
 
+	m->db = db;
+	m->key_type = key_type;
+	m->since = since;
+	m->capacity = capacity;
+	m->num_scanners = 0;
+	m->heap_len = 0;
+	m->entries = 0;
+
 	return 1;
 }
 
-
-static struct ndb_filter_elements *
-ndb_filter_find_elements(struct ndb_filter *filter, enum ndb_filter_fieldtype typ)
+static void ndb_index_merger_destroy(struct ndb_index_merger *m)
 {
 	int i;
-	struct ndb_filter_elements *els;
 
-	for (i = 0; i < filter->num_elements; i++) {
-		els = ndb_filter_get_elements(filter, i);
-		assert(els);
-		if (els->field.type == typ) {
-			return els;
-		}
-	}
+	for (i = 0; i < m->num_scanners; i++)
+		mdb_cursor_close(m->scanners[i].cur);
 
-	return NULL;
+	free(m->scanners);
+	free(m->heap);
 }
 
-static const char *ndb_filter_find_search(struct ndb_filter *filter)
+/* Add a group to the merge, seeked to the newest entry at or before the
+ * `until` baked into `key`. Groups with nothing in range are dropped. */
+static int ndb_index_merger_add(struct ndb_index_merger *m,
+				struct ndb_txn *txn,
+				const void *key, size_t key_size)
 {
-	struct ndb_filter_elements *els;
-
-	if (!(els = ndb_filter_find_elements(filter, NDB_FILTER_SEARCH)))
-		return NULL;
-
-	return ndb_filter_get_string_element(filter, els, 0);
-}
+	struct ndb_index_scanner *s;
+	MDB_val k, v;
 
-int ndb_filter_is_subset_of(const struct ndb_filter *a, const struct ndb_filter *b)
-{
-	int i;
-	struct ndb_filter_elements *b_field, *a_field;
+	if (m->num_scanners == m->capacity || key_size > NDB_SCAN_KEY_MAX)
+		return 0;
 
-        // Everything is always a subset of {}
-	if (b->num_elements == 0)
-		return 1;
+	s = &m->scanners[m->num_scanners];
 
-        // We can't be a subset if the number of elements in the other
-        // filter is larger then the number of elements we have.
-	if (b->num_elements > a->num_elements)
+	if (mdb_cursor_open(txn->mdb_txn, m->db, &s->cur))
 		return 0;
 
-        // If our filter count matches, we can only be a subset if we are
-        // equal
-	if (b->num_elements == a->num_elements)
-		return ndb_filter_eq(a, b);
-
-        // If our element count is larger than the other filter, then we
-        // must see if every element in the other filter exists in ours. If
-        // so, then we are a subset of the other.
-        //
-        // eg: B={k:1, a:b} <- A={t:x, k:1, a:b}
-        //
-        // A is a subset of B because `k:1` and `a:b` both exist in A
+	memcpy(s->group, key, key_size);
+	s->group_size = key_size;
+	m->num_scanners++;
 
-	for (i = 0; i < b->num_elements; i++) {
-		b_field = ndb_filter_get_elements((struct ndb_filter*)b, i);
-		a_field = ndb_filter_find_elements((struct ndb_filter*)a,
-						   b_field->field.type);
+	// ndb_cursor_start repoints k at the entry it found, leaving
+	// s->group intact
+	k.mv_data = s->group;
+	k.mv_size = key_size;
 
-		if (a_field == NULL)
-			return 0;
+	if (!ndb_cursor_start(s->cur, &k, &v))
+		return 1;
 
-		if (!ndb_filter_field_eq((struct ndb_filter*)a, a_field,
-					 (struct ndb_filter*)b, b_field))
-			return 0;
-	}
+	if (ndb_scanner_load(m, s))
+		ndb_merger_push(m, m->num_scanners - 1);
 
 	return 1;
 }
 
-int ndb_filter_eq(const struct ndb_filter *a, const struct ndb_filter *b)
+/* Pop the newest note across every group, then advance the group it came
+ * from. */
+static int ndb_index_merger_next(struct ndb_index_merger *m, uint64_t *note_key)
 {
-	int i;
-	struct ndb_filter_elements *a_els, *b_els;
+	struct ndb_index_scanner *s;
+	MDB_val k, v;
 
-	if (a->num_elements != b->num_elements)
+	if (m->heap_len == 0)
 		return 0;
 
-	for (i = 0; i < a->num_elements; i++) {
-		a_els = ndb_filter_get_elements((struct ndb_filter*)a, i);
-		b_els = ndb_filter_find_elements((struct ndb_filter *)b,
-						 a_els->field.type);
-
-		if (b_els == NULL)
-			return 0;
+	s = &m->scanners[m->heap[0]];
+	*note_key = s->note_key;
+	s->entries++;
+	m->entries++;
 
-		if (!ndb_filter_field_eq((struct ndb_filter*)a, a_els,
-					 (struct ndb_filter*)b, b_els))
-			return 0;
+	if (mdb_cursor_get(s->cur, &k, &v, MDB_PREV) || !ndb_scanner_load(m, s)) {
+		// this group is done, drop it out of the heap
+		m->heap[0] = m->heap[--m->heap_len];
 	}
 
+	ndb_merger_sift(m);
+
 	return 1;
 }
 
-
-static uint64_t *
-ndb_filter_get_elem(struct ndb_filter *filter, enum ndb_filter_fieldtype typ)
+/* The created_at of the newest entry left in the merge */
+static int ndb_index_merger_peek(struct ndb_index_merger *m, uint64_t *created_at)
 {
-	struct ndb_filter_elements *els;
-	if ((els = ndb_filter_find_elements(filter, typ)))
-		return &els->elements[0];
-	return NULL;
-}
+	if (m->heap_len == 0)
+		return 0;
 
-static uint64_t *ndb_filter_get_int(struct ndb_filter *filter,
-				    enum ndb_filter_fieldtype typ)
-{
-	uint64_t *el;
-	if (NULL == (el = ndb_filter_get_elem(filter, typ)))
-		return NULL;
-	return el;
+	*created_at = m->scanners[m->heap[0]].created_at;
+	return 1;
 }
 
-static inline int push_query_result(struct ndb_query_state *state,
-				    struct ndb_query_result *result)
+/* Move a scanner down to its newest entry at or before `created_at`.
+ * Every key layout but relay+kind ends in its created_at, so rather than
+ * stepping over everything newer we can reseek the group at the new
+ * timestamp. Returns 0 when the scanner is finished. */
+static int ndb_scanner_seek(struct ndb_index_merger *m,
+			    struct ndb_index_scanner *s, uint64_t created_at)
 {
-	enum ndb_visitor_action action;
+	// the index comparators read keys as integers
+	uint64_t key_aligned[NDB_SCAN_KEY_MAX / 8];
+	unsigned char *key = (unsigned char *)key_aligned;
+	uint64_t ts;
+	MDB_val k, v;
 
-	switch (state->type) {
-	case NDB_QUERY_TYPE_STANDARD:
-		return cursor_push(&state->query.results.cur,
-				   (unsigned char*)result, sizeof(*result));
-	case NDB_QUERY_TYPE_VISITOR:
-		action = state->visitor.visitor(state->visitor.ctx, result);
-		state->visitor.visited++;
-		if (action == NDB_VISITOR_STOP) {
-			state->visitor.done = 1;
-			return 0;
-		}
-		return 1;
-	}
+	if (s->created_at > created_at &&
+	    m->key_type != NDB_SCAN_KEY_RELAY_KIND) {
+		// the first entry past created_at is where the cursor
+		// lands, ndb_cursor_start backs up from it
+		ts = created_at + 1;
+		memcpy(key, s->group, s->group_size);
+		memcpy(key + s->group_size - sizeof(ts), &ts, sizeof(ts));
 
-	assert(!"corrupt query state");
-	return 0;
-}
+		k.mv_data = key;
+		k.mv_size = s->group_size;
 
-static int compare_query_results(const void *pa, const void *pb)
-{
-	struct ndb_query_result *a, *b;
+		s->entries++;
+		m->entries++;
 
-	a = (struct ndb_query_result *)pa;
-	b = (struct ndb_query_result *)pb;
+		if (!ndb_cursor_start(s->cur, &k, &v) || !ndb_scanner_load(m, s))
+			return 0;
+	}
 
-	if (a->note->created_at == b->note->created_at) {
-		return 0;
-	} else if (a->note->created_at > b->note->created_at) {
-		return -1;
-	} else {
-		return 1;
+	while (s->created_at > created_at) {
+		s->entries++;
+		m->entries++;
+
+		if (mdb_cursor_get(s->cur, &k, &v, MDB_PREV) ||
+		    !ndb_scanner_load(m, s))
+			return 0;
 	}
-}
 
-static void ndb_query_result_init(struct ndb_query_result *res,
-				  struct ndb_note *note,
-				  uint64_t note_size,
-				  uint64_t note_id)
-{
-	*res = (struct ndb_query_result){
-		.note_id = note_id,
-		.note_size = note_size,
-		.note = note,
-	};
+	return 1;
 }
 
-static int query_is_full(struct ndb_query_state *state)
+/* Drop everything newer than `created_at` from the merge. */
+static void ndb_index_merger_seek(struct ndb_index_merger *m,
+				  uint64_t created_at)
 {
-	size_t count;
+	int i, n, scanner;
 
-	switch (state->type) {
-	case NDB_QUERY_TYPE_STANDARD:
-		if (state->query.results.cur.p >= state->query.results.cur.end)
-			return 1;
-		/* limit 0 means no limit */
-		if (state->limit == 0)
-			return 0;
-		count = cursor_count(&state->query.results.cur,
-				     sizeof(struct ndb_query_result));
-		return count >= state->limit;
-	case NDB_QUERY_TYPE_VISITOR:
-		if (state->visitor.done)
-			return 1;
-		if (state->limit == 0)
-			return 0;
-		return state->visitor.visited >= state->limit;
-	}
+	if (m->heap_len == 0 ||
+	    m->scanners[m->heap[0]].created_at <= created_at)
+		return;
 
-	assert(!"corrupt query state");
-	return 0;
+	// take the heap apart and push back whichever scanners survive the
+	// seek. pushing only ever touches slots we've already read
+	n = m->heap_len;
+	m->heap_len = 0;
+
+	for (i = 0; i < n; i++) {
+		scanner = m->heap[i];
+		if (ndb_scanner_seek(m, &m->scanners[scanner], created_at))
+			ndb_merger_push(m, scanner);
+	}
 }
 
-static int ndb_query_plan_execute_search(struct ndb_txn *txn,
-					 struct ndb_filter *filter,
-					 struct ndb_query_state *results)
+static int ndb_note_key_cmp_desc(const void *a, const void *b)
 {
-	const char *search;
-	int i;
-	struct ndb_text_search_results text_results;
-	struct ndb_text_search_result *text_result;
-	struct ndb_text_search_config config;
-	struct ndb_query_result result;
+	uint64_t ka = *(const uint64_t *)a;
+	uint64_t kb = *(const uint64_t *)b;
 
-	ndb_default_text_search_config(&config);
+	return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
 
-	if (!(search = ndb_filter_find_search(filter)))
-		return 0;
+/* Pop every note the merge has at exactly `created_at` into `keys`, sorted
+ * newest note_key first with duplicates removed. */
+static int ndb_index_merger_take(struct ndb_index_merger *m,
+				 uint64_t created_at,
+				 uint64_t **keys, int *len, int *cap)
+{
+	uint64_t ts, note_key, *grown;
+	int i, n;
 
-	if (!ndb_text_search_with(txn, search, &text_results, &config, filter))
-		return 0;
+	n = 0;
+	while (ndb_index_merger_peek(m, &ts) && ts == created_at) {
+		ndb_index_merger_next(m, &note_key);
 
-	for (i = 0; i < text_results.num_results; i++) {
-		if (query_is_full(results))
-			break;
+		if (n == *cap) {
+			if (!(grown = realloc(*keys, (*cap * 2 + 8) * sizeof(**keys))))
+				return 0;
+			*keys = grown;
+			*cap = *cap * 2 + 8;
+		}
 
-		text_result = &text_results.results[i];
+		(*keys)[n++] = note_key;
+	}
 
-		result.note = text_result->note;
-		result.note_size = text_result->note_size;
-		result.note_id = text_result->key.note_id;
+	qsort(*keys, n, sizeof(**keys), ndb_note_key_cmp_desc);
 
-		if (!push_query_result(results, &result))
-			break;
+	*len = 0;
+	for (i = 0; i < n; i++) {
+		if (*len == 0 || (*keys)[*len - 1] != (*keys)[i])
+			(*keys)[(*len)++] = (*keys)[i];
 	}
 
 	return 1;
 }
 
-static int ndb_query_plan_all_notes(struct ndb_txn *txn, struct ndb_query_state *results)
+/* Collect every kind present in the kind index. The index is clustered by
+ * kind, so we can hop from one kind to the next instead of walking every
+ * entry. */
+static int ndb_all_kinds(struct ndb_txn *txn, uint64_t **out, int *out_count)
 {
 	MDB_cursor *cur;
-	MDB_dbi db;
 	MDB_val k, v;
-	int rc;
-	struct ndb_query_result res;
-	uint64_t note_id;
-	struct ndb_note *note;
-	size_t note_size;
+	struct ndb_u64_ts key;
+	uint64_t *kinds, *tmp, kind;
+	int count, capacity;
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE];
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
+	*out = NULL;
+	*out_count = 0;
+
+	capacity = 16;
+	count = 0;
+
+	if (!(kinds = malloc(capacity * sizeof(*kinds))))
 		return 0;
 
-	rc = mdb_cursor_get(cur, &k, &v, MDB_FIRST);
-	while (rc == MDB_SUCCESS) {
-		memcpy(&note_id, k.mv_data, sizeof(note_id));
-		note = (struct ndb_note *)v.mv_data;
-		note_size = v.mv_size;
+	if (mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_KIND], &cur)) {
+		free(kinds);
+		return 0;
+	}
 
-		ndb_query_result_init(&res, note, note_size, note_id);
-		if (!push_query_result(results, &res))
+	ndb_u64_ts_init(&key, 0, 0);
+	k.mv_data = &key;
+	k.mv_size = sizeof(key);
+
+	while (!mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE)) {
+		kind = ((struct ndb_u64_ts *)k.mv_data)->u64;
+
+		if (count == capacity) {
+			capacity *= 2;
+			if (!(tmp = realloc(kinds, capacity * sizeof(*kinds)))) {
+				mdb_cursor_close(cur);
+				free(kinds);
+				return 0;
+			}
+			kinds = tmp;
+		}
+
+		kinds[count++] = kind;
+
+		if (kind == UINT64_MAX)
 			break;
 
-		rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT);
+		// jump past every entry for this kind
+		ndb_u64_ts_init(&key, kind + 1, 0);
+		k.mv_data = &key;
+		k.mv_size = sizeof(key);
 	}
 
 	mdb_cursor_close(cur);
 
+	*out = kinds;
+	*out_count = count;
+
 	return 1;
 }
 
-static int ndb_query_plan_execute_ids(struct ndb_txn *txn,
-				      struct ndb_filter *filter,
-				      struct ndb_query_state *results)
+/* Add one tag run per value of a tag field to a merge over the tag index.
+ * Values too big to have been indexed are skipped. */
+static int ndb_tags_merger_add(struct ndb_txn *txn, struct ndb_filter *filter,
+			       struct ndb_filter_elements *tags,
+			       struct ndb_index_merger *merger, uint64_t until)
 {
-	MDB_cursor *cur;
-	MDB_dbi db;
-	MDB_val k, v;
-	int rc, i, need_relays = 0;
-	struct ndb_filter_elements *ids;
-	struct ndb_note *note;
-	struct ndb_query_result res;
-	struct ndb_tsid tsid, *ptsid;
-	uint64_t note_id, until, *pint;
-	size_t note_size;
-	unsigned char *id;
-	struct ndb_note_relay_iterator note_relay_iter = {0};
-	struct ndb_note_relay_iterator *relay_iter = NULL;
+	unsigned char *tag;
+	unsigned char key[255];
+	int i, len, taglen;
 
-	until = UINT64_MAX;
+	for (i = 0; i < tags->count; i++) {
+		tag = ndb_filter_get_id_element(filter, tags, i);
 
-	if (!(ids = ndb_filter_find_elements(filter, NDB_FILTER_IDS)))
-		return 0;
+		taglen = tags->field.elem_type == NDB_ELEMENT_ID
+		       ? 32 : strlen((const char*)tag);
 
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+		if (!(len = ndb_encode_tag_key(key, sizeof(key), tags->field.tag,
+					       tag, taglen, until)))
+			continue;
 
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
+		if (!ndb_index_merger_add(merger, txn, key, len))
+			return 0;
+	}
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_ID];
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
-		return 0;
+	return 1;
+}
 
-	// for each id in our ids filter, find in the db
-	for (i = 0; i < ids->count; i++) {
-		if (query_is_full(results))
-			break;
+/* Open a merge over every value of one tag field */
+static int ndb_tags_merger_open(struct ndb_txn *txn, struct ndb_filter *filter,
+				struct ndb_filter_elements *tags,
+				struct ndb_index_merger *merger)
+{
+	uint64_t *pint, until, since;
 
-		id = ndb_filter_get_id_element(filter, ids, i);
-		ndb_tsid_init(&tsid, (unsigned char *)id, until);
+	until = UINT64_MAX;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
+		until = *pint;
 
-		k.mv_data = &tsid;
-		k.mv_size = sizeof(tsid);
+	since = 0;
+	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
+		since = *pint;
 
-		if (!ndb_cursor_start(cur, &k, &v))
-			continue;
+	if (!ndb_index_merger_init(merger, txn->lmdb->dbs[NDB_DB_NOTE_TAGS],
+				   NDB_SCAN_KEY_TAG, since, tags->count))
+		return 0;
 
-		ptsid = (struct ndb_tsid *)k.mv_data;
-		note_id = *(uint64_t*)v.mv_data;
+	if (!ndb_tags_merger_add(txn, filter, tags, merger, until)) {
+		ndb_index_merger_destroy(merger);
+		return 0;
+	}
 
-		if (memcmp(id, ptsid->id, 32))
-			continue;
+	return 1;
+}
 
-		// get the note because we need it to match against the filter
-		if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
-			continue;
+// how far we look into each tag field when choosing between them
+#define NDB_TAG_PROBE_MAX 256
 
-		relay_iter = need_relays ? &note_relay_iter : NULL;
-		if (relay_iter)
-			ndb_note_relay_iterate_start(txn, relay_iter, note_id);
+/* Pick the tag field a tags plan should scan. A filter can have several
+ * (#e and #p, say) and every one of them has to match, so the best one to
+ * drive the scan is whichever has the fewest index entries in range. We
+ * count up to NDB_TAG_PROBE_MAX entries under each field to find out. */
+static struct ndb_filter_elements *
+ndb_filter_selective_tags(struct ndb_txn *txn, struct ndb_filter *filter,
+			  int *num_tag_fields)
+{
+	struct ndb_index_merger merger;
+	struct ndb_filter_elements *els, *best;
+	uint64_t note_key, entries, best_entries;
+	int i;
 
-		// Sure this particular lookup matched the index query, but
-		// does it match the entire filter? Check! We also pass in
-		// things we've already matched via the filter so we don't have
-		// to check again. This can be pretty important for filters
-		// with a large number of entries.
-		if (!ndb_filter_matches_with(filter, note, 1 << NDB_FILTER_IDS, relay_iter)) {
-			ndb_note_relay_iterate_close(relay_iter);
+	best = NULL;
+	*num_tag_fields = 0;
+
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		if (els->field.type != NDB_FILTER_TAGS)
 			continue;
-		}
-		ndb_note_relay_iterate_close(relay_iter);
 
-		ndb_query_result_init(&res, note, note_size, note_id);
-		if (!push_query_result(results, &res))
-			break;
+		if ((*num_tag_fields)++ == 0)
+			best = els;
 	}
 
-	mdb_cursor_close(cur);
-	return 1;
-}
+	// only worth counting when there's a choice to make
+	if (*num_tag_fields < 2)
+		return best;
 
-//
-// encode a tag index key
-//
-// consists of:
-//
-//   u8   tag
-//   u8   tag_val_len
-//   [u8] tag_val_bytes
-//   u64  created_at
-//
-static int ndb_encode_tag_key(unsigned char *buf, int buf_size,
-			      char tag, const unsigned char *val,
-			      unsigned char val_len,
-			      uint64_t timestamp)
-{
-	struct cursor writer;
-	int ok;
+	best_entries = UINT64_MAX;
 
-	// quick exit for obvious case where it will be too big. There can be
-	// values of val_len that still fail, but we just let the writer handle
-	// those failure cases
-	if (val_len >= buf_size)
-		return 0;
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		if (els->field.type != NDB_FILTER_TAGS)
+			continue;
 
-	make_cursor(buf, buf + buf_size, &writer);
+		if (!ndb_tags_merger_open(txn, filter, els, &merger))
+			continue;
 
-	ok =
-		cursor_push_byte(&writer, tag) &&
-		cursor_push(&writer, (unsigned char*)val, val_len) &&
-		cursor_push(&writer, (unsigned char*)&timestamp, sizeof(timestamp));
+		entries = 0;
+		while (entries < NDB_TAG_PROBE_MAX &&
+		       ndb_index_merger_next(&merger, &note_key))
+			entries++;
 
-	if (!ok)
-		return 0;
+		ndb_index_merger_destroy(&merger);
 
-	return writer.p - writer.start;
+		if (entries < best_entries) {
+			best = els;
+			best_entries = entries;
+		}
+	}
+
+	return best;
 }
 
-static int ndb_query_plan_execute_authors(struct ndb_txn *txn,
-					  struct ndb_filter *filter,
-					  struct ndb_query_state *results)
+/* Open the merged index scan behind one of the created_at ordered plans.
+ * `already_matched` is set to the filter fields the index itself guarantees,
+ * ready for ndb_filter_matches_with. A `stride` past 1 only takes every
+ * stride'th author's runs, which the planner uses to sample a plan too big
+ * to probe whole. */
+static int ndb_query_plan_merger(struct ndb_txn *txn,
+				 struct ndb_filter *filter,
+				 enum ndb_query_plan plan, int stride,
+				 struct ndb_index_merger *merger,
+				 int *already_matched)
 {
-	MDB_val k, v;
-	MDB_cursor *cur;
-	int rc, i, need_relays = 0;
-	uint64_t *pint, until, since, note_key;
+	struct ndb_filter_elements *kinds, *authors, *tags, *relays;
+	struct ndb_u64_ts kind_key;
+	struct ndb_id_u64_ts author_kind_key;
+	struct ndb_tsid author_key;
+	struct ndb_relay_kind_key relay_key;
+	uint64_t *pint, *all_kinds, until, since;
 	unsigned char *author;
-	struct ndb_note *note;
-	size_t note_size;
-	struct ndb_filter_elements *authors;
-	struct ndb_query_result res;
-	struct ndb_tsid tsid, *ptsid;
-	struct ndb_note_relay_iterator note_relay_iter;
-	enum ndb_dbs db;
-
-	db = txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY];
-
-	if (!(authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS)))
-		return 0;
+	const char *relay;
+	int i, j, len, num_kinds, num_tag_fields, ok;
+	// the relay+kind comparator requires 8 byte aligned keys
+	uint64_t keybuf_aligned[NDB_SCAN_KEY_MAX / 8];
+	unsigned char *keybuf = (unsigned char *)keybuf_aligned;
 
 	until = UINT64_MAX;
 	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
@@ -4788,641 +7043,761 @@ static int ndb_query_plan_execute_authors(struct ndb_txn *txn,
 	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
 		since = *pint;
 
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
-
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
-		return 0;
+	kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS);
+	authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS);
+	relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS);
 
-	for (i = 0; i < authors->count; i++) {
-		author = ndb_filter_get_id_element(filter, authors, i);
+	ok = 1;
+	switch (plan) {
+	/* Newest-first with nothing to index on.
+	 *
+	 * The created_at index is one reverse cursor, but it only covers every
+	 * note once its migration has run. Until then we merge the per-kind
+	 * scans of the kind index instead. The note id index is clustered by
+	 * id, not created_at, so scanning it backwards hands back an
+	 * arbitrary sample. */
+	case NDB_PLAN_CREATED:
+		*already_matched = 0;
 
-		ndb_tsid_init(&tsid, author, until);
+		if (ndb_db_version(txn) >= NDB_CREATED_INDEX_VERSION) {
+			if (!ndb_index_merger_init(merger,
+						   txn->lmdb->dbs[NDB_DB_NOTE_CREATED],
+						   NDB_SCAN_KEY_TS, since, 1))
+				return 0;
 
-		k.mv_data = &tsid;
-		k.mv_size = sizeof(tsid);
+			ok = ndb_index_merger_add(merger, txn, &until,
+						  sizeof(until));
+			break;
+		}
 
-		if (!ndb_cursor_start(cur, &k, &v))
-			continue;
+		if (!ndb_all_kinds(txn, &all_kinds, &num_kinds))
+			return 0;
 
-		// for each id in our ids filter, find in the db
-		while (!query_is_full(results)) {
-			ptsid = (struct ndb_tsid *)k.mv_data;
-			note_key = *(uint64_t*)v.mv_data;
+		if (!ndb_index_merger_init(merger,
+					   txn->lmdb->dbs[NDB_DB_NOTE_KIND],
+					   NDB_SCAN_KEY_U64_TS, since,
+					   num_kinds)) {
+			free(all_kinds);
+			return 0;
+		}
 
-			// don't continue the scan if we're below `since`
-			if (ptsid->timestamp < since)
-				break;
+		for (i = 0; ok && i < num_kinds; i++) {
+			ndb_u64_ts_init(&kind_key, all_kinds[i], until);
+			ok = ndb_index_merger_add(merger, txn, &kind_key,
+						  sizeof(kind_key));
+		}
 
-			// our author should match, if not bail
-			if (memcmp(author, ptsid->id, 32))
-				break;
+		free(all_kinds);
+		break;
 
-			// fetch the note, we need it for our query results
-			// and to match further against the filter
-			if (!(note = ndb_get_note_by_key(txn, note_key, &note_size)))
-				goto next;
+	// the kind index is only created_at ordered within a single kind, so
+	// merge the kinds rather than draining them one at a time
+	case NDB_PLAN_KINDS:
+		if (!kinds)
+			return 0;
 
-			if (need_relays)
-				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_key);
+		*already_matched = 1 << NDB_FILTER_KINDS;
 
-			if (!ndb_filter_matches_with(filter, note,
-						     1 << NDB_FILTER_AUTHORS,
-						     need_relays ? &note_relay_iter : NULL))
-			{
-				goto next;
-			}
+		if (!ndb_index_merger_init(merger,
+					   txn->lmdb->dbs[NDB_DB_NOTE_KIND],
+					   NDB_SCAN_KEY_U64_TS, since,
+					   kinds->count))
+			return 0;
 
-			ndb_query_result_init(&res, note, note_size, note_key);
-			if (!push_query_result(results, &res))
-				break;
+		for (i = 0; ok && i < kinds->count; i++) {
+			ndb_debug("kind %" PRIu64 "\n", kinds->elements[i]);
 
-next:
-			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
-				break;
+			ndb_u64_ts_init(&kind_key, kinds->elements[i], until);
+			ok = ndb_index_merger_add(merger, txn, &kind_key,
+						  sizeof(kind_key));
 		}
-	}
-
-	mdb_cursor_close(cur);
-	return 1;
-}
+		break;
 
-/* The largest index key we know how to scan over. relay+kind keys are the
- * biggest: 24 bytes of ints, a length byte, up to 248 bytes of relay url, a
- * nul terminator and 8-byte alignment padding. */
-#define NDB_SCAN_KEY_MAX 288
+	// every author+kind pair is its own created_at ordered run, so merge
+	// them instead of draining one pair at a time
+	case NDB_PLAN_AUTHOR_KINDS:
+		if (!kinds || !authors)
+			return 0;
 
-/* The index key layouts we know how to walk backwards over.
- *
- * Each of these indexes clusters its entries by some group (a kind, a
- * pubkey+kind, a relay+kind) and orders them by created_at within that group,
- * so a reverse cursor walk inside a single group is descending by created_at.
- * Across groups it is not ordered at all. */
-enum ndb_scan_key_type {
-	NDB_SCAN_KEY_U64_TS,     // note_kind:        {kind, created_at}
-	NDB_SCAN_KEY_ID_U64_TS,  // note_pubkey_kind: {pubkey, kind, created_at}
-	NDB_SCAN_KEY_RELAY_KIND, // relay_kind:       {note_key, kind, created_at, relay}
-};
+		*already_matched = (1 << NDB_FILTER_KINDS) |
+				   (1 << NDB_FILTER_AUTHORS);
 
-/* A reverse cursor over a single group of an index. */
-struct ndb_index_scanner {
-	/* the key we seeked with, kept so we can tell when we've walked out
-	 * of our group. first member so that it inherits the struct's 8 byte
-	 * alignment, which the relay+kind key parser requires */
-	unsigned char group[NDB_SCAN_KEY_MAX];
-	MDB_cursor *cur;
-	uint64_t created_at;
-	uint64_t note_key;
-};
+		if (!ndb_index_merger_init(merger,
+					   txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND],
+					   NDB_SCAN_KEY_ID_U64_TS, since,
+					   (authors->count + stride - 1) / stride *
+					   kinds->count))
+			return 0;
 
-/* Merges any number of reverse index scans into one created_at-descending
- * stream.
- *
- * Anything that spans more than one group (every kind, several kinds, several
- * authors) has to merge rather than concatenate. Draining group by group
- * lets the first group eat the whole limit and starve the rest, which looks
- * like results arriving out of order. */
-struct ndb_index_merger {
-	struct ndb_index_scanner *scanners;
-	int *heap; // indices into scanners, max-heap on created_at
-	int num_scanners;
-	int capacity;
-	int heap_len;
-	uint64_t since;
-	enum ndb_scan_key_type key_type;
-	MDB_dbi db;
-};
+		for (j = 0; ok && j < authors->count; j += stride) {
+			if (!(author = ndb_filter_get_id_element(filter, authors, j)))
+				continue;
 
-/* is the entry the cursor is sitting on still in this scanner's group? */
-static int ndb_scanner_in_group(struct ndb_index_scanner *s,
-				enum ndb_scan_key_type type, MDB_val *k)
-{
-	struct ndb_u64_ts *kts, *gts;
-	struct ndb_id_u64_ts *kits, *gits;
-	struct ndb_relay_kind_key krk, grk;
+			for (i = 0; ok && i < kinds->count; i++) {
+				ndb_id_u64_ts_init(&author_kind_key, author,
+						   kinds->elements[i], until);
+				ok = ndb_index_merger_add(merger, txn,
+							  &author_kind_key,
+							  sizeof(author_kind_key));
+			}
+		}
+		break;
 
-	switch (type) {
-	case NDB_SCAN_KEY_U64_TS:
-		if (k->mv_size != sizeof(*kts))
-			return 0;
-		kts = (struct ndb_u64_ts *)k->mv_data;
-		gts = (struct ndb_u64_ts *)s->group;
-		return kts->u64 == gts->u64;
-	case NDB_SCAN_KEY_ID_U64_TS:
-		if (k->mv_size != sizeof(*kits))
+	// one pubkey run per author
+	case NDB_PLAN_AUTHORS:
+		if (!authors)
 			return 0;
-		kits = (struct ndb_id_u64_ts *)k->mv_data;
-		gits = (struct ndb_id_u64_ts *)s->group;
-		return kits->u64 == gits->u64 && !memcmp(kits->id, gits->id, 32);
-	case NDB_SCAN_KEY_RELAY_KIND:
-		ndb_parse_relay_kind_key(&krk, (unsigned char *)k->mv_data);
-		ndb_parse_relay_kind_key(&grk, s->group);
-		return krk.kind == grk.kind && !strcmp(krk.relay, grk.relay);
-	}
 
-	return 0;
-}
+		*already_matched = 1 << NDB_FILTER_AUTHORS;
 
-static void ndb_scanner_read(struct ndb_index_scanner *s,
-			     enum ndb_scan_key_type type,
-			     MDB_val *k, MDB_val *v)
-{
-	struct ndb_relay_kind_key rk;
+		if (!ndb_index_merger_init(merger,
+					   txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY],
+					   NDB_SCAN_KEY_ID_TS, since,
+					   (authors->count + stride - 1) / stride))
+			return 0;
 
-	switch (type) {
-	case NDB_SCAN_KEY_U64_TS:
-		s->created_at = ((struct ndb_u64_ts *)k->mv_data)->timestamp;
-		s->note_key = *(uint64_t *)v->mv_data;
-		return;
-	case NDB_SCAN_KEY_ID_U64_TS:
-		s->created_at = ((struct ndb_id_u64_ts *)k->mv_data)->timestamp;
-		s->note_key = *(uint64_t *)v->mv_data;
-		return;
-	case NDB_SCAN_KEY_RELAY_KIND:
-		// the relay+kind index stores everything in the key
-		ndb_parse_relay_kind_key(&rk, (unsigned char *)k->mv_data);
-		s->created_at = rk.created_at;
-		s->note_key = rk.note_key;
-		return;
-	}
-}
+		for (j = 0; ok && j < authors->count; j += stride) {
+			if (!(author = ndb_filter_get_id_element(filter, authors, j)))
+				continue;
 
-/* Load the entry under the cursor. Returns 0 when this scanner is finished:
- * off the end of the db, out of its group, or below `since`. Stopping at
- * `since` is sound here because created_at descends within a group. */
-static int ndb_scanner_load(struct ndb_index_merger *m,
-			    struct ndb_index_scanner *s)
-{
-	MDB_val k, v;
+			ndb_tsid_init(&author_key, author, until);
+			ok = ndb_index_merger_add(merger, txn, &author_key,
+						  sizeof(author_key));
+		}
+		break;
 
-	if (mdb_cursor_get(s->cur, &k, &v, MDB_GET_CURRENT))
-		return 0;
+	// every relay+kind pair is its own created_at ordered run
+	case NDB_PLAN_RELAY_KINDS:
+		if (!kinds || !relays)
+			return 0;
 
-	if (!ndb_scanner_in_group(s, m->key_type, &k))
-		return 0;
+		*already_matched = (1 << NDB_FILTER_KINDS) |
+				   (1 << NDB_FILTER_RELAYS);
 
-	ndb_scanner_read(s, m->key_type, &k, &v);
+		if (!ndb_index_merger_init(merger,
+					   txn->lmdb->dbs[NDB_DB_NOTE_RELAY_KIND],
+					   NDB_SCAN_KEY_RELAY_KIND, since,
+					   relays->count * kinds->count))
+			return 0;
 
-	return s->created_at >= m->since;
-}
+		for (j = 0; ok && j < relays->count; j++) {
+			if (!(relay = ndb_filter_get_string_element(filter, relays, j)))
+				continue;
 
-static int ndb_merger_gt(struct ndb_index_merger *m, int a, int b)
-{
-	struct ndb_index_scanner *sa, *sb;
+			for (i = 0; ok && i < kinds->count; i++) {
+				ndb_debug("kind %" PRIu64 "\n", kinds->elements[i]);
 
-	sa = &m->scanners[a];
-	sb = &m->scanners[b];
+				if (!ndb_relay_kind_key_init_high(&relay_key, relay,
+								  kinds->elements[i],
+								  until)) {
+					ndb_debug("ndb_relay_kind_key_init_high failed in relay query\n");
+					continue;
+				}
 
-	if (sa->created_at != sb->created_at)
-		return sa->created_at > sb->created_at;
+				if (!(len = ndb_build_relay_kind_key(keybuf, NDB_SCAN_KEY_MAX, &relay_key))) {
+					ndb_debug("ndb_build_relay_kind_key failed in relay query\n");
+					ndb_debug_relay_kind_key(&relay_key);
+					continue;
+				}
 
-	// deterministic tiebreak for notes sharing a created_at
-	return sa->note_key > sb->note_key;
-}
+				ndb_debug("starting with key ");
+				ndb_debug_relay_kind_key(&relay_key);
 
-static void ndb_merger_swap(struct ndb_index_merger *m, int a, int b)
-{
-	int tmp;
+				ok = ndb_index_merger_add(merger, txn, keybuf, len);
+			}
+		}
+		break;
 
-	tmp = m->heap[a];
-	m->heap[a] = m->heap[b];
-	m->heap[b] = tmp;
-}
+	// one tag run per value of the most selective tag field
+	case NDB_PLAN_TAGS:
+		if (!(tags = ndb_filter_selective_tags(txn, filter, &num_tag_fields)))
+			return 0;
 
-static void ndb_merger_push(struct ndb_index_merger *m, int scanner)
-{
-	int i, parent;
+		// the index only vouches for the field we scan
+		*already_matched = num_tag_fields == 1 ? 1 << NDB_FILTER_TAGS : 0;
 
-	i = m->heap_len++;
-	m->heap[i] = scanner;
+		return ndb_tags_merger_open(txn, filter, tags, merger);
 
-	while (i > 0) {
-		parent = (i - 1) / 2;
-		if (!ndb_merger_gt(m, m->heap[i], m->heap[parent]))
-			break;
-		ndb_merger_swap(m, i, parent);
-		i = parent;
+	default:
+		return 0;
 	}
-}
 
-static void ndb_merger_sift(struct ndb_index_merger *m)
-{
-	int i, l, r, big;
+	if (!ok) {
+		ndb_index_merger_destroy(merger);
+		return 0;
+	}
 
-	for (i = 0;;) {
-		l = i * 2 + 1;
-		r = l + 1;
-		big = i;
+	return 1;
+}
 
-		if (l < m->heap_len && ndb_merger_gt(m, m->heap[l], m->heap[big]))
-			big = l;
-		if (r < m->heap_len && ndb_merger_gt(m, m->heap[r], m->heap[big]))
-			big = r;
-		if (big == i)
-			break;
+/* The most index streams the intersect plan walks together: one for its
+ * authors or kinds, one per tag field */
+#define NDB_MAX_SCAN_STREAMS 8
 
-		ndb_merger_swap(m, i, big);
-		i = big;
-	}
-}
+/* The index scan behind one of the created_at ordered plans.
+ *
+ * Most plans are a single merged stream. The intersect plan opens a stream
+ * per index it can use and zig-zags them down created_at together, seeking
+ * each one to the oldest of their heads, so it only hands out notes that
+ * every stream has without loading the ones that miss.
+ *
+ * Streams agree on created_at, not on order within it: the tag and
+ * relay+kind indexes don't keep a timestamp's notes in note_key order, and
+ * a note can sit under more than one value of a tag field. So wherever that
+ * matters we pull every note at a timestamp into `block` first, and
+ * intersect or dedup there.
+ *
+ * A scan the planner probed keeps the notes the probe read in `replay`, so
+ * the query can start over from them instead of opening the scan again. */
+struct ndb_plan_scan {
+	struct ndb_index_merger streams[NDB_MAX_SCAN_STREAMS];
+	int num_streams;
 
-static int ndb_index_merger_init(struct ndb_index_merger *m, MDB_dbi db,
-				 enum ndb_scan_key_type key_type,
-				 uint64_t since, int capacity)
-{
-	if (capacity <= 0)
-		capacity = 1;
+	uint64_t *block, *other;
+	uint64_t block_ts;
+	int block_len, block_pos, block_cap, other_len, other_cap;
 
-	m->scanners = calloc(capacity, sizeof(*m->scanners));
-	m->heap = malloc(capacity * sizeof(*m->heap));
+	uint64_t *replay; // note_key, created_at pairs
+	int replay_len, replay_pos, replay_cap;
 
-	if (!m->scanners || !m->heap) {
-		free(m->scanners);
-		free(m->heap);
-		return 0;
-	}
+	uint64_t created_at; // of the note we handed out last
+};
 
-	m->db = db;
-	m->key_type = key_type;
-	m->since = since;
-	m->capacity = capacity;
-	m->num_scanners = 0;
-	m->heap_len = 0;
+static void ndb_plan_scan_destroy(struct ndb_plan_scan *scan)
+{
+	int i;
+
+	for (i = 0; i < scan->num_streams; i++)
+		ndb_index_merger_destroy(&scan->streams[i]);
 
-	return 1;
+	free(scan->block);
+	free(scan->other);
+	free(scan->replay);
 }
 
-static void ndb_index_merger_destroy(struct ndb_index_merger *m)
+/* The index the intersect plan pairs with the filter's tag fields */
+static enum ndb_query_plan ndb_intersect_base(struct ndb_filter *filter)
 {
-	int i;
-
-	for (i = 0; i < m->num_scanners; i++)
-		mdb_cursor_close(m->scanners[i].cur);
+	if (ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS)) {
+		if (ndb_filter_find_elements(filter, NDB_FILTER_KINDS))
+			return NDB_PLAN_AUTHOR_KINDS;
+		return NDB_PLAN_AUTHORS;
+	}
 
-	free(m->scanners);
-	free(m->heap);
+	return NDB_PLAN_KINDS;
 }
 
-/* Add a group to the merge, seeked to the newest entry at or before the
- * `until` baked into `key`. Groups with nothing in range are dropped. */
-static int ndb_index_merger_add(struct ndb_index_merger *m,
-				struct ndb_txn *txn,
-				const void *key, size_t key_size)
+/* Open a plan's scan with only every stride'th author's runs, see
+ * ndb_query_plan_merger */
+static int ndb_plan_scan_sample(struct ndb_txn *txn, struct ndb_filter *filter,
+				enum ndb_query_plan plan, int stride,
+				struct ndb_plan_scan *scan, int *already_matched)
 {
-	struct ndb_index_scanner *s;
-	MDB_val k, v;
+	struct ndb_filter_elements *els;
+	int i, covered;
 
-	if (m->num_scanners == m->capacity || key_size > NDB_SCAN_KEY_MAX)
-		return 0;
+	memset(scan, 0, sizeof(*scan));
 
-	s = &m->scanners[m->num_scanners];
+	if (plan != NDB_PLAN_INTERSECT) {
+		if (!ndb_query_plan_merger(txn, filter, plan, stride,
+					   &scan->streams[0], already_matched))
+			return 0;
+		scan->num_streams = 1;
+		return 1;
+	}
 
-	if (mdb_cursor_open(txn->mdb_txn, m->db, &s->cur))
+	if (!ndb_query_plan_merger(txn, filter, ndb_intersect_base(filter),
+				   stride, &scan->streams[0], already_matched))
 		return 0;
+	scan->num_streams = 1;
 
-	memcpy(s->group, key, key_size);
-	m->num_scanners++;
+	// a stream per tag field, past the limit the filter checks the rest
+	covered = 1;
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+		if (els->field.type != NDB_FILTER_TAGS)
+			continue;
 
-	// ndb_cursor_start repoints k at the entry it found, leaving
-	// s->group intact
-	k.mv_data = s->group;
-	k.mv_size = key_size;
+		if (scan->num_streams == NDB_MAX_SCAN_STREAMS) {
+			covered = 0;
+			break;
+		}
 
-	if (!ndb_cursor_start(s->cur, &k, &v))
-		return 1;
+		if (!ndb_tags_merger_open(txn, filter, els,
+					  &scan->streams[scan->num_streams])) {
+			ndb_plan_scan_destroy(scan);
+			return 0;
+		}
+		scan->num_streams++;
+	}
 
-	if (ndb_scanner_load(m, s))
-		ndb_merger_push(m, m->num_scanners - 1);
+	if (covered)
+		*already_matched |= 1 << NDB_FILTER_TAGS;
 
 	return 1;
 }
 
-/* Pop the newest note across every group, then advance the group it came
- * from. */
-static int ndb_index_merger_next(struct ndb_index_merger *m, uint64_t *note_key)
+static int ndb_plan_scan_open(struct ndb_txn *txn, struct ndb_filter *filter,
+			      enum ndb_query_plan plan,
+			      struct ndb_plan_scan *scan, int *already_matched)
 {
-	struct ndb_index_scanner *s;
-	MDB_val k, v;
+	return ndb_plan_scan_sample(txn, filter, plan, 1, scan,
+				    already_matched);
+}
 
-	if (m->heap_len == 0)
-		return 0;
+/* Next note in the scan, newest first */
+static int ndb_plan_scan_next(struct ndb_plan_scan *scan, uint64_t *note_key)
+{
+	struct ndb_index_merger *stream;
+	uint64_t ts, head;
+	int i, j, k, n, agreed;
 
-	s = &m->scanners[m->heap[0]];
-	*note_key = s->note_key;
+	if (scan->replay_pos < scan->replay_len) {
+		*note_key = scan->replay[scan->replay_pos * 2];
+		scan->created_at = scan->replay[scan->replay_pos * 2 + 1];
+		scan->replay_pos++;
+		return 1;
+	}
 
-	if (mdb_cursor_get(s->cur, &k, &v, MDB_PREV) || !ndb_scanner_load(m, s)) {
-		// this group is done, drop it out of the heap
-		m->heap[0] = m->heap[--m->heap_len];
+	// nothing to intersect and nothing to dedup. a note only sits in
+	// more than one group of the tag index (two of a field's values) or
+	// the relay+kind index (two relays)
+	if (scan->num_streams == 1 &&
+	    (scan->streams[0].num_scanners == 1 ||
+	     (scan->streams[0].key_type != NDB_SCAN_KEY_TAG &&
+	      scan->streams[0].key_type != NDB_SCAN_KEY_RELAY_KIND))) {
+		return ndb_index_merger_peek(&scan->streams[0],
+					     &scan->created_at) &&
+		       ndb_index_merger_next(&scan->streams[0], note_key);
 	}
 
-	ndb_merger_sift(m);
+	while (scan->block_pos == scan->block_len) {
+		// every stream has to come down to the oldest of their heads
+		ts = 0;
+		for (i = 0; i < scan->num_streams; i++) {
+			if (!ndb_index_merger_peek(&scan->streams[i], &head))
+				return 0;
+			if (i == 0 || head < ts)
+				ts = head;
+		}
+
+		agreed = 1;
+		for (i = 0; i < scan->num_streams; i++) {
+			stream = &scan->streams[i];
+			ndb_index_merger_seek(stream, ts);
+			if (!ndb_index_merger_peek(stream, &head))
+				return 0;
+			if (head != ts)
+				agreed = 0;
+		}
+
+		if (!agreed)
+			continue;
+
+		// every stream has notes at ts, keep the ones they share
+		scan->block_pos = 0;
+		scan->block_ts = ts;
+		if (!ndb_index_merger_take(&scan->streams[0], ts, &scan->block,
+					   &scan->block_len, &scan->block_cap))
+			return 0;
+
+		for (i = 1; i < scan->num_streams && scan->block_len; i++) {
+			if (!ndb_index_merger_take(&scan->streams[i], ts,
+						   &scan->other,
+						   &scan->other_len,
+						   &scan->other_cap))
+				return 0;
+
+			// both are sorted descending
+			for (j = k = n = 0; j < scan->block_len &&
+					    k < scan->other_len;) {
+				if (scan->block[j] == scan->other[k]) {
+					scan->block[n++] = scan->block[j];
+					j++;
+					k++;
+				} else if (scan->block[j] > scan->other[k]) {
+					j++;
+				} else {
+					k++;
+				}
+			}
+			scan->block_len = n;
+		}
+	}
 
+	*note_key = scan->block[scan->block_pos++];
+	scan->created_at = scan->block_ts;
 	return 1;
 }
 
-/* Collect every kind present in the kind index. The index is clustered by
- * kind, so we can hop from one kind to the next instead of walking every
- * entry. */
-static int ndb_all_kinds(struct ndb_txn *txn, uint64_t **out, int *out_count)
+/* Put a scanner back on the entry a continuation token left it sitting on.
+ * If that note has since gone from the index, we settle for the newest
+ * entry before it. */
+static int ndb_scanner_restore(struct ndb_index_merger *m,
+			       struct ndb_index_scanner *s,
+			       uint64_t created_at, uint64_t note_key)
 {
-	MDB_cursor *cur;
+	// the index comparators read keys as integers
+	uint64_t key_aligned[NDB_SCAN_KEY_MAX / 8];
+	unsigned char *key = (unsigned char *)key_aligned;
+	uint64_t ts;
 	MDB_val k, v;
-	struct ndb_u64_ts key;
-	uint64_t *kinds, *tmp, kind;
-	int count, capacity;
 
-	*out = NULL;
-	*out_count = 0;
+	memcpy(key, s->group, s->group_size);
+	k.mv_data = key;
+	k.mv_size = s->group_size;
 
-	capacity = 16;
-	count = 0;
+	if (m->key_type == NDB_SCAN_KEY_RELAY_KIND) {
+		// note_key is the last thing the relay+kind keys sort on, so
+		// the entry right before note_key+1 is ours
+		note_key++;
+		memcpy(key, &note_key, sizeof(note_key));
+		memcpy(key + 16, &created_at, sizeof(created_at));
+		return ndb_cursor_start(s->cur, &k, &v) && ndb_scanner_load(m, s);
+	}
 
-	if (!(kinds = malloc(capacity * sizeof(*kinds))))
-		return 0;
+	memcpy(key + s->group_size - sizeof(created_at), &created_at,
+	       sizeof(created_at));
+	v.mv_data = &note_key;
+	v.mv_size = sizeof(note_key);
 
-	if (mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE_KIND], &cur)) {
-		free(kinds);
-		return 0;
-	}
+	if (!mdb_cursor_get(s->cur, &k, &v, MDB_GET_BOTH))
+		return ndb_scanner_load(m, s);
 
-	ndb_u64_ts_init(&key, 0, 0);
-	k.mv_data = &key;
-	k.mv_size = sizeof(key);
+	ts = created_at + 1;
+	k.mv_data = key;
+	k.mv_size = s->group_size;
+	memcpy(key + s->group_size - sizeof(ts), &ts, sizeof(ts));
 
-	while (!mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE)) {
-		kind = ((struct ndb_u64_ts *)k.mv_data)->u64;
+	return ndb_cursor_start(s->cur, &k, &v) && ndb_scanner_load(m, s);
+}
 
-		if (count == capacity) {
-			capacity *= 2;
-			if (!(tmp = realloc(kinds, capacity * sizeof(*kinds)))) {
-				mdb_cursor_close(cur);
-				free(kinds);
-				return 0;
-			}
-			kinds = tmp;
+#define NDB_QUERY_TOKEN_VERSION 1
+
+/* FNV-1a over a stream's groups, so a token can only resume the scan it was
+ * taken from. The tags plan picks its field by how full each one is, which
+ * can change between pages. */
+static uint64_t ndb_merger_groups_hash(struct ndb_index_merger *m)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	struct ndb_index_scanner *s;
+	int i;
+	size_t j;
+
+	for (i = 0; i < m->num_scanners; i++) {
+		s = &m->scanners[i];
+
+		// relay+kind groups carry the note_key and created_at we
+		// seeked with, only the relay and kind name the group
+		j = m->key_type == NDB_SCAN_KEY_RELAY_KIND ? 8 : 0;
+		for (; j < s->group_size; j++) {
+			if (m->key_type == NDB_SCAN_KEY_RELAY_KIND && j == 16)
+				j = 24;
+			hash = (hash ^ s->group[j]) * 0x100000001b3ULL;
 		}
+	}
 
-		kinds[count++] = kind;
+	return hash;
+}
 
-		if (kind == UINT64_MAX)
-			break;
+/* A continuation token is a string of varints:
+ *
+ *   version, plan, number of streams, then for each stream its number of
+ *   scanners, a hash of their groups, and for each scanner whether it's
+ *   still live and the created_at and note_key of the entry it will read
+ *   next. Last comes whatever is left of the block of same-created_at
+ *   notes the scan was handing out, led by that created_at.
+ *
+ * The groups themselves come from the filter, so the token only has to say
+ * where in them we were. */
+static int ndb_plan_scan_save(struct ndb_plan_scan *scan,
+			      enum ndb_query_plan plan,
+			      unsigned char *buf, int bufsize, int *len)
+{
+	struct ndb_index_merger *m;
+	struct ndb_index_scanner *s;
+	struct cursor cur;
+	unsigned char *live;
+	int i, j, ok;
 
-		// jump past every entry for this kind
-		ndb_u64_ts_init(&key, kind + 1, 0);
-		k.mv_data = &key;
-		k.mv_size = sizeof(key);
-	}
+	make_cursor(buf, buf + bufsize, &cur);
 
-	mdb_cursor_close(cur);
+	ok = cursor_push_varint(&cur, NDB_QUERY_TOKEN_VERSION) > 0 &&
+	     cursor_push_varint(&cur, plan) > 0 &&
+	     cursor_push_varint(&cur, scan->num_streams) > 0;
 
-	*out = kinds;
-	*out_count = count;
+	for (i = 0; ok && i < scan->num_streams; i++) {
+		m = &scan->streams[i];
 
-	return 1;
+		if (!(live = calloc(m->num_scanners + 1, 1)))
+			return 0;
+
+		for (j = 0; j < m->heap_len; j++)
+			live[m->heap[j]] = 1;
+
+		ok = cursor_push_varint(&cur, m->num_scanners) > 0 &&
+		     cursor_push_varint(&cur, ndb_merger_groups_hash(m)) > 0;
+
+		for (j = 0; ok && j < m->num_scanners; j++) {
+			s = &m->scanners[j];
+			ok = cursor_push_varint(&cur, live[j]) > 0 &&
+			     cursor_push_varint(&cur, live[j] ? s->created_at : 0) > 0 &&
+			     cursor_push_varint(&cur, live[j] ? s->note_key : 0) > 0;
+		}
+
+		free(live);
+	}
+
+	ok = ok && cursor_push_varint(&cur, scan->block_len - scan->block_pos) > 0 &&
+	     cursor_push_varint(&cur, scan->block_ts) > 0;
+	for (i = scan->block_pos; ok && i < scan->block_len; i++)
+		ok = cursor_push_varint(&cur, scan->block[i]) > 0;
+
+	*len = ok ? cur.p - cur.start : 0;
+	return ok;
 }
 
-/* Drain a merged scan into the query results, filtering as we go. */
-static void ndb_query_drain_merger(struct ndb_txn *txn,
-				   struct ndb_filter *filter,
-				   struct ndb_query_state *results,
-				   struct ndb_index_merger *merger,
-				   int already_matched,
-				   int need_relays)
+static int ndb_query_token_plan(const unsigned char *token, int token_len,
+				enum ndb_query_plan *plan)
 {
-	struct ndb_query_result res;
-	struct ndb_note *note;
-	struct ndb_note_relay_iterator note_relay_iter;
-	uint64_t note_key;
-	size_t note_size;
-
-	while (!query_is_full(results) &&
-	       ndb_index_merger_next(merger, &note_key)) {
-		if (!(note = ndb_get_note_by_key(txn, note_key, &note_size)))
-			continue;
+	struct cursor cur;
+	uint64_t version, n;
 
-		if (need_relays)
-			ndb_note_relay_iterate_start(txn, &note_relay_iter, note_key);
+	make_cursor((unsigned char *)token, (unsigned char *)token + token_len,
+		    &cur);
 
-		if (!ndb_filter_matches_with(filter, note, already_matched,
-					     need_relays ? &note_relay_iter : NULL))
-			continue;
+	if (!cursor_pull_varint(&cur, &version) ||
+	    version != NDB_QUERY_TOKEN_VERSION ||
+	    !cursor_pull_varint(&cur, &n))
+		return 0;
 
-		ndb_query_result_init(&res, note, (uint64_t)note_size, note_key);
-		if (!push_query_result(results, &res))
-			break;
-	}
+	*plan = (enum ndb_query_plan)n;
+	return 1;
 }
 
-/* Newest-first with nothing to index on.
- *
- * No index orders every note by created_at, so we merge the per-kind scans of
- * the kind index instead. The note id index is clustered by id, not
- * created_at, so scanning it backwards hands back an arbitrary sample. */
-static int ndb_query_plan_execute_created_at(struct ndb_txn *txn,
-					     struct ndb_filter *filter,
-					     struct ndb_query_state *results)
+/* Move a freshly opened scan to where a token says it was. Fails if the
+ * token wasn't made from this filter. */
+static int ndb_plan_scan_restore(struct ndb_plan_scan *scan,
+				 const unsigned char *token, int token_len)
 {
-	struct ndb_index_merger merger;
-	struct ndb_u64_ts key;
-	uint64_t *kinds, *pint, until, since;
-	int i, num_kinds, need_relays = 0, ok;
+	struct ndb_index_merger *m;
+	struct cursor cur;
+	uint64_t version, plan, n, live, created_at, note_key;
+	int i, j;
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+	make_cursor((unsigned char *)token, (unsigned char *)token + token_len,
+		    &cur);
 
-	since = 0;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-		since = *pint;
+	if (!cursor_pull_varint(&cur, &version) ||
+	    !cursor_pull_varint(&cur, &plan) ||
+	    !cursor_pull_varint(&cur, &n) || n != (uint64_t)scan->num_streams)
+		return 0;
 
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
+	for (i = 0; i < scan->num_streams; i++) {
+		m = &scan->streams[i];
+
+		if (!cursor_pull_varint(&cur, &n) ||
+		    n != (uint64_t)m->num_scanners ||
+		    !cursor_pull_varint(&cur, &n) ||
+		    n != ndb_merger_groups_hash(m))
+			return 0;
+
+		m->heap_len = 0;
+
+		for (j = 0; j < m->num_scanners; j++) {
+			if (!cursor_pull_varint(&cur, &live) ||
+			    !cursor_pull_varint(&cur, &created_at) ||
+			    !cursor_pull_varint(&cur, &note_key))
+				return 0;
+
+			if (live && ndb_scanner_restore(m, &m->scanners[j],
+							created_at, note_key))
+				ndb_merger_push(m, j);
+		}
+	}
 
-	if (!ndb_all_kinds(txn, &kinds, &num_kinds))
+	if (!cursor_pull_varint(&cur, &n) || n > (uint64_t)(token_len) ||
+	    !cursor_pull_varint(&cur, &scan->block_ts))
 		return 0;
 
-	if (!ndb_index_merger_init(&merger, txn->lmdb->dbs[NDB_DB_NOTE_KIND],
-				   NDB_SCAN_KEY_U64_TS, since, num_kinds)) {
-		free(kinds);
+	if (n && !(scan->block = malloc(n * sizeof(*scan->block))))
 		return 0;
-	}
 
-	ok = 1;
-	for (i = 0; i < num_kinds; i++) {
-		ndb_u64_ts_init(&key, kinds[i], until);
-		if (!ndb_index_merger_add(&merger, txn, &key, sizeof(key))) {
-			ok = 0;
-			break;
-		}
+	scan->block_cap = scan->block_len = n;
+	scan->block_pos = 0;
+
+	for (i = 0; i < scan->block_len; i++) {
+		if (!cursor_pull_varint(&cur, &scan->block[i]))
+			return 0;
 	}
 
-	if (ok)
-		ndb_query_drain_merger(txn, filter, results, &merger, 0,
-				       need_relays);
+	return 1;
+}
+
+/* Remember the note a probe just read off the scan, see
+ * ndb_plan_scan_rewind */
+static int ndb_plan_scan_record(struct ndb_plan_scan *scan, uint64_t note_key)
+{
+	uint64_t *replay;
+	int cap;
 
-	ndb_index_merger_destroy(&merger);
-	free(kinds);
+	if (scan->replay_len == scan->replay_cap) {
+		cap = max(scan->replay_cap * 2, 64);
+		if (!(replay = realloc(scan->replay, cap * 2 * sizeof(*replay))))
+			return 0;
+		scan->replay = replay;
+		scan->replay_cap = cap;
+	}
 
-	return ok;
+	scan->replay[scan->replay_len * 2] = note_key;
+	scan->replay[scan->replay_len * 2 + 1] = scan->created_at;
+	scan->replay_pos = ++scan->replay_len;
+
+	return 1;
 }
 
-static int ndb_query_plan_execute_tags(struct ndb_txn *txn,
-				       struct ndb_filter *filter,
-				       struct ndb_query_state *results)
+/* Hand out the notes a probe read again, then carry on from where it
+ * stopped */
+static void ndb_plan_scan_rewind(struct ndb_plan_scan *scan)
 {
-	MDB_cursor *cur;
-	MDB_dbi db;
-	MDB_val k, v;
-	int len, taglen, rc, i, need_relays = 0;
-	uint64_t *pint, until, note_id;
-	size_t note_size;
-	unsigned char key_buffer[255];
-	struct ndb_note *note;
-	struct ndb_filter_elements *tags;
-	unsigned char *tag;
-	struct ndb_query_result res;
-	struct ndb_note_relay_iterator note_relay_iter;
+	scan->replay_pos = 0;
+}
 
-	db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
+/* Is there anything left for the scan to hand out? */
+static int ndb_plan_scan_done(struct ndb_plan_scan *scan)
+{
+	int i;
 
-	if (!(tags = ndb_filter_find_elements(filter, NDB_FILTER_TAGS)))
+	if (scan->block_pos < scan->block_len ||
+	    scan->replay_pos < scan->replay_len)
 		return 0;
 
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
+	// an intersection is over as soon as any of its streams is
+	for (i = 0; i < scan->num_streams; i++) {
+		if (scan->streams[i].heap_len == 0)
+			return 1;
+	}
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+	return 0;
+}
 
-	if ((rc = mdb_cursor_open(txn->mdb_txn, db, &cur)))
-		return 0;
+/* How many index entries the scan has read so far */
+static uint64_t ndb_plan_scan_entries(struct ndb_plan_scan *scan)
+{
+	uint64_t entries;
+	int i;
 
-	for (i = 0; i < tags->count; i++) {
-		tag = ndb_filter_get_id_element(filter, tags, i);
+	entries = 0;
+	for (i = 0; i < scan->num_streams; i++)
+		entries += scan->streams[i].entries;
 
-		taglen = tags->field.elem_type == NDB_ELEMENT_ID
-		       ? 32 : strlen((const char*)tag);
+	return entries;
+}
 
-		if (!(len = ndb_encode_tag_key(key_buffer, sizeof(key_buffer),
-					       tags->field.tag, tag, taglen,
-					       until))) {
-			goto fail;
-		}
+static int ndb_plan_scan_needs_relays(struct ndb_filter *filter,
+				      int already_matched)
+{
+	return !(already_matched & (1 << NDB_FILTER_RELAYS)) &&
+		ndb_filter_find_elements(filter, NDB_FILTER_RELAYS) != NULL;
+}
 
-		k.mv_data = key_buffer;
-		k.mv_size = len;
+/* Load notes off the scan until one matches the whole filter */
+static int ndb_plan_scan_next_result(struct ndb_txn *txn,
+				     struct ndb_filter *filter,
+				     struct ndb_plan_scan *scan,
+				     int already_matched, int need_relays,
+				     struct ndb_query_state *results,
+				     struct ndb_query_result *res)
+{
+	struct ndb_note *note;
+	struct ndb_note_relay_iterator note_relay_iter;
+	uint64_t note_key;
+	size_t note_size;
 
-		if (!ndb_cursor_start(cur, &k, &v))
+	while (ndb_plan_scan_next(scan, &note_key)) {
+		if (!(note = ndb_get_note_by_key(txn, note_key, &note_size)))
 			continue;
 
-		// for each id in our ids filter, find in the db
-		while (!query_is_full(results)) {
-			// check if tag value matches, bail if not
-			if (((unsigned char *)k.mv_data)[0] != tags->field.tag)
-				break;
+		if (need_relays)
+			ndb_note_relay_iterate_start(txn, &note_relay_iter, note_key);
 
-			// check if tag value matches, bail if not
-			if (taglen != k.mv_size - 9)
-				break;
+		if (!ndb_filter_matches_with(filter, note, already_matched,
+					     need_relays ? &note_relay_iter : NULL)) {
+			ndb_explain_note(results, 0);
+			continue;
+		}
+		ndb_explain_note(results, 1);
 
-			if (memcmp((unsigned char *)k.mv_data+1, tag, k.mv_size-9))
-				break;
+		ndb_query_result_init(res, note, (uint64_t)note_size, note_key);
+		return 1;
+	}
 
-			note_id = *(uint64_t*)v.mv_data;
+	return 0;
+}
 
-			if (!(note = ndb_get_note_by_key(txn, note_id, &note_size)))
-				goto next;
+/* Account for the index work a finished scan did */
+static void ndb_explain_scan(struct ndb_query_state *results,
+			     struct ndb_plan_scan *scan)
+{
+	struct ndb_index_merger *stream;
+	int i, j;
 
-			if (need_relays)
-				ndb_note_relay_iterate_start(txn, &note_relay_iter, note_id);
+	if (!results->explain)
+		return;
 
-			if (!ndb_filter_matches_with(filter, note,
-						     1 << NDB_FILTER_TAGS,
-						     need_relays ? &note_relay_iter : NULL))
-				goto next;
+	results->explain->index_entries += ndb_plan_scan_entries(scan);
 
-			ndb_query_result_init(&res, note, note_size, note_id);
-			if (!push_query_result(results, &res))
-				break;
+	for (i = 0; i < scan->num_streams; i++) {
+		stream = &scan->streams[i];
+		ndb_explain_seeks(results, stream->num_scanners);
 
-next:
-			if (mdb_cursor_get(cur, &k, &v, MDB_PREV))
-				break;
+		for (j = 0; j < stream->num_scanners; j++) {
+			results->explain->max_scanner_entries =
+				max(results->explain->max_scanner_entries,
+				    stream->scanners[j].entries);
 		}
 	}
-
-	mdb_cursor_close(cur);
-	return 1;
-fail:
-	mdb_cursor_close(cur);
-	return 0;
 }
 
-static int ndb_query_plan_execute_author_kinds(
-		struct ndb_txn *txn,
-		struct ndb_filter *filter,
-		struct ndb_query_state *results)
+/* Load and filter each note the scan turns up until the query is full */
+static void ndb_query_drain_scan(struct ndb_txn *txn,
+				 struct ndb_filter *filter,
+				 struct ndb_query_state *results,
+				 struct ndb_plan_scan *scan,
+				 int already_matched)
 {
-	struct ndb_index_merger merger;
-	struct ndb_filter_elements *kinds, *relays, *authors;
-	uint64_t kind, until, since, *pint;
-	unsigned char *author;
-	int i, j, ok;
-	struct ndb_id_u64_ts key;
+	struct ndb_query_result res;
+	int need_relays;
 
-	// we should have kinds in a kinds filter!
-	if (!(kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS)))
-		return 0;
-	//
-	// we should have kinds in a kinds filter!
-	if (!(authors = ndb_filter_find_elements(filter, NDB_FILTER_AUTHORS)))
-		return 0;
+	need_relays = ndb_plan_scan_needs_relays(filter, already_matched);
 
-	relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS);
+	while (!query_is_full(results) &&
+	       ndb_plan_scan_next_result(txn, filter, scan, already_matched,
+					 need_relays, results, &res)) {
+		if (!push_query_result(results, &res))
+			break;
+	}
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+	ndb_explain_scan(results, scan);
+}
 
-	since = 0;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-		since = *pint;
+/* Run one of the merged, created_at ordered plans */
+static int ndb_query_plan_execute_merged(struct ndb_txn *txn,
+					 struct ndb_filter *filter,
+					 enum ndb_query_plan plan,
+					 struct ndb_query_state *results)
+{
+	struct ndb_plan_scan scan;
+	int already_matched;
 
-	// every author+kind pair is its own created_at ordered run, so merge
-	// them instead of draining one pair at a time
-	if (!ndb_index_merger_init(&merger,
-				   txn->lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND],
-				   NDB_SCAN_KEY_ID_U64_TS, since,
-				   authors->count * kinds->count))
+	if (!ndb_plan_scan_open(txn, filter, plan, &scan, &already_matched))
 		return 0;
 
-	ok = 1;
-	for (j = 0; ok && j < authors->count; j++) {
-		if (!(author = ndb_filter_get_id_element(filter, authors, j)))
-			continue;
-
-		for (i = 0; i < kinds->count; i++) {
-			kind = kinds->elements[i];
-
-			ndb_debug("finding kind %"PRIu64"\n", kind);
+	ndb_query_drain_scan(txn, filter, results, &scan, already_matched);
 
-			ndb_id_u64_ts_init(&key, author, kind, until);
-			if (!ndb_index_merger_add(&merger, txn, &key, sizeof(key))) {
-				ok = 0;
-				break;
-			}
-		}
-	}
-
-	if (ok)
-		ndb_query_drain_merger(txn, filter, results, &merger,
-				       (1 << NDB_FILTER_KINDS) | (1 << NDB_FILTER_AUTHORS),
-				       relays != NULL);
-
-	ndb_index_merger_destroy(&merger);
+	ndb_plan_scan_destroy(&scan);
 
-	return ok;
+	return 1;
 }
 
 static int ndb_query_plan_execute_profile_search(
@@ -5465,6 +7840,11 @@ static int ndb_query_plan_execute_profile_search(
 	if (!(filter_pubkey = ndb_filter_get_id_element(f, els, 0)))
 		goto fail;
 
+	// the compiled matcher keeps its own copy of the authors, which
+	// would go stale as we swap pubkeys in
+	ndb_filter_matcher_free(f->matcher);
+	f->matcher = NULL;
+
 	for (i = 0; !query_is_full(results); i++) {
 		if (i == 0) {
 			if (!ndb_search_profile(txn, &profile_search, search))
@@ -5478,7 +7858,9 @@ static int ndb_query_plan_execute_profile_search(
 		memcpy(filter_pubkey, profile_search.key->id, 32);
 
 		// Look up the corresponding note associated with that pubkey
-		if (!ndb_query_plan_execute_author_kinds(txn, f, results))
+		if (!ndb_query_plan_execute_merged(txn, f,
+						   NDB_PLAN_AUTHOR_KINDS,
+						   results))
 			goto fail;
 	}
 
@@ -5491,142 +7873,168 @@ fail:
 	return 0;
 }
 
-static int ndb_query_plan_execute_relay_kinds(
-		struct ndb_txn *txn,
-		struct ndb_filter *filter,
-		struct ndb_query_state *results)
-{
-	struct ndb_index_merger merger;
-	struct ndb_filter_elements *kinds, *relays;
-	uint64_t kind, until, since, *pint;
-	const char *relay;
-	int i, j, len, ok;
-	struct ndb_relay_kind_key relay_key;
-	// the relay+kind comparator requires 8 byte aligned keys
-	uint64_t keybuf_aligned[NDB_SCAN_KEY_MAX / 8];
-	unsigned char *keybuf = (unsigned char *)keybuf_aligned;
-
-	// we should have kinds in a kinds filter!
-	if (!(kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS)))
-		return 0;
+static int filter_is_empty(struct ndb_filter *filter) {
+	return filter->elem_buf.start == NULL;
+}
 
-	if (!(relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS)))
-		return 0;
+static const char *ndb_query_plan_name(enum ndb_query_plan plan_id)
+{
+	switch (plan_id) {
+		case NDB_PLAN_IDS:     return "ids";
+		case NDB_PLAN_SEARCH:  return "search";
+		case NDB_PLAN_KINDS:   return "kinds";
+		case NDB_PLAN_TAGS:    return "tags";
+		case NDB_PLAN_CREATED: return "created";
+		case NDB_PLAN_AUTHORS: return "authors";
+		case NDB_PLAN_RELAY_KINDS: return "relay_kinds";
+		case NDB_PLAN_AUTHOR_KINDS: return "author_kinds";
+		case NDB_PLAN_PROFILE_SEARCH: return "profile_search";
+		case NDB_PLAN_INTERSECT: return "intersect";
+		case NDB_PLAN_ALL_NOTES: return "all_notes";
+	}
 
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+	return "unknown";
+}
 
-	since = 0;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-		since = *pint;
+/* Does the index behind a scan vouch for every field of the filter? The
+ * scan itself bounds since and until, and counts don't have limits. */
+static int ndb_filter_is_covered(struct ndb_filter *filter, int already_matched)
+{
+	struct ndb_filter_elements *els;
+	int i;
 
-	// every relay+kind pair is its own created_at ordered run, so merge
-	// them instead of draining one pair at a time
-	if (!ndb_index_merger_init(&merger,
-				   txn->lmdb->dbs[NDB_DB_NOTE_RELAY_KIND],
-				   NDB_SCAN_KEY_RELAY_KIND, since,
-				   relays->count * kinds->count))
-		return 0;
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
 
-	ok = 1;
-	for (j = 0; ok && j < relays->count; j++) {
-		if (!(relay = ndb_filter_get_string_element(filter, relays, j)))
+		switch (els->field.type) {
+		case NDB_FILTER_SINCE:
+		case NDB_FILTER_UNTIL:
+		case NDB_FILTER_LIMIT:
 			continue;
-
-		for (i = 0; i < kinds->count; i++) {
-			kind = kinds->elements[i];
-			ndb_debug("kind %" PRIu64 "\n", kind);
-
-			if (!ndb_relay_kind_key_init_high(&relay_key, relay, kind, until)) {
-				ndb_debug("ndb_relay_kind_key_init_high failed in relay query\n");
-				continue;
-			}
-
-			if (!(len = ndb_build_relay_kind_key(keybuf, NDB_SCAN_KEY_MAX, &relay_key))) {
-				ndb_debug("ndb_build_relay_kind_key failed in relay query\n");
-				ndb_debug_relay_kind_key(&relay_key);
-				continue;
-			}
-
-			ndb_debug("starting with key ");
-			ndb_debug_relay_kind_key(&relay_key);
-
-			if (!ndb_index_merger_add(&merger, txn, keybuf, len)) {
-				ok = 0;
-				break;
-			}
+		default:
+			if (!(already_matched & (1 << els->field.type)))
+				return 0;
 		}
 	}
 
-	if (ok)
-		ndb_query_drain_merger(txn, filter, results, &merger,
-				       (1 << NDB_FILTER_KINDS) | (1 << NDB_FILTER_RELAYS), 0);
-
-	ndb_index_merger_destroy(&merger);
-
-	return ok;
+	return 1;
 }
 
-static int ndb_query_plan_execute_kinds(struct ndb_txn *txn,
-					struct ndb_filter *filter,
-					struct ndb_query_state *results)
-{
-	struct ndb_index_merger merger;
-	struct ndb_u64_ts tsid;
-	struct ndb_filter_elements *kinds;
-	uint64_t kind, until, since, *pint;
-	int i, need_relays = 0, ok;
-
-	// we should have kinds in a kinds filter!
-	if (!(kinds = ndb_filter_find_elements(filter, NDB_FILTER_KINDS)))
-		return 0;
-
-	if (ndb_filter_find_elements(filter, NDB_FILTER_RELAYS))
-		need_relays = 1;
-
-	until = UINT64_MAX;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_UNTIL)))
-		until = *pint;
+/* What the planner's probes have learned about a filter */
+struct ndb_plan_probe {
+	uint64_t want;   // results the query wants, 0 for all of them
+	uint64_t floor;  // the query reaches back to at least this created_at
+	uint64_t need;   // the fewest entries past its seeks any plan can read
+	uint64_t probed; // index entries read so far
+};
 
-	since = 0;
-	if ((pint = ndb_filter_get_int(filter, NDB_FILTER_SINCE)))
-		since = *pint;
+/* Estimate a plan's scan from its index keys alone, without loading a note.
+ *
+ * Every entry of a scan whose index covers the filter is a result, so that
+ * scan stops at its `want`th entry, and its created_at is how far back the
+ * query reaches. A scan that still has to match notes can't stop any
+ * sooner, so it reads until it has seen `want` entries and gone below the
+ * oldest created_at a probe has reached. That's optimistic until a covering
+ * scan has been probed, which is why those are listed first. With no
+ * `want`, every scan reads all of its entries, and a covering scan's count
+ * of them is the number of results.
+ *
+ * A `stride` past 1 probes every stride'th author's runs, a sample that
+ * reaches as far back with 1/stride of the results, and scales what it read
+ * back up. A probe never reads more than NDB_PLAN_PROBE_MAX entries itself.
+ *
+ * The probe's scan is left in `scan`, rewindable to the notes it read, for
+ * the caller to run or destroy. Returns the entries the whole scan would
+ * read, or UINT64_MAX if that's more than `budget`. */
+static uint64_t ndb_query_plan_probe(struct ndb_txn *txn,
+				     struct ndb_filter *filter,
+				     enum ndb_query_plan plan, int stride,
+				     struct ndb_plan_probe *probe,
+				     uint64_t budget,
+				     struct ndb_plan_scan *scan,
+				     int *already_matched)
+{
+	uint64_t note_key, read, n, want, reached;
+	int covered;
+
+	if (!ndb_plan_scan_sample(txn, filter, plan, stride, scan,
+				  already_matched)) {
+		memset(scan, 0, sizeof(*scan));
+		return UINT64_MAX;
+	}
+
+	covered = ndb_filter_is_covered(filter, *already_matched);
+	want = (probe->want + stride - 1) / stride;
+
+	n = 0;
+	reached = 0;
+	while (ndb_plan_scan_next(scan, &note_key)) {
+		read = ndb_plan_scan_entries(scan);
+		if (read > NDB_PLAN_PROBE_MAX || read * stride > budget)
+			break;
 
-	// the kind index is only created_at ordered within a single kind, so
-	// merge the kinds rather than draining them one at a time
-	if (!ndb_index_merger_init(&merger, txn->lmdb->dbs[NDB_DB_NOTE_KIND],
-				   NDB_SCAN_KEY_U64_TS, since, kinds->count))
-		return 0;
+		if (!ndb_plan_scan_record(scan, note_key)) {
+			probe->probed += read;
+			return UINT64_MAX;
+		}
 
-	ok = 1;
-	for (i = 0; i < kinds->count; i++) {
-		kind = kinds->elements[i];
-		ndb_debug("kind %" PRIu64 "\n", kind);
+		if (++n == want)
+			reached = scan->created_at;
 
-		ndb_u64_ts_init(&tsid, kind, until);
-		if (!ndb_index_merger_add(&merger, txn, &tsid, sizeof(tsid))) {
-			ok = 0;
+		if (want && n >= want &&
+		    (covered || scan->created_at < probe->floor))
 			break;
-		}
 	}
 
-	if (ok)
-		ndb_query_drain_merger(txn, filter, results, &merger,
-				       1 << NDB_FILTER_KINDS, need_relays);
+	read = ndb_plan_scan_entries(scan);
+	probe->probed += read;
 
-	ndb_index_merger_destroy(&merger);
+	if (read > NDB_PLAN_PROBE_MAX || read * stride > budget) {
+		// there are at least this many results
+		if (covered)
+			probe->need = max(probe->need, n * stride);
+		return UINT64_MAX;
+	}
 
-	return ok;
-}
+	// fewer than `want` in range means every plan reads all of it
+	probe->floor = n < want ? 0 : min(probe->floor, reached);
 
-static int filter_is_empty(struct ndb_filter *filter) {
-	return filter->elem_buf.start == NULL;
+	if (covered)
+		probe->need = want && n >= want ? probe->want : n * stride;
+
+	return read * stride;
 }
 
-static enum ndb_query_plan ndb_filter_plan(struct ndb_filter *filter)
+/* Pick a plan for a filter that wants `want` results (0 for all of them).
+ * `probed` gets the number of index entries we read deciding. Deciding
+ * never loads a note. If `scan` isn't NULL, it gets the chosen plan's scan
+ * when a probe already opened it, rewound and ready to run, along with its
+ * `already_matched` fields, or is zeroed for the caller to open one.
+ *
+ * Ids, search and relays have exactly one sensible plan. Everything else has
+ * several index plans to choose from, which we cost by seeks plus the
+ * entries each would scan to find `want` matches, probing the index to find
+ * out. Every plan reads at least `want` entries past its seeks, or with no
+ * `want`, as many as a covering scan turned up, so one that can't beat the
+ * best so far isn't probed at all. An author plan with more runs than a
+ * probe could open is sampled rather than skipped, so it still says how far
+ * back its results reach. Candidates are
+ * listed in the order the planner used to prefer them, so ties keep the old
+ * choice, except that the intersect plan, which covers more of the filter
+ * than the author plans, goes ahead of them. */
+static enum ndb_query_plan ndb_filter_plan(struct ndb_txn *txn,
+					   struct ndb_filter *filter,
+					   uint64_t want, uint64_t *probed,
+					   struct ndb_plan_scan *scan,
+					   int *already_matched)
 {
 	struct ndb_filter_elements *ids, *kinds, *authors, *tags, *search, *relays;
+	struct ndb_filter_elements *els;
+	struct ndb_plan_probe probe;
+	struct ndb_plan_scan probe_scan;
+	enum ndb_query_plan candidates[5], best;
+	uint64_t seeks[5], cost, best_cost, read;
+	int i, n, stride, matched;
 
 	ids = ndb_filter_find_elements(filter, NDB_FILTER_IDS);
 	search = ndb_filter_find_elements(filter, NDB_FILTER_SEARCH);
@@ -5635,6 +8043,11 @@ static enum ndb_query_plan ndb_filter_plan(struct ndb_filter *filter)
 	tags = ndb_filter_find_elements(filter, NDB_FILTER_TAGS);
 	relays = ndb_filter_find_elements(filter, NDB_FILTER_RELAYS);
 
+	*probed = 0;
+
+	if (scan)
+		memset(scan, 0, sizeof(*scan));
+
 	if (filter_is_empty(filter))
 		return NDB_PLAN_ALL_NOTES;
 
@@ -5643,46 +8056,117 @@ static enum ndb_query_plan ndb_filter_plan(struct ndb_filter *filter)
 		return NDB_PLAN_PROFILE_SEARCH;
 	}
 
-	// TODO: fix multi-author queries
 	if (search) {
 		return NDB_PLAN_SEARCH;
 	} else if (ids) {
 		return NDB_PLAN_IDS;
 	} else if (relays && kinds && !authors) {
 		return NDB_PLAN_RELAY_KINDS;
-	} else if (kinds && authors &&
-		   (authors->count == 1 ||
-		    authors->count * kinds->count <= NDB_MAX_AUTHOR_KIND_SCANNERS)) {
-		// the plan itself has always been multi-author (it merges every
-		// author*kind run); only the scanner count needs bounding
-		return NDB_PLAN_AUTHOR_KINDS;
-	} else if (authors && authors->count == 1) {
-		return NDB_PLAN_AUTHORS;
-	} else if (tags && tags->count == 1) {
-		return NDB_PLAN_TAGS;
-	} else if (kinds) {
-		return NDB_PLAN_KINDS;
 	}
 
-	return NDB_PLAN_CREATED;
-}
+	n = 0;
+	// walk the tag index alongside the author or kind index, loading
+	// only the notes both have
+	if (tags && (kinds || authors) &&
+	    (kinds || authors->count <= NDB_MAX_AUTHOR_SCANNERS)) {
+		candidates[n] = NDB_PLAN_INTERSECT;
+		seeks[n] = authors ? authors->count : 1;
+		seeks[n] *= kinds ? kinds->count : 1;
 
-static const char *ndb_query_plan_name(enum ndb_query_plan plan_id)
-{
-	switch (plan_id) {
-		case NDB_PLAN_IDS:     return "ids";
-		case NDB_PLAN_SEARCH:  return "search";
-		case NDB_PLAN_KINDS:   return "kinds";
-		case NDB_PLAN_TAGS:    return "tags";
-		case NDB_PLAN_CREATED: return "created";
-		case NDB_PLAN_AUTHORS: return "authors";
-		case NDB_PLAN_RELAY_KINDS: return "relay_kinds";
-		case NDB_PLAN_AUTHOR_KINDS: return "author_kinds";
-		case NDB_PLAN_PROFILE_SEARCH: return "profile_search";
-		case NDB_PLAN_ALL_NOTES: return "all_notes";
+		for (i = 0; i < filter->num_elements; i++) {
+			els = ndb_filter_get_elements(filter, i);
+			if (els->field.type == NDB_FILTER_TAGS)
+				seeks[n] += els->count;
+		}
+		n++;
+	}
+	if (kinds && authors) {
+		candidates[n] = NDB_PLAN_AUTHOR_KINDS;
+		seeks[n++] = authors->count * kinds->count;
+	}
+	// with kinds, author_kinds walks the same runs minus the other kinds
+	if (authors && !kinds && authors->count <= NDB_MAX_AUTHOR_SCANNERS) {
+		candidates[n] = NDB_PLAN_AUTHORS;
+		seeks[n++] = authors->count;
+	}
+	if (tags) {
+		candidates[n] = NDB_PLAN_TAGS;
+		seeks[n++] = tags->count;
+	}
+	// every kinds scan is a subset of the created scan, so created is
+	// only worth considering when there are no kinds
+	if (kinds) {
+		candidates[n] = NDB_PLAN_KINDS;
+		seeks[n++] = kinds->count;
+	} else {
+		candidates[n] = NDB_PLAN_CREATED;
+		seeks[n++] = 1;
 	}
 
-	return "unknown";
+	if (n == 1)
+		return candidates[0];
+
+	best = candidates[0];
+	best_cost = UINT64_MAX;
+
+	probe.want = want;
+	probe.floor = UINT64_MAX;
+	probe.need = want;
+	probe.probed = 0;
+
+	for (i = 0; i < n; i++) {
+		cost = seeks[i] * NDB_PLAN_SEEK_COST;
+		if (cost + probe.need >= best_cost)
+			continue;
+
+		// opening a scan costs its seeks. past the probe budget,
+		// sample the runs of enough authors to fit in it
+		stride = 1;
+		if (cost > NDB_PLAN_PROBE_MAX && authors &&
+		    candidates[i] != NDB_PLAN_TAGS &&
+		    candidates[i] != NDB_PLAN_KINDS) {
+			stride = min((cost + NDB_PLAN_PROBE_MAX - 1) /
+				     NDB_PLAN_PROBE_MAX, authors->count);
+		}
+
+		memset(&probe_scan, 0, sizeof(probe_scan));
+		read = cost > NDB_PLAN_PROBE_MAX && stride == 1 ? probe.need
+		     : ndb_query_plan_probe(txn, filter, candidates[i], stride,
+					    &probe, best_cost - cost,
+					    &probe_scan, &matched);
+		cost = read == UINT64_MAX ? UINT64_MAX : cost + read;
+
+		ndb_debug("plan '%s' cost %" PRIu64 "\n",
+			  ndb_query_plan_name(candidates[i]), cost);
+
+		if (cost < best_cost) {
+			best = candidates[i];
+			best_cost = cost;
+
+			// hold on to the winner's scan, unless it's a sample
+			if (scan) {
+				ndb_plan_scan_destroy(scan);
+				memset(scan, 0, sizeof(*scan));
+				if (stride == 1 && probe_scan.num_streams) {
+					*scan = probe_scan;
+					*already_matched = matched;
+					memset(&probe_scan, 0, sizeof(probe_scan));
+				}
+			}
+		}
+
+		ndb_plan_scan_destroy(&probe_scan);
+
+		if (best_cost <= NDB_PLAN_PROBE_MIN)
+			break;
+	}
+
+	*probed = probe.probed;
+
+	if (scan && scan->num_streams)
+		ndb_plan_scan_rewind(scan);
+
+	return best;
 }
 
 /* Fill an ndb_query_state with the correct limit depending on the 
@@ -5703,76 +8187,146 @@ static void ndb_query_state_fill_limit(
 		struct ndb_filter *filter,
 		int *result_capacity)
 {
-	uint64_t *pint;
+	uint64_t *pint;
+
+	pint = ndb_filter_get_int(filter, NDB_FILTER_LIMIT);
+
+	/* default: visitor = unbounded (0), standard = bounded by capacity */
+	state->limit = result_capacity ? (uint64_t)(*result_capacity) : 0;
+
+	/* filter limit: 0 means "no limit" (don't clamp) */
+	if (pint && *pint != 0) {
+		state->limit = result_capacity
+			     ? (uint64_t)min(*result_capacity, (int)*pint)
+			     : *pint;
+ 	}
+}
+
+/* Plans that hand back notes newest first straight off an index scan, which
+ * a multi-filter query can merge without running them to completion */
+static int ndb_query_plan_is_scan(enum ndb_query_plan plan)
+{
+	switch (plan) {
+	case NDB_PLAN_KINDS:
+	case NDB_PLAN_TAGS:
+	case NDB_PLAN_CREATED:
+	case NDB_PLAN_AUTHORS:
+	case NDB_PLAN_AUTHOR_KINDS:
+	case NDB_PLAN_RELAY_KINDS:
+	case NDB_PLAN_INTERSECT:
+		return 1;
+	case NDB_PLAN_IDS:
+	case NDB_PLAN_SEARCH:
+	case NDB_PLAN_PROFILE_SEARCH:
+	case NDB_PLAN_ALL_NOTES:
+		return 0;
+	}
+
+	return 0;
+}
+
+static int ndb_query_plan_execute(struct ndb_txn *txn,
+				  struct ndb_filter *filter,
+				  enum ndb_query_plan plan,
+				  struct ndb_query_state *state)
+{
+	if (ndb_query_plan_is_scan(plan))
+		return ndb_query_plan_execute_merged(txn, filter, plan, state);
+
+	switch (plan) {
+	// We have a list of ids, just open a cursor and jump to each once
+	case NDB_PLAN_IDS:
+		return ndb_query_plan_execute_ids(txn, filter, state);
+	case NDB_PLAN_SEARCH:
+		return ndb_query_plan_execute_search(txn, filter, state);
+	case NDB_PLAN_PROFILE_SEARCH:
+		return ndb_query_plan_execute_profile_search(txn, filter, state);
+	case NDB_PLAN_ALL_NOTES:
+		return ndb_query_plan_all_notes(txn, state);
+	default:
+		return 0;
+	}
+}
+
+// how many more results a filter can contribute, 0 for unbounded
+static uint64_t ndb_query_state_want(struct ndb_query_state *state)
+{
+	uint64_t want;
+
+	want = state->limit;
+	if (want && state->type == NDB_QUERY_TYPE_VISITOR)
+		want -= min(want, state->visitor.visited);
+
+	return want;
+}
+
+static inline void ndb_explain_start(struct ndb_query_state *state,
+				     struct timespec *start)
+{
+	if (state->explain)
+		clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+static inline void ndb_explain_stop(struct ndb_query_state *state,
+				    struct timespec *start)
+{
+	struct timespec end;
 
-	pint = ndb_filter_get_int(filter, NDB_FILTER_LIMIT);
+	if (!state->explain)
+		return;
 
-	/* default: visitor = unbounded (0), standard = bounded by capacity */
-	state->limit = result_capacity ? (uint64_t)(*result_capacity) : 0;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	state->explain->elapsed_ns +=
+		(uint64_t)(end.tv_sec - start->tv_sec) * 1000000000ULL +
+		end.tv_nsec - start->tv_nsec;
+}
 
-	/* filter limit: 0 means "no limit" (don't clamp) */
-	if (pint && *pint != 0) {
-		state->limit = result_capacity
-			     ? (uint64_t)min(*result_capacity, (int)*pint)
-			     : *pint;
- 	}
+static enum ndb_query_plan ndb_query_state_plan(struct ndb_txn *txn,
+						struct ndb_filter *filter,
+						struct ndb_query_state *state,
+						struct ndb_plan_scan *scan,
+						int *already_matched)
+{
+	enum ndb_query_plan plan;
+	uint64_t probed;
+
+	plan = ndb_filter_plan(txn, filter, ndb_query_state_want(state),
+			       &probed, scan, already_matched);
+	ndb_debug("using query plan '%s'\n", ndb_query_plan_name(plan));
+
+	if (state->explain) {
+		state->explain->plan = ndb_query_plan_name(plan);
+		state->explain->planner_entries += probed;
+	}
+
+	return plan;
 }
 
 static int ndb_query_filter(struct ndb_txn *txn, struct ndb_filter *filter,
 			    struct ndb_query_state *state)
 {
 	enum ndb_query_plan plan;
+	struct ndb_plan_scan scan;
+	struct timespec start;
+	int already_matched, ok;
 
-	plan = ndb_filter_plan(filter);
-	ndb_debug("using query plan '%s'\n", ndb_query_plan_name(plan));
-	switch (plan) {
-	// We have a list of ids, just open a cursor and jump to each once
-	case NDB_PLAN_ALL_NOTES:
-		if (!ndb_query_plan_all_notes(txn, state))
-			return 0;
-		break;
-	case NDB_PLAN_IDS:
-		if (!ndb_query_plan_execute_ids(txn, filter, state))
-			return 0;
-		break;
-	case NDB_PLAN_RELAY_KINDS:
-		if (!ndb_query_plan_execute_relay_kinds(txn, filter, state))
-			return 0;
-		break;
-	case NDB_PLAN_SEARCH:
-		if (!ndb_query_plan_execute_search(txn, filter, state))
-			return 0;
-		break;
+	ndb_explain_start(state, &start);
 
-	case NDB_PLAN_PROFILE_SEARCH:
-		if (!ndb_query_plan_execute_profile_search(txn, filter, state))
-			return 0;
-		break;
+	plan = ndb_query_state_plan(txn, filter, state, &scan,
+				    &already_matched);
 
-	// We have just kinds, just scan the kind index
-	case NDB_PLAN_KINDS:
-		if (!ndb_query_plan_execute_kinds(txn, filter, state))
-			return 0;
-		break;
-	case NDB_PLAN_TAGS:
-		if (!ndb_query_plan_execute_tags(txn, filter, state))
-			return 0;
-		break;
-	case NDB_PLAN_CREATED:
-		if (!ndb_query_plan_execute_created_at(txn, filter, state))
-			return 0;
-		break;
-	case NDB_PLAN_AUTHORS:
-		if (!ndb_query_plan_execute_authors(txn, filter, state))
-			return 0;
-		break;
-	case NDB_PLAN_AUTHOR_KINDS:
-		if (!ndb_query_plan_execute_author_kinds(txn, filter, state))
-			return 0;
-		break;
+	// carry on with the scan the planner probed, rather than seek it again
+	if (scan.num_streams) {
+		ndb_query_drain_scan(txn, filter, state, &scan, already_matched);
+		ndb_plan_scan_destroy(&scan);
+		ok = 1;
+	} else {
+		ok = ndb_query_plan_execute(txn, filter, plan, state);
 	}
 
-	return 1;
+	ndb_explain_stop(state, &start);
+
+	return ok;
 }
 
 int ndb_query_visit(struct ndb_txn *txn,
@@ -5788,6 +8342,7 @@ int ndb_query_visit(struct ndb_txn *txn,
 		return 0;
 
 	state.type = NDB_QUERY_TYPE_VISITOR;
+	state.explain = NULL;
 	state.visitor.done = 0;
 	state.visitor.visited = 0;
 	state.visitor.visitor = visitor;
@@ -5813,17 +8368,170 @@ int ndb_query_visit(struct ndb_txn *txn,
 int ndb_query(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters,
 	      struct ndb_query_result *results, int result_capacity, int *count)
 {
-	int i, total, dst, cap, ok;
+	return ndb_query_explain(txn, filters, num_filters, results,
+				 result_capacity, count, NULL);
+}
+
+/* One filter of a multi-filter query, as a stream of its matching notes,
+ * newest first.
+ *
+ * Index plans are read lazily off their scan, so a filter only does the
+ * work for the notes that make it into the results. The other plans (ids,
+ * search, all notes) aren't created_at ordered, so they run up front into a
+ * buffer no bigger than their own limit and get sorted there. */
+struct ndb_query_source {
+	struct ndb_filter *filter;
+	struct ndb_query_state state; // the filter's limit, its explain
+
+	int scanning;
+	struct ndb_plan_scan scan;
+	int already_matched, need_relays;
+
+	struct ndb_query_result *buf;
+	int buf_len, buf_pos;
+
+	uint64_t produced;
+	struct ndb_query_result head;
+	int has_head;
+};
+
+static int ndb_query_source_open(struct ndb_txn *txn,
+				 struct ndb_query_source *src,
+				 struct ndb_filter *filter, int capacity,
+				 struct ndb_query_explain *explain)
+{
+	enum ndb_query_plan plan;
+	struct timespec start;
+	int ok;
+
+	memset(src, 0, sizeof(*src));
+	src->filter = filter;
+	src->state.type = NDB_QUERY_TYPE_STANDARD;
+	src->state.explain = explain;
+	ndb_query_state_fill_limit(&src->state, filter, &capacity);
+
+	ndb_explain_start(&src->state, &start);
+
+	plan = ndb_query_state_plan(txn, filter, &src->state, &src->scan,
+				    &src->already_matched);
+
+	if (ndb_query_plan_is_scan(plan)) {
+		ok = src->scanning = src->scan.num_streams ||
+			ndb_plan_scan_open(txn, filter, plan, &src->scan,
+					   &src->already_matched);
+		src->need_relays =
+			ndb_plan_scan_needs_relays(filter, src->already_matched);
+	} else if ((src->buf = malloc(src->state.limit * sizeof(*src->buf)))) {
+		src->state.query.capacity = src->state.limit;
+		make_cursor((unsigned char *)src->buf,
+			    (unsigned char *)(src->buf + src->state.limit),
+			    &src->state.query.results.cur);
+
+		ok = ndb_query_plan_execute(txn, filter, plan, &src->state);
+
+		src->buf_len = cursor_count(&src->state.query.results.cur,
+					    sizeof(*src->buf));
+		qsort(src->buf, src->buf_len, sizeof(*src->buf),
+		      compare_query_results);
+	} else {
+		ok = 0;
+	}
+
+	ndb_explain_stop(&src->state, &start);
+
+	return ok;
+}
+
+/* Move the source's head to its next note. Returns 0 once it's out of notes
+ * or has given its limit's worth. */
+static int ndb_query_source_next(struct ndb_txn *txn,
+				 struct ndb_query_source *src)
+{
+	struct timespec start;
+
+	src->has_head = 0;
+
+	if (src->produced >= src->state.limit)
+		return 0;
+
+	if (src->scanning) {
+		ndb_explain_start(&src->state, &start);
+		src->has_head = ndb_plan_scan_next_result(txn, src->filter,
+							  &src->scan,
+							  src->already_matched,
+							  src->need_relays,
+							  &src->state,
+							  &src->head);
+		ndb_explain_stop(&src->state, &start);
+	} else if (src->buf_pos < src->buf_len) {
+		src->head = src->buf[src->buf_pos++];
+		src->has_head = 1;
+	}
+
+	if (src->has_head)
+		src->produced++;
+
+	return src->has_head;
+}
+
+static void ndb_query_source_close(struct ndb_query_source *src)
+{
+	if (src->scanning) {
+		ndb_explain_scan(&src->state, &src->scan);
+		ndb_plan_scan_destroy(&src->scan);
+	}
+
+	free(src->buf);
+}
+
+/* Does a note we're about to add already sit in the results? Results are
+ * newest first, so any copy of it is among the trailing ones that share its
+ * created_at. */
+static int ndb_query_results_have(struct ndb_query_result *results, int count,
+				  struct ndb_query_result *res)
+{
+	int i;
+
+	for (i = count - 1; i >= 0; i--) {
+		if (results[i].note->created_at != res->note->created_at)
+			return 0;
+		if (results[i].note_id == res->note_id)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Is `a` newer than `b`? note_key breaks created_at ties so merges come out
+ * the same way every time */
+static int ndb_query_result_newer(struct ndb_query_result *a,
+				  struct ndb_query_result *b)
+{
+	if (a->note->created_at != b->note->created_at)
+		return a->note->created_at > b->note->created_at;
+
+	return a->note_id > b->note_id;
+}
+
+int ndb_query_explain(struct ndb_txn *txn, struct ndb_filter *filters,
+		      int num_filters, struct ndb_query_result *results,
+		      int result_capacity, int *count,
+		      struct ndb_query_explain *explain)
+{
+	int i, best, ok;
 	struct ndb_query_state state;
-	struct ndb_query_result *tmp, *buf;
-	int *counts;
+	struct ndb_query_source *sources;
 
 	if (num_filters == 0)
 		return 0;
 
+	if (explain)
+		memset(explain, 0, num_filters * sizeof(*explain));
+
 	/* single filter: run directly into output buffer */
 	if (num_filters == 1) {
 		state.type = NDB_QUERY_TYPE_STANDARD;
+		state.explain = explain;
 		state.query.capacity = result_capacity;
 		make_cursor((unsigned char *)results,
 			    ((unsigned char *)results) +
@@ -5836,78 +8544,395 @@ int ndb_query(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters,
 		if (!ndb_query_filter(txn, &filters[0], &state))
 			return 0;
 
-		*count = cursor_count(&state.query.results.cur,
-				      sizeof(*results));
-		qsort(results, *count, sizeof(*results),
-		      compare_query_results);
-		return 1;
-	}
+		*count = cursor_count(&state.query.results.cur,
+				      sizeof(*results));
+		qsort(results, *count, sizeof(*results),
+		      compare_query_results);
+
+		if (explain)
+			explain->results = *count;
+		return 1;
+	}
+
+	/* multi-filter: merge every filter's notes by created_at as they
+	 * come, so each filter gets a fair chance to contribute and we stop
+	 * as soon as the results are full. A note matching more than one
+	 * filter only goes in once. Filter counts are small, so the newest
+	 * head is found with a linear scan rather than a heap. */
+	*count = 0;
+	if (result_capacity <= 0)
+		return 1;
+
+	if (!(sources = calloc(num_filters, sizeof(*sources))))
+		return 0;
+
+	ok = 1;
+	for (i = 0; i < num_filters; i++) {
+		if (!ndb_query_source_open(txn, &sources[i], &filters[i],
+					   result_capacity,
+					   explain ? &explain[i] : NULL)) {
+			ok = 0;
+			num_filters = i + 1;
+			break;
+		}
+
+		ndb_query_source_next(txn, &sources[i]);
+	}
+
+	while (ok && *count < result_capacity) {
+		best = -1;
+		for (i = 0; i < num_filters; i++) {
+			if (!sources[i].has_head)
+				continue;
+			if (best == -1 ||
+			    ndb_query_result_newer(&sources[i].head,
+						   &sources[best].head))
+				best = i;
+		}
+
+		if (best == -1)
+			break;
+
+		if (!ndb_query_results_have(results, *count,
+					    &sources[best].head)) {
+			results[(*count)++] = sources[best].head;
+			if (explain)
+				explain[best].results++;
+		}
+
+		ndb_query_source_next(txn, &sources[best]);
+	}
+
+	for (i = 0; i < num_filters; i++)
+		ndb_query_source_close(&sources[i]);
+	free(sources);
+
+	return ok;
+}
+
+int ndb_query_page(struct ndb_txn *txn, struct ndb_filter *filter,
+		   const unsigned char *token, int token_len,
+		   struct ndb_query_result *results, int result_capacity,
+		   int *count, unsigned char *next, int next_size,
+		   int *next_len)
+{
+	struct ndb_query_state state;
+	struct ndb_plan_scan scan;
+	enum ndb_query_plan plan;
+	uint64_t probed;
+	int already_matched, ok;
+
+	*count = 0;
+	*next_len = 0;
+
+	state.type = NDB_QUERY_TYPE_STANDARD;
+	state.explain = NULL;
+	state.query.capacity = result_capacity;
+	make_cursor((unsigned char *)results,
+		    ((unsigned char *)results) +
+		    result_capacity * sizeof(*results),
+		    &state.query.results.cur);
+
+	ndb_query_state_fill_limit(&state, filter, &result_capacity);
+
+	// stick with the plan the first page picked, the token describes
+	// its scan
+	if (token) {
+		if (!ndb_query_token_plan(token, token_len, &plan))
+			return 0;
+	} else {
+		plan = ndb_filter_plan(txn, filter, state.limit, &probed,
+				       NULL, NULL);
+	}
+
+	if (!ndb_query_plan_is_scan(plan)) {
+		ndb_debug("query plan '%s' can't be paged\n",
+			  ndb_query_plan_name(plan));
+		return 0;
+	}
+
+	if (!ndb_plan_scan_open(txn, filter, plan, &scan, &already_matched))
+		return 0;
+
+	if (token && !ndb_plan_scan_restore(&scan, token, token_len)) {
+		ndb_plan_scan_destroy(&scan);
+		return 0;
+	}
+
+	ndb_query_drain_scan(txn, filter, &state, &scan, already_matched);
+
+	*count = cursor_count(&state.query.results.cur, sizeof(*results));
+
+	ok = 1;
+	if (!ndb_plan_scan_done(&scan))
+		ok = ndb_plan_scan_save(&scan, plan, next, next_size, next_len);
+
+	ndb_plan_scan_destroy(&scan);
+
+	return ok;
+}
+
+/* Counts are either a plain tally, or with more than one filter, the note
+ * keys themselves so that notes matching several filters count once */
+struct ndb_count_state {
+	uint64_t count;
+	int dedup;
+	uint64_t *keys;
+	size_t len, cap;
+};
+
+static int ndb_count_add(struct ndb_count_state *st, uint64_t note_key)
+{
+	uint64_t *grown;
+
+	if (!st->dedup) {
+		st->count++;
+		return 1;
+	}
+
+	if (st->len == st->cap) {
+		if (!(grown = realloc(st->keys, (st->cap * 2 + 64) * sizeof(*grown))))
+			return 0;
+		st->keys = grown;
+		st->cap = st->cap * 2 + 64;
+	}
+
+	st->keys[st->len++] = note_key;
+	return 1;
+}
+
+static enum ndb_visitor_action ndb_count_visitor(void *ctx,
+						 struct ndb_query_result *res)
+{
+	return ndb_count_add((struct ndb_count_state *)ctx, res->note_id)
+		? NDB_VISITOR_CONT : NDB_VISITOR_STOP;
+}
+
+static int ndb_count_filter(struct ndb_txn *txn, struct ndb_filter *filter,
+			    struct ndb_count_state *st)
+{
+	struct ndb_query_state state;
+	struct ndb_query_result res;
+	struct ndb_plan_scan scan;
+	enum ndb_query_plan plan;
+	uint64_t probed, note_key;
+	int already_matched, ok;
+
+	state.type = NDB_QUERY_TYPE_VISITOR;
+	state.explain = NULL;
+	state.limit = 0;
+	state.visitor.done = 0;
+	state.visitor.visited = 0;
+	state.visitor.visitor = ndb_count_visitor;
+	state.visitor.ctx = st;
+
+	plan = ndb_filter_plan(txn, filter, 0, &probed, &scan,
+			       &already_matched);
+
+	if (!ndb_query_plan_is_scan(plan))
+		return ndb_query_plan_execute(txn, filter, plan, &state);
+
+	if (!scan.num_streams &&
+	    !ndb_plan_scan_open(txn, filter, plan, &scan, &already_matched))
+		return 0;
+
+	ok = 1;
+	if (ndb_filter_is_covered(filter, already_matched)) {
+		// every entry is a match, no need to look at the notes
+		while (ok && ndb_plan_scan_next(&scan, &note_key))
+			ok = ndb_count_add(st, note_key);
+	} else {
+		while (ok && ndb_plan_scan_next_result(txn, filter, &scan,
+				already_matched,
+				ndb_plan_scan_needs_relays(filter, already_matched),
+				&state, &res))
+			ok = ndb_count_add(st, res.note_id);
+	}
+
+	ndb_plan_scan_destroy(&scan);
+
+	return ok;
+}
+
+static int ndb_count_notes(struct ndb_txn *txn, uint64_t *count)
+{
+	MDB_stat stat;
+
+	if (mdb_stat(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE], &stat))
+		return 0;
+
+	*count = stat.ms_entries;
+	return 1;
+}
+
+int ndb_count(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters,
+	      uint64_t *count)
+{
+	struct ndb_count_state st = {0};
+	size_t i, unique;
+	int ok;
+
+	*count = 0;
+
+	for (i = 0; i < (size_t)num_filters; i++) {
+		// an empty filter matches every note
+		if (filter_is_empty(&filters[i]))
+			return ndb_count_notes(txn, count);
+	}
+
+	st.dedup = num_filters > 1;
+
+	ok = 1;
+	for (i = 0; ok && i < (size_t)num_filters; i++)
+		ok = ndb_count_filter(txn, &filters[i], &st);
+
+	if (ok && st.dedup) {
+		qsort(st.keys, st.len, sizeof(*st.keys), ndb_note_key_cmp_desc);
+
+		for (i = 0, unique = 0; i < st.len; i++) {
+			if (i == 0 || st.keys[i] != st.keys[i - 1])
+				unique++;
+		}
+		st.count = unique;
+	}
+
+	free(st.keys);
+
+	if (ok)
+		*count = st.count;
+
+	return ok;
+}
+
+struct ndb_query_keys_state {
+	struct ndb_query_key *keys;
+	int count, capacity;
+};
+
+static enum ndb_visitor_action ndb_query_keys_visitor(void *ctx,
+						      struct ndb_query_result *res)
+{
+	struct ndb_query_keys_state *st = (struct ndb_query_keys_state *)ctx;
+
+	if (st->count == st->capacity)
+		return NDB_VISITOR_STOP;
+
+	st->keys[st->count].note_key = res->note_id;
+	st->keys[st->count].created_at = res->note->created_at;
+	st->count++;
+
+	return NDB_VISITOR_CONT;
+}
+
+static int ndb_query_key_cmp(const void *pa, const void *pb)
+{
+	const struct ndb_query_key *a = pa, *b = pb;
+
+	if (a->created_at != b->created_at)
+		return a->created_at < b->created_at ? 1 : -1;
+
+	return a->note_key < b->note_key ? 1 : a->note_key > b->note_key ? -1 : 0;
+}
+
+int ndb_query_keys(struct ndb_txn *txn, struct ndb_filter *filter,
+		   struct ndb_query_key *keys, int capacity, int *count)
+{
+	return ndb_query_keys_explain(txn, filter, keys, capacity, count, NULL);
+}
+
+int ndb_query_keys_explain(struct ndb_txn *txn, struct ndb_filter *filter,
+			   struct ndb_query_key *keys, int capacity, int *count,
+			   struct ndb_query_explain *explain)
+{
+	struct ndb_query_keys_state st;
+	struct ndb_query_state state;
+	struct ndb_query_result res;
+	struct ndb_plan_scan scan;
+	struct timespec start;
+	enum ndb_query_plan plan;
+	uint64_t probed, note_key;
+	int already_matched, covered, need_relays, ok;
+
+	st.keys = keys;
+	st.count = 0;
+	st.capacity = capacity;
+	*count = 0;
+
+	if (explain)
+		memset(explain, 0, sizeof(*explain));
 
-	/* multi-filter: run each filter into its own buffer, then merge
-	 * the results by created_at so that every filter gets a fair
-	 * chance to contribute */
-	tmp = malloc(num_filters * result_capacity * sizeof(*tmp));
-	counts = calloc(num_filters, sizeof(int));
-	if (!tmp || !counts) {
-		free(tmp);
-		free(counts);
-		return 0;
-	}
+	state.type = NDB_QUERY_TYPE_VISITOR;
+	state.explain = explain;
+	state.visitor.done = 0;
+	state.visitor.visited = 0;
+	state.visitor.visitor = ndb_query_keys_visitor;
+	state.visitor.ctx = &st;
+	ndb_query_state_fill_limit(&state, filter, &capacity);
 
-	ok = 1;
-	for (i = 0; i < num_filters; i++) {
-		buf = tmp + i * result_capacity;
-		cap = result_capacity;
+	ndb_explain_start(&state, &start);
 
-		state.type = NDB_QUERY_TYPE_STANDARD;
-		state.query.capacity = cap;
-		make_cursor((unsigned char *)buf,
-			    ((unsigned char *)buf) + cap * sizeof(*buf),
-			    &state.query.results.cur);
+	plan = ndb_filter_plan(txn, filter, state.limit, &probed, &scan,
+			       &already_matched);
 
-		ndb_query_state_fill_limit(&state, &filters[i], &cap);
+	if (explain) {
+		explain->plan = ndb_query_plan_name(plan);
+		explain->planner_entries = probed;
+	}
 
-		if (!ndb_query_filter(txn, &filters[i], &state)) {
-			ok = 0;
-			break;
-		}
+	// these have to load the notes anyway, and aren't in created_at order
+	if (!ndb_query_plan_is_scan(plan)) {
+		ok = ndb_query_plan_execute(txn, filter, plan, &state);
+		ndb_explain_stop(&state, &start);
+		if (!ok)
+			return 0;
 
-		counts[i] = cursor_count(&state.query.results.cur,
-					 sizeof(*buf));
+		qsort(keys, st.count, sizeof(*keys), ndb_query_key_cmp);
+		*count = st.count;
+		if (explain)
+			explain->results = st.count;
+		return 1;
 	}
 
-	if (!ok) {
-		free(tmp);
-		free(counts);
+	if (!scan.num_streams &&
+	    !ndb_plan_scan_open(txn, filter, plan, &scan, &already_matched)) {
+		ndb_explain_stop(&state, &start);
 		return 0;
 	}
 
-	/* compact: remove gaps between per-filter result slabs */
-	total = counts[0];
-	dst = counts[0];
-	for (i = 1; i < num_filters; i++) {
-		if (counts[i] > 0) {
-			buf = tmp + i * result_capacity;
-			memmove(tmp + dst, buf, counts[i] * sizeof(*tmp));
-			dst += counts[i];
-			total += counts[i];
+	covered = ndb_filter_is_covered(filter, already_matched);
+	need_relays = ndb_plan_scan_needs_relays(filter, already_matched);
+
+	while ((uint64_t)st.count < state.limit) {
+		if (covered) {
+			if (!ndb_plan_scan_next(&scan, &note_key))
+				break;
+		} else {
+			if (!ndb_plan_scan_next_result(txn, filter, &scan,
+						       already_matched,
+						       need_relays, &state,
+						       &res))
+				break;
+			note_key = res.note_id;
 		}
-	}
 
-	/* sort all results by created_at descending */
-	qsort(tmp, total, sizeof(*tmp), compare_query_results);
+		keys[st.count].note_key = note_key;
+		keys[st.count].created_at = scan.created_at;
+		st.count++;
+	}
 
-	/* copy top results into output */
-	*count = total < result_capacity ? total : result_capacity;
-	memcpy(results, tmp, *count * sizeof(*results));
+	ndb_explain_scan(&state, &scan);
+	ndb_plan_scan_destroy(&scan);
+	ndb_explain_stop(&state, &start);
 
-	free(tmp);
-	free(counts);
+	*count = st.count;
+	if (explain)
+		explain->results = st.count;
 	return 1;
 }
 
 static int ndb_write_note_tag_index(struct ndb_txn *txn, struct ndb_note *note,
-				    uint64_t note_key)
+				    uint64_t note_key,
+				    struct ndb_index_run *run)
 {
 	unsigned char key_buffer[255];
 	struct ndb_iterator iter;
@@ -5915,9 +8940,6 @@ static int ndb_write_note_tag_index(struct ndb_txn *txn, struct ndb_note *note,
 	char tchar;
 	int len, rc;
 	MDB_val key, val;
-	MDB_dbi tags_db;
-
-	tags_db = txn->lmdb->dbs[NDB_DB_NOTE_TAGS];
 
 	ndb_tags_iterate_start(note, &iter);
 
@@ -5951,7 +8973,7 @@ static int ndb_write_note_tag_index(struct ndb_txn *txn, struct ndb_note *note,
 		val.mv_data = &note_key;
 		val.mv_size = sizeof(note_key);
 
-		if ((rc = mdb_put(txn->mdb_txn, tags_db, &key, &val, 0))) {
+		if ((rc = ndb_index_put(txn, run, NDB_DB_NOTE_TAGS, &key, &val))) {
 			ndb_debug("write note tag index to db failed: %s\n",
 					mdb_strerror(rc));
 			return 0;
@@ -5962,12 +8984,12 @@ static int ndb_write_note_tag_index(struct ndb_txn *txn, struct ndb_note *note,
 }
 
 static int ndb_write_note_kind_index(struct ndb_txn *txn, struct ndb_note *note,
-				     uint64_t note_key)
+				     uint64_t note_key,
+				     struct ndb_index_run *run)
 {
 	struct ndb_u64_ts tsid;
 	int rc;
 	MDB_val key, val;
-	MDB_dbi kind_db;
 
 	ndb_u64_ts_init(&tsid, note->kind, note->created_at);
 
@@ -5976,9 +8998,7 @@ static int ndb_write_note_kind_index(struct ndb_txn *txn, struct ndb_note *note,
 	val.mv_data = &note_key;
 	val.mv_size = sizeof(note_key);
 
-	kind_db = txn->lmdb->dbs[NDB_DB_NOTE_KIND];
-
-	if ((rc = mdb_put(txn->mdb_txn, kind_db, &key, &val, 0))) {
+	if ((rc = ndb_index_put(txn, run, NDB_DB_NOTE_KIND, &key, &val))) {
 		ndb_debug("write note kind index to db failed: %s\n",
 				mdb_strerror(rc));
 		return 0;
@@ -5987,7 +9007,8 @@ static int ndb_write_note_kind_index(struct ndb_txn *txn, struct ndb_note *note,
 	return 1;
 }
 
-static int ndb_write_word_to_index(struct ndb_txn *txn, const char *word,
+static int ndb_write_word_to_index(struct ndb_txn *txn,
+				   struct ndb_index_run *run, const char *word,
 				   int word_len, int word_index,
 				   uint64_t timestamp, uint64_t note_id)
 {
@@ -5995,7 +9016,6 @@ static int ndb_write_word_to_index(struct ndb_txn *txn, const char *word,
 	unsigned char buffer[1024];
 	int keysize, rc;
 	MDB_val k, v;
-	MDB_dbi text_db;
 
 	// build our compressed text index key
 	if (!ndb_make_text_search_key(buffer, sizeof(buffer), word_index,
@@ -6012,9 +9032,7 @@ static int ndb_write_word_to_index(struct ndb_txn *txn, const char *word,
 	v.mv_data = NULL;
 	v.mv_size = 0;
 
-	text_db = txn->lmdb->dbs[NDB_DB_NOTE_TEXT];
-
-	if ((rc = mdb_put(txn->mdb_txn, text_db, &k, &v, 0))) {
+	if ((rc = ndb_index_put(txn, run, NDB_DB_NOTE_TEXT, &k, &v))) {
 		ndb_debug("write note text index to db failed: %s\n",
 				mdb_strerror(rc));
 		return 0;
@@ -6069,6 +9087,7 @@ static int ndb_parse_words(struct cursor *cur, void *ctx, ndb_word_parser_fn fn)
 struct ndb_word_writer_ctx
 {
 	struct ndb_txn *txn;
+	struct ndb_index_run *run;
 	struct ndb_note *note;
 	uint64_t note_id;
 };
@@ -6078,7 +9097,7 @@ static int ndb_fulltext_word_writer(void *ctx,
 {
 	struct ndb_word_writer_ctx *wctx = ctx;
 
-	if (!ndb_write_word_to_index(wctx->txn, word, word_len, words,
+	if (!ndb_write_word_to_index(wctx->txn, wctx->run, word, word_len, words,
 				     wctx->note->created_at, wctx->note_id)) {
 		// too big to write this one, just skip it
 		ndb_debug("failed to write word '%.*s' to index\n", word_len, word);
@@ -6092,7 +9111,8 @@ static int ndb_fulltext_word_writer(void *ctx,
 
 static int ndb_write_note_fulltext_index(struct ndb_txn *txn,
 					 struct ndb_note *note,
-					 uint64_t note_id)
+					 uint64_t note_id,
+					 struct ndb_index_run *run)
 {
 	struct cursor cur;
 	unsigned char *content;
@@ -6109,6 +9129,7 @@ static int ndb_write_note_fulltext_index(struct ndb_txn *txn,
 	make_cursor(content, content + note->content_length, &cur);
 
 	ctx.txn = txn;
+	ctx.run = run;
 	ctx.note = note;
 	ctx.note_id = note_id;
 
@@ -6914,7 +9935,7 @@ static int handle_reprocessed_giftwrap(
 
 	/* relay must be dup'd because it is assumed to be cloned */
 	if (relay != NULL) {
-		relay = strdup(relay);
+		relay = ndb_relay_dup(relay);
 		if (relay == NULL)
 			return 0;
 	}
@@ -6937,9 +9958,22 @@ static uint64_t ndb_write_note(secp256k1_context *secp,
 	MDB_dbi note_db;
 	MDB_val key, val;
 	int promoted = 0;
+	int deferred;
 
 	kind = note->note->kind;
 
+	// an unverified copy of a note we took from another relay. it only
+	// vouches for the relay, and only if that note made it in
+	if (note->relay_only) {
+		existing = ndb_get_note_by_id(txn, note->note->id, NULL, &note_key);
+		if (existing && ndb_relay_kind_key_init(&relay_key, note_key,
+							 ndb_note_kind(existing),
+							 ndb_note_created_at(existing),
+							 note->relay))
+			ndb_write_note_relay_indexes(txn, &relay_key);
+		return 0;
+	}
+
 	// let's quickly sanity check if we already have this note
 	if (!note->overwrite_note_id &&
 	    (note_key = ndb_get_notekey_by_id(txn, note->note->id)))
@@ -6997,18 +10031,25 @@ static uint64_t ndb_write_note(secp256k1_context *secp,
 	}
 
 	ndb_write_note_id_index(txn, note->note, note_key);
-	ndb_write_note_kind_index(txn, note->note, note_key);
-	ndb_write_note_tag_index(txn, note->note, note_key);
-	ndb_write_note_pubkey_index(txn, note->note, note_key);
-	ndb_write_note_pubkey_kind_index(txn, note->note, note_key);
 
+	// a bulk load leaves the rest to ndb_build_deferred_indices
+	deferred = ndb_flag_set(ndb_flags, NDB_FLAG_DEFER_INDICES);
+	if (!deferred) {
+		ndb_write_note_kind_index(txn, note->note, note_key, NULL);
+		ndb_write_note_tag_index(txn, note->note, note_key, NULL);
+		ndb_write_note_pubkey_index(txn, note->note, note_key, NULL);
+		ndb_write_note_pubkey_kind_index(txn, note->note, note_key, NULL);
+		ndb_write_note_created_index(txn, note->note, note_key, NULL);
+	}
+
+	// relays aren't kept anywhere else, so these can't wait
 	if (ndb_relay_kind_key_init(&relay_key, note_key, kind, ndb_note_created_at(note->note), note->relay))
 		ndb_write_note_relay_indexes(txn, &relay_key);
 
 	// only parse content and do fulltext index on text and longform notes
 	if (kind == 1 || kind == 30023) {
-		if (!ndb_flag_set(ndb_flags, NDB_FLAG_NO_FULLTEXT)) {
-			if (!ndb_write_note_fulltext_index(txn, note->note, note_key))
+		if (!deferred && !ndb_flag_set(ndb_flags, NDB_FLAG_NO_FULLTEXT)) {
+			if (!ndb_write_note_fulltext_index(txn, note->note, note_key, NULL))
 				return 0;
 		}
 
@@ -7093,14 +10134,20 @@ static int ndb_ingest_rumor(secp256k1_context *secp,
 
 	/* relay must be dup'd because it is assumed to be cloned */
 	if (relay != NULL) {
-		relay = strdup(relay);
+		relay = ndb_relay_dup(relay);
 		if (relay == NULL)
 			return 0;
 	}
-	return ndb_ingester_process_note(secp, rumor_msg, rc, ingester,
-					 scratch+rc, scratch_size-rc,
-					 relay, keys, nkeys,
-					 NULL, 0, NULL, 0);
+	if (ndb_ingester_process_note(secp, rumor_msg, rc, NULL, ingester,
+				      scratch+rc, scratch_size-rc,
+				      relay, keys, nkeys,
+				      NULL, 0, NULL, 0, 0) !=
+	    NDB_INGEST_STATUS_QUEUED) {
+		ndb_relay_free(relay);
+		return 0;
+	}
+
+	return 1;
 }
 
 static int ndb_process_seal(secp256k1_context *secp,
@@ -7540,18 +10587,20 @@ static int ndb_process_pns_event(struct ndb_ingester *ingester,
 		memcpy(inner_msg, inner, note_size);
 
 		if (relay != NULL) {
-			relay = strdup(relay);
+			relay = ndb_relay_dup(relay);
 			if (relay == NULL)
 				return 0;
 		}
 
-		if (!ndb_ingester_process_note(secp, inner_msg, note_size,
-					       ingester,
-					       inner_scratch + note_size,
-					       inner_scratch_size - note_size,
-					       relay, keys, nkeys,
-					       pns_keys, npns_keys, NULL, 0)) {
+		if (ndb_ingester_process_note(secp, inner_msg, note_size,
+					      NULL, ingester,
+					      inner_scratch + note_size,
+					      inner_scratch_size - note_size,
+					      relay, keys, nkeys,
+					      pns_keys, npns_keys, NULL, 0, 0) !=
+		    NDB_INGEST_STATUS_QUEUED) {
 			ndb_debug("failed to process pns inner note\n");
+			ndb_relay_free(relay);
 			return 0;
 		}
 
@@ -7614,100 +10663,583 @@ static int ndb_process_sns_event(secp256k1_context *secp,
 			return 0;
 		}
 
-		/* advance scratch past the decrypted seal json */
-		old_scratch = scratch;
-		scratch = decrypted + decrypted_len;
-		if (scratch - old_scratch <= 0)
-			return 0;
-		scratch_size -= scratch - old_scratch;
+		/* advance scratch past the decrypted seal json */
+		old_scratch = scratch;
+		scratch = decrypted + decrypted_len;
+		if (scratch - old_scratch <= 0)
+			return 0;
+		scratch_size -= scratch - old_scratch;
+
+		/* reuse the seal machinery with the team keypair as the ECDH
+		 * recipient; the rumor inside carries the member's real pubkey */
+		memcpy(team_kp.pubkey, sk->pubkey, 32);
+		memcpy(team_kp.seckey, sk->seckey, 32);
+
+		if (!ndb_process_seal(secp, ingester,
+				      (const char *)decrypted, decrypted_len,
+				      wrap_id, &team_kp,
+				      relay, scratch, scratch_size,
+				      keys, nkeys)) {
+			ndb_debug("sns: failed to process seal\n");
+			return 0;
+		}
+
+		/* mark the envelope as unwrapped */
+		flags = ndb_note_flags(note);
+		*flags = *flags | NDB_NOTE_FLAG_UNWRAPPED;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void ndb_monitor_lock(struct ndb_monitor *mon) {
+	pthread_mutex_lock(&mon->mutex);
+}
+
+static void ndb_monitor_unlock(struct ndb_monitor *mon) {
+	pthread_mutex_unlock(&mon->mutex);
+}
+
+struct written_note {
+	uint64_t note_id;
+	struct ndb_writer_note *note;
+};
+
+enum ndb_sub_key {
+	NDB_SUB_KEY_ID     = 'i',
+	NDB_SUB_KEY_AUTHOR = 'a',
+	NDB_SUB_KEY_KIND   = 'k',
+	NDB_SUB_KEY_TAG_ID = '#',
+	NDB_SUB_KEY_TAG    = 't',
+};
+
+// FNV-1a. Collisions only cost us an extra filter match
+static uint64_t ndb_sub_key_hash(enum ndb_sub_key type, char tag,
+				 const void *data, int len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	hash = (hash ^ (unsigned char)type) * 0x100000001b3ULL;
+	hash = (hash ^ (unsigned char)tag) * 0x100000001b3ULL;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+static int ndb_sub_index_push(struct ndb_sub_index_entry **entries, int *len,
+			      int *cap, uint64_t hash, uint32_t sub,
+			      uint32_t filter)
+{
+	struct ndb_sub_index_entry *entry;
+	int new_cap;
+
+	if (*len == *cap) {
+		new_cap = *cap ? *cap * 2 : 64;
+		if (!(entry = realloc(*entries, new_cap * sizeof(*entry))))
+			return 0;
+		*entries = entry;
+		*cap = new_cap;
+	}
+
+	entry = &(*entries)[(*len)++];
+	entry->hash = hash;
+	entry->sub = sub;
+	entry->filter = filter;
+
+	return 1;
+}
+
+static int ndb_sub_index_entry_cmp(const void *pa, const void *pb)
+{
+	const struct ndb_sub_index_entry *a = pa, *b = pb;
+
+	if (a->hash < b->hash)
+		return -1;
+	else if (a->hash > b->hash)
+		return 1;
+
+	return 0;
+}
+
+// The field we file a filter under. Every one of its values has to be
+// looked at when matching, so fewer, rarer values are better.
+static struct ndb_filter_elements *ndb_sub_index_field(struct ndb_filter *filter)
+{
+	struct ndb_filter_elements *els, *best;
+	int i, rank, best_rank;
+
+	best = NULL;
+	best_rank = 0;
+
+	for (i = 0; i < filter->num_elements; i++) {
+		els = ndb_filter_get_elements(filter, i);
+
+		switch (els->field.type) {
+		case NDB_FILTER_IDS:
+			rank = 0;
+			break;
+		case NDB_FILTER_AUTHORS:
+			rank = 1;
+			break;
+		case NDB_FILTER_TAGS:
+			if (els->field.elem_type != NDB_ELEMENT_ID &&
+			    els->field.elem_type != NDB_ELEMENT_STRING)
+				continue;
+			rank = 2;
+			break;
+		case NDB_FILTER_KINDS:
+			rank = 3;
+			break;
+		default:
+			continue;
+		}
+
+		if (best == NULL || rank < best_rank ||
+		    (rank == best_rank && els->count < best->count)) {
+			best = els;
+			best_rank = rank;
+		}
+	}
+
+	return best;
+}
+
+static int ndb_sub_index_add_filter(struct ndb_sub_index *index,
+				    struct ndb_filter *filter,
+				    uint32_t sub, uint32_t filter_ind)
+{
+	struct ndb_filter_elements *els;
+	const char *str;
+	uint64_t hash, kind;
+	int i;
+
+	if (!(els = ndb_sub_index_field(filter))) {
+		return ndb_sub_index_push(&index->always, &index->num_always,
+					  &index->always_cap, 0, sub,
+					  filter_ind);
+	}
+
+	for (i = 0; i < els->count; i++) {
+		switch (els->field.type) {
+		case NDB_FILTER_IDS:
+			hash = ndb_sub_key_hash(NDB_SUB_KEY_ID, 0,
+				ndb_filter_get_id_element(filter, els, i), 32);
+			break;
+		case NDB_FILTER_AUTHORS:
+			hash = ndb_sub_key_hash(NDB_SUB_KEY_AUTHOR, 0,
+				ndb_filter_get_id_element(filter, els, i), 32);
+			break;
+		case NDB_FILTER_KINDS:
+			kind = (uint32_t)els->elements[i];
+			hash = ndb_sub_key_hash(NDB_SUB_KEY_KIND, 0, &kind,
+						sizeof(kind));
+			break;
+		case NDB_FILTER_TAGS:
+			if (els->field.elem_type == NDB_ELEMENT_ID) {
+				hash = ndb_sub_key_hash(NDB_SUB_KEY_TAG_ID,
+					els->field.tag,
+					ndb_filter_get_id_element(filter, els, i),
+					32);
+			} else {
+				str = ndb_filter_get_string_element(filter, els, i);
+				hash = ndb_sub_key_hash(NDB_SUB_KEY_TAG,
+							els->field.tag, str,
+							strlen(str));
+			}
+			break;
+		default:
+			return 0;
+		}
+
+		if (!ndb_sub_index_push(&index->entries, &index->num_entries,
+					&index->entries_cap, hash, sub,
+					filter_ind))
+			return 0;
+	}
+
+	return 1;
+}
+
+static int ndb_sub_index_build(struct ndb_sub_index *index,
+			       struct ndb_monitor *monitor)
+{
+	struct ndb_subscription *sub;
+	struct ndb_sub_mark *marks;
+	int i, j;
+
+	index->num_entries = 0;
+	index->num_always = 0;
+
+	if (monitor->num_subscriptions > index->marks_cap) {
+		if (!(marks = realloc(index->marks, monitor->num_subscriptions *
+				      sizeof(*marks))))
+			return 0;
+		index->marks = marks;
+		index->marks_cap = monitor->num_subscriptions;
+	}
+
+	if (index->marks_cap > 0)
+		memset(index->marks, 0, index->marks_cap * sizeof(*index->marks));
+	index->stamp = 0;
+
+	for (i = 0; i < monitor->num_subscriptions; i++) {
+		sub = monitor->subscriptions[i];
+
+		if (sub->group.num_filters == 0) {
+			if (!ndb_sub_index_push(&index->always,
+						&index->num_always,
+						&index->always_cap, 0, i,
+						NDB_SUB_INDEX_ALL))
+				return 0;
+			continue;
+		}
+
+		for (j = 0; j < sub->group.num_filters; j++) {
+			if (!ndb_sub_index_add_filter(index,
+						      &sub->group.filters[j],
+						      i, j))
+				return 0;
+		}
+	}
+
+	qsort(index->entries, index->num_entries, sizeof(index->entries[0]),
+	      ndb_sub_index_entry_cmp);
+
+	index->dirty = 0;
+	return 1;
+}
+
+static void ndb_sub_index_destroy(struct ndb_sub_index *index)
+{
+	free(index->entries);
+	free(index->always);
+	free(index->marks);
+	memset(index, 0, sizeof(*index));
+}
+
+// Make the subscription's fd readable, if it has one. The monitor must be
+// locked.
+static void ndb_subscription_signal(struct ndb_subscription *sub)
+{
+#ifndef _WIN32
+	uint64_t one = 1;
+
+	if (sub->fd_write == -1 || sub->fd_armed)
+		return;
+
+	// eventfd wants 8 bytes, a pipe takes whatever
+#ifdef __linux__
+	if (write(sub->fd_write, &one, sizeof(one)) != sizeof(one))
+		return;
+#else
+	if (write(sub->fd_write, &one, 1) != 1)
+		return;
+#endif
+
+	sub->fd_armed = 1;
+#endif
+}
+
+// Once the subscriber has taken everything, the fd goes quiet until the
+// next note. The monitor must be locked.
+static void ndb_subscription_unsignal(struct ndb_subscription *sub)
+{
+#ifndef _WIN32
+	uint64_t buf;
+
+	if (!sub->fd_armed || prot_queue_count(&sub->inbox) > 0)
+		return;
+
+	while (read(sub->fd_read, &buf, sizeof(buf)) > 0)
+		;
+
+	sub->fd_armed = 0;
+#endif
+}
+
+// Queue a matching note for the subscriber. When the inbox is full we drop
+// it, and remember the first note we dropped so the subscriber can catch up
+// with one query instead of us holding on to everything.
+static void ndb_subscription_push(struct ndb_subscription *sub,
+				  uint64_t *note_id, int *pushed)
+{
+	if (prot_queue_push(&sub->inbox, note_id)) {
+		(*pushed)++;
+		return;
+	}
+
+	ndb_debug("couldn't push note to subscriber");
+
+	// the subscriber needs to hear about the first one
+	if (sub->resync_from == 0) {
+		sub->resync_from = *note_id;
+		(*pushed)++;
+	}
+
+	sub->dropped++;
+}
+
+// match one candidate filter against the note, pushing it to the
+// subscription's inbox if it's the first of its filters to match
+static void ndb_sub_index_check(struct ndb_monitor *monitor,
+				struct ndb_sub_index_entry *entry,
+				struct ndb_note *note, uint64_t *note_id)
+{
+	struct ndb_sub_index *index = &monitor->index;
+	struct ndb_sub_mark *mark = &index->marks[entry->sub];
+	struct ndb_subscription *sub;
+
+	if (mark->stamp == index->stamp)
+		return;
+
+	sub = monitor->subscriptions[entry->sub];
+
+	if (*note_id <= sub->watermark)
+		return;
+
+	if (entry->filter != NDB_SUB_INDEX_ALL &&
+	    !ndb_filter_matches(&sub->group.filters[entry->filter], note)) {
+		return;
+	}
+
+	mark->stamp = index->stamp;
+
+	ndb_subscription_push(sub, note_id, &mark->pushed);
+}
+
+static void ndb_sub_index_lookup(struct ndb_monitor *monitor, uint64_t hash,
+				 struct ndb_note *note, uint64_t *note_id)
+{
+	struct ndb_sub_index *index = &monitor->index;
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = index->num_entries;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->entries[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < index->num_entries && index->entries[lo].hash == hash; lo++)
+		ndb_sub_index_check(monitor, &index->entries[lo], note, note_id);
+}
+
+static void ndb_sub_index_match(struct ndb_monitor *monitor,
+				struct ndb_note *note, uint64_t *note_id)
+{
+	struct ndb_sub_index *index = &monitor->index;
+	struct ndb_iterator iter, *it = &iter;
+	struct ndb_str name, val;
+	uint64_t kind;
+	int i;
+
+	// a fresh stamp means no subscription has this note yet
+	if (++index->stamp == 0) {
+		for (i = 0; i < monitor->num_subscriptions; i++)
+			index->marks[i].stamp = 0;
+		index->stamp = 1;
+	}
+
+	for (i = 0; i < index->num_always; i++)
+		ndb_sub_index_check(monitor, &index->always[i], note, note_id);
+
+	ndb_sub_index_lookup(monitor,
+		ndb_sub_key_hash(NDB_SUB_KEY_ID, 0, ndb_note_id(note), 32),
+		note, note_id);
+
+	ndb_sub_index_lookup(monitor,
+		ndb_sub_key_hash(NDB_SUB_KEY_AUTHOR, 0, ndb_note_pubkey(note), 32),
+		note, note_id);
+
+	kind = note->kind;
+	ndb_sub_index_lookup(monitor,
+		ndb_sub_key_hash(NDB_SUB_KEY_KIND, 0, &kind, sizeof(kind)),
+		note, note_id);
 
-		/* reuse the seal machinery with the team keypair as the ECDH
-		 * recipient; the rumor inside carries the member's real pubkey */
-		memcpy(team_kp.pubkey, sk->pubkey, 32);
-		memcpy(team_kp.seckey, sk->seckey, 32);
+	ndb_tags_iterate_start(note, it);
 
-		if (!ndb_process_seal(secp, ingester,
-				      (const char *)decrypted, decrypted_len,
-				      wrap_id, &team_kp,
-				      relay, scratch, scratch_size,
-				      keys, nkeys)) {
-			ndb_debug("sns: failed to process seal\n");
-			return 0;
-		}
+	while (ndb_tags_iterate_next(it)) {
+		if (it->tag->count < 2)
+			continue;
 
-		/* mark the envelope as unwrapped */
-		flags = ndb_note_flags(note);
-		*flags = *flags | NDB_NOTE_FLAG_UNWRAPPED;
-		return 1;
-	}
+		name = ndb_tag_str(note, it->tag, 0);
 
-	return 0;
-}
+		// only single letter tags can be filtered on
+		if (name.flag != NDB_PACKED_STR || name.str[1] != 0)
+			continue;
 
-static void ndb_monitor_lock(struct ndb_monitor *mon) {
-	pthread_mutex_lock(&mon->mutex);
-}
+		val = ndb_tag_str(note, it->tag, 1);
 
-static void ndb_monitor_unlock(struct ndb_monitor *mon) {
-	pthread_mutex_unlock(&mon->mutex);
+		if (val.flag == NDB_PACKED_ID) {
+			ndb_sub_index_lookup(monitor,
+				ndb_sub_key_hash(NDB_SUB_KEY_TAG_ID,
+						 name.str[0], val.id, 32),
+				note, note_id);
+		} else {
+			ndb_sub_index_lookup(monitor,
+				ndb_sub_key_hash(NDB_SUB_KEY_TAG, name.str[0],
+						 val.str, strlen(val.str)),
+				note, note_id);
+		}
+	}
 }
 
-struct written_note {
-	uint64_t note_id;
-	struct ndb_writer_note *note;
-};
-
-// When the data has been committed to the database, take all of the written
-// notes, check them against subscriptions, and then write to the subscription
-// inbox for all matching notes
-static void ndb_notify_subscriptions(struct ndb_monitor *monitor,
-				     struct written_note *wrote, int num_notes)
+// Match every note against every subscription, for when we couldn't build
+// the subscription index
+static void ndb_notify_each_subscription(struct ndb_monitor *monitor,
+					 struct ndb_notifier_msg *wrote,
+					 int num_notes)
 {
 	int i, k;
 	int pushed;
-	struct written_note *written;
+	struct ndb_notifier_msg *written;
 	struct ndb_note *note;
 	struct ndb_subscription *sub;
 
-	ndb_monitor_lock(monitor);
-
 	for (i = 0; i < monitor->num_subscriptions; i++) {
-		sub = &monitor->subscriptions[i];
+		sub = monitor->subscriptions[i];
 		ndb_debug("checking subscription %d, %d notes\n", i, num_notes);
 
 		pushed = 0;
 		for (k = 0; k < num_notes; k++) {
 			written = &wrote[k];
-			note = written->note->note;
+			note = written->note;
+
+			if (written->note_id <= sub->watermark)
+				continue;
 
 			if (ndb_filter_group_matches(&sub->group, note)) {
 				ndb_debug("pushing note\n");
-
-				if (!prot_queue_push(&sub->inbox, &written->note_id)) {
-					ndb_debug("couldn't push note to subscriber");
-				} else {
-					pushed++;
-				}
+				ndb_subscription_push(sub, &written->note_id,
+						      &pushed);
 			} else {
 				ndb_debug("not pushing note\n");
 			}
 		}
 
-		// After pushing all of the matching notes, check to see if we
-		// have a registered subscription callback. If so, we call it.
-		// The callback needs to call ndb_poll_for_notes to pull data
-		// that was just pushed to the queue in the for loop above.
+		if (pushed > 0)
+			ndb_subscription_signal(sub);
+
 		if (monitor->sub_cb != NULL && pushed > 0) {
 			monitor->sub_cb(monitor->sub_cb_ctx, sub->subid);
 		}
 	}
+}
+
+// When the data has been committed to the database, take all of the written
+// notes, check them against subscriptions, and then write to the subscription
+// inbox for all matching notes
+static void ndb_notify_subscriptions(struct ndb_monitor *monitor,
+				     struct ndb_notifier_msg *wrote,
+				     int num_notes)
+{
+	int i, k, pushed;
+
+	ndb_monitor_lock(monitor);
+
+	if (monitor->index.dirty &&
+	    !ndb_sub_index_build(&monitor->index, monitor)) {
+		fprintf(stderr, "ndb_notify_subscriptions: couldn't build the "
+			"subscription index\n");
+		ndb_notify_each_subscription(monitor, wrote, num_notes);
+		goto done;
+	}
+
+	for (k = 0; k < num_notes; k++) {
+		ndb_sub_index_match(monitor, wrote[k].note, &wrote[k].note_id);
+	}
+
+	// After pushing all of the matching notes, check to see if we
+	// have a registered subscription callback. If so, we call it.
+	// The callback needs to call ndb_poll_for_notes to pull data
+	// that was just pushed to the queue above.
+	for (i = 0; i < monitor->num_subscriptions; i++) {
+		pushed = monitor->index.marks[i].pushed;
+		monitor->index.marks[i].pushed = 0;
+
+		if (pushed > 0)
+			ndb_subscription_signal(monitor->subscriptions[i]);
+
+		if (monitor->sub_cb != NULL && pushed > 0) {
+			monitor->sub_cb(monitor->sub_cb_ctx,
+					monitor->subscriptions[i]->subid);
+		}
+	}
 
+done:
 	// wake up any threads blocked in ndb_wait_for_notes
 	pthread_cond_broadcast(&monitor->cond);
 
 	ndb_monitor_unlock(monitor);
 }
 
+static void *ndb_notifier_thread(void *data)
+{
+	struct ndb_notifier *notifier = data;
+	struct ndb_notifier_msg msgs[THREAD_QUEUE_BATCH];
+	struct ndb_note_slab_releaser releaser;
+	int i, popped, num_notes, done;
+
+	ndb_debug("started notifier thread\n");
+
+	done = 0;
+	while (!done) {
+		popped = prot_queue_pop_all(&notifier->inbox, msgs,
+					    THREAD_QUEUE_BATCH);
+
+		// the writer quits before we do, so nothing follows a quit
+		for (num_notes = 0; num_notes < popped; num_notes++) {
+			if (msgs[num_notes].type == NDB_NOTIFIER_QUIT) {
+				done = 1;
+				break;
+			}
+		}
+
+		if (num_notes > 0)
+			ndb_notify_subscriptions(notifier->monitor, msgs,
+						 num_notes);
+
+		ndb_note_slab_releaser_init(&releaser);
+		for (i = 0; i < num_notes; i++)
+			ndb_note_slab_release(&releaser, msgs[i].slab,
+					      msgs[i].note);
+		ndb_note_slab_releaser_flush(&releaser);
+	}
+
+	ndb_debug("quitting notifier thread\n");
+	return NULL;
+}
+
+// Hand the notes we just committed over to the notifier, which takes
+// ownership of them. We only wait here if it's a whole queue behind.
+static void ndb_writer_notify(struct ndb_notifier *notifier,
+			      struct written_note *written, int num_notes)
+{
+	struct ndb_notifier_msg msgs[THREAD_QUEUE_BATCH];
+	int i;
+
+	if (num_notes == 0)
+		return;
+
+	for (i = 0; i < num_notes; i++) {
+		msgs[i].type = NDB_NOTIFIER_NOTE;
+		msgs[i].note_id = written[i].note_id;
+		msgs[i].note = written[i].note->note;
+		msgs[i].slab = written[i].note->slab;
+		written[i].note->note = NULL;
+	}
+
+	prot_queue_push_all_wait(&notifier->inbox, msgs, num_notes);
+}
+
 uint64_t ndb_write_note_and_profile(
 		secp256k1_context *secp,
 		struct ndb_txn *txn,
@@ -7755,6 +11287,110 @@ static int ndb_write_version(struct ndb_txn *txn, uint64_t version)
 	return 1;
 }
 
+/* Remember that notes from note key `from` on have no secondary indices
+ * yet, or with 0 that they all do. An earlier `from` is kept, since those
+ * notes still need indexing. Only to be called from the writer thread. */
+static int ndb_write_indices_deferred(struct ndb_txn *txn, uint64_t from)
+{
+	int rc;
+	MDB_val key, val;
+	uint64_t meta_key;
+
+	meta_key = NDB_META_KEY_INDICES_DEFERRED;
+
+	key.mv_data = &meta_key;
+	key.mv_size = sizeof(meta_key);
+	val.mv_data = &from;
+	val.mv_size = sizeof(from);
+
+	if (from) {
+		rc = mdb_put(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META],
+			     &key, &val, MDB_NOOVERWRITE);
+		if (rc == MDB_KEYEXIST)
+			rc = 0;
+	} else if ((rc = mdb_del(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META], &key, NULL)) == MDB_NOTFOUND)
+		rc = 0;
+
+	if (rc) {
+		ndb_debug("write indices deferred to ndb_meta failed: %s\n",
+				mdb_strerror(rc));
+		return 0;
+	}
+
+	return 1;
+}
+
+// the first note key without secondary indices, or 0 if there's none
+static uint64_t ndb_indices_deferred(struct ndb_txn *txn)
+{
+	MDB_val key, val;
+	uint64_t meta_key;
+
+	meta_key = NDB_META_KEY_INDICES_DEFERRED;
+	key.mv_data = &meta_key;
+	key.mv_size = sizeof(meta_key);
+
+	if (mdb_get(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NDB_META], &key, &val))
+		return 0;
+
+	// older dbs stored 1 here, which rebuilds from the first note
+	return *(uint64_t *)val.mv_data;
+}
+
+// Build the note indices a bulk load left out, see NDB_FLAG_DEFER_INDICES
+static int ndb_build_deferred_indices(struct ndb_txn *txn, uint64_t from,
+				      uint32_t ndb_flags)
+{
+	int count, num_indices;
+
+	enum ndb_dbs indices[] = {
+		NDB_DB_NOTE_KIND,
+		NDB_DB_NOTE_TAGS,
+		NDB_DB_NOTE_PUBKEY,
+		NDB_DB_NOTE_PUBKEY_KIND,
+		NDB_DB_NOTE_CREATED,
+		NDB_DB_NOTE_TEXT, // last, so NDB_FLAG_NO_FULLTEXT can skip it
+	};
+
+	num_indices = sizeof(indices) / sizeof(indices[0]);
+	if (ndb_flag_set(ndb_flags, NDB_FLAG_NO_FULLTEXT))
+		num_indices--;
+
+	if ((count = ndb_rebuild_note_indices(txn, indices, num_indices, from)) == -1) {
+		fprintf(stderr, "error building deferred note indices\n");
+		return 0;
+	}
+
+	fprintf(stderr, "nostrdb: built deferred indices for %d notes\n", count);
+
+	return ndb_write_indices_deferred(txn, 0);
+}
+
+// in its own txn, when the writer isn't taking anything else
+static void ndb_writer_build_deferred_indices(struct ndb_writer *writer)
+{
+	struct ndb_txn txn;
+	uint64_t from;
+	int rc;
+
+	ndb_txn_from_mdb(&txn, writer->lmdb, NULL);
+	if ((rc = mdb_txn_begin(writer->lmdb->env, NULL, 0, (MDB_txn **)&txn.mdb_txn))) {
+		fprintf(stderr, "writer: couldn't begin txn to build deferred indices: %s\n",
+			mdb_strerror(rc));
+		return;
+	}
+
+	if (!(from = ndb_indices_deferred(&txn)) ||
+	    !ndb_build_deferred_indices(&txn, from, writer->ndb_flags)) {
+		mdb_txn_abort(txn.mdb_txn);
+		return;
+	}
+
+	if ((rc = mdb_txn_commit(txn.mdb_txn)))
+		fprintf(stderr, "writer: deferred indices commit failed: %s\n",
+			mdb_strerror(rc));
+}
+
 
 static int ndb_run_migrations(struct ndb_txn *txn)
 {
@@ -7798,6 +11434,34 @@ static int ndb_run_migrations(struct ndb_txn *txn)
 	return 1;
 }
 
+/* The ingesters skip copies of notes they've queued. If one never made it
+ * into the db, forget it so the next copy gets verified and written */
+static void ndb_writer_forget_note(struct ndb_writer *writer,
+				   struct ndb_writer_note *note)
+{
+	if (writer->seen == NULL || note->note == NULL)
+		return;
+
+	ndb_seen_ids_remove(writer->seen, ndb_seen_ids_key(note->note->id, NULL));
+	if (note->relay) {
+		ndb_seen_ids_remove(writer->seen,
+				    ndb_seen_ids_key(note->note->id, note->relay));
+	}
+}
+
+// when a whole batch is lost
+static void ndb_writer_forget_notes(struct ndb_writer *writer,
+				    struct ndb_writer_msg *msgs, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (msgs[i].type == NDB_WRITER_NOTE)
+			ndb_writer_forget_note(writer, &msgs[i].note);
+		else if (msgs[i].type == NDB_WRITER_PROFILE)
+			ndb_writer_forget_note(writer, &msgs[i].profile.note);
+	}
+}
 
 static void *ndb_writer_thread(void *data)
 {
@@ -7805,7 +11469,8 @@ static void *ndb_writer_thread(void *data)
 	struct ndb_writer *writer = data;
 	struct ndb_writer_msg msgs[THREAD_QUEUE_BATCH], *msg;
 	struct written_note written_notes[THREAD_QUEUE_BATCH];
-	int i, popped, done, needs_commit, num_notes;
+	struct ndb_note_slab_releaser releaser;
+	int i, popped, done, needs_commit, has_notes, num_notes;
 	uint64_t note_nkey;
 	struct ndb_txn txn;
 	unsigned char *scratch;
@@ -7818,6 +11483,10 @@ static void *ndb_writer_thread(void *data)
 	MDB_txn *mdb_txn = NULL;
 	ndb_txn_from_mdb(&txn, writer->lmdb, mdb_txn);
 
+	// a bulk load that never got to build its indices
+	if (!ndb_flag_set(writer->ndb_flags, NDB_FLAG_DEFER_INDICES))
+		ndb_writer_build_deferred_indices(writer);
+
 	done = 0;
 	while (!done) {
 		txn.mdb_txn = NULL;
@@ -7827,12 +11496,16 @@ static void *ndb_writer_thread(void *data)
 		ndb_debug("writer popped %d items\n", popped);
 
 		needs_commit = 0;
+		has_notes = 0;
 		for (i = 0 ; i < popped; i++) {
 			msg = &msgs[i];
 			switch (msg->type) {
 			case NDB_WRITER_NOTE:
-			case NDB_WRITER_NOTE_META:
 			case NDB_WRITER_PROFILE:
+				has_notes = 1;
+				needs_commit = 1;
+				break;
+			case NDB_WRITER_NOTE_META:
 			case NDB_WRITER_DBMETA:
 			case NDB_WRITER_PROFILE_LAST_FETCH:
 			case NDB_WRITER_BLOCKS:
@@ -7849,9 +11522,15 @@ static void *ndb_writer_thread(void *data)
 			fprintf(stderr, "writer thread txn_begin failed");
 			// should definitely not happen unless DB is full
 			// or something ?
+			ndb_writer_forget_notes(writer, msgs, popped);
 			continue;
 		}
 
+		// remember the notes need indexing, in case we never get to it
+		if (has_notes && ndb_flag_set(writer->ndb_flags, NDB_FLAG_DEFER_INDICES))
+			ndb_write_indices_deferred(&txn, ndb_get_last_key(txn.mdb_txn,
+				txn.lmdb->dbs[NDB_DB_NOTE]) + 1);
+
 		for (i = 0; i < popped; i++) {
 			msg = &msgs[i];
 
@@ -7878,8 +11557,11 @@ static void *ndb_writer_thread(void *data)
 						.note_id = note_nkey,
 						.note = &msg->profile.note,
 					};
-				} else {
+				} else if (!ndb_get_notekey_by_id(&txn,
+						msg->profile.note.note->id)) {
 					ndb_debug("failed to write note\n");
+					ndb_writer_forget_note(writer,
+							       &msg->profile.note);
 				}
 				break;
 			case NDB_WRITER_NOTE_META:
@@ -7900,6 +11582,11 @@ static void *ndb_writer_thread(void *data)
 						.note_id = note_nkey,
 						.note = &msg->note,
 					};
+				} else if (!ndb_get_notekey_by_id(&txn,
+						msg->note.note->id)) {
+					// a failed write, or a relay copy of a
+					// note that never made it in
+					ndb_writer_forget_note(writer, &msg->note);
 				}
 				break;
 			case NDB_WRITER_NOTE_RELAY:
@@ -7938,35 +11625,45 @@ static void *ndb_writer_thread(void *data)
 		if (needs_commit) {
 			if (!ndb_end_query(&txn)) {
 				ndb_debug("writer thread txn commit failed\n");
+				ndb_writer_forget_notes(writer, msgs, popped);
 			} else {
 				ndb_debug("commit write thead txn. notifying subscriptions, %d notes\n", num_notes);
-				ndb_notify_subscriptions(writer->monitor,
-							 written_notes,
-							 num_notes);
-				// update subscriptions
+				ndb_writer_notify(writer->notifier,
+						  written_notes, num_notes);
 			}
 		}
 
-		// free notes
+		// free notes that didn't go to the notifier
+		ndb_note_slab_releaser_init(&releaser);
 		for (i = 0; i < popped; i++) {
 			msg = &msgs[i];
 			if (msg->type == NDB_WRITER_NOTE) {
-				free(msg->note.note);
-				if (msg->note.relay)
-					free((void*)msg->note.relay);
+				if (msg->note.note)
+					ndb_note_slab_release(&releaser,
+							      msg->note.slab,
+							      msg->note.note);
+				ndb_relay_free(msg->note.relay);
 			} else if (msg->type == NDB_WRITER_PROFILE) {
-				free(msg->profile.note.note);
+				if (msg->profile.note.note)
+					ndb_note_slab_release(&releaser,
+							      msg->profile.note.slab,
+							      msg->profile.note.note);
+				ndb_relay_free(msg->profile.note.relay);
 				ndb_profile_record_builder_free(&msg->profile.record);
 			} else if (msg->type == NDB_WRITER_BLOCKS) {
 				ndb_blocks_free(msg->blocks.blocks);
 			} else if (msg->type == NDB_WRITER_NOTE_RELAY) {
-				free((void*)msg->note_relay.relay);
+				ndb_relay_free(msg->note_relay.relay);
 			} else if (msg->type == NDB_WRITER_NOTE_META) {
 				free(msg->note_meta.metadata);
 			}
 		}
+		ndb_note_slab_releaser_flush(&releaser);
 	}
 
+	if (ndb_flag_set(writer->ndb_flags, NDB_FLAG_DEFER_INDICES))
+		ndb_writer_build_deferred_indices(writer);
+
 bail:
 	secp256k1_context_destroy(secp);
 	free(scratch);
@@ -8128,6 +11825,7 @@ static const char *ndb_ingest_msg_name(enum ndb_ingester_msgtype type)
 	case NDB_INGEST_ADD_TEAM_ROOT: return "add_team_root";
 	case NDB_INGEST_QUIT: return "quit";
 	case NDB_INGEST_EVENT: return "event";
+	case NDB_INGEST_IMPORT: return "import";
 	}
 
 	return "unknown";
@@ -8255,8 +11953,10 @@ static void *ndb_ingester_thread(void *data)
 	struct pns_key *pns_keys;
 	struct sns_key *sns_keys;
 	struct ndb_txn txn;
+	struct ndb_note_slab *slab;
 	unsigned char *scratch;
 
+	slab = NULL;
 	nkeys = 0;
 	npns_keys = 0;
 	nsns_keys = 0;
@@ -8275,8 +11975,7 @@ static void *ndb_ingester_thread(void *data)
 	while (!done) {
 		any_event = 0;
 
-		popped = prot_queue_pop_all(&thread->inbox, msgs,
-					    THREAD_QUEUE_BATCH);
+		popped = threadpool_pop(thread, msgs, THREAD_QUEUE_BATCH);
 #ifdef NDB_LOG
 		ndb_debug("ingester %lx popped %d items ",
 			  thread->thread_id & 0xFFFFFFF, popped);
@@ -8297,6 +11996,7 @@ static void *ndb_ingester_thread(void *data)
 			msg = &msgs[i];
 			switch (msg->type) {
 			case NDB_INGEST_EVENT:
+			case NDB_INGEST_IMPORT:
 			case NDB_INGEST_PROCESS_GIFTWRAP:
 			case NDB_INGEST_PROCESS_PNS:
 			case NDB_INGEST_PROCESS_SNS:
@@ -8309,12 +12009,14 @@ static void *ndb_ingester_thread(void *data)
 			}
 		}
 
+		read_txn = NULL;
 		if (any_event && (rc = mdb_txn_begin(lmdb->env, NULL,
 						     MDB_RDONLY, &read_txn))) {
-			// this is bad
+			// this is bad. the events in this batch are dropped
+			// below, but imports still finish their ranges
 			fprintf(stderr, "UNUSUAL ndb_ingester: mdb_txn_begin failed: '%s'\n",
 					mdb_strerror(rc));
-			continue;
+			read_txn = NULL;
 		}
 
 		for (i = 0; i < popped; i++) {
@@ -8325,6 +12027,8 @@ static void *ndb_ingester_thread(void *data)
 				break;
 
 			case NDB_INGEST_PROCESS_GIFTWRAP:
+				if (read_txn == NULL)
+					break;
 				ndb_txn_from_mdb(&txn, lmdb, read_txn);
 				ndb_ingester_reprocess_giftwrap(
 					ctx, ingester, &txn,
@@ -8334,6 +12038,8 @@ static void *ndb_ingester_thread(void *data)
 				break;
 
 			case NDB_INGEST_PROCESS_PNS:
+				if (read_txn == NULL)
+					break;
 				ndb_txn_from_mdb(&txn, lmdb, read_txn);
 				ndb_ingester_reprocess_pns(
 					ctx, ingester, &txn,
@@ -8344,6 +12050,8 @@ static void *ndb_ingester_thread(void *data)
 				break;
 
 			case NDB_INGEST_PROCESS_SNS:
+				if (read_txn == NULL)
+					break;
 				ndb_txn_from_mdb(&txn, lmdb, read_txn);
 				ndb_ingester_reprocess_sns(
 					ctx, ingester, &txn,
@@ -8367,22 +12075,41 @@ static void *ndb_ingester_thread(void *data)
 				break;
 
 			case NDB_INGEST_EVENT:
+				if (read_txn == NULL) {
+					// nothing to check it against
+					ndb_ingester_event_release(&msg->event);
+					ndb_relay_free(msg->event.relay);
+					break;
+				}
 				ndb_ingester_process_event(ctx, ingester,
 							   &msg->event,
 							   scratch,
 							   keys, nkeys,
 							   pns_keys, npns_keys,
 							   sns_keys, nsns_keys,
-							   read_txn);
+							   &slab, read_txn);
+				break;
+
+			case NDB_INGEST_IMPORT:
+				ndb_ingester_import_range(ctx, ingester,
+							  &msg->import,
+							  scratch,
+							  keys, nkeys,
+							  pns_keys, npns_keys,
+							  sns_keys, nsns_keys,
+							  &slab, &read_txn);
 				break;
 			}
 		}
 
-		if (any_event)
+		if (read_txn)
 			mdb_txn_abort(read_txn);
 	}
 
 	ndb_debug("quitting ingester thread\n");
+	// notes still on their way to the writer keep the slab alive
+	if (slab)
+		ndb_note_slab_unref(slab, 1);
 	secp256k1_context_destroy(ctx);
 	free(scratch);
 	free(keys);
@@ -8392,12 +12119,42 @@ static void *ndb_ingester_thread(void *data)
 }
 
 
+static int ndb_notifier_init(struct ndb_notifier *notifier,
+			     struct ndb_monitor *monitor)
+{
+	notifier->monitor = monitor;
+	notifier->queue_buflen = sizeof(struct ndb_notifier_msg) * DEFAULT_QUEUE_SIZE;
+	notifier->queue_buf = malloc(notifier->queue_buflen);
+	if (notifier->queue_buf == NULL) {
+		fprintf(stderr, "ndb: failed to allocate space for notifier queue");
+		return 0;
+	}
+
+	if (!prot_queue_init(&notifier->inbox, notifier->queue_buf,
+			     notifier->queue_buflen,
+			     sizeof(struct ndb_notifier_msg))) {
+		fprintf(stderr, "ndb: failed to init notifier queue\n");
+		free(notifier->queue_buf);
+		return 0;
+	}
+
+	if (THREAD_CREATE(notifier->thread_id, ndb_notifier_thread, notifier))
+	{
+		fprintf(stderr, "ndb notifier thread failed to create\n");
+		return 0;
+	}
+
+	return 1;
+}
+
 static int ndb_writer_init(struct ndb_writer *writer, struct ndb_lmdb *lmdb,
-			   struct ndb_monitor *monitor, uint32_t ndb_flags,
+			   struct ndb_notifier *notifier,
+			   struct ndb_seen_ids *seen, uint32_t ndb_flags,
 			   int scratch_size)
 {
 	writer->lmdb = lmdb;
-	writer->monitor = monitor;
+	writer->notifier = notifier;
+	writer->seen = seen;
 	writer->ndb_flags = ndb_flags;
 	writer->scratch_size = scratch_size;
 	writer->queue_buflen = sizeof(struct ndb_writer_msg) * DEFAULT_QUEUE_SIZE;
@@ -8408,8 +12165,12 @@ static int ndb_writer_init(struct ndb_writer *writer, struct ndb_lmdb *lmdb,
 	}
 
 	// init the writer queue.
-	prot_queue_init(&writer->inbox, writer->queue_buf,
-			writer->queue_buflen, sizeof(struct ndb_writer_msg));
+	if (!prot_queue_init(&writer->inbox, writer->queue_buf,
+			     writer->queue_buflen, sizeof(struct ndb_writer_msg))) {
+		fprintf(stderr, "ndb: failed to init writer queue\n");
+		free(writer->queue_buf);
+		return 0;
+	}
 
 	// spin up the writer thread
 	if (THREAD_CREATE(writer->thread_id, ndb_writer_thread, writer))
@@ -8425,6 +12186,7 @@ static int ndb_writer_init(struct ndb_writer *writer, struct ndb_lmdb *lmdb,
 static int ndb_ingester_init(struct ndb_ingester *ingester,
 			     struct ndb_lmdb *lmdb,
 			     struct prot_queue *writer_inbox,
+			     struct ndb_seen_ids *seen,
 			     int scratch_size,
 			     const struct ndb_config *config)
 {
@@ -8437,6 +12199,7 @@ static int ndb_ingester_init(struct ndb_ingester *ingester,
 
 	ingester->scratch_size = scratch_size;
 	ingester->writer_inbox = writer_inbox;
+	ingester->seen = seen;
 	ingester->lmdb = lmdb;
 	ingester->flags = config->flags;
 	ingester->filter = config->ingest_filter;
@@ -8457,17 +12220,13 @@ static int ndb_writer_destroy(struct ndb_writer *writer)
 {
 	struct ndb_writer_msg msg;
 
-	// kill thread
+	// kill thread. the writer always drains its queue, so wait for room
+	// rather than leaving notes behind
 	msg.type = NDB_WRITER_QUIT;
 	ndb_debug("writer: pushing quit message\n");
-	if (!prot_queue_push(&writer->inbox, &msg)) {
-		// queue is too full to push quit message. just kill it.
-		ndb_debug("writer: terminating thread\n");
-		THREAD_TERMINATE(writer->thread_id);
-	} else {
-		ndb_debug("writer: joining thread\n");
-		THREAD_FINISH(writer->thread_id);
-	}
+	prot_queue_push_all_wait(&writer->inbox, &msg, 1);
+	ndb_debug("writer: joining thread\n");
+	THREAD_FINISH(writer->thread_id);
 
 	// cleanup
 	ndb_debug("writer: cleaning up protected queue\n");
@@ -8478,6 +12237,26 @@ static int ndb_writer_destroy(struct ndb_writer *writer)
 	return 1;
 }
 
+// must be destroyed after the writer, which feeds it
+static int ndb_notifier_destroy(struct ndb_notifier *notifier)
+{
+	struct ndb_notifier_msg msg = { .type = NDB_NOTIFIER_QUIT };
+
+	ndb_debug("notifier: pushing quit message\n");
+	if (!prot_queue_push(&notifier->inbox, &msg)) {
+		ndb_debug("notifier: terminating thread\n");
+		THREAD_TERMINATE(notifier->thread_id);
+	} else {
+		ndb_debug("notifier: joining thread\n");
+		THREAD_FINISH(notifier->thread_id);
+	}
+
+	prot_queue_destroy(&notifier->inbox);
+	free(notifier->queue_buf);
+
+	return 1;
+}
+
 static int ndb_ingester_destroy(struct ndb_ingester *ingester)
 {
 	threadpool_destroy(&ingester->tp);
@@ -8489,6 +12268,7 @@ static int ndb_init_lmdb(const char *filename, struct ndb_lmdb *lmdb, size_t map
 	int rc;
 	MDB_txn *txn;
 
+
 	if ((rc = mdb_env_create(&lmdb->env))) {
 		fprintf(stderr, "mdb_env_create failed, error %d\n", rc);
 		return 0;
@@ -8612,6 +12392,13 @@ static int ndb_init_lmdb(const char *filename, struct ndb_lmdb *lmdb, size_t map
 	}
 	mdb_set_compare(txn, lmdb->dbs[NDB_DB_NOTE_PUBKEY_KIND], ndb_id_u64_ts_compare);
 
+	if ((rc = mdb_dbi_open(txn, "note_created",
+			       MDB_CREATE | MDB_INTEGERKEY | MDB_DUPSORT | MDB_INTEGERDUP | MDB_DUPFIXED,
+			       &lmdb->dbs[NDB_DB_NOTE_CREATED]))) {
+		fprintf(stderr, "mdb_dbi_open note_created failed: %s\n", mdb_strerror(rc));
+		return 0;
+	}
+
 	if ((rc = mdb_dbi_open(txn, "note_text", MDB_CREATE | MDB_DUPSORT,
 			       &lmdb->dbs[NDB_DB_NOTE_TEXT]))) {
 		fprintf(stderr, "mdb_dbi_open note_text failed: %s\n", mdb_strerror(rc));
@@ -8652,9 +12439,13 @@ static int ndb_queue_write_version(struct ndb *ndb, uint64_t version)
 static void ndb_monitor_init(struct ndb_monitor *monitor, ndb_sub_fn cb,
 			     void *sub_cb_ctx)
 {
+	monitor->subscriptions = NULL;
+	monitor->subscriptions_cap = 0;
 	monitor->num_subscriptions = 0;
 	monitor->sub_cb = cb;
 	monitor->sub_cb_ctx = sub_cb_ctx;
+	memset(&monitor->index, 0, sizeof(monitor->index));
+	monitor->index.dirty = 1;
 	pthread_mutex_init(&monitor->mutex, NULL);
 	pthread_cond_init(&monitor->cond, NULL);
 }
@@ -8667,15 +12458,24 @@ void ndb_filter_group_destroy(struct ndb_filter_group *group)
 		filter = &group->filters[i];
 		ndb_filter_destroy(filter);
 	}
+
+	free(group->filters);
+	ndb_filter_group_init(group);
 }
 
 static void ndb_subscription_destroy(struct ndb_subscription *sub)
 {
 	ndb_filter_group_destroy(&sub->group);
-	// this was malloc'd inside ndb_subscribe
+#ifndef _WIN32
+	if (sub->fd_read != -1)
+		close(sub->fd_read);
+	if (sub->fd_write != -1 && sub->fd_write != sub->fd_read)
+		close(sub->fd_write);
+#endif
+	// these were malloc'd inside ndb_subscribe
 	free(sub->inbox.buf);
 	prot_queue_destroy(&sub->inbox);
-	sub->subid = 0;
+	free(sub);
 }
 
 static void ndb_monitor_destroy(struct ndb_monitor *monitor)
@@ -8685,10 +12485,14 @@ static void ndb_monitor_destroy(struct ndb_monitor *monitor)
 	ndb_monitor_lock(monitor);
 
 	for (i = 0; i < monitor->num_subscriptions; i++) {
-		ndb_subscription_destroy(&monitor->subscriptions[i]);
+		ndb_subscription_destroy(monitor->subscriptions[i]);
 	}
 
+	free(monitor->subscriptions);
+	monitor->subscriptions = NULL;
+	monitor->subscriptions_cap = 0;
 	monitor->num_subscriptions = 0;
+	ndb_sub_index_destroy(&monitor->index);
 
 	ndb_monitor_unlock(monitor);
 
@@ -8714,14 +12518,26 @@ int ndb_init(struct ndb **pndb, const char *filename, const struct ndb_config *c
 
 	ndb_monitor_init(&ndb->monitor, config->sub_cb, config->sub_cb_ctx);
 
-	if (!ndb_writer_init(&ndb->writer, &ndb->lmdb, &ndb->monitor, ndb->flags,
+	if (!ndb_notifier_init(&ndb->notifier, &ndb->monitor)) {
+		fprintf(stderr, "ndb_notifier_init failed\n");
+		return 0;
+	}
+
+	if (!ndb_seen_ids_init(&ndb->seen)) {
+		fprintf(stderr, "ndb_init: seen ids failed to init\n");
+		return 0;
+	}
+
+	if (!ndb_writer_init(&ndb->writer, &ndb->lmdb, &ndb->notifier,
+			     &ndb->seen, ndb->flags,
 			     config->writer_scratch_buffer_size)) {
 		fprintf(stderr, "ndb_writer_init failed\n");
 		return 0;
 	}
 
 	if (!ndb_ingester_init(&ndb->ingester, &ndb->lmdb, &ndb->writer.inbox,
-			       config->writer_scratch_buffer_size, config)) {
+			       &ndb->seen, config->writer_scratch_buffer_size,
+			       config)) {
 		fprintf(stderr, "failed to initialize %d ingester thread(s)\n",
 				config->ingester_threads);
 		return 0;
@@ -8931,8 +12747,11 @@ void ndb_destroy(struct ndb *ndb)
 	ndb_ingester_destroy(&ndb->ingester);
 	ndb_debug("destroying writer\n");
 	ndb_writer_destroy(&ndb->writer);
+	ndb_debug("destroying notifier\n");
+	ndb_notifier_destroy(&ndb->notifier);
 	ndb_debug("destroying monitor\n");
 	ndb_monitor_destroy(&ndb->monitor);
+	ndb_seen_ids_destroy(&ndb->seen);
 
 	ndb_debug("closing env\n");
 	mdb_env_close(ndb->lmdb.env);
@@ -8986,6 +12805,14 @@ int ndb_process_event_with(struct ndb *ndb, const char *json, int json_len,
 	return ndb_ingest_event(&ndb->ingester, json, json_len, meta);
 }
 
+int ndb_process_event_owned(struct ndb *ndb, const char *json, int json_len,
+			    struct ndb_ingest_meta *meta,
+			    ndb_release_fn release, void *release_ctx)
+{
+	return ndb_ingest_event_owned(&ndb->ingester, json, json_len, meta,
+				      release, release_ctx);
+}
+
 int ndb_verify_zap(struct ndb *ndb, struct ndb_txn *txn,
 		   const unsigned char *zap_note_id)
 {
@@ -9137,16 +12964,142 @@ int ndb_process_events_stream(struct ndb *ndb, FILE* fp)
 	size_t len = 0;
 	ssize_t nread;
 
-	while ((nread = getline(&line, &len, fp)) != -1) {
-		if (line == NULL)
+	while ((nread = getline(&line, &len, fp)) != -1) {
+		if (line == NULL)
+			break;
+		ndb_process_event(ndb, line, len);
+	}
+
+	if (line)
+		free(line);
+
+	return 1;
+}
+
+int ndb_import_file(struct ndb *ndb, const char *path,
+		    struct ndb_ingest_meta *meta,
+		    struct ndb_import_stats *stats)
+{
+	struct ndb_import *import;
+	struct ndb_ingester_msg msg;
+	struct timespec t1, t2;
+	struct stat st;
+	const char *map, *p, *end, *eol;
+	size_t step;
+	int fd, i, nranges, ok;
+	uint32_t seen;
+
+	struct {
+		const char *start;
+		size_t len;
+	} *ranges;
+
+	ok = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		fprintf(stderr, "ndb_import_file: couldn't open %s\n", path);
+		return 0;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return 0;
+	}
+
+	map = NULL;
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "ndb_import_file: couldn't map %s\n", path);
+			close(fd);
+			return 0;
+		}
+		madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	nranges = ndb->ingester.tp.num_threads * NDB_IMPORT_RANGES_PER_THREAD;
+	ranges = malloc(sizeof(*ranges) * nranges);
+	import = calloc(1, sizeof(*import));
+	if (ranges == NULL || import == NULL)
+		goto cleanup;
+
+	// every line's note shares this one
+	if (meta->relay && !(import->relay = ndb_relay_dup(meta->relay)))
+		goto cleanup;
+
+	// split at the first newline after each step
+	step = st.st_size / nranges + 1;
+	end = map + st.st_size;
+	for (i = 0, p = map; p < end; i++) {
+		eol = NULL;
+		if (i < nranges - 1 && step < (size_t)(end - p))
+			eol = fast_strchr(p + step, '\n', end - p - step);
+
+		ranges[i].start = p;
+		ranges[i].len = (eol ? eol + 1 : end) - p;
+		p += ranges[i].len;
+	}
+	nranges = i;
+
+	import->client = meta->client;
+	import->pending = nranges;
+	import->refs = nranges + 1;
+	prot_event_init(&import->done);
+
+	ok = 1;
+	msg.type = NDB_INGEST_IMPORT;
+	msg.import.import = import;
+	for (i = 0; i < nranges; i++) {
+		msg.import.start = ranges[i].start;
+		msg.import.len = ranges[i].len;
+
+		if (threadpool_dispatch(&ndb->ingester.tp, &msg))
+			continue;
+
+		fprintf(stderr, "ndb_import_file: ingester queues are full\n");
+		ok = 0;
+		__atomic_sub_fetch(&import->pending, 1, __ATOMIC_ACQ_REL);
+		__atomic_sub_fetch(&import->refs, 1, __ATOMIC_ACQ_REL);
+	}
+
+	for (;;) {
+		seen = prot_event_wait_begin(&import->done);
+		if (__atomic_load_n(&import->pending, __ATOMIC_ACQUIRE) == 0) {
+			prot_event_wait_end(&import->done);
 			break;
-		ndb_process_event(ndb, line, len);
+		}
+		prot_event_sleep(&import->done, seen);
+		prot_event_wait_end(&import->done);
 	}
 
-	if (line)
-		free(line);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
 
-	return 1;
+	if (stats) {
+		*stats = import->stats;
+		stats->seconds = (t2.tv_sec - t1.tv_sec) +
+				 (t2.tv_nsec - t1.tv_nsec) / 1e9;
+		stats->events_per_sec = stats->seconds > 0
+			? stats->lines / stats->seconds : 0;
+	}
+
+	// every line has to make it to the writer
+	if (import->failed || import->stats.dropped > 0)
+		ok = 0;
+
+	ndb_import_unref(import);
+	import = NULL;
+
+cleanup:
+	free(ranges);
+	if (import)
+		ndb_relay_free(import->relay);
+	free(import);
+	if (map)
+		munmap((void *)map, st.st_size);
+
+	return ok;
 }
 #endif
 
@@ -11276,6 +15229,8 @@ const char *ndb_db_name(enum ndb_dbs db)
 			return "note_relay_kind_index";
 		case NDB_DB_NOTE_RELAYS:
 			return "note_relays";
+		case NDB_DB_NOTE_CREATED:
+			return "note_created_index";
 		case NDB_DBS:
 			return "count";
 	}
@@ -11366,7 +15321,7 @@ ndb_monitor_find_subscription(struct ndb_monitor *monitor, uint64_t subid, int *
 	int i;
 
 	for (i = 0, sub = NULL; i < monitor->num_subscriptions; i++) {
-		tsub = &monitor->subscriptions[i];
+		tsub = monitor->subscriptions[i];
 		if (tsub->subid == subid) {
 			sub = tsub;
 			if (index)
@@ -11378,27 +15333,365 @@ ndb_monitor_find_subscription(struct ndb_monitor *monitor, uint64_t subid, int *
 	return sub;
 }
 
-int ndb_poll_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_ids,
-		       int note_id_capacity)
+int ndb_poll_for_notes_status(struct ndb *ndb, uint64_t subid,
+			      uint64_t *note_ids, int note_id_capacity,
+			      struct ndb_subscription_status *status)
 {
 	struct ndb_subscription *sub;
 	int res;
 
+	if (status)
+		memset(status, 0, sizeof(*status));
+
 	if (subid == 0)
 		return 0;
 
 	ndb_monitor_lock(&ndb->monitor);
 
-	if (!(sub = ndb_monitor_find_subscription(&ndb->monitor, subid, NULL)))
+	if (!(sub = ndb_monitor_find_subscription(&ndb->monitor, subid, NULL))) {
 		res = 0;
-	else
+	} else {
 		res = prot_queue_try_pop_all(&sub->inbox, note_ids, note_id_capacity);
+		ndb_subscription_unsignal(sub);
+		if (status) {
+			status->dropped = sub->dropped;
+			status->resync_from = sub->resync_from;
+		}
+	}
 
 	ndb_monitor_unlock(&ndb->monitor);
 
 	return res;
 }
 
+int ndb_poll_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_ids,
+		       int note_id_capacity)
+{
+	return ndb_poll_for_notes_status(ndb, subid, note_ids,
+					 note_id_capacity, NULL);
+}
+
+int ndb_subscription_fd(struct ndb *ndb, uint64_t subid)
+{
+	struct ndb_subscription *sub;
+	int fd = -1;
+#if !defined(_WIN32) && !defined(__linux__)
+	int fds[2];
+#endif
+
+	ndb_monitor_lock(&ndb->monitor);
+
+	if (!(sub = ndb_monitor_find_subscription(&ndb->monitor, subid, NULL)))
+		goto done;
+
+	if (sub->fd_read != -1) {
+		fd = sub->fd_read;
+		goto done;
+	}
+
+#if defined(__linux__)
+	if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		goto done;
+	sub->fd_read = sub->fd_write = fd;
+#elif !defined(_WIN32)
+	if (pipe(fds) == -1)
+		goto done;
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	sub->fd_read = fd = fds[0];
+	sub->fd_write = fds[1];
+#else
+	// windows has no pipes, so the fd stays -1
+	goto done;
+#endif
+
+	// notes may already be waiting
+	if (prot_queue_count(&sub->inbox) > 0)
+		ndb_subscription_signal(sub);
+
+done:
+	ndb_monitor_unlock(&ndb->monitor);
+	return fd;
+}
+
+// drop queued notes the resync query is about to return
+static int ndb_subscription_trim_inbox(struct ndb_subscription *sub,
+				       uint64_t from)
+{
+	uint64_t *keys;
+	int i, n, kept, cap;
+
+	cap = prot_queue_capacity(&sub->inbox);
+	if (!(keys = malloc(cap * sizeof(*keys))))
+		return 0;
+
+	// pops stop at the end of the ring buffer, so keep going
+	for (n = 0; n < cap; ) {
+		i = prot_queue_try_pop_all(&sub->inbox, keys + n, cap - n);
+		if (i == 0)
+			break;
+		n += i;
+	}
+
+	for (i = 0, kept = 0; i < n; i++) {
+		if (keys[i] < from)
+			keys[kept++] = keys[i];
+	}
+
+	if (kept > 0)
+		prot_queue_push_all(&sub->inbox, keys, kept);
+	else
+		ndb_subscription_unsignal(sub);
+
+	free(keys);
+	return 1;
+}
+
+// the most notes, matching or not, a resync looks through in one call
+#define NDB_RESYNC_MAX_ROWS 16384
+
+// Collect the note keys in [from, last] that the group's index scans turn up,
+// sorted newest first with duplicates left in. Fails if a filter has no index
+// scan, or the scans would read more than `budget` entries, in which case
+// walking the notes themselves is no worse.
+static int ndb_subscription_index_keys(struct ndb_txn *txn,
+				       struct ndb_filter_group *group,
+				       uint64_t from, uint64_t last,
+				       uint64_t budget,
+				       uint64_t **keys, int *len)
+{
+	struct ndb_plan_scan scan;
+	struct ndb_filter *filter;
+	enum ndb_query_plan plan;
+	uint64_t probed, note_key, *grown;
+	int i, cap, already_matched, ok;
+
+	*keys = NULL;
+	*len = cap = 0;
+
+	// an empty group matches every note
+	ok = group->num_filters > 0;
+
+	for (i = 0; ok && i < group->num_filters; i++) {
+		filter = &group->filters[i];
+
+		plan = ndb_filter_plan(txn, filter, 0, &probed, &scan,
+				       &already_matched);
+		if (probed >= budget || !ndb_query_plan_is_scan(plan)) {
+			ndb_plan_scan_destroy(&scan);
+			ok = 0;
+			break;
+		}
+		budget -= probed;
+
+		if (!scan.num_streams &&
+		    !ndb_plan_scan_open(txn, filter, plan, &scan,
+					&already_matched)) {
+			ok = 0;
+			break;
+		}
+
+		while (ok && ndb_plan_scan_next(&scan, &note_key)) {
+			if (ndb_plan_scan_entries(&scan) > budget) {
+				ok = 0;
+				break;
+			}
+
+			if (note_key < from || note_key > last)
+				continue;
+
+			if (*len == cap) {
+				cap = cap * 2 + 64;
+				if (!(grown = realloc(*keys, cap * sizeof(*grown)))) {
+					ok = 0;
+					break;
+				}
+				*keys = grown;
+			}
+
+			(*keys)[(*len)++] = note_key;
+		}
+
+		budget -= min(budget, ndb_plan_scan_entries(&scan));
+		ndb_plan_scan_destroy(&scan);
+	}
+
+	if (!ok) {
+		free(*keys);
+		*keys = NULL;
+		return 0;
+	}
+
+	qsort(*keys, *len, sizeof(**keys), ndb_note_key_cmp_desc);
+	return 1;
+}
+
+// Find the notes written in [from, last] that the group wants, in key order.
+// That's a walk over the note db, unless the group's index scans are
+// cheaper. Either way no more than NDB_RESYNC_MAX_ROWS notes are looked at.
+// If there's more to go, or the matches don't all fit, *next is the key to
+// carry on from, 0 otherwise.
+static int ndb_subscription_scan(struct ndb_txn *txn,
+				 struct ndb_filter_group *group,
+				 uint64_t from, uint64_t last,
+				 struct ndb_query_result *results,
+				 int result_capacity, int *count,
+				 uint64_t *next)
+{
+	MDB_cursor *cur;
+	MDB_val k, v;
+	struct ndb_note *note;
+	uint64_t note_key, rows, *keys;
+	size_t note_size;
+	int i, len, rc;
+
+	*next = 0;
+
+	if (last < from)
+		return 1;
+
+	rows = min(last - from + 1, NDB_RESYNC_MAX_ROWS);
+	if (ndb_subscription_index_keys(txn, group, from, last, rows,
+					&keys, &len)) {
+		for (i = len - 1; i >= 0; i--) {
+			if (i < len - 1 && keys[i] == keys[i + 1])
+				continue;
+
+			if (!(note = ndb_get_note_by_key(txn, keys[i], &note_size)) ||
+			    !ndb_filter_group_matches(group, note))
+				continue;
+
+			if (*count == result_capacity) {
+				*next = keys[i];
+				break;
+			}
+
+			ndb_query_result_init(&results[*count], note,
+					      note_size, keys[i]);
+			(*count)++;
+		}
+
+		free(keys);
+		return 1;
+	}
+
+	if ((rc = mdb_cursor_open(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE],
+				  &cur))) {
+		ndb_debug("ndb_subscription_scan: cursor open failed: %s\n",
+			  mdb_strerror(rc));
+		return 0;
+	}
+
+	note_key = from;
+	k.mv_data = &note_key;
+	k.mv_size = sizeof(note_key);
+
+	rows = 0;
+	for (rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE);
+	     rc == 0;
+	     rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT)) {
+		note_key = *(uint64_t *)k.mv_data;
+		if (note_key > last)
+			break;
+
+		if (rows++ == NDB_RESYNC_MAX_ROWS) {
+			*next = note_key;
+			break;
+		}
+
+		if (!ndb_filter_group_matches(group, v.mv_data))
+			continue;
+
+		if (*count == result_capacity) {
+			*next = note_key;
+			break;
+		}
+
+		results[*count].note = v.mv_data;
+		results[*count].note_size = v.mv_size;
+		results[*count].note_id = note_key;
+		(*count)++;
+	}
+
+	mdb_cursor_close(cur);
+	return 1;
+}
+
+int ndb_subscription_resync(struct ndb *ndb, struct ndb_txn *txn,
+			    uint64_t subid, struct ndb_query_result *results,
+			    int result_capacity, int *count)
+{
+	struct ndb_subscription *sub;
+	struct ndb_filter_group group;
+	uint64_t from, last, next;
+	int i, ok;
+
+	*count = 0;
+	ndb_filter_group_init(&group);
+
+	ndb_monitor_lock(&ndb->monitor);
+
+	if (!(sub = ndb_monitor_find_subscription(&ndb->monitor, subid, NULL)) ||
+	    !ndb_begin_query(ndb, txn)) {
+		ndb_monitor_unlock(&ndb->monitor);
+		return 0;
+	}
+
+	// nothing to catch up on
+	if ((from = sub->resync_from) == 0) {
+		ndb_monitor_unlock(&ndb->monitor);
+		return 1;
+	}
+
+	// like ndb_subscribe_with_backfill, everything up to the snapshot
+	// comes from the scan and everything after from the inbox. The scan
+	// runs on a copy of the filters with the lock released, so it doesn't
+	// hold up the notifier, or the writer behind it. Anything dropped in
+	// the meantime starts a new resync_from.
+	last = ndb_get_last_key(txn->mdb_txn, txn->lmdb->dbs[NDB_DB_NOTE]);
+	ok = ndb_subscription_trim_inbox(sub, from);
+	for (i = 0; ok && i < sub->group.num_filters; i++)
+		ok = ndb_filter_group_add(&group, &sub->group.filters[i]);
+
+	if (ok) {
+		sub->watermark = last;
+		sub->resync_from = 0;
+	}
+
+	ndb_monitor_unlock(&ndb->monitor);
+
+	ok = ok && ndb_subscription_scan(txn, &group, from, last, results,
+					 result_capacity, count, &next);
+	ndb_filter_group_destroy(&group);
+
+	// a failed scan has to be picked up again from the start
+	if (!ok)
+		next = from;
+
+	ndb_monitor_lock(&ndb->monitor);
+
+	if (next &&
+	    (sub = ndb_monitor_find_subscription(&ndb->monitor, subid, NULL))) {
+		// not caught up yet. the inbox stays quiet so nothing is
+		// delivered twice, the next resync picks up from here
+		ndb_subscription_trim_inbox(sub, next);
+		sub->resync_from = next;
+		sub->watermark = UINT64_MAX;
+	}
+
+	ndb_monitor_unlock(&ndb->monitor);
+
+	if (!ok) {
+		*count = 0;
+		ndb_end_query(txn);
+		return 0;
+	}
+
+	return 1;
+}
+
 int ndb_wait_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_ids,
                        int note_id_capacity)
 {
@@ -11421,6 +15714,7 @@ int ndb_wait_for_notes(struct ndb *ndb, uint64_t subid, uint64_t *note_ids,
 
 		res = prot_queue_try_pop_all(&sub->inbox, note_ids,
 					     note_id_capacity);
+		ndb_subscription_unsignal(sub);
 		if (res > 0)
 			break;
 
@@ -11437,6 +15731,7 @@ int ndb_unsubscribe(struct ndb *ndb, uint64_t subid)
 {
 	struct ndb_subscription *sub;
 	int index, res, elems_to_move;
+	struct ndb_monitor *monitor = &ndb->monitor;
 
 	ndb_monitor_lock(&ndb->monitor);
 
@@ -11447,12 +15742,13 @@ int ndb_unsubscribe(struct ndb *ndb, uint64_t subid)
 
 	ndb_subscription_destroy(sub);
 
-	elems_to_move = (--ndb->monitor.num_subscriptions) - index;
+	elems_to_move = (--monitor->num_subscriptions) - index;
 
-	memmove(&ndb->monitor.subscriptions[index],
-		&ndb->monitor.subscriptions[index+1],
-		elems_to_move * sizeof(*sub));
+	memmove(&monitor->subscriptions[index],
+		&monitor->subscriptions[index+1],
+		elems_to_move * sizeof(*monitor->subscriptions));
 
+	ndb->monitor.index.dirty = 1;
 	res = 1;
 
 done:
@@ -11466,45 +15762,142 @@ int ndb_num_subscriptions(struct ndb *ndb)
 	return ndb->monitor.num_subscriptions;
 }
 
-uint64_t ndb_subscribe(struct ndb *ndb, struct ndb_filter *filters, int num_filters)
+static struct ndb_subscription *
+ndb_subscription_new(struct ndb_filter *filters, int num_filters, int queue_size)
 {
-	static uint64_t subids = 0;
 	struct ndb_subscription *sub;
 	size_t buflen;
-	uint64_t subid;
 	char *buf;
 
-	ndb_monitor_lock(&ndb->monitor);
+	if (queue_size <= 0)
+		queue_size = DEFAULT_QUEUE_SIZE;
 
-	if (ndb->monitor.num_subscriptions + 1 >= MAX_SUBSCRIPTIONS) {
-		fprintf(stderr, "too many subscriptions\n");
-		subid = 0;
-		goto done;
-	}
+	if (!(sub = calloc(1, sizeof(*sub))))
+		return NULL;
 
-	sub = &ndb->monitor.subscriptions[ndb->monitor.num_subscriptions];
-	subid = ++subids;
-	sub->subid = subid;
+	sub->fd_read = -1;
+	sub->fd_write = -1;
 
 	ndb_filter_group_init(&sub->group);
 	if (!ndb_filter_group_add_filters(&sub->group, filters, num_filters)) {
-		subid = 0;
-		goto done;
+		ndb_filter_group_destroy(&sub->group);
+		free(sub);
+		return NULL;
 	}
 
-	// 500k ought to be enough for anyone
-	buflen = sizeof(uint64_t) * DEFAULT_QUEUE_SIZE;
-	buf = malloc(buflen);
+	buflen = sizeof(uint64_t) * queue_size;
+	if (!(buf = malloc(buflen))) {
+		ndb_filter_group_destroy(&sub->group);
+		free(sub);
+		return NULL;
+	}
 
 	if (!prot_queue_init(&sub->inbox, buf, buflen, sizeof(uint64_t))) {
 		fprintf(stderr, "failed to push prot queue\n");
-		subid = 0;
-		goto done;
+		ndb_filter_group_destroy(&sub->group);
+		free(buf);
+		free(sub);
+		return NULL;
+	}
+
+	return sub;
+}
+
+// give the subscription an id and start matching notes against it. The
+// monitor must be locked.
+static uint64_t ndb_monitor_add_subscription(struct ndb_monitor *monitor,
+					     struct ndb_subscription *sub)
+{
+	static uint64_t subids = 0;
+	struct ndb_subscription **subs;
+	int cap;
+
+	if (monitor->num_subscriptions == monitor->subscriptions_cap) {
+		cap = monitor->subscriptions_cap ? monitor->subscriptions_cap * 2 : 16;
+		subs = realloc(monitor->subscriptions, cap * sizeof(*subs));
+		if (subs == NULL)
+			return 0;
+		monitor->subscriptions = subs;
+		monitor->subscriptions_cap = cap;
+	}
+
+	sub->subid = ++subids;
+
+	monitor->subscriptions[monitor->num_subscriptions++] = sub;
+	monitor->index.dirty = 1;
+
+	return sub->subid;
+}
+
+uint64_t ndb_subscribe_with(struct ndb *ndb, struct ndb_filter *filters,
+			    int num_filters, int queue_size)
+{
+	struct ndb_subscription *sub;
+	uint64_t subid;
+
+	if (!(sub = ndb_subscription_new(filters, num_filters, queue_size)))
+		return 0;
+
+	ndb_monitor_lock(&ndb->monitor);
+	subid = ndb_monitor_add_subscription(&ndb->monitor, sub);
+	ndb_monitor_unlock(&ndb->monitor);
+
+	if (subid == 0)
+		ndb_subscription_destroy(sub);
+
+	return subid;
+}
+
+uint64_t ndb_subscribe_with_backfill(struct ndb *ndb, struct ndb_txn *txn,
+				     struct ndb_filter *filters,
+				     int num_filters,
+				     struct ndb_query_result *results,
+				     int result_capacity, int *count)
+{
+	struct ndb_subscription *sub;
+	uint64_t subid;
+
+	*count = 0;
+
+	if (!(sub = ndb_subscription_new(filters, num_filters,
+					 DEFAULT_QUEUE_SIZE)))
+		return 0;
+
+	// The notifier holds the monitor lock while it delivers notes, so
+	// anything committed after our snapshot can't be delivered until
+	// we're subscribed. Anything that made it into the snapshot has a
+	// key at or below the watermark, and is left to the backfill.
+	ndb_monitor_lock(&ndb->monitor);
+
+	if (!ndb_begin_query(ndb, txn)) {
+		ndb_monitor_unlock(&ndb->monitor);
+		ndb_subscription_destroy(sub);
+		return 0;
+	}
+
+	sub->watermark = ndb_get_last_key(txn->mdb_txn,
+					  txn->lmdb->dbs[NDB_DB_NOTE]);
+
+	if (!(subid = ndb_monitor_add_subscription(&ndb->monitor, sub))) {
+		ndb_monitor_unlock(&ndb->monitor);
+		ndb_end_query(txn);
+		ndb_subscription_destroy(sub);
+		return 0;
 	}
 
-	ndb->monitor.num_subscriptions++;
-done:
 	ndb_monitor_unlock(&ndb->monitor);
 
+	if (!ndb_query(txn, filters, num_filters, results, result_capacity,
+		       count)) {
+		ndb_unsubscribe(ndb, subid);
+		ndb_end_query(txn);
+		return 0;
+	}
+
 	return subid;
 }
+
+uint64_t ndb_subscribe(struct ndb *ndb, struct ndb_filter *filters, int num_filters)
+{
+	return ndb_subscribe_with(ndb, filters, num_filters, DEFAULT_QUEUE_SIZE);
+}
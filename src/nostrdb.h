@@ -23,6 +23,10 @@
 #define NDB_FLAG_NO_FULLTEXT      (1 << 2)
 #define NDB_FLAG_NO_NOTE_BLOCKS   (1 << 3)
 #define NDB_FLAG_NO_STATS         (1 << 4)
+// bulk loads: only write notes and their id index, the other note indices
+// are built in one sorted pass when the db is closed (or next opened
+// without this flag). Queries won't see new notes until then.
+#define NDB_FLAG_DEFER_INDICES    (1 << 5)
 
 //#define DEBUG 1
 
@@ -113,6 +117,19 @@ struct ndb_ingest_meta {
 	const char *relay;
 };
 
+// what happened to the lines of a bulk import
+struct ndb_import_stats {
+	uint64_t lines;      // non-empty lines
+	uint64_t queued;     // new notes sent to the writer
+	uint64_t duplicates; // notes we already had
+	uint64_t ignored;    // lines that weren't notes, like EOSE
+	uint64_t invalid;    // lines that didn't parse
+	uint64_t rejected;   // failed verification or the ingest filter
+	uint64_t dropped;    // notes the writer couldn't take
+	double seconds;
+	double events_per_sec; // lines per second
+};
+
 struct ndb_keypair {
 	unsigned char pubkey[32];
 	unsigned char secret[32];
@@ -128,6 +145,8 @@ typedef enum ndb_idres (*ndb_id_fn)(void *, const char *);
 
 // callback function for when we receive new subscription results
 typedef void (*ndb_sub_fn)(void *, uint64_t subid);
+// called from an ingester thread once it's done with a caller-owned buffer
+typedef void (*ndb_release_fn)(void *ctx, const char *json, int len);
 
 struct ndb_query_result {
 	struct ndb_note *note;
@@ -135,6 +154,34 @@ struct ndb_query_result {
 	uint64_t note_id;
 };
 
+// How a subscription's inbox is keeping up. When a subscriber falls so far
+// behind that its inbox fills up, new matches are dropped and resync_from
+// is set to the note key of the first of them. Drops after that are only
+// counted, until ndb_subscription_resync picks up from there.
+struct ndb_subscription_status {
+	uint64_t dropped;     // over the life of the subscription
+	uint64_t resync_from; // 0 when nothing was missed
+};
+
+// a query result without the note, see ndb_query_keys
+struct ndb_query_key {
+	uint64_t note_key;
+	uint64_t created_at;
+};
+
+// what a query did for one of its filters, see ndb_query_explain
+struct ndb_query_explain {
+	const char *plan;              // the plan ndb_filter_plan picked
+	uint64_t planner_entries;      // index entries the planner's probes read
+	uint64_t seeks;                // index cursors positioned
+	uint64_t index_entries;        // index entries read by the plan, including its probe's
+	uint64_t max_scanner_entries;  // most entries read by any one merged scanner
+	uint64_t notes_loaded;         // notes fetched to match against the filter
+	uint64_t mismatches;           // loaded notes that didn't match the filter
+	uint64_t results;              // results this filter contributed
+	uint64_t elapsed_ns;           // wall time spent on this filter
+};
+
 // callback function for when we visit a note during a query (used in ndb_query_visit)
 typedef enum ndb_visitor_action (*ndb_visitor_fn)(void *ctx, struct ndb_query_result *res);
 
@@ -261,6 +308,7 @@ enum ndb_dbs {
 	NDB_DB_NOTE_PUBKEY_KIND, // note pubkey kind index
 	NDB_DB_NOTE_RELAY_KIND, // relay+kind+created -> note_id
 	NDB_DB_NOTE_RELAYS, // note_id -> relays
+	NDB_DB_NOTE_CREATED, // created_at -> note_id, for newest-first scans
 	NDB_DBS,
 };
 
@@ -351,6 +399,8 @@ struct ndb_filter_elements {
 	uint64_t elements[0];
 };
 
+struct ndb_filter_matcher;
+
 struct ndb_filter {
 	struct cursor elem_buf;
 	struct cursor data_buf;
@@ -358,6 +408,9 @@ struct ndb_filter {
 	int finalized;
 	int current;
 
+	// built by ndb_filter_end, NULL until then
+	struct ndb_filter_matcher *matcher;
+
 	// struct ndb_filter_elements offsets into elem_buf
 	//
 	// TODO(jb55): this should probably be called fields. elements are
@@ -554,6 +607,9 @@ struct ndb_query_state {
 	enum ndb_query_type type;
 	uint64_t limit;
 
+	/* filled in when profiling, NULL otherwise */
+	struct ndb_query_explain *explain;
+
 	union {
 		struct {
 			int capacity;
@@ -575,6 +631,8 @@ void ndb_config_set_ingest_threads(struct ndb_config *config, int threads);
 void ndb_config_set_flags(struct ndb_config *config, int flags);
 void ndb_config_set_mapsize(struct ndb_config *config, size_t mapsize);
 void ndb_config_set_ingest_filter(struct ndb_config *config, ndb_ingest_filter_fn fn, void *);
+/// The subscription callback runs on ndb's notifier thread after the notes
+/// are committed. The writer doesn't wait for it, but later notes do.
 void ndb_config_set_subscription_callback(struct ndb_config *config, ndb_sub_fn fn, void *ctx);
 
 /// Configurable scratch buffer size for the writer thread. Default is 2MB. If you have smaller notes
@@ -615,6 +673,11 @@ int ndb_process_event(struct ndb *, const char *json, int len);
 void ndb_ingest_meta_init(struct ndb_ingest_meta *meta, unsigned client, const char *relay);
 // Process an event, recording the relay where it came from.
 int ndb_process_event_with(struct ndb *, const char *json, int len, struct ndb_ingest_meta *meta);
+// Process an event without copying it. On success the buffer belongs to
+// nostrdb until `release` is called on an ingester thread. On failure the
+// caller keeps it and `release` is never called. `release` must not be NULL,
+// this fails without taking the buffer if it is.
+int ndb_process_event_owned(struct ndb *, const char *json, int len, struct ndb_ingest_meta *meta, ndb_release_fn release, void *release_ctx);
 int ndb_process_events(struct ndb *, const char *ldjson, size_t len);
 /* reprocess unwrapped giftwraps */
 int ndb_process_giftwraps(struct ndb *, struct ndb_txn *);
@@ -627,6 +690,12 @@ int ndb_process_events_with(struct ndb *ndb, const char *ldjson, size_t json_len
 #ifndef _WIN32
 // TODO: fix on windows
 int ndb_process_events_stream(struct ndb *, FILE* fp);
+// Import a file of line-delimited events. The file is mapped and split into
+// ranges that the ingester threads parse in place, without copying lines.
+// Returns once every line has been through an ingester, the writer may still
+// be committing the last of them. Returns 0 if any line couldn't be checked
+// against the db or handed to the writer. stats can be NULL.
+int ndb_import_file(struct ndb *, const char *path, struct ndb_ingest_meta *meta, struct ndb_import_stats *stats);
 #endif
 // deprecated: use ndb_ingest_event_with
 int ndb_process_client_event(struct ndb *, const char *json, int len);
@@ -691,6 +760,8 @@ int ndb_filter_from_json(const char *, int len, struct ndb_filter *filter, unsig
 unsigned char *ndb_filter_get_id_element(const struct ndb_filter *, const struct ndb_filter_elements *, int index);
 const char *ndb_filter_get_string_element(const struct ndb_filter *, const struct ndb_filter_elements *, int index);
 uint64_t ndb_filter_get_int_element(const struct ndb_filter_elements *, int index);
+// only since, until and limit can be updated in place once a filter is
+// finalized, the rest are compiled into its matcher by ndb_filter_end
 uint64_t *ndb_filter_get_int_element_ptr(struct ndb_filter_elements *, int index);
 
 struct ndb_filter_elements *ndb_filter_current_element(const struct ndb_filter *);
@@ -707,8 +778,34 @@ int ndb_filter_json(const struct ndb_filter *, char *buf, int buflen);
 
 // SUBSCRIPTIONS
 uint64_t ndb_subscribe(struct ndb *, struct ndb_filter *, int num_filters);
+/// Like ndb_subscribe, with room for queue_size unpolled notes in the
+/// subscription's inbox. Notes that don't fit are dropped. 0 means the
+/// default, which is 32768.
+uint64_t ndb_subscribe_with(struct ndb *, struct ndb_filter *, int num_filters, int queue_size);
+/// Subscribe and query in one step, with no gap or overlap between the two. The
+/// filters are queried against a snapshot taken as the subscription starts, and
+/// only notes written after that snapshot are delivered to the subscription.
+/// `txn` is begun for you, end it with ndb_end_query when you're done with the
+/// results. Returns 0 on failure, in which case there's no txn to end.
+uint64_t ndb_subscribe_with_backfill(struct ndb *, struct ndb_txn *txn, struct ndb_filter *, int num_filters, struct ndb_query_result *results, int result_capacity, int *count);
 int ndb_wait_for_notes(struct ndb *, uint64_t subid, uint64_t *note_ids, int note_id_capacity);
 int ndb_poll_for_notes(struct ndb *, uint64_t subid, uint64_t *note_ids, int note_id_capacity);
+/// ndb_poll_for_notes, also reporting whether the subscription's inbox has
+/// overflowed, see struct ndb_subscription_status
+int ndb_poll_for_notes_status(struct ndb *, uint64_t subid, uint64_t *note_ids, int note_id_capacity, struct ndb_subscription_status *status);
+/// Catch an overflowed subscription up: match its filters against the notes
+/// written from `resync_from` up to a snapshot, in the order they were
+/// written, and deliver everything after that snapshot through the inbox as
+/// usual. If the notes don't all fit in `results`, or there are more written
+/// than one call looks through, `resync_from` moves up to the first one it
+/// didn't get to and the inbox stays quiet until another resync catches up. `txn` is begun for you unless this returns 0. `count` is 0 if
+/// there was nothing to catch up on.
+int ndb_subscription_resync(struct ndb *, struct ndb_txn *txn, uint64_t subid, struct ndb_query_result *results, int result_capacity, int *count);
+/// A file descriptor that's readable while the subscription has notes waiting
+/// to be polled, for poll/epoll/kqueue loops. It goes quiet again once polling
+/// has emptied the inbox. The fd belongs to the subscription and is closed by
+/// ndb_unsubscribe. Returns -1 on failure, and on windows.
+int ndb_subscription_fd(struct ndb *, uint64_t subid);
 int ndb_unsubscribe(struct ndb *, uint64_t subid);
 int ndb_num_subscriptions(struct ndb *);
 
@@ -723,6 +820,26 @@ void ndb_text_search_config_set_limit(struct ndb_text_search_config *, int limit
 int ndb_query(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, struct ndb_query_result *results, int result_capacity, int *count);
 int ndb_query_visit(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, ndb_visitor_fn visitor, void *ctx);
 
+/// ndb_query, also filling in one `explain` per filter with the plan it ran and the work it took
+int ndb_query_explain(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, struct ndb_query_result *results, int result_capacity, int *count, struct ndb_query_explain *explain);
+
+/// Page through a filter's results without re-seeking or losing notes that share a created_at across a page boundary.
+/// Pass a NULL token for the first page, then the `next` token each page hands back to get the one after it.
+/// `*next_len` is 0 once there's nothing left. Only filters that run on an index scan can be paged, and
+/// `next` needs room for up to 21 bytes per scanner (one per author, kind, tag value, etc) the scan uses.
+int ndb_query_page(struct ndb_txn *txn, struct ndb_filter *filter, const unsigned char *token, int token_len, struct ndb_query_result *results, int result_capacity, int *count, unsigned char *next, int next_size, int *next_len);
+
+/// Count the notes matching any of the filters, as in a NIP-45 COUNT. Limits are ignored. Filters whose index covers
+/// every field (kinds, author+kind, a single tag field, each with since/until) are counted without loading any notes.
+int ndb_count(struct ndb_txn *txn, struct ndb_filter *filters, int num_filters, uint64_t *count);
+
+/// Like ndb_query for a single filter, but only hands back the note keys and created_at of the results, newest first.
+/// Filters the index covers (see ndb_count) are answered without reading a single note, planning included.
+int ndb_query_keys(struct ndb_txn *txn, struct ndb_filter *filter, struct ndb_query_key *keys, int capacity, int *count);
+
+/// ndb_query_keys, also filling in `explain` with the plan it ran and the work it took
+int ndb_query_keys_explain(struct ndb_txn *txn, struct ndb_filter *filter, struct ndb_query_key *keys, int capacity, int *count, struct ndb_query_explain *explain);
+
 // NOTE METADATA
 int ndb_note_meta_builder_init(struct ndb_note_meta_builder *builder, unsigned char *, size_t);
 int ndb_set_note_meta(struct ndb *ndb, const unsigned char *id, struct ndb_note_meta *meta);
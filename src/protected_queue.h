@@ -1,12 +1,22 @@
 /*
  *    This header file provides a thread-safe queue implementation for generic
- *    data elements. It uses POSIX threads (pthreads) to ensure thread safety.
- *    The queue allows for pushing and popping elements, with the ability to
- *    block or non-block on pop operations. Users are responsible for providing
- *    memory for the queue buffer and ensuring its correct lifespan.
+ *    data elements. The queue allows for pushing and popping elements, with
+ *    the ability to block or non-block on pop operations. Users are
+ *    responsible for providing memory for the queue buffer and ensuring its
+ *    correct lifespan.
+ *
+ *    The queue is a bounded lock-free ring. Every slot carries a sequence
+ *    number that says whether it is free or filled for the current lap, so
+ *    producers and consumers only contend on a compare-and-swap of the tail
+ *    or head, and never on a lock. Any number of threads can push and pop,
+ *    which covers our single consumer inboxes as well as the ingester
+ *    inboxes fed by a single caller. Threads only sleep when the queue is
+ *    empty (or full, for prot_queue_push_all_wait), on a futex on linux and
+ *    a condition variable elsewhere.
  *
  *         Author:  William Casarin
  *         Inspired-by: https://github.com/hoytech/hoytech-cpp/blob/master/hoytech/protected_queue.h
+ *         Ring: Dmitry Vyukov's bounded MPMC queue
  */
 
 #ifndef PROT_QUEUE_H
@@ -14,34 +24,139 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "cursor.h"
 #include "util.h"
 #include "thread.h"
 
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
 #define max(a,b) ((a) > (b) ? (a) : (b))
 #define min(a,b) ((a) < (b) ? (a) : (b))
 
-/* 
+#define PROT_QUEUE_CACHELINE 64
+
+/*
+ * Something threads can sleep on until another thread bumps it. Wakers only
+ * make a syscall when someone is actually waiting.
+ */
+struct prot_event {
+	uint32_t word;
+	int waiters;
+
+#ifndef __linux__
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+/*
  * The prot_queue structure represents a thread-safe queue that can hold
  * generic data elements.
  */
 struct prot_queue {
 	unsigned char *buf;
 	size_t buflen;
-
-	int head;
-	int tail;
-	int count;
 	int elem_size;
+	uint64_t *seqs; // per slot, == pos when free, pos + 1 when filled
 
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+	// producers and consumers each get their own cache line
+	char pad0[PROT_QUEUE_CACHELINE];
+	uint64_t tail;
+	char pad1[PROT_QUEUE_CACHELINE - sizeof(uint64_t)];
+	uint64_t head;
+	char pad2[PROT_QUEUE_CACHELINE - sizeof(uint64_t)];
+
+	struct prot_event items; // for threads waiting on an empty queue
+	struct prot_event space; // for threads waiting on a full queue
 };
 
+static inline void prot_event_init(struct prot_event *ev)
+{
+	ev->word = 0;
+	ev->waiters = 0;
+#ifndef __linux__
+	pthread_mutex_init(&ev->mutex, NULL);
+	pthread_cond_init(&ev->cond, NULL);
+#endif
+}
+
+static inline void prot_event_destroy(struct prot_event *ev)
+{
+#ifndef __linux__
+	pthread_mutex_destroy(&ev->mutex);
+	pthread_cond_destroy(&ev->cond);
+#else
+	(void)ev;
+#endif
+}
+
+/*
+ * Wake one or all of the threads sleeping on the event. The fence pairs with
+ * the one in prot_event_wait_begin: either we see the waiter, or the
+ * waiter's retry sees whatever we did before calling this.
+ */
+static inline void prot_event_wake(struct prot_event *ev, int all)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ev->waiters, __ATOMIC_RELAXED) == 0)
+		return;
+
+	__atomic_add_fetch(&ev->word, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+	syscall(SYS_futex, &ev->word, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1,
+		NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&ev->mutex);
+	if (all)
+		pthread_cond_broadcast(&ev->cond);
+	else
+		pthread_cond_signal(&ev->cond);
+	pthread_mutex_unlock(&ev->mutex);
+#endif
+}
+
+/*
+ * Register as a waiter. The caller retries whatever it was waiting for, and
+ * if that still fails, sleeps with the returned value.
+ */
+static inline uint32_t prot_event_wait_begin(struct prot_event *ev)
+{
+	__atomic_add_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ev->word, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Sleep until the event is bumped past `seen`. Spurious wakeups happen.
+ */
+static inline void prot_event_sleep(struct prot_event *ev, uint32_t seen)
+{
+#ifdef __linux__
+	syscall(SYS_futex, &ev->word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&ev->mutex);
+	while (__atomic_load_n(&ev->word, __ATOMIC_SEQ_CST) == seen)
+		pthread_cond_wait(&ev->cond, &ev->mutex);
+	pthread_mutex_unlock(&ev->mutex);
+#endif
+}
+
+static inline void prot_event_wait_end(struct prot_event *ev)
+{
+	__atomic_sub_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+}
 
-/* 
- * Initialize the queue. 
+
+/*
+ * Initialize the queue.
  * Params:
  * q         - Pointer to the queue.
  * buf       - Buffer for holding data elements.
@@ -52,24 +167,31 @@ struct prot_queue {
 static inline int prot_queue_init(struct prot_queue* q, void* buf,
 				  size_t buflen, int elem_size)
 {
+	size_t i, cap;
+
 	// buffer elements must fit nicely in the buffer
 	if (buflen == 0 || buflen % elem_size != 0)
 		assert(!"queue elements don't fit nicely");
 
-	q->head = 0;
-	q->tail = 0;
-	q->count = 0;
+	memset(q, 0, sizeof(*q));
 	q->buf = buf;
 	q->buflen = buflen;
 	q->elem_size = elem_size;
 
-	pthread_mutex_init(&q->mutex, NULL);
-	pthread_cond_init(&q->cond, NULL);
+	cap = buflen / elem_size;
+	if (!(q->seqs = malloc(cap * sizeof(*q->seqs))))
+		return 0;
+
+	for (i = 0; i < cap; i++)
+		q->seqs[i] = i;
+
+	prot_event_init(&q->items);
+	prot_event_init(&q->space);
 
 	return 1;
 }
 
-/* 
+/*
  * Return the capacity of the queue.
  * q    - Pointer to the queue.
  */
@@ -77,7 +199,140 @@ static inline size_t prot_queue_capacity(struct prot_queue *q) {
 	return q->buflen / q->elem_size;
 }
 
-/* 
+/*
+ * Return the number of elements in the queue. Elements that are still being
+ * pushed or popped are counted, so this is only exact when nothing else is
+ * touching the queue.
+ */
+static inline int prot_queue_count(struct prot_queue *q)
+{
+	uint64_t head, tail;
+
+	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+
+	return tail > head ? (int)(tail - head) : 0;
+}
+
+/*
+ * Claim `count` free slots at the tail. Returns 0 if they aren't all free.
+ */
+static inline int prot_queue_reserve(struct prot_queue *q, int count,
+				     uint64_t *pos_out)
+{
+	uint64_t pos, seq, cap;
+	int i;
+
+	if (count <= 0)
+		return 0;
+
+	cap = prot_queue_capacity(q);
+	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		seq = pos;
+		for (i = 0; i < count; i++) {
+			seq = __atomic_load_n(&q->seqs[(pos + i) % cap],
+					      __ATOMIC_ACQUIRE);
+			if (seq != pos + i)
+				break;
+		}
+
+		if (i == count) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos,
+							pos + count, 0,
+							__ATOMIC_ACQ_REL,
+							__ATOMIC_RELAXED)) {
+				*pos_out = pos;
+				return 1;
+			}
+			// someone else pushed, pos was reloaded
+			continue;
+		}
+
+		// the slot still holds last lap's element, we're full
+		if ((int64_t)(seq - (pos + i)) < 0)
+			return 0;
+
+		// someone else pushed
+		pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Copy elements into slots we reserved and hand them to consumers.
+ */
+static inline void prot_queue_publish(struct prot_queue *q, uint64_t pos,
+				      void *data, int count)
+{
+	uint64_t cap, slot;
+	int i;
+
+	cap = prot_queue_capacity(q);
+	for (i = 0; i < count; i++) {
+		slot = (pos + i) % cap;
+		memcpy(&q->buf[slot * q->elem_size],
+		       (char *)data + i * q->elem_size, q->elem_size);
+		__atomic_store_n(&q->seqs[slot], pos + i + 1, __ATOMIC_RELEASE);
+	}
+
+	prot_event_wake(&q->items, 1);
+}
+
+/*
+ * Pop up to max_items filled slots from the head without blocking.
+ */
+static inline int prot_queue_claim(struct prot_queue *q, void *dest,
+				   int max_items)
+{
+	uint64_t pos, seq, cap, slot;
+	int i, n;
+
+	if (max_items <= 0)
+		return 0;
+
+	cap = prot_queue_capacity(q);
+	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		seq = pos + 1;
+		for (n = 0; n < max_items; n++) {
+			seq = __atomic_load_n(&q->seqs[(pos + n) % cap],
+					      __ATOMIC_ACQUIRE);
+			if (seq != pos + n + 1)
+				break;
+		}
+
+		if (n == 0) {
+			// nothing has been published here yet
+			if ((int64_t)(seq - (pos + 1)) < 0)
+				return 0;
+
+			// someone else popped
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (__atomic_compare_exchange_n(&q->head, &pos, pos + n, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED))
+			break;
+	}
+
+	for (i = 0; i < n; i++) {
+		slot = (pos + i) % cap;
+		memcpy((char *)dest + i * q->elem_size,
+		       &q->buf[slot * q->elem_size], q->elem_size);
+		__atomic_store_n(&q->seqs[slot], pos + i + cap,
+				 __ATOMIC_RELEASE);
+	}
+
+	prot_event_wake(&q->space, 1);
+
+	return n;
+}
+
+/*
  * Push an element onto the queue.
  * Params:
  * q    - Pointer to the queue.
@@ -87,23 +342,12 @@ static inline size_t prot_queue_capacity(struct prot_queue *q) {
  */
 static int prot_queue_push(struct prot_queue* q, void *data)
 {
-	int cap;
+	uint64_t pos;
 
-	pthread_mutex_lock(&q->mutex);
-
-	cap = prot_queue_capacity(q);
-	if (q->count == cap) {
-		// only signal if the push was sucessful
-		pthread_mutex_unlock(&q->mutex);
+	if (!prot_queue_reserve(q, 1, &pos))
 		return 0;
-	}
-
-	memcpy(&q->buf[q->tail * q->elem_size], data, q->elem_size);
-	q->tail = (q->tail + 1) % cap;
-	q->count++;
 
-	pthread_cond_signal(&q->cond);
-	pthread_mutex_unlock(&q->mutex);
+	prot_queue_publish(q, pos, data, 1);
 
 	return 1;
 }
@@ -115,71 +359,68 @@ static int prot_queue_push(struct prot_queue* q, void *data)
  * data   - Pointer to the data elements to be pushed.
  * count  - Number of elements to push.
  *
- * Returns the number of elements successfully pushed, 0 if the queue is full or if there is not enough contiguous space.
+ * Returns the number of elements successfully pushed, 0 if they don't all fit.
  */
 static int prot_queue_push_all(struct prot_queue* q, void *data, int count)
 {
-	int cap;
-	int first_copy_count, second_copy_count;
-
-	pthread_mutex_lock(&q->mutex);
-
-	cap = prot_queue_capacity(q);
-	if (q->count + count > cap) {
-		pthread_mutex_unlock(&q->mutex);
-		return 0; // Return failure if the queue is full
-	}
-
-	first_copy_count = min(count, cap - q->tail); // Elements until the end of the buffer
-	second_copy_count = count - first_copy_count; // Remaining elements if wrap around
-
-	memcpy(&q->buf[q->tail * q->elem_size], data, first_copy_count * q->elem_size);
-	q->tail = (q->tail + first_copy_count) % cap;
+	uint64_t pos;
 
-	if (second_copy_count > 0) {
-		// If there is a wrap around, copy the remaining elements
-		memcpy(&q->buf[q->tail * q->elem_size], (char *)data + first_copy_count * q->elem_size, second_copy_count * q->elem_size);
-		q->tail = (q->tail + second_copy_count) % cap;
-	}
+	if (count > (int)prot_queue_capacity(q))
+		return 0;
 
-	q->count += count;
+	if (!prot_queue_reserve(q, count, &pos))
+		return 0;
 
-	pthread_cond_signal(&q->cond); // Signal a waiting thread
-	pthread_mutex_unlock(&q->mutex);
+	prot_queue_publish(q, pos, data, count);
 
 	return count;
 }
 
-/* 
- * Try to pop an element from the queue without blocking.
+/*
+ * Push multiple elements onto the queue, waiting for room if it's full.
  * Params:
- * q    - Pointer to the queue.
- * data - Pointer to where the popped data will be stored.
- * Returns 1 if successful, 0 if the queue is empty.
+ * q      - Pointer to the queue.
+ * data   - Pointer to the data elements to be pushed.
+ * count  - Number of elements to push.
+ *
+ * Returns the number of elements pushed, 0 if they could never fit.
  */
-static inline int prot_queue_try_pop_all(struct prot_queue *q, void *data, int max_items) {
-	int items_to_pop, items_until_end;
-
-	pthread_mutex_lock(&q->mutex);
+static int prot_queue_push_all_wait(struct prot_queue* q, void *data, int count)
+{
+	uint64_t pos;
+	uint32_t seen;
 
-	if (q->count == 0) {
-		pthread_mutex_unlock(&q->mutex);
+	if (count > (int)prot_queue_capacity(q))
 		return 0;
+
+	while (!prot_queue_reserve(q, count, &pos)) {
+		seen = prot_event_wait_begin(&q->space);
+		if (prot_queue_reserve(q, count, &pos)) {
+			prot_event_wait_end(&q->space);
+			break;
+		}
+		prot_event_sleep(&q->space, seen);
+		prot_event_wait_end(&q->space);
 	}
 
-	items_until_end = (q->buflen - q->head * q->elem_size) / q->elem_size;
-	items_to_pop = min(q->count, max_items);
-	items_to_pop = min(items_to_pop, items_until_end);
+	prot_queue_publish(q, pos, data, count);
 
-	memcpy(data, &q->buf[q->head * q->elem_size], items_to_pop * q->elem_size);
-	q->head = (q->head + items_to_pop) % prot_queue_capacity(q);
-	q->count -= items_to_pop;
+	return count;
+}
 
-	pthread_mutex_unlock(&q->mutex);
-	return items_to_pop;
+/*
+ * Try to pop multiple elements from the queue without blocking.
+ * Params:
+ * q         - Pointer to the queue.
+ * data      - Pointer to where the popped data will be stored.
+ * max_items - Maximum number of items to pop from the queue.
+ * Returns the number of items popped, 0 if the queue is empty.
+ */
+static inline int prot_queue_try_pop_all(struct prot_queue *q, void *data, int max_items) {
+	return prot_queue_claim(q, data, max_items);
 }
 
-/* 
+/*
  * Wait until we have elements, and then pop multiple elements from the queue
  * up to the specified maximum.
  *
@@ -190,53 +431,42 @@ static inline int prot_queue_try_pop_all(struct prot_queue *q, void *data, int m
  * Returns the actual number of items popped.
  */
 static int prot_queue_pop_all(struct prot_queue *q, void *dest, int max_items) {
-	pthread_mutex_lock(&q->mutex);
-
-	// Wait until there's at least one item to pop
-	while (q->count == 0) {
-		pthread_cond_wait(&q->cond, &q->mutex);
+	uint32_t seen;
+	int n;
+
+	while (!(n = prot_queue_claim(q, dest, max_items))) {
+		seen = prot_event_wait_begin(&q->items);
+		if ((n = prot_queue_claim(q, dest, max_items))) {
+			prot_event_wait_end(&q->items);
+			break;
+		}
+		prot_event_sleep(&q->items, seen);
+		prot_event_wait_end(&q->items);
 	}
 
-	int items_until_end = (q->buflen - q->head * q->elem_size) / q->elem_size;
-	int items_to_pop = min(q->count, max_items);
-	items_to_pop = min(items_to_pop, items_until_end);
-
-	memcpy(dest, &q->buf[q->head * q->elem_size], items_to_pop * q->elem_size);
-	q->head = (q->head + items_to_pop) % prot_queue_capacity(q);
-	q->count -= items_to_pop;
-
-	pthread_mutex_unlock(&q->mutex);
-
-	return items_to_pop;
+	return n;
 }
 
-/* 
+/*
  * Pop an element from the queue. Blocks if the queue is empty.
  * Params:
  * q    - Pointer to the queue.
  * data - Pointer to where the popped data will be stored.
  */
 static inline void prot_queue_pop(struct prot_queue *q, void *data) {
-	pthread_mutex_lock(&q->mutex);
-
-	while (q->count == 0)
-		pthread_cond_wait(&q->cond, &q->mutex);
-
-	memcpy(data, &q->buf[q->head * q->elem_size], q->elem_size);
-	q->head = (q->head + 1) % prot_queue_capacity(q);
-	q->count--;
-
-	pthread_mutex_unlock(&q->mutex);
+	prot_queue_pop_all(q, data, 1);
 }
 
-/* 
+/*
  * Destroy the queue. Releases resources associated with the queue.
  * Params:
  * q - Pointer to the queue.
  */
 static inline void prot_queue_destroy(struct prot_queue* q) {
-	pthread_mutex_destroy(&q->mutex);
-	pthread_cond_destroy(&q->cond);
+	free(q->seqs);
+	q->seqs = NULL;
+	prot_event_destroy(&q->items);
+	prot_event_destroy(&q->space);
 }
 
 #endif // PROT_QUEUE_H
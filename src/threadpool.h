@@ -1,23 +1,43 @@
-
 #ifndef THREADPOOL_H
 #define THREADPOOL_H
 
 #include "protected_queue.h"
 
+/*
+ * A work-stealing pool. Work is handed out round-robin to per-thread inboxes,
+ * and threads that run out of their own work take batches from the busiest
+ * inbox. Messages sent to every thread go to a separate control queue that
+ * is never stolen from.
+ */
+
+// most work a thread takes at once, so the rest stays up for grabs
+#define THREADPOOL_BATCH 64
+
+// room for messages sent to every thread
+#define THREADPOOL_CONTROL_SIZE 1024
+
+struct threadpool;
+
 struct thread
 {
 	pthread_t thread_id;
-	struct prot_queue inbox;
+	struct prot_queue inbox;   // work, other threads may steal from it
+	struct prot_queue control; // messages for this thread only
 	void *qmem;
+	void *cmem;
 	void *ctx;
+	struct threadpool *tp;
+	int quitting;
 };
 
 struct threadpool
 {
 	int num_threads;
 	struct thread *pool;
-	int next_thread;
+	unsigned int next_thread;
+	int elem_size;
 	void *quit_msg;
+	struct prot_event work; // idle threads sleep here
 };
 
 static int threadpool_init(struct threadpool *tp, int num_threads,
@@ -31,30 +51,39 @@ static int threadpool_init(struct threadpool *tp, int num_threads,
 		return 0;
 
 	tp->num_threads = num_threads;
-	tp->pool = malloc(sizeof(*tp->pool) * num_threads);
+	tp->pool = calloc(num_threads, sizeof(*tp->pool));
 	tp->quit_msg = quit_msg;
-	tp->next_thread = -1;
+	tp->elem_size = q_elem_size;
+	tp->next_thread = 0;
+	prot_event_init(&tp->work);
 
 	if (tp->pool == NULL) {
 		fprintf(stderr, "threadpool_init: couldn't allocate memory for pool");
 		return 0;
 	}
 
+	// every inbox has to exist before any thread goes looking for work
 	for (i = 0; i < num_threads; i++) {
 		t = &tp->pool[i];
 		t->qmem = malloc(q_elem_size * q_num_elems);
+		t->cmem = malloc(q_elem_size * THREADPOOL_CONTROL_SIZE);
 		t->ctx = ctx;
+		t->tp = tp;
 
-		if (t->qmem == NULL) {
+		if (t->qmem == NULL || t->cmem == NULL) {
 			fprintf(stderr, "threadpool_init: couldn't allocate memory for queue");
 			return 0;
 		}
 
-		if (!prot_queue_init(&t->inbox, t->qmem, q_elem_size * q_num_elems, q_elem_size)) {
+		if (!prot_queue_init(&t->inbox, t->qmem, q_elem_size * q_num_elems, q_elem_size) ||
+		    !prot_queue_init(&t->control, t->cmem, q_elem_size * THREADPOOL_CONTROL_SIZE, q_elem_size)) {
 			fprintf(stderr, "threadpool_init: couldn't init queue. buffer alignment is wrong.");
 			return 0;
 		}
+	}
 
+	for (i = 0; i < num_threads; i++) {
+		t = &tp->pool[i];
 		if (THREAD_CREATE(t->thread_id, thread_fn, t) != 0) {
 			fprintf(stderr, "threadpool_init: failed to create thread\n");
 			return 0;
@@ -66,14 +95,29 @@ static int threadpool_init(struct threadpool *tp, int num_threads,
 
 static inline struct thread *threadpool_next_thread(struct threadpool *tp)
 {
-	tp->next_thread = (tp->next_thread + 1) % tp->num_threads;
-	return &tp->pool[tp->next_thread];
+	unsigned int next;
+
+	next = __atomic_fetch_add(&tp->next_thread, 1, __ATOMIC_RELAXED);
+	return &tp->pool[next % tp->num_threads];
 }
 
+/*
+ * Queue a message on the next thread, moving on to the others if its inbox
+ * is full. Returns 0 only when every inbox is full.
+ */
 static inline int threadpool_dispatch(struct threadpool *tp, void *msg)
 {
-	struct thread *t = threadpool_next_thread(tp);
-	return prot_queue_push(&t->inbox, msg);
+	int i;
+
+	for (i = 0; i < tp->num_threads; i++) {
+		if (prot_queue_push(&threadpool_next_thread(tp)->inbox, msg)) {
+			// whoever is idle can take it
+			prot_event_wake(&tp->work, 0);
+			return 1;
+		}
+	}
+
+	return 0;
 }
 
 static inline int threadpool_dispatch_all_threads(struct threadpool *tp, void *msg)
@@ -82,9 +126,11 @@ static inline int threadpool_dispatch_all_threads(struct threadpool *tp, void *m
 	ok = 1;
 
 	for (i = 0; i < tp->num_threads; i++) {
-		ok = ok && prot_queue_push(&tp->pool[i].inbox, msg);
+		ok = ok && prot_queue_push(&tp->pool[i].control, msg);
 	}
 
+	prot_event_wake(&tp->work, 1);
+
 	return ok;
 }
 
@@ -92,24 +138,176 @@ static inline int threadpool_dispatch_all_threads(struct threadpool *tp, void *m
 static inline int threadpool_dispatch_all(struct threadpool *tp, void *msgs,
 					  int num_msgs)
 {
-	struct thread *t = threadpool_next_thread(tp);
-	return prot_queue_push_all(&t->inbox, msgs, num_msgs);
+	int i;
+
+	for (i = 0; i < tp->num_threads; i++) {
+		if (prot_queue_push_all(&threadpool_next_thread(tp)->inbox, msgs,
+					num_msgs)) {
+			prot_event_wake(&tp->work, 1);
+			return num_msgs;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Take up to half of the busiest inbox.
+ */
+static inline int threadpool_steal(struct thread *t, void *msgs, int max_items)
+{
+	struct threadpool *tp = t->tp;
+	struct thread *victim, *busiest;
+	int i, count, most;
+
+	busiest = NULL;
+	most = 0;
+	for (i = 0; i < tp->num_threads; i++) {
+		victim = &tp->pool[i];
+		if (victim == t)
+			continue;
+
+		count = prot_queue_count(&victim->inbox);
+		if (count > most) {
+			most = count;
+			busiest = victim;
+		}
+	}
+
+	if (busiest == NULL)
+		return 0;
+
+	return prot_queue_try_pop_all(&busiest->inbox, msgs,
+				      min(max_items, (most + 1) / 2));
+}
+
+/*
+ * Pop this thread's control messages. The quit message is held back until
+ * our inbox is drained.
+ */
+static inline int threadpool_pop_control(struct thread *t, void *msgs,
+					 int max_items)
+{
+	struct threadpool *tp = t->tp;
+	unsigned char *msg;
+	int i, n;
+
+	n = prot_queue_try_pop_all(&t->control, msgs, max_items);
+	for (i = 0; i < n; i++) {
+		msg = (unsigned char *)msgs + i * tp->elem_size;
+		if (memcmp(msg, tp->quit_msg, tp->elem_size))
+			continue;
+
+		t->quitting = 1;
+		memmove(msg, msg + tp->elem_size, (n - i - 1) * tp->elem_size);
+		n--;
+		i--;
+	}
+
+	return n;
+}
+
+static inline int threadpool_has_work(struct thread *t)
+{
+	struct threadpool *tp = t->tp;
+	int i;
+
+	if (prot_queue_count(&t->control) > 0)
+		return 1;
+
+	for (i = 0; i < tp->num_threads; i++) {
+		if (prot_queue_count(&tp->pool[i].inbox) > 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for messages for this thread, from its own inbox or stolen from
+ * another, and pop up to max_items of them (max_items must be at least 2).
+ *
+ * Control messages come first. They are popped after the work, so anything
+ * sent to every thread before a piece of work was queued is handled before
+ * that work, whichever thread ends up with it. Once the quit message arrives
+ * the thread stops stealing, and gets the quit message when its own inbox is
+ * empty.
+ */
+static inline int threadpool_pop(struct thread *t, void *msgs, int max_items)
+{
+	struct threadpool *tp = t->tp;
+	unsigned char *work;
+	uint32_t seen;
+	int nwork, nctl, room;
+
+	room = min(max_items / 2, THREADPOOL_BATCH);
+	work = (unsigned char *)msgs + (max_items - room) * tp->elem_size;
+
+	for (;;) {
+		nwork = prot_queue_try_pop_all(&t->inbox, work, room);
+		if (nwork == 0 && !t->quitting)
+			nwork = threadpool_steal(t, work, room);
+
+		nctl = 0;
+		if (!t->quitting)
+			nctl = threadpool_pop_control(t, msgs, max_items - room);
+
+		if (nwork + nctl > 0) {
+			memmove((unsigned char *)msgs + nctl * tp->elem_size,
+				work, nwork * tp->elem_size);
+			return nwork + nctl;
+		}
+
+		if (t->quitting) {
+			memcpy(msgs, tp->quit_msg, tp->elem_size);
+			return 1;
+		}
+
+		seen = prot_event_wait_begin(&tp->work);
+		if (threadpool_has_work(t)) {
+			prot_event_wait_end(&tp->work);
+			continue;
+		}
+		prot_event_sleep(&tp->work, seen);
+		prot_event_wait_end(&tp->work);
+	}
 }
 
 static inline void threadpool_destroy(struct threadpool *tp)
 {
 	struct thread *t;
+	int *quit;
+
+	quit = calloc(tp->num_threads, sizeof(*quit));
 
 	for (int i = 0; i < tp->num_threads; i++) {
 		t = &tp->pool[i];
-		if (!prot_queue_push(&t->inbox, tp->quit_msg)) {
+		if (quit)
+			quit[i] = prot_queue_push(&t->control, tp->quit_msg);
+	}
+	prot_event_wake(&tp->work, 1);
+
+	// threads steal from each other until they quit, so the queues
+	// outlive all of them
+	for (int i = 0; i < tp->num_threads; i++) {
+		t = &tp->pool[i];
+		if (!quit || !quit[i]) {
 			THREAD_TERMINATE(t->thread_id);
 		} else {
 			THREAD_FINISH(t->thread_id);
 		}
+	}
+
+	for (int i = 0; i < tp->num_threads; i++) {
+		t = &tp->pool[i];
 		prot_queue_destroy(&t->inbox);
+		prot_queue_destroy(&t->control);
 		free(t->qmem);
+		free(t->cmem);
 	}
+
+	free(quit);
+	prot_event_destroy(&tp->work);
 	free(tp->pool);
 }
 
@@ -6,6 +6,7 @@
 #include "invoice.h"
 #include "block.h"
 #include "protected_queue.h"
+#include "threadpool.h"
 #include "memchr.h"
 #include "print_util.h"
 #include "bindings/c/profile_reader.h"
@@ -15,9 +16,11 @@
 #include "secp256k1.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <poll.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
@@ -1261,6 +1264,66 @@ static void test_filters()
 	assert(ndb_filter_matches(f, note));
 
 	ndb_filter_destroy(f);
+
+	// big fields get hashed, and spread out kinds skip the bitmap
+	unsigned char pk[32];
+	char tag[16];
+	int i;
+
+	ndb_filter_init(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	for (i = 0; i < 40; i++) {
+		memset(pk, i, sizeof(pk));
+		assert(ndb_filter_add_id_element(f, pk));
+	}
+	assert(ndb_filter_add_id_element(f, ndb_note_pubkey(note)));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_tag_field(f, 't'));
+	for (i = 0; i < 40; i++) {
+		snprintf(tag, sizeof(tag), "tag%d", i);
+		assert(ndb_filter_add_str_element(f, tag));
+	}
+	assert(ndb_filter_add_str_element(f, "hashtag"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_tag_field(f, 'p'));
+	assert(ndb_filter_add_id_element(f, pk));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 3));
+	assert(ndb_filter_add_int_element(f, 1000000));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+
+	// the p tag doesn't match yet
+	assert(!ndb_filter_matches(f, note));
+	ndb_filter_destroy(f);
+
+	ndb_filter_init(f);
+	assert(ndb_filter_start_tag_field(f, 'p'));
+	assert(ndb_filter_add_id_element(f, pk));
+	hex_decode("4d2e7a6a8e08007ace5a03391d21735f45caf1bf3d67b492adc28967ab46525e", 64, pk, sizeof(pk));
+	assert(ndb_filter_add_id_element(f, pk));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_tag_field(f, 't'));
+	for (i = 0; i < 40; i++) {
+		snprintf(tag, sizeof(tag), "tag%d", i);
+		assert(ndb_filter_add_str_element(f, tag));
+	}
+	assert(ndb_filter_add_str_element(f, "grownostr"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 3));
+	assert(ndb_filter_add_int_element(f, 1000000));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+
+	assert(ndb_filter_matches(f, note));
+	_ndb_note_set_kind(note, 4);
+	assert(!ndb_filter_matches(f, note));
+	_ndb_note_set_kind(note, 1000000);
+	assert(ndb_filter_matches(f, note));
+
+	ndb_filter_destroy(f);
 }
 
 static void test_filter_json()
@@ -2411,6 +2474,8 @@ static void test_queue_init_pop_push() {
 		assert(data == i);
 	}
 	assert(prot_queue_try_pop_all(&q, &data, 1) == 0);  // Should fail as queue is empty
+
+	prot_queue_destroy(&q);
 }
 
 // This function will be used by threads to test thread safety.
@@ -2446,6 +2511,8 @@ static void test_queue_thread_safety() {
 	// After all operations, the queue should be empty
 	int data;
 	assert(prot_queue_try_pop_all(&q, &data, 1) == 0);
+
+	prot_queue_destroy(&q);
 }
 
 static void test_queue_boundary_conditions() {
@@ -2464,13 +2531,13 @@ static void test_queue_boundary_conditions() {
     // Try to push to a full queue
     int old_head = q.head;
     int old_tail = q.tail;
-    int old_count = q.count;
+    int old_count = prot_queue_count(&q);
     assert(prot_queue_push(&q, &data) == 0);
 
     // Assert the queue's state has not changed
     assert(old_head == q.head);
     assert(old_tail == q.tail);
-    assert(old_count == q.count);
+    assert(old_count == prot_queue_count(&q));
 
     // Pop to empty
     for (int i = 0; i < TEST_BUF_SIZE; i++) {
@@ -2480,13 +2547,177 @@ static void test_queue_boundary_conditions() {
     // Try to pop from an empty queue
     old_head = q.head;
     old_tail = q.tail;
-    old_count = q.count;
+    old_count = prot_queue_count(&q);
     assert(prot_queue_try_pop_all(&q, &data, 1) == 0);
 
     // Assert the queue's state has not changed
     assert(old_head == q.head);
     assert(old_tail == q.tail);
-    assert(old_count == q.count);
+    assert(old_count == prot_queue_count(&q));
+
+    prot_queue_destroy(&q);
+}
+
+#define MPSC_PRODUCERS 4
+#define MPSC_PER_PRODUCER 20000
+
+struct mpsc_producer {
+	struct prot_queue *q;
+	int id;
+};
+
+static void *mpsc_producer_thread(void *arg)
+{
+	struct mpsc_producer *p = arg;
+	int i, j, batch[3];
+
+	// mix single pushes with batches that have to wait for room
+	for (i = 0; i < MPSC_PER_PRODUCER; ) {
+		if (i % 2 == 0 || i + 3 > MPSC_PER_PRODUCER) {
+			batch[0] = p->id * MPSC_PER_PRODUCER + i++;
+			while (!prot_queue_push(p->q, batch))
+				;
+			continue;
+		}
+
+		for (j = 0; j < 3; j++)
+			batch[j] = p->id * MPSC_PER_PRODUCER + i++;
+		assert(prot_queue_push_all_wait(p->q, batch, 3) == 3);
+	}
+
+	return NULL;
+}
+
+static void test_queue_many_producers()
+{
+	struct prot_queue q;
+	struct mpsc_producer producers[MPSC_PRODUCERS];
+	pthread_t threads[MPSC_PRODUCERS];
+	int buffer[8], data[8], next[MPSC_PRODUCERS] = {0};
+	int i, n, id, total;
+
+	assert(prot_queue_init(&q, buffer, sizeof(buffer), sizeof(int)));
+	assert(prot_queue_push_all(&q, data, 9) == 0);
+
+	for (i = 0; i < MPSC_PRODUCERS; i++) {
+		producers[i].q = &q;
+		producers[i].id = i;
+		pthread_create(&threads[i], NULL, mpsc_producer_thread,
+			       &producers[i]);
+	}
+
+	// every element arrives once, in order per producer
+	for (total = 0; total < MPSC_PRODUCERS * MPSC_PER_PRODUCER; ) {
+		n = prot_queue_pop_all(&q, data, 8);
+		assert(n > 0);
+		for (i = 0; i < n; i++) {
+			id = data[i] / MPSC_PER_PRODUCER;
+			assert(data[i] % MPSC_PER_PRODUCER == next[id]);
+			next[id]++;
+		}
+		total += n;
+	}
+
+	for (i = 0; i < MPSC_PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+
+	assert(prot_queue_try_pop_all(&q, data, 8) == 0);
+	assert(prot_queue_count(&q) == 0);
+	prot_queue_destroy(&q);
+}
+
+enum steal_msg_type { STEAL_WORK, STEAL_SLOW, STEAL_MARK, STEAL_QUIT };
+
+struct steal_msg {
+	int type;
+};
+
+struct steal_ctx {
+	pthread_mutex_t gate;
+	int slow_started;
+	int done;
+	int marks;
+};
+
+static void *steal_thread(void *data)
+{
+	struct thread *t = data;
+	struct steal_ctx *ctx = t->ctx;
+	struct steal_msg msgs[16];
+	int i, n;
+
+	for (;;) {
+		n = threadpool_pop(t, msgs, 16);
+		for (i = 0; i < n; i++) {
+			switch (msgs[i].type) {
+			case STEAL_WORK:
+				__atomic_add_fetch(&ctx->done, 1, __ATOMIC_SEQ_CST);
+				break;
+			case STEAL_SLOW:
+				__atomic_store_n(&ctx->slow_started, 1, __ATOMIC_SEQ_CST);
+				pthread_mutex_lock(&ctx->gate);
+				pthread_mutex_unlock(&ctx->gate);
+				break;
+			case STEAL_MARK:
+				__atomic_add_fetch(&ctx->marks, 1, __ATOMIC_SEQ_CST);
+				break;
+			case STEAL_QUIT:
+				return NULL;
+			}
+		}
+	}
+}
+
+static int steal_wait(int *counter, int want)
+{
+	int attempts;
+
+	for (attempts = 0; attempts < 500; attempts++) {
+		if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) >= want)
+			return 1;
+		usleep(10000);
+	}
+
+	return 0;
+}
+
+static void test_threadpool_work_stealing()
+{
+	static struct steal_msg quit_msg = { .type = STEAL_QUIT };
+	struct threadpool tp;
+	struct steal_ctx ctx = {0};
+	struct steal_msg msg;
+	int i;
+
+	pthread_mutex_init(&ctx.gate, NULL);
+	pthread_mutex_lock(&ctx.gate);
+
+	assert(threadpool_init(&tp, 3, sizeof(msg), 128, &quit_msg, &ctx,
+			       steal_thread));
+
+	// wedge one thread
+	msg.type = STEAL_SLOW;
+	assert(threadpool_dispatch(&tp, &msg));
+	assert(steal_wait(&ctx.slow_started, 1));
+
+	// a third of this lands behind the stuck thread, the others take it
+	msg.type = STEAL_WORK;
+	for (i = 0; i < 300; i++) {
+		while (!threadpool_dispatch(&tp, &msg))
+			usleep(1000);
+	}
+	assert(steal_wait(&ctx.done, 300));
+
+	// control messages reach every thread, the stuck one included
+	msg.type = STEAL_MARK;
+	assert(threadpool_dispatch_all_threads(&tp, &msg));
+	assert(steal_wait(&ctx.marks, 2));
+	pthread_mutex_unlock(&ctx.gate);
+	assert(steal_wait(&ctx.marks, 3));
+
+	threadpool_destroy(&tp);
+	assert(ctx.marks == 3 && ctx.done == 300);
+	pthread_mutex_destroy(&ctx.gate);
 }
 
 static void test_fast_strchr()
@@ -2710,6 +2941,34 @@ static void test_multifilter_query()
 	ndb_destroy(ndb);
 }
 
+/* Write a test event's json to buf: a relay EVENT, or a client one if subid
+ * is NULL. The id and pubkey are numbers padded out to 64 hex digits and the
+ * sig is bogus, so ingest with NDB_FLAG_SKIP_NOTE_VERIFY. tags is a json
+ * array and the content is printf formatted. Returns the length, like
+ * snprintf. */
+static int test_event_json(char *buf, size_t bufsize, const char *subid,
+			   unsigned id, unsigned pubkey, int created_at,
+			   int kind, const char *tags, const char *content, ...)
+{
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+	char text[256];
+	va_list ap;
+
+	va_start(ap, content);
+	vsnprintf(text, sizeof(text), content, ap);
+	va_end(ap);
+
+	return snprintf(buf, bufsize,
+			"[\"EVENT\",%s%s%s{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			"\"created_at\":%d,\"kind\":%d,\"tags\":%s,"
+			"\"content\":\"%s\",\"sig\":\"%s\"}]",
+			subid ? "\"" : "", subid ? subid : "",
+			subid ? "\"," : "", id, pubkey, created_at, kind, tags,
+			text, sig);
+}
+
 /* Every created_at ordered index in nostrdb is only ordered *within* a group
  * (a kind, a pubkey+kind, a relay+kind). Query plans that span more than one
  * group have to merge those groups, so this exercises the plans that do:
@@ -2829,10 +3088,12 @@ static void test_query_ordering()
 	for (i = 0; i < ORDER_NOTES; i++) {
 		snprintf(json, sizeof(json),
 			 "[\"EVENT\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
-			 "\"created_at\":%d,\"kind\":%" PRIu64 ",\"tags\":[],"
+			 "\"created_at\":%d,\"kind\":%" PRIu64 ",\"tags\":"
+			 "[[\"t\",\"t%d\"],[\"x\",\"x%d\"]],"
 			 "\"content\":\"n%d\",\"sig\":\"%s\"}]",
 			 order_note_id(i), order_note_author(i) + 1,
-			 ORDER_BASE_TIME + i, order_note_kind(i), i, sig);
+			 ORDER_BASE_TIME + i, order_note_kind(i), i % 4, i % 2,
+			 i, sig);
 
 		ndb_ingest_meta_init(&meta, 1,
 				     order_relays[order_note_relay(i)]);
@@ -2883,6 +3144,20 @@ static void test_query_ordering()
 	ndb_filter_end_field(f);
 	assert(ndb_filter_end(f));
 	order_check("created", &txn, f, 10, -1, -1, -1, -1);
+	{
+		struct ndb_query_result results[ORDER_NOTES];
+		struct ndb_query_explain explain;
+		int count = 0;
+
+		// a fresh db is fully migrated, so this is one reverse scan
+		// over the created_at index rather than a merge of every kind
+		assert(ndb_query_explain(&txn, f, 1, results, 10, &count,
+					 &explain));
+		assert(count == 10);
+		assert(!strcmp(explain.plan, "created"));
+		assert(explain.seeks == 1);
+		assert(explain.index_entries == 10);
+	}
 	ndb_filter_destroy(f);
 
 	// NDB_PLAN_KINDS: merge kinds 1 and 7, skipping 30023
@@ -2934,6 +3209,69 @@ static void test_query_ordering()
 	order_check("multi_author_kinds", &txn, f, 12, 1, 7, -1, -1);
 	ndb_filter_destroy(f);
 
+	// a large author set where almost nobody has posted. The planner
+	// probes the kind scan against the author*kind merge here, and
+	// whichever it picks has to come back with the same answer
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	memset(author, 0, sizeof(author));
+	for (i = 0; i < 100; i++) {
+		// only the first is anybody (author 0), the rest are nobody
+		author[30] = i;
+		author[31] = i == 0 ? 1 : 2;
+		assert(ndb_filter_add_id_element(f, author));
+	}
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	assert(ndb_filter_add_int_element(f, 7));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	order_check("planner_sparse_authors", &txn, f, 12, 1, 7, 0, -1);
+	{
+		struct ndb_query_result results[12];
+		struct ndb_query_explain explain;
+		int count = 0;
+
+		// author 0 wrote every other note, so twelve of theirs are
+		// a couple dozen kind entries back, far cheaper than
+		// seeking 200 author*kind runs
+		assert(ndb_query_explain(&txn, f, 1, results, 12, &count,
+					 &explain));
+		assert(count == 12);
+		assert(!strcmp(explain.plan, "kinds"));
+		assert(explain.seeks == 2);
+		assert(explain.notes_loaded < 2 * 12 + 2);
+	}
+	ndb_filter_destroy(f);
+	memset(author, 0, sizeof(author));
+
+	// NDB_PLAN_AUTHORS: no kinds, so merge one pubkey run per author
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	memset(author, 0, sizeof(author));
+	author[31] = 1; // author 0
+	assert(ndb_filter_add_id_element(f, author));
+	author[31] = 3; // nobody
+	assert(ndb_filter_add_id_element(f, author));
+	author[31] = 4; // nobody
+	assert(ndb_filter_add_id_element(f, author));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	order_check("multi_authors", &txn, f, 10, -1, -1, 0, -1);
+	{
+		struct ndb_query_result results[ORDER_NOTES];
+		struct ndb_query_explain explain;
+		int count = 0;
+
+		assert(ndb_query_explain(&txn, f, 1, results, 10, &count,
+					 &explain));
+		assert(!strcmp(explain.plan, "authors"));
+		assert(explain.seeks == 3);
+		assert(explain.mismatches == 0);
+	}
+	ndb_filter_destroy(f);
+
 	// the same plan under since/until bounds
 	assert(ndb_filter_init(f));
 	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
@@ -2985,6 +3323,59 @@ static void test_query_ordering()
 	order_check("relay_kinds", &txn, f, 8, 1, 7, -1, 0);
 	ndb_filter_destroy(f);
 
+	// NDB_PLAN_TAGS: merge the runs of two values of #t
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "t0"));
+	assert(ndb_filter_add_str_element(f, "t1"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	{
+		struct ndb_query_result results[ORDER_NOTES];
+		struct ndb_query_explain explain;
+		int count = 0, want;
+
+		assert(ndb_query_explain(&txn, f, 1, results, 10, &count,
+					 &explain));
+		assert(!strcmp(explain.plan, "tags"));
+		assert(explain.seeks == 2);
+		assert(count == 10);
+
+		for (i = 0, want = ORDER_NOTES - 1; i < count; i++, want--) {
+			while (want % 4 > 1)
+				want--;
+			assert(ndb_note_created_at(results[i].note) ==
+			       (uint64_t)(ORDER_BASE_TIME + want));
+		}
+	}
+	ndb_filter_destroy(f);
+
+	// with two tag fields the plan scans one and must still check the
+	// other: every #t value, but only x1
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "t0"));
+	assert(ndb_filter_add_str_element(f, "t1"));
+	assert(ndb_filter_add_str_element(f, "t2"));
+	assert(ndb_filter_add_str_element(f, "t3"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_tag_field(f, 'x'));
+	assert(ndb_filter_add_str_element(f, "x1"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	{
+		struct ndb_query_result results[ORDER_NOTES];
+		int count = 0;
+
+		assert(ndb_query(&txn, f, 1, results, 8, &count));
+		assert(count == 8);
+
+		for (i = 0; i < count; i++)
+			assert(ndb_note_created_at(results[i].note) ==
+			       (uint64_t)(ORDER_BASE_TIME + ORDER_NOTES - 1 - 2*i));
+	}
+	ndb_filter_destroy(f);
+
 	// since/until should bound the merged scan, not truncate it at the
 	// first out-of-range group
 	assert(ndb_filter_init(f));
@@ -3010,59 +3401,404 @@ static void test_query_ordering()
 	}
 	ndb_filter_destroy(f);
 
-	ndb_end_query(&txn);
-	ndb_destroy(ndb);
-}
+	// explain should account for every note the plan looked at
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	author[31] = 2; // author 1
+	assert(ndb_filter_add_id_element(f, author));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	{
+		struct ndb_query_result results[ORDER_NOTES];
+		struct ndb_query_explain explain;
+		int count = 0;
 
-static void test_multifilter_query_fair_distribution()
-{
-	struct ndb *ndb;
-	struct ndb_txn txn;
-	struct ndb_filter filters[2];
-	struct ndb_config config;
-	struct ndb_query_result results[2];
-	int count, i, kind1_count, kind2_count;
-	uint64_t subid, note_ids[4];
-	int nres;
+		assert(ndb_query_explain(&txn, f, 1, results, 5, &count,
+					 &explain));
+		assert(count == 5);
+		assert(!strcmp(explain.plan, "author_kinds"));
+		// its five entries are all the planner read, the kind scan
+		// couldn't have been cheaper so it wasn't probed
+		assert(explain.planner_entries == 5);
+		assert(explain.results == 5);
+		assert(explain.seeks == 1);
+		assert(explain.index_entries == 5);
+		assert(explain.max_scanner_entries == 5);
+		assert(explain.notes_loaded == 5);
+		assert(explain.mismatches == 0);
+	}
+	ndb_filter_destroy(f);
 
-	delete_test_db();
-	ndb_default_config(&config);
+	// NDB_PLAN_INTERSECT: kind 7 and #t t1 only meet every 12th note, so
+	// walk both indexes together and only load those
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 7));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "t1"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	{
+		struct ndb_query_result results[ORDER_NOTES];
+		struct ndb_query_explain explain;
+		int count = 0;
 
-	// kind-1 events (older timestamps)
-	const char *k1a = "[\"EVENT\",\"s\",{\"id\": \"0336948bdfbf5f939802eba03aa78735c82825211eece987a6d2e20e3cfff930\",\"pubkey\": \"aeadd3bf2fd92e509e137c9e8bdf20e99f286b90be7692434e03c015e1d3bbfe\",\"created_at\": 1704401597,\"kind\": 1,\"tags\": [],\"content\": \"hello\",\"sig\": \"232395427153b693e0426b93d89a8319324d8657e67d23953f014a22159d2127b4da20b95644b3e34debd5e20be0401c283e7308ccb63c1c1e0f81cac7502f09\"}]";
-	const char *k1b = "[\"EVENT\",\"s\",{\"id\": \"0a350c5851af6f6ce368bab4e2d4fe442a1318642c7fe58de5392103700c10fc\",\"pubkey\": \"dfa3fc062f7430dab3d947417fd3c6fb38a7e60f82ffe3387e2679d4c6919b1d\",\"created_at\": 1704404822,\"kind\": 1,\"tags\": [],\"content\": \"hello2\",\"sig\": \"48a0bb9560b89ee2c6b88edcf1cbeeff04f5e1b10d26da8564cac851065f30fa6961ee51f450cefe5e8f4895e301e8ffb2be06a2ff44259684fbd4ea1c885696\"}]";
-	// kind-2 events (newer timestamps: 1704408561, 1704408730)
-	const char *k2a = "[\"EVENT\",\"s\",{\"id\": \"20d2b66e1a3ac4a2afe22866ad742091b6267e6e614303de062adb33e12c9931\",\"pubkey\": \"7987bfb2632d561088fc8e3c30a95836f822e4f53633228ec92ae2f5cd6690aa\",\"created_at\": 1704408561,\"kind\": 2,\"tags\": [],\"content\": \"what\",\"sig\": \"cc8533bf177ac87771a5218a04bed24f7a1706f0b2d92700045cdeb38accc5507c6c8de09525e43190df3652012b554d4efe7b82ab268a87ff6f23da44e16a8f\"}]";
-	const char *k2b = "[\"EVENT\",\"s\",{\"id\": \"8a2057c13c1c57b536eab78e6c55428732d33b6b5b234c1f5eab2b5918c37fa1\",\"pubkey\": \"303b5851504da5caa14142e9e2e1b1b60783c48d6f137c205019d46d09244c26\",\"created_at\": 1704408730,\"kind\": 2,\"tags\": [],\"content\": \"hmm\",\"sig\": \"e7cd3029042d41964192411929cade59592840af766da6420077ccc57a61405312db6ca879150db01f53c3b81c477cec5d6bd49f9dc10937267cacf7e5c784b3\"}]";
+		assert(ndb_query_explain(&txn, f, 1, results, 10, &count,
+					 &explain));
+		assert(!strcmp(explain.plan, "intersect"));
+		assert(count == 5);
+		assert(explain.notes_loaded == 5);
 
-	assert(ndb_init(&ndb, test_dir, &config));
+		for (i = 0; i < count; i++)
+			assert(ndb_note_created_at(results[i].note) ==
+			       (uint64_t)(ORDER_BASE_TIME + 53 - 12*i));
+	}
+	ndb_filter_destroy(f);
 
-	// filter 0: kind 1, NO explicit limit
-	ndb_filter_init(&filters[0]);
-	ndb_filter_start_field(&filters[0], NDB_FILTER_KINDS);
-	ndb_filter_add_int_element(&filters[0], 1);
-	ndb_filter_end_field(&filters[0]);
-	ndb_filter_end(&filters[0]);
+	// author 0 only wrote even notes and #x x1 only tags odd ones. they
+	// interleave note for note, so the planner is free to skip the
+	// intersection, but whatever it picks must come back empty
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	author[31] = 1; // author 0
+	assert(ndb_filter_add_id_element(f, author));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_tag_field(f, 'x'));
+	assert(ndb_filter_add_str_element(f, "x1"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	{
+		struct ndb_query_result results[ORDER_NOTES];
+		struct ndb_query_explain explain;
+		int count = 0;
 
-	// filter 1: kind 2, NO explicit limit
-	ndb_filter_init(&filters[1]);
-	ndb_filter_start_field(&filters[1], NDB_FILTER_KINDS);
-	ndb_filter_add_int_element(&filters[1], 2);
-	ndb_filter_end_field(&filters[1]);
-	ndb_filter_end(&filters[1]);
+		assert(ndb_query_explain(&txn, f, 1, results, 10, &count,
+					 &explain));
+		assert(count == 0);
+		assert(explain.results == 0);
+	}
+	ndb_filter_destroy(f);
 
-	assert((subid = ndb_subscribe(ndb, filters, 2)));
-	assert(ndb_process_event(ndb, k1a, strlen(k1a)));
-	assert(ndb_process_event(ndb, k1b, strlen(k1b)));
-	assert(ndb_process_event(ndb, k2a, strlen(k2a)));
-	assert(ndb_process_event(ndb, k2b, strlen(k2b)));
+	// overlapping filters merge newest first, and a note matching both
+	// only comes back once
+	{
+		struct ndb_filter filters[2];
+		struct ndb_query_result results[ORDER_NOTES];
+		struct ndb_query_explain explain[2];
+		int count = 0, want;
+
+		assert(ndb_filter_init(&filters[0]));
+		assert(ndb_filter_start_field(&filters[0], NDB_FILTER_KINDS));
+		assert(ndb_filter_add_int_element(&filters[0], 1));
+		ndb_filter_end_field(&filters[0]);
+		assert(ndb_filter_end(&filters[0]));
+
+		assert(ndb_filter_init(&filters[1]));
+		assert(ndb_filter_start_field(&filters[1], NDB_FILTER_AUTHORS));
+		author[31] = 1; // author 0
+		assert(ndb_filter_add_id_element(&filters[1], author));
+		ndb_filter_end_field(&filters[1]);
+		assert(ndb_filter_end(&filters[1]));
+
+		assert(ndb_query_explain(&txn, filters, 2, results, 12, &count,
+					 explain));
+		assert(count == 12);
+		assert(explain[0].results + explain[1].results == 12);
+
+		// kind 1 is every third note, author 0 every other one
+		for (i = 0, want = ORDER_NOTES - 1; i < count; i++, want--) {
+			while (want % 3 != 0 && want % 2 != 0)
+				want--;
+			assert(ndb_note_created_at(results[i].note) ==
+			       (uint64_t)(ORDER_BASE_TIME + want));
+		}
 
-	for (nres = 4; nres > 0;)
-		nres -= ndb_wait_for_notes(ndb, subid, note_ids, 4);
+		ndb_filter_destroy(&filters[0]);
+		ndb_filter_destroy(&filters[1]);
+	}
 
-	ndb_begin_query(ndb, &txn);
+	// counts straight off the index, off an intersection, and the union
+	// of two overlapping filters
+	{
+		struct ndb_filter filters[2];
+		uint64_t count;
+
+		assert(ndb_filter_init(&filters[0]));
+		assert(ndb_filter_start_field(&filters[0], NDB_FILTER_KINDS));
+		assert(ndb_filter_add_int_element(&filters[0], 1));
+		ndb_filter_end_field(&filters[0]);
+		assert(ndb_filter_end(&filters[0]));
+
+		assert(ndb_count(&txn, filters, 1, &count));
+		assert(count == ORDER_NOTES / 3);
+
+		assert(ndb_filter_init(&filters[1]));
+		assert(ndb_filter_start_field(&filters[1], NDB_FILTER_AUTHORS));
+		author[31] = 1; // author 0
+		assert(ndb_filter_add_id_element(&filters[1], author));
+		ndb_filter_end_field(&filters[1]);
+		assert(ndb_filter_start_tag_field(&filters[1], 't'));
+		assert(ndb_filter_add_str_element(&filters[1], "t2"));
+		ndb_filter_end_field(&filters[1]);
+		assert(ndb_filter_end(&filters[1]));
+
+		// author 0 is every even note, t2 every fourth
+		assert(ndb_count(&txn, &filters[1], 1, &count));
+		assert(count == ORDER_NOTES / 4);
+
+		// kind 1 (i % 3 == 0) or t2 (i % 4 == 2), less the i % 12 == 6
+		// notes that are both
+		assert(ndb_count(&txn, filters, 2, &count));
+		assert(count == ORDER_NOTES / 3 + ORDER_NOTES / 4 - ORDER_NOTES / 12);
+
+		ndb_filter_destroy(&filters[0]);
+		ndb_filter_destroy(&filters[1]);
+
+		// an empty filter counts everything
+		assert(ndb_filter_init(&filters[0]));
+		assert(ndb_filter_end(&filters[0]));
+		assert(ndb_count(&txn, filters, 1, &count));
+		assert(count == ORDER_NOTES);
+		ndb_filter_destroy(&filters[0]);
+	}
 
-	// capacity=2 with 2 kind-1 and 2 kind-2 events.
+	// keys only, straight off the kind index
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	{
+		struct ndb_query_result results[5];
+		struct ndb_query_key keys[5];
+		int count = 0, nkeys = 0;
+
+		assert(ndb_query(&txn, f, 1, results, 5, &count));
+		assert(ndb_query_keys(&txn, f, keys, 5, &nkeys));
+		assert(count == 5 && nkeys == 5);
+
+		for (i = 0; i < nkeys; i++) {
+			assert(keys[i].note_key == results[i].note_id);
+			assert(keys[i].created_at ==
+			       (uint64_t)(ORDER_BASE_TIME + ORDER_NOTES - 3 - 3*i));
+		}
+	}
+	ndb_filter_destroy(f);
+
+	// with authors too there are plans to choose between, and neither
+	// picking one nor running it should load a note
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	memset(author, 0, sizeof(author));
+	author[31] = 1; // author 0
+	assert(ndb_filter_add_id_element(f, author));
+	author[31] = 2; // author 1
+	assert(ndb_filter_add_id_element(f, author));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	{
+		struct ndb_query_key keys[5];
+		struct ndb_query_explain explain;
+		int nkeys = 0;
+
+		assert(ndb_query_keys_explain(&txn, f, keys, 5, &nkeys,
+					      &explain));
+		assert(nkeys == 5);
+		assert(!strcmp(explain.plan, "author_kinds"));
+		assert(explain.results == 5);
+		assert(explain.notes_loaded == 0);
+
+		for (i = 0; i < nkeys; i++)
+			assert(keys[i].created_at ==
+			       (uint64_t)(ORDER_BASE_TIME + ORDER_NOTES - 3 - 3*i));
+	}
+	ndb_filter_destroy(f);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+/* Page through notes that pile up on the same created_at, so that page
+ * boundaries land in the middle of a timestamp */
+#define PAGE_NOTES 10
+
+static void page_all(struct ndb_txn *txn, struct ndb_filter *f,
+		     int page_size, int expected)
+{
+	struct ndb_query_result results[PAGE_NOTES];
+	unsigned char token[256], next[256];
+	uint64_t seen[PAGE_NOTES], last_created;
+	int i, j, count, total, token_len, next_len, pages;
+
+	total = 0;
+	token_len = 0;
+	last_created = UINT64_MAX;
+
+	for (pages = 0; pages < PAGE_NOTES + 1; pages++) {
+		assert(ndb_query_page(txn, f, token_len ? token : NULL,
+				      token_len, results, page_size, &count,
+				      next, sizeof(next), &next_len));
+
+		for (i = 0; i < count; i++) {
+			assert(ndb_note_created_at(results[i].note) <= last_created);
+			last_created = ndb_note_created_at(results[i].note);
+
+			for (j = 0; j < total; j++)
+				assert(seen[j] != results[i].note_id);
+			assert(total < PAGE_NOTES);
+			seen[total++] = results[i].note_id;
+		}
+
+		if (next_len == 0)
+			break;
+
+		memcpy(token, next, next_len);
+		token_len = next_len;
+	}
+
+	assert(total == expected);
+}
+
+static void test_query_page()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	uint64_t note_ids[PAGE_NOTES], subid;
+	char json[1024];
+	int i, nres, attempts;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	assert((subid = ndb_subscribe(ndb, f, 1)));
+
+	// four notes to a timestamp
+	for (i = 0; i < PAGE_NOTES; i++) {
+		snprintf(json, sizeof(json),
+			 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			 "\"created_at\":%d,\"kind\":1,\"tags\":"
+			 "[[\"t\",\"t%d\"]],\"content\":\"p%d\",\"sig\":\"%s\"}]",
+			 i + 1, 1, 1700000000 + i / 4, i % 2, i, sig);
+		assert(ndb_process_event(ndb, json, strlen(json)));
+	}
+
+	for (nres = 0, attempts = 0; nres < PAGE_NOTES && attempts < 500;
+	     attempts++) {
+		nres += ndb_poll_for_notes(ndb, subid, note_ids + nres,
+					   PAGE_NOTES - nres);
+		if (nres < PAGE_NOTES)
+			usleep(10000);
+	}
+	assert(nres == PAGE_NOTES);
+
+	assert(ndb_begin_query(ndb, &txn));
+
+	page_all(&txn, f, 3, PAGE_NOTES);
+	page_all(&txn, f, 1, PAGE_NOTES);
+	ndb_filter_destroy(f);
+
+	// tag scans hand out a timestamp's notes as a block, which the
+	// token has to carry over
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "t0"));
+	assert(ndb_filter_add_str_element(f, "t1"));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	page_all(&txn, f, 3, PAGE_NOTES);
+	ndb_filter_destroy(f);
+
+	// ids don't run on an index scan
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_IDS));
+	memset(json, 0, 32);
+	json[31] = 1;
+	assert(ndb_filter_add_id_element(f, (unsigned char *)json));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+	{
+		struct ndb_query_result results[1];
+		unsigned char next[64];
+		int count, next_len;
+
+		assert(!ndb_query_page(&txn, f, NULL, 0, results, 1, &count,
+				       next, sizeof(next), &next_len));
+	}
+	ndb_filter_destroy(f);
+
+	ndb_end_query(&txn);
+	ndb_destroy(ndb);
+}
+
+static void test_multifilter_query_fair_distribution()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_filter filters[2];
+	struct ndb_config config;
+	struct ndb_query_result results[2];
+	int count, i, kind1_count, kind2_count;
+	uint64_t subid, note_ids[4];
+	int nres;
+
+	delete_test_db();
+	ndb_default_config(&config);
+
+	// kind-1 events (older timestamps)
+	const char *k1a = "[\"EVENT\",\"s\",{\"id\": \"0336948bdfbf5f939802eba03aa78735c82825211eece987a6d2e20e3cfff930\",\"pubkey\": \"aeadd3bf2fd92e509e137c9e8bdf20e99f286b90be7692434e03c015e1d3bbfe\",\"created_at\": 1704401597,\"kind\": 1,\"tags\": [],\"content\": \"hello\",\"sig\": \"232395427153b693e0426b93d89a8319324d8657e67d23953f014a22159d2127b4da20b95644b3e34debd5e20be0401c283e7308ccb63c1c1e0f81cac7502f09\"}]";
+	const char *k1b = "[\"EVENT\",\"s\",{\"id\": \"0a350c5851af6f6ce368bab4e2d4fe442a1318642c7fe58de5392103700c10fc\",\"pubkey\": \"dfa3fc062f7430dab3d947417fd3c6fb38a7e60f82ffe3387e2679d4c6919b1d\",\"created_at\": 1704404822,\"kind\": 1,\"tags\": [],\"content\": \"hello2\",\"sig\": \"48a0bb9560b89ee2c6b88edcf1cbeeff04f5e1b10d26da8564cac851065f30fa6961ee51f450cefe5e8f4895e301e8ffb2be06a2ff44259684fbd4ea1c885696\"}]";
+	// kind-2 events (newer timestamps: 1704408561, 1704408730)
+	const char *k2a = "[\"EVENT\",\"s\",{\"id\": \"20d2b66e1a3ac4a2afe22866ad742091b6267e6e614303de062adb33e12c9931\",\"pubkey\": \"7987bfb2632d561088fc8e3c30a95836f822e4f53633228ec92ae2f5cd6690aa\",\"created_at\": 1704408561,\"kind\": 2,\"tags\": [],\"content\": \"what\",\"sig\": \"cc8533bf177ac87771a5218a04bed24f7a1706f0b2d92700045cdeb38accc5507c6c8de09525e43190df3652012b554d4efe7b82ab268a87ff6f23da44e16a8f\"}]";
+	const char *k2b = "[\"EVENT\",\"s\",{\"id\": \"8a2057c13c1c57b536eab78e6c55428732d33b6b5b234c1f5eab2b5918c37fa1\",\"pubkey\": \"303b5851504da5caa14142e9e2e1b1b60783c48d6f137c205019d46d09244c26\",\"created_at\": 1704408730,\"kind\": 2,\"tags\": [],\"content\": \"hmm\",\"sig\": \"e7cd3029042d41964192411929cade59592840af766da6420077ccc57a61405312db6ca879150db01f53c3b81c477cec5d6bd49f9dc10937267cacf7e5c784b3\"}]";
+
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	// filter 0: kind 1, NO explicit limit
+	ndb_filter_init(&filters[0]);
+	ndb_filter_start_field(&filters[0], NDB_FILTER_KINDS);
+	ndb_filter_add_int_element(&filters[0], 1);
+	ndb_filter_end_field(&filters[0]);
+	ndb_filter_end(&filters[0]);
+
+	// filter 1: kind 2, NO explicit limit
+	ndb_filter_init(&filters[1]);
+	ndb_filter_start_field(&filters[1], NDB_FILTER_KINDS);
+	ndb_filter_add_int_element(&filters[1], 2);
+	ndb_filter_end_field(&filters[1]);
+	ndb_filter_end(&filters[1]);
+
+	assert((subid = ndb_subscribe(ndb, filters, 2)));
+	assert(ndb_process_event(ndb, k1a, strlen(k1a)));
+	assert(ndb_process_event(ndb, k1b, strlen(k1b)));
+	assert(ndb_process_event(ndb, k2a, strlen(k2a)));
+	assert(ndb_process_event(ndb, k2b, strlen(k2b)));
+
+	for (nres = 4; nres > 0;)
+		nres -= ndb_wait_for_notes(ndb, subid, note_ids, 4);
+
+	ndb_begin_query(ndb, &txn);
+
+	// capacity=2 with 2 kind-1 and 2 kind-2 events.
 	// The old sequential code would run filter[0] (kind 1) first,
 	// fill both slots with kind-1 events, and never run filter[1].
 	// With separate buffers + merge, both filters run independently
@@ -3216,6 +3952,1184 @@ static void test_subscriptions()
 	ndb_destroy(ndb);
 }
 
+// wait until a subscription has seen `want` notes
+static int sub_wait(struct ndb *ndb, uint64_t subid, int want)
+{
+	uint64_t note_ids[16];
+	int nres, attempts;
+
+	for (nres = 0, attempts = 0; nres < want && attempts < 500; attempts++) {
+		nres += ndb_poll_for_notes(ndb, subid, note_ids, 16);
+		if (nres < want)
+			usleep(10000);
+	}
+
+	return nres;
+}
+
+static void test_subscription_index()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filters[2], *f = &filters[0];
+	uint64_t kind_sub, author_sub, tag_sub, etag_sub, all_sub, or_sub,
+		 since_sub, note_ids[16];
+	unsigned char pk[32], id[32];
+	char json[1024];
+	int i;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+	static const char *etag =
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+
+	// kind, author, tags
+	static const struct { int kind; int author; const char *tags; } notes[] = {
+		{ 1, 1, "[[\"t\",\"a\"]]" },
+		{ 7, 2, "[[\"t\",\"b\"]]" },
+		{ 1, 2, "[[\"e\",\"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\"]]" },
+		{ 7, 1, "[[\"t\",\"a\"]]" },
+		{ 3, 3, "[]" },
+		{ 1, 1, "[]" },
+	};
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((kind_sub = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	memset(pk, 0, 32);
+	pk[31] = 1;
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(f, pk));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((author_sub = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 't'));
+	assert(ndb_filter_add_str_element(f, "a"));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((tag_sub = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	hex_decode(etag, 64, id, sizeof(id));
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_tag_field(f, 'e'));
+	assert(ndb_filter_add_id_element(f, id));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((etag_sub = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	assert((all_sub = ndb_subscribe(ndb, NULL, 0)));
+
+	// a note matching both filters is only delivered once
+	pk[31] = 2;
+	assert(ndb_filter_init(&filters[0]));
+	assert(ndb_filter_start_field(&filters[0], NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(&filters[0], 7));
+	ndb_filter_end_field(&filters[0]);
+	ndb_filter_end(&filters[0]);
+	assert(ndb_filter_init(&filters[1]));
+	assert(ndb_filter_start_field(&filters[1], NDB_FILTER_AUTHORS));
+	assert(ndb_filter_add_id_element(&filters[1], pk));
+	ndb_filter_end_field(&filters[1]);
+	ndb_filter_end(&filters[1]);
+	assert((or_sub = ndb_subscribe(ndb, filters, 2)));
+	ndb_filter_destroy(&filters[0]);
+	ndb_filter_destroy(&filters[1]);
+
+	// nothing to index on, always checked
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_SINCE));
+	assert(ndb_filter_add_int_element(f, 1700000003));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((since_sub = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	for (i = 0; i < 5; i++) {
+		snprintf(json, sizeof(json),
+			 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			 "\"created_at\":%d,\"kind\":%d,\"tags\":%s,"
+			 "\"content\":\"n%d\",\"sig\":\"%s\"}]",
+			 i + 1, notes[i].author, 1700000000 + i, notes[i].kind,
+			 notes[i].tags, i, sig);
+		assert(ndb_process_event(ndb, json, strlen(json)));
+	}
+
+	// every subscription is notified in the same pass, so once the
+	// catch-all one has everything the rest are done too
+	assert(sub_wait(ndb, all_sub, 5) == 5);
+	assert(ndb_poll_for_notes(ndb, kind_sub, note_ids, 16) == 2);
+	assert(ndb_poll_for_notes(ndb, author_sub, note_ids, 16) == 2);
+	assert(ndb_poll_for_notes(ndb, tag_sub, note_ids, 16) == 2);
+	assert(ndb_poll_for_notes(ndb, etag_sub, note_ids, 16) == 1);
+	assert(ndb_poll_for_notes(ndb, or_sub, note_ids, 16) == 3);
+	assert(ndb_poll_for_notes(ndb, since_sub, note_ids, 16) == 2);
+
+	// the index follows subscriptions going away
+	assert(ndb_unsubscribe(ndb, kind_sub));
+
+	snprintf(json, sizeof(json),
+		 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+		 "\"created_at\":%d,\"kind\":%d,\"tags\":%s,"
+		 "\"content\":\"n%d\",\"sig\":\"%s\"}]",
+		 6, notes[5].author, 1700000005, notes[5].kind, notes[5].tags,
+		 5, sig);
+	assert(ndb_process_event(ndb, json, strlen(json)));
+
+	assert(sub_wait(ndb, all_sub, 1) == 1);
+	assert(ndb_poll_for_notes(ndb, kind_sub, note_ids, 16) == 0);
+	assert(ndb_poll_for_notes(ndb, author_sub, note_ids, 16) == 1);
+	assert(ndb_poll_for_notes(ndb, or_sub, note_ids, 16) == 0);
+	assert(ndb_poll_for_notes(ndb, since_sub, note_ids, 16) == 1);
+
+	ndb_destroy(ndb);
+	delete_test_db();
+
+	printf("ok test_subscription_index\n");
+}
+
+#define MANY_SUBS 300
+#define MANY_FILTERS 20
+
+static void test_many_subscriptions()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filters[MANY_FILTERS], *f = &filters[0];
+	uint64_t subids[MANY_SUBS], big_sub, small_sub, note_ids[4];
+	char json[1024];
+	int i;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	for (i = 0; i < MANY_FILTERS; i++) {
+		assert(ndb_filter_init(&filters[i]));
+		assert(ndb_filter_start_field(&filters[i], NDB_FILTER_KINDS));
+		assert(ndb_filter_add_int_element(&filters[i], i + 1));
+		ndb_filter_end_field(&filters[i]);
+		ndb_filter_end(&filters[i]);
+	}
+
+	// more than we used to have room for
+	for (i = 0; i < MANY_SUBS; i++)
+		assert((subids[i] = ndb_subscribe(ndb, f, 1)));
+
+	assert((big_sub = ndb_subscribe(ndb, filters, MANY_FILTERS)));
+	assert((small_sub = ndb_subscribe_with(ndb, f, 1, 2)));
+	assert(ndb_num_subscriptions(ndb) == MANY_SUBS + 2);
+
+	for (i = 0; i < MANY_FILTERS; i++)
+		ndb_filter_destroy(&filters[i]);
+
+	for (i = 0; i < 3; i++) {
+		snprintf(json, sizeof(json),
+			 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			 "\"created_at\":%d,\"kind\":1,\"tags\":[],"
+			 "\"content\":\"many%d\",\"sig\":\"%s\"}]",
+			 i + 1, 1, 1700000000 + i, i, sig);
+		assert(ndb_process_event(ndb, json, strlen(json)));
+	}
+
+	assert(sub_wait(ndb, subids[MANY_SUBS - 1], 3) == 3);
+	assert(sub_wait(ndb, big_sub, 3) == 3);
+
+	// the small inbox only had room for two
+	assert(ndb_poll_for_notes(ndb, small_sub, note_ids, 4) == 2);
+
+	for (i = 0; i < MANY_SUBS; i++)
+		assert(ndb_unsubscribe(ndb, subids[i]));
+	assert(ndb_num_subscriptions(ndb) == 2);
+
+	ndb_destroy(ndb);
+	delete_test_db();
+
+	printf("ok test_many_subscriptions\n");
+}
+
+#define BACKFILL_NOTES 200
+
+static void test_subscribe_with_backfill()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_result results[BACKFILL_NOTES];
+	struct ndb_txn txn;
+	uint64_t subid, note_ids[BACKFILL_NOTES];
+	char json[1024];
+	int i, j, count, nres, attempts;
+
+	subid = 0;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+
+	// subscribe while the notes are still being written, so some land
+	// in the backfill and the rest come through the subscription
+	for (i = 0; i < BACKFILL_NOTES; i++) {
+		snprintf(json, sizeof(json),
+			 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			 "\"created_at\":%d,\"kind\":1,\"tags\":[],"
+			 "\"content\":\"backfill%d\",\"sig\":\"%s\"}]",
+			 i + 1, 1, 1700000000 + i, i, sig);
+		assert(ndb_process_event(ndb, json, strlen(json)));
+
+		if (i == BACKFILL_NOTES / 2) {
+			assert((subid = ndb_subscribe_with_backfill(ndb, &txn,
+				f, 1, results, BACKFILL_NOTES, &count)));
+			ndb_end_query(&txn);
+		}
+	}
+
+	for (nres = 0, attempts = 0; count + nres < BACKFILL_NOTES &&
+	     attempts < 500; attempts++) {
+		nres += ndb_poll_for_notes(ndb, subid, note_ids + nres,
+					   BACKFILL_NOTES - count - nres);
+		if (count + nres < BACKFILL_NOTES)
+			usleep(10000);
+	}
+
+	// every note exactly once, between the two
+	assert(count + nres == BACKFILL_NOTES);
+	for (i = 0; i < nres; i++) {
+		for (j = 0; j < count; j++)
+			assert(results[j].note_id != note_ids[i]);
+	}
+
+	usleep(10000);
+	assert(ndb_poll_for_notes(ndb, subid, note_ids, BACKFILL_NOTES) == 0);
+
+	ndb_filter_destroy(f);
+	ndb_destroy(ndb);
+	delete_test_db();
+
+	printf("ok test_subscribe_with_backfill\n");
+}
+
+static void test_subscription_overflow()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_subscription_status status;
+	struct ndb_query_result results[8];
+	struct ndb_txn txn;
+	uint64_t subid, from, note_ids[8];
+	char json[1024];
+	int i, count, attempts;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+
+	// room for two
+	assert((subid = ndb_subscribe_with(ndb, f, 1, 2)));
+
+	for (i = 0; i < 5; i++) {
+		snprintf(json, sizeof(json),
+			 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			 "\"created_at\":%d,\"kind\":1,\"tags\":[],"
+			 "\"content\":\"overflow%d\",\"sig\":\"%s\"}]",
+			 i + 1, 1, 1700000000 + i, i, sig);
+		assert(ndb_process_event(ndb, json, strlen(json)));
+	}
+
+	for (attempts = 0; attempts < 500; attempts++) {
+		assert(ndb_poll_for_notes_status(ndb, subid, note_ids, 0,
+						 &status) == 0);
+		if (status.dropped == 3)
+			break;
+		usleep(10000);
+	}
+	assert(status.dropped == 3);
+	assert((from = status.resync_from) != 0);
+
+	// one query picks up what we missed, the inbox keeps the rest
+	assert(ndb_subscription_resync(ndb, &txn, subid, results, 8, &count));
+	assert(count == 3);
+	for (i = 0; i < count; i++)
+		assert(results[i].note_id >= from);
+	ndb_end_query(&txn);
+
+	assert(ndb_poll_for_notes_status(ndb, subid, note_ids, 8, &status) == 2);
+	assert(note_ids[0] < from && note_ids[1] < from);
+	assert(status.resync_from == 0);
+	assert(status.dropped == 3);
+
+	// and we're back to normal
+	snprintf(json, sizeof(json),
+		 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+		 "\"created_at\":%d,\"kind\":1,\"tags\":[],"
+		 "\"content\":\"overflow%d\",\"sig\":\"%s\"}]",
+		 6, 1, 1700000005, 5, sig);
+	assert(ndb_process_event(ndb, json, strlen(json)));
+	assert(sub_wait(ndb, subid, 1) == 1);
+
+	ndb_filter_destroy(f);
+	ndb_destroy(ndb);
+	delete_test_db();
+
+	printf("ok test_subscription_overflow\n");
+}
+
+// a resync with less room than it has to catch up on, over notes whose
+// created_at runs backwards, comes back in key order over several calls
+static void test_subscription_resync_partial()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_subscription_status status;
+	struct ndb_query_result results[3];
+	struct ndb_txn txn;
+	unsigned char id[32] = {0};
+	uint64_t subid, from, last, note_ids[8], seen[16];
+	char json[1024];
+	int i, count, nseen, attempts, written;
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+
+	// room for two, so eight of the ten kind 1 notes are dropped
+	assert((subid = ndb_subscribe_with(ndb, f, 1, 2)));
+
+	for (i = 0; i < 15; i++) {
+		test_event_json(json, sizeof(json), "s", i + 1, 1,
+				1700000000 - i * 10, i % 3 == 2 ? 2 : 1, "[]",
+				"resync%d", i);
+		assert(ndb_process_event(ndb, json, strlen(json)));
+	}
+
+	for (attempts = 0; attempts < 500; attempts++) {
+		assert(ndb_poll_for_notes_status(ndb, subid, note_ids, 0,
+						 &status) == 0);
+		if (status.dropped == 8)
+			break;
+		usleep(10000);
+	}
+	assert(status.dropped == 8);
+	from = status.resync_from;
+
+	// three at a time, each call starting where the last one stopped
+	assert(ndb_subscription_resync(ndb, &txn, subid, results, 3, &count));
+	assert(count == 3);
+	for (i = 0, last = from - 1; i < count; i++) {
+		assert(results[i].note_id > last);
+		assert(ndb_note_kind(results[i].note) == 1);
+		seen[i] = last = results[i].note_id;
+	}
+	nseen = count;
+	ndb_end_query(&txn);
+
+	assert(ndb_poll_for_notes_status(ndb, subid, note_ids, 0, &status) == 0);
+	assert(status.resync_from > last);
+
+	// a note written while we're catching up only shows up once
+	test_event_json(json, sizeof(json), "s", 16, 1, 1600000000, 1, "[]",
+			"resync%d", 15);
+	assert(ndb_process_event(ndb, json, strlen(json)));
+	id[31] = 16;
+	for (written = 0, attempts = 0; !written && attempts < 500; attempts++) {
+		assert(ndb_begin_query(ndb, &txn));
+		written = ndb_get_notekey_by_id(&txn, id) != 0;
+		ndb_end_query(&txn);
+		if (!written)
+			usleep(10000);
+	}
+	assert(written);
+
+	for (attempts = 0; attempts < 10; attempts++) {
+		assert(ndb_poll_for_notes_status(ndb, subid, note_ids, 0,
+						 &status) == 0);
+		if (status.resync_from == 0)
+			break;
+
+		assert(ndb_subscription_resync(ndb, &txn, subid, results, 3,
+					       &count));
+		assert(count > 0);
+		for (i = 0; i < count; i++) {
+			assert(results[i].note_id > last);
+			seen[nseen++] = last = results[i].note_id;
+		}
+		ndb_end_query(&txn);
+	}
+	assert(status.resync_from == 0);
+	assert(nseen == 9);
+
+	// the inbox only has the two notes from before the overflow
+	assert(ndb_poll_for_notes(ndb, subid, note_ids, 8) == 2);
+	assert(note_ids[0] < from && note_ids[1] < from);
+	assert(seen[0] == from);
+
+	ndb_filter_destroy(f);
+	ndb_destroy(ndb);
+	delete_test_db();
+
+	printf("ok test_subscription_resync_partial\n");
+}
+
+static int fd_readable(int fd, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	return poll(&pfd, 1, timeout_ms) == 1 && (pfd.revents & POLLIN);
+}
+
+static void test_subscription_fd()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	uint64_t subid, other_sub, note_ids[4];
+	char json[1024];
+	int fd, other_fd;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((subid = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 2));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((other_sub = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	assert((fd = ndb_subscription_fd(ndb, subid)) != -1);
+	assert(ndb_subscription_fd(ndb, subid) == fd);
+	assert((other_fd = ndb_subscription_fd(ndb, other_sub)) != -1);
+	assert(!fd_readable(fd, 0));
+
+	snprintf(json, sizeof(json),
+		 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+		 "\"created_at\":%d,\"kind\":1,\"tags\":[],"
+		 "\"content\":\"fd\",\"sig\":\"%s\"}]", 1, 1, 1700000000, sig);
+	assert(ndb_process_event(ndb, json, strlen(json)));
+
+	// only the subscription with something to read wakes up
+	assert(fd_readable(fd, 5000));
+	assert(!fd_readable(other_fd, 0));
+
+	assert(ndb_poll_for_notes(ndb, subid, note_ids, 4) == 1);
+	assert(!fd_readable(fd, 0));
+
+	assert(ndb_unsubscribe(ndb, subid));
+	assert(ndb_subscription_fd(ndb, subid) == -1);
+
+	ndb_destroy(ndb);
+	delete_test_db();
+
+	printf("ok test_subscription_fd\n");
+}
+
+struct owned_frames {
+	const char *buf;
+	int released;
+	int bytes;
+};
+
+static void owned_release(void *ctx, const char *json, int len)
+{
+	struct owned_frames *frames = ctx;
+
+	assert(json >= frames->buf);
+	__atomic_add_fetch(&frames->bytes, len, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&frames->released, 1, __ATOMIC_SEQ_CST);
+}
+
+static void test_process_event_owned()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_ingest_meta meta;
+	struct owned_frames frames = {0};
+	uint64_t subid;
+	char buf[4096];
+	int offsets[4], lens[4];
+	int i, n, attempts;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((subid = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	// frames packed back to back, none of them nul terminated
+	for (i = 0, n = 0; i < 3; i++) {
+		offsets[i] = n;
+		lens[i] = snprintf(buf + n, sizeof(buf) - n,
+			 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			 "\"created_at\":%d,\"kind\":1,\"tags\":[],"
+			 "\"content\":\"owned%d\",\"sig\":\"%s\"}]",
+			 i + 1, 1, 1700000000 + i, i, sig);
+		n += lens[i];
+	}
+	offsets[3] = n;
+	lens[3] = snprintf(buf + n, sizeof(buf) - n, "[\"EVENT\",\"s\",{\"id\":");
+	frames.buf = buf;
+
+	ndb_ingest_meta_init(&meta, 0, "wss://relay.damus.io");
+	for (i = 0; i < 4; i++) {
+		assert(ndb_process_event_owned(ndb, buf + offsets[i], lens[i],
+					       &meta, owned_release, &frames));
+	}
+
+	// the buffer has to outlive every release, bad frames included
+	for (attempts = 0; attempts < 500; attempts++) {
+		if (__atomic_load_n(&frames.released, __ATOMIC_SEQ_CST) == 4)
+			break;
+		usleep(10000);
+	}
+	assert(frames.released == 4);
+	assert(frames.bytes == lens[0] + lens[1] + lens[2] + lens[3]);
+	assert(sub_wait(ndb, subid, 3) == 3);
+
+	// an empty frame is refused, and stays ours
+	assert(!ndb_process_event_owned(ndb, buf, 0, &meta, owned_release,
+					&frames));
+	// so is one without a release, which would free our buffer
+	assert(!ndb_process_event_owned(ndb, buf + offsets[0], lens[0], &meta,
+					NULL, NULL));
+
+	ndb_destroy(ndb);
+	assert(frames.released == 4);
+	delete_test_db();
+
+	printf("ok test_process_event_owned\n");
+}
+
+static void test_duplicate_events()
+{
+	struct ndb *ndb;
+	struct ndb_txn txn;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_ingest_meta meta;
+	struct ndb_query_result results[4];
+	uint64_t subid, note_key;
+	char forged[1024];
+	int i, count, attempts, got_all;
+
+	const char *json = "[\"EVENT\",{\"id\": \"0f20295584a62d983a4fa85f7e50b460cd0049f94d8cd250b864bb822a747114\",\"pubkey\": \"55c882cf4a255ac66fc8507e718a1d1283ba46eb7d678d0573184dada1a4f376\",\"created_at\": 1742498339,\"kind\": 1,\"tags\": [],\"content\": \"hi\",\"sig\": \"ae1218280f554ea0b04ae09921031493d60fb7831dfd2dbd7086efeace2719a46842ce80342ebc002da8943df02e98b8b4abb4629c7103ca2114e6c4425f97fe\"}]";
+
+	// same id, different content. it must not shadow the real one
+	snprintf(forged, sizeof(forged), "%s", json);
+	*strstr(forged, "\"hi\"") = '\0';
+	snprintf(forged + strlen(forged), sizeof(forged) - strlen(forged),
+		 "\"ho\"%s", strstr(json, "\"hi\"") + 4);
+
+	delete_test_db();
+	ndb_default_config(&config);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((subid = ndb_subscribe(ndb, f, 1)));
+
+	ndb_ingest_meta_init(&meta, 1, "wss://forged.example");
+	assert(ndb_process_event_with(ndb, forged, strlen(forged), &meta));
+
+	for (i = 0; i < 100; i++) {
+		meta.relay = i % 2 ? "wss://relay.damus.io" : NULL;
+		assert(ndb_process_event_with(ndb, json, strlen(json), &meta));
+	}
+	meta.relay = "wss://nostr.mom";
+	assert(ndb_process_event_with(ndb, json, strlen(json), &meta));
+
+	assert(ndb_wait_for_notes(ndb, subid, &note_key, 1) == 1);
+
+	// copies that skipped the lookup still record their relays
+	for (attempts = 0; attempts < 100; attempts++) {
+		assert(ndb_begin_query(ndb, &txn));
+		got_all =
+			ndb_note_seen_on_relay(&txn, note_key, "wss://relay.damus.io") &&
+			ndb_note_seen_on_relay(&txn, note_key, "wss://nostr.mom");
+		ndb_end_query(&txn);
+		if (got_all)
+			break;
+		usleep(10000);
+	}
+	assert(attempts < 100);
+
+	// a copy of a note that's already in the db
+	meta.relay = "ws://monad.jb55.com:8080";
+	assert(ndb_process_event_with(ndb, json, strlen(json), &meta));
+	for (attempts = 0; attempts < 100; attempts++) {
+		assert(ndb_begin_query(ndb, &txn));
+		got_all = ndb_note_seen_on_relay(&txn, note_key,
+						 "ws://monad.jb55.com:8080");
+		ndb_end_query(&txn);
+		if (got_all)
+			break;
+		usleep(10000);
+	}
+	assert(attempts < 100);
+
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_query(&txn, f, 1, results, 4, &count));
+	assert(count == 1);
+	assert(!strcmp(ndb_note_content(results[0].note), "hi"));
+	assert(!ndb_note_seen_on_relay(&txn, note_key, "wss://forged.example"));
+	ndb_end_query(&txn);
+
+	ndb_filter_destroy(f);
+	ndb_destroy(ndb);
+	delete_test_db();
+
+	printf("ok test_duplicate_events\n");
+}
+
+static void test_import_file()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_ingest_meta meta;
+	struct ndb_import_stats stats;
+	struct ndb_query_result results[1];
+	struct ndb_txn txn;
+	uint64_t subid;
+	const char *path = TEST_DIR "/import.json";
+	char json[1024];
+	FILE *fp;
+	int i, count;
+
+	delete_test_db();
+
+	// 300 notes, a copy of the first right behind it, a bad line, blank
+	// and crlf lines, and no newline at the end
+	assert((fp = fopen(path, "w")));
+	for (i = 0; i < 301; i++) {
+		test_event_json(json, sizeof(json), "s", i == 0 ? 1 : i, 1,
+				1700000000 + i, 1, "[]", "import%d", i);
+		fprintf(fp, "%s%s", json, i % 7 == 0 ? "\r\n\n" : "\n");
+	}
+	fprintf(fp, "[\"EVENT\",\"s\",{\"id\":\"nope\"}]\n");
+	fprintf(fp, "[\"EOSE\",\"s\"]");
+	fclose(fp);
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_ingest_threads(&config, 3);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((subid = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	// every note shares the import's relay
+	ndb_ingest_meta_init(&meta, 0, "wss://import.example");
+	assert(ndb_import_file(ndb, path, &meta, &stats));
+	assert(stats.lines == 303);
+	assert(stats.queued + stats.duplicates == 301);
+	assert(stats.duplicates >= 1);
+	assert(stats.invalid == 1);
+	assert(stats.ignored == 1);
+	assert(stats.rejected == 0);
+	assert(sub_wait(ndb, subid, 300) == 300);
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_query(&txn, f, 1, results, 1, &count));
+	assert(count == 1);
+	assert(ndb_note_seen_on_relay(&txn, results[0].note_id,
+				      "wss://import.example"));
+	ndb_end_query(&txn);
+	ndb_filter_destroy(f);
+
+	// nothing new the second time around
+	assert(ndb_import_file(ndb, path, &meta, &stats));
+	assert(stats.lines == 303);
+	assert(stats.queued == 0);
+	assert(stats.duplicates == 301);
+
+	assert(!ndb_import_file(ndb, TEST_DIR "/missing.json", &meta, &stats));
+
+	ndb_destroy(ndb);
+	unlink(path);
+	delete_test_db();
+
+	printf("ok test_import_file\n");
+}
+
+// more lines than the writer queue holds (32768), so the ingesters have to
+// wait for the writer instead of dropping notes
+#define IMPORT_MANY_NOTES 40000
+
+static void test_import_many()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_ingest_meta meta;
+	struct ndb_import_stats stats;
+	struct ndb_stat stat;
+	const char *path = TEST_DIR "/import.json";
+	char json[1024];
+	FILE *fp;
+	int i;
+
+	delete_test_db();
+
+	assert((fp = fopen(path, "w")));
+	for (i = 0; i < IMPORT_MANY_NOTES; i++) {
+		test_event_json(json, sizeof(json), "s", i + 1, 1,
+				1700000000 + i, 1, "[]", "many%d", i);
+		fprintf(fp, "%s\n", json);
+	}
+	fclose(fp);
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_ingest_threads(&config, 2);
+	assert(ndb_init(&ndb, test_dir, &config));
+	ndb_ingest_meta_init(&meta, 0, NULL);
+	assert(ndb_import_file(ndb, path, &meta, &stats));
+	assert(stats.lines == IMPORT_MANY_NOTES);
+	assert(stats.queued == IMPORT_MANY_NOTES);
+	assert(stats.dropped == 0);
+	ndb_destroy(ndb);
+	unlink(path);
+
+	// everything we were told was queued made it in
+	ndb_default_config(&config);
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_stat(ndb, &stat));
+	assert(stat.dbs[NDB_DB_NOTE].count == stats.queued);
+	ndb_destroy(ndb);
+
+	delete_test_db();
+
+	printf("ok test_import_many\n");
+}
+
+// import the same notes and return the index sizes once they're built
+static void import_index_stats(uint32_t flags, struct ndb_stat *stat)
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_ingest_meta meta;
+	struct ndb_import_stats stats;
+	const char *path = TEST_DIR "/import.json";
+	FILE *fp;
+	int i, half;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	delete_test_db();
+
+	// two loads, so the second one's indices go on top of the first's
+	for (half = 0; half < 2; half++) {
+		assert((fp = fopen(path, "w")));
+		for (i = half * 100; i < half * 100 + 100; i++) {
+			fprintf(fp, "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+				"\"created_at\":%d,\"kind\":%d,"
+				"\"tags\":[[\"t\",\"tag%d\"],[\"t\",\"tag%d\"],[\"p\",\"%064x\"]],"
+				"\"content\":\"bulk load word%d again%d\",\"sig\":\"%s\"}]\n",
+				i + 1, i % 7 + 1, 1700000000 + (i * 37) % 101,
+				i % 3 ? 1 : 30023, i % 5, i % 5, i % 11 + 1, i, i % 13,
+				sig);
+		}
+		fclose(fp);
+
+		ndb_default_config(&config);
+		ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY | flags);
+		assert(ndb_init(&ndb, test_dir, &config));
+		ndb_ingest_meta_init(&meta, 0, NULL);
+		assert(ndb_import_file(ndb, path, &meta, &stats));
+		assert(stats.queued == 100);
+		ndb_destroy(ndb);
+		unlink(path);
+	}
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+	assert(ndb_stat(ndb, stat));
+	ndb_destroy(ndb);
+
+	delete_test_db();
+}
+
+static void test_deferred_indices()
+{
+	struct ndb_stat normal, deferred;
+	int i;
+
+	static const enum ndb_dbs dbs[] = {
+		NDB_DB_NOTE, NDB_DB_NOTE_ID, NDB_DB_NOTE_KIND, NDB_DB_NOTE_TAGS,
+		NDB_DB_NOTE_PUBKEY, NDB_DB_NOTE_PUBKEY_KIND,
+		NDB_DB_NOTE_CREATED, NDB_DB_NOTE_TEXT,
+	};
+
+	import_index_stats(0, &normal);
+	import_index_stats(NDB_FLAG_DEFER_INDICES, &deferred);
+
+	// sorted appends build the same indices put one at a time would
+	for (i = 0; i < (int)(sizeof(dbs) / sizeof(dbs[0])); i++) {
+		assert(normal.dbs[dbs[i]].count > 0);
+		assert(deferred.dbs[dbs[i]].count == normal.dbs[dbs[i]].count);
+		assert(deferred.dbs[dbs[i]].key_size == normal.dbs[dbs[i]].key_size);
+	}
+
+	printf("ok test_deferred_indices\n");
+}
+
+// more authors than the planner can probe whole, all quiet but one old poster
+#define SAMPLED_AUTHORS 2100
+#define SAMPLED_LOUD_NOTES 5000
+
+static void test_plan_sampled_authors()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_ingest_meta meta;
+	struct ndb_import_stats stats;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_query_result results[12];
+	struct ndb_query_explain explain;
+	struct ndb_txn txn;
+	const char *path = TEST_DIR "/import.json";
+	unsigned char author[32];
+	FILE *fp;
+	int i, count;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	delete_test_db();
+
+	// pubkey 1 floods kind 1 with recent notes, pubkey 2 posted long ago
+	assert((fp = fopen(path, "w")));
+	for (i = 0; i < SAMPLED_LOUD_NOTES + 12; i++) {
+		fprintf(fp, "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			"\"created_at\":%d,\"kind\":1,\"tags\":[],"
+			"\"content\":\"n%d\",\"sig\":\"%s\"}]\n",
+			i + 1, i < 12 ? 2 : 1,
+			i < 12 ? 1600000000 + i : 1700000000 + i, i, sig);
+	}
+	fclose(fp);
+
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+	ndb_ingest_meta_init(&meta, 0, NULL);
+	assert(ndb_import_file(ndb, path, &meta, &stats));
+	assert(stats.queued == SAMPLED_LOUD_NOTES + 12);
+	ndb_destroy(ndb);
+	unlink(path);
+
+	ndb_default_config(&config);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_AUTHORS));
+	memset(author, 0, sizeof(author));
+	for (i = 0; i < SAMPLED_AUTHORS; i++) {
+		// the first is pubkey 2, the rest are nobody
+		author[29] = i >> 8;
+		author[30] = i & 0xff;
+		author[31] = i == 0 ? 2 : 3;
+		assert(ndb_filter_add_id_element(f, author));
+	}
+	ndb_filter_end_field(f);
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	assert(ndb_filter_end(f));
+
+	// the kind scan would have to get through every loud note first.
+	// only a sample of the author runs fits in a probe, but it's enough
+	// to see how far back the results are
+	assert(ndb_begin_query(ndb, &txn));
+	count = 0;
+	assert(ndb_query_explain(&txn, f, 1, results, 12, &count, &explain));
+	assert(count == 12);
+	assert(!strcmp(explain.plan, "author_kinds"));
+	assert(explain.planner_entries <= 2 * 4096);
+	assert(explain.notes_loaded == 12);
+	for (i = 0; i < count; i++)
+		assert(ndb_note_created_at(results[i].note) ==
+		       (uint64_t)(1600000000 + 11 - i));
+	ndb_end_query(&txn);
+
+	ndb_filter_destroy(f);
+	ndb_destroy(ndb);
+	delete_test_db();
+
+	printf("ok test_plan_sampled_authors\n");
+}
+
+static void test_subscription_search()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_txn txn;
+	struct ndb_filter filters[2], *f;
+	struct ndb_query_result results[8];
+	uint64_t both_sub, word_sub, all_sub, note_ids[8];
+	char json[1024];
+	int i, count;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	static const struct { int kind; const char *content; } notes[] = {
+		{ 1, "I love Bitcoins and the Lightning network" },
+		{ 1, "bitcoin only" },
+		{ 1, "lightning strikes, BITCOIN pumps" },
+		{ 1, "bit light" },
+		{ 2, "bitcoin lightning" },
+		{ 1, "nothing to see here" },
+	};
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	f = &filters[0];
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert((all_sub = ndb_subscribe(ndb, f, 1)));
+	ndb_filter_destroy(f);
+
+	for (i = 0; i < 2; i++) {
+		f = &filters[i];
+		assert(ndb_filter_init(f));
+		assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+		assert(ndb_filter_add_int_element(f, 1));
+		ndb_filter_end_field(f);
+		assert(ndb_filter_start_field(f, NDB_FILTER_SEARCH));
+		assert(ndb_filter_add_str_element(f, i == 0 ? "bitcoin lightning"
+							    : "bitcoin"));
+		ndb_filter_end_field(f);
+		ndb_filter_end(f);
+	}
+	assert((both_sub = ndb_subscribe(ndb, &filters[0], 1)));
+	assert((word_sub = ndb_subscribe(ndb, &filters[1], 1)));
+
+	for (i = 0; i < (int)(sizeof(notes) / sizeof(notes[0])); i++) {
+		snprintf(json, sizeof(json),
+			 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			 "\"created_at\":%d,\"kind\":%d,\"tags\":[],"
+			 "\"content\":\"%s\",\"sig\":\"%s\"}]",
+			 i + 1, 1, 1700000000 + i, notes[i].kind,
+			 notes[i].content, sig);
+		assert(ndb_process_event(ndb, json, strlen(json)));
+	}
+
+	// notes are notified in order, so once the catch-all has seen every
+	// kind 1 note the search subscriptions have seen them too
+	assert(sub_wait(ndb, all_sub, 5) == 5);
+
+	// every word has to prefix match, in any order and any case
+	assert(ndb_poll_for_notes(ndb, both_sub, note_ids, 8) == 2);
+	assert(note_ids[0] == 1 && note_ids[1] == 3);
+
+	// live matches agree with the fulltext index
+	assert(ndb_poll_for_notes(ndb, word_sub, note_ids, 8) == 3);
+	assert(ndb_begin_query(ndb, &txn));
+	assert(ndb_query(&txn, &filters[1], 1, results, 8, &count));
+	assert(count == 3);
+	for (i = 0; i < count; i++) {
+		assert(results[i].note_id == note_ids[0] ||
+		       results[i].note_id == note_ids[1] ||
+		       results[i].note_id == note_ids[2]);
+		assert(ndb_filter_matches(&filters[1], results[i].note));
+		assert(ndb_filter_matches(&filters[0], results[i].note) ==
+		       (results[i].note_id != 2));
+	}
+	ndb_end_query(&txn);
+
+	ndb_filter_destroy(&filters[0]);
+	ndb_filter_destroy(&filters[1]);
+	ndb_destroy(ndb);
+	delete_test_db();
+
+	printf("ok test_subscription_search\n");
+}
+
+struct slow_sub_ctx {
+	pthread_mutex_t gate;
+	int calls;
+};
+
+// blocks until the test opens the gate
+static void slow_sub_cb(void *ctx, uint64_t subid)
+{
+	struct slow_sub_ctx *slow = ctx;
+
+	__atomic_add_fetch(&slow->calls, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&slow->gate);
+	pthread_mutex_unlock(&slow->gate);
+}
+
+static void test_slow_subscription_callback()
+{
+	struct ndb *ndb;
+	struct ndb_config config;
+	struct ndb_filter filter, *f = &filter;
+	struct ndb_txn txn;
+	struct slow_sub_ctx slow;
+	unsigned char id[32] = {0};
+	char json[1024];
+	int i, attempts, written;
+
+	static const char *sig =
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff"
+		"ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff";
+
+	slow.calls = 0;
+	pthread_mutex_init(&slow.gate, NULL);
+	pthread_mutex_lock(&slow.gate);
+
+	delete_test_db();
+	ndb_default_config(&config);
+	ndb_config_set_flags(&config, NDB_FLAG_SKIP_NOTE_VERIFY);
+	ndb_config_set_subscription_callback(&config, slow_sub_cb, &slow);
+	assert(ndb_init(&ndb, test_dir, &config));
+
+	assert(ndb_filter_init(f));
+	assert(ndb_filter_start_field(f, NDB_FILTER_KINDS));
+	assert(ndb_filter_add_int_element(f, 1));
+	ndb_filter_end_field(f);
+	ndb_filter_end(f);
+	assert(ndb_subscribe(ndb, f, 1));
+	ndb_filter_destroy(f);
+
+	for (i = 0; i < 2; i++) {
+		snprintf(json, sizeof(json),
+			 "[\"EVENT\",\"s\",{\"id\":\"%064x\",\"pubkey\":\"%064x\","
+			 "\"created_at\":%d,\"kind\":1,\"tags\":[],"
+			 "\"content\":\"slow%d\",\"sig\":\"%s\"}]",
+			 i + 1, 1, 1700000000 + i, i, sig);
+		assert(ndb_process_event(ndb, json, strlen(json)));
+
+		// the first note leaves the callback stuck
+		for (attempts = 0; i == 0 && attempts < 500 &&
+		     !__atomic_load_n(&slow.calls, __ATOMIC_SEQ_CST); attempts++)
+			usleep(10000);
+		assert(slow.calls == 1);
+	}
+
+	// the writer doesn't wait on subscription callbacks, so the second
+	// note still lands
+	id[31] = 2;
+	for (written = 0, attempts = 0; !written && attempts < 500; attempts++) {
+		assert(ndb_begin_query(ndb, &txn));
+		written = ndb_get_notekey_by_id(&txn, id) != 0;
+		ndb_end_query(&txn);
+		if (!written)
+			usleep(10000);
+	}
+	assert(written);
+
+	pthread_mutex_unlock(&slow.gate);
+	ndb_destroy(ndb);
+	pthread_mutex_destroy(&slow.gate);
+	delete_test_db();
+
+	printf("ok test_slow_subscription_callback\n");
+}
+
 static void test_weird_note_corruption() {
 	struct ndb *ndb;
 	struct ndb_config config;
@@ -3703,6 +5617,21 @@ int main(int argc, const char *argv[]) {
 	test_url_parsing();
 	test_query();
 	test_query_ordering();
+	test_query_page();
+	test_subscription_index();
+	test_slow_subscription_callback();
+	test_many_subscriptions();
+	test_subscribe_with_backfill();
+	test_subscription_overflow();
+	test_subscription_resync_partial();
+	test_subscription_fd();
+	test_subscription_search();
+	test_process_event_owned();
+	test_duplicate_events();
+	test_import_file();
+	test_import_many();
+	test_deferred_indices();
+	test_plan_sampled_authors();
 	test_multifilter_query();
 	test_multifilter_query_fair_distribution();
 	test_tag_query();
@@ -3744,6 +5673,8 @@ int main(int argc, const char *argv[]) {
 	test_queue_init_pop_push();
 	test_queue_thread_safety();
 	test_queue_boundary_conditions();
+	test_queue_many_producers();
+	test_threadpool_work_stealing();
 
 	// memchr stuff
 	test_fast_strchr();